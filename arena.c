@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+
+/* 分配的对齐字节数 */
+#define ARENA_ALIGNMENT 8
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static size_t alignSize(size_t size);
+static ArenaBlock* newBlock(Arena* arena, size_t size);
+static void freeBlock(ArenaBlock* block);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+void initArena(Arena* arena) {
+  arena->block = NULL;
+  arena->spare = NULL;
+  arena->last = NULL;
+}
+
+/**
+ * 从 arena 中分配 size 字节，当前块放不下时再向内存池申请新块。
+ *
+ * @return 按 8 字节对齐的内存
+ */
+void* arenaAlloc(Arena* arena, size_t size) {
+  size = alignSize(size);
+  ArenaBlock* block = arena->block;
+  if (block == NULL || block->size - block->used < size) {
+    block = newBlock(arena, size);
+  }
+  void* result = block->data + block->used;
+  block->used += size;
+  arena->last = result;
+  return result;
+}
+
+/**
+ * 把 arena 中的一块内存扩大到 newSize。
+ * 这块内存是最近一次分配且当前块还有空间时原地扩展，否则分配新内存并复制，
+ * 旧内存直到回退或释放 arena 时才回收。
+ *
+ * @param pointer 原内存，为 NULL 时等同于 arenaAlloc
+ * @return 扩大后的内存
+ */
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+  if (pointer == NULL) return arenaAlloc(arena, newSize);
+
+  ArenaBlock* block = arena->block;
+  if (pointer == arena->last) {
+    size_t start = (uint8_t*)pointer - block->data;
+    if (start + alignSize(newSize) <= block->size) {
+      block->used = start + alignSize(newSize);
+      return pointer;
+    }
+  }
+
+  void* result = arenaAlloc(arena, newSize);
+  memcpy(result, pointer, oldSize);
+  return result;
+}
+
+ArenaMark arenaMark(Arena* arena) {
+  ArenaMark mark;
+  mark.block = arena->block;
+  mark.used = arena->block == NULL ? 0 : arena->block->used;
+  return mark;
+}
+
+/**
+ * 回退到 mark 所在的位置，释放之后分配的所有内存。
+ */
+void arenaRelease(Arena* arena, ArenaMark mark) {
+  while (arena->block != mark.block) {
+    ArenaBlock* block = arena->block;
+    arena->block = block->prev;
+    if (arena->spare == NULL && block->size == ARENA_BLOCK_SIZE) {
+      arena->spare = block;
+    } else {
+      freeBlock(block);
+    }
+  }
+  if (arena->block != NULL) arena->block->used = mark.used;
+  arena->last = NULL;
+}
+
+void freeArena(Arena* arena) {
+  while (arena->block != NULL) {
+    ArenaBlock* block = arena->block;
+    arena->block = block->prev;
+    freeBlock(block);
+  }
+  if (arena->spare != NULL) freeBlock(arena->spare);
+  initArena(arena);
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static size_t alignSize(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+/**
+ * 申请一个至少能放下 size 字节的新块并设为当前块，优先复用保留的空块。
+ */
+static ArenaBlock* newBlock(Arena* arena, size_t size) {
+  ArenaBlock* block;
+  if (size <= ARENA_BLOCK_SIZE && arena->spare != NULL) {
+    block = arena->spare;
+    arena->spare = NULL;
+  } else {
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock*)reallocate(NULL, 0, sizeof(ArenaBlock) + blockSize);
+    block->size = blockSize;
+  }
+  block->used = 0;
+  block->prev = arena->block;
+  arena->block = block;
+  return block;
+}
+
+static void freeBlock(ArenaBlock* block) {
+  reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+}
@@ -0,0 +1,45 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 每次向内存池申请的最小块大小 */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+//在 arena 中扩容数组，数组位于 arena 顶部时原地扩展
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+    (type*)arenaGrow(arena, pointer, sizeof(type) * (oldCount), \
+                     sizeof(type) * (newCount))
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* prev;  //更早申请的块
+  size_t size;              //data 的字节数
+  size_t used;              //data 中已分配的字节数
+  uint8_t data[];
+} ArenaBlock;
+
+//按栈的方式分配的内存区域：只能整体释放或回退到之前的某个位置
+typedef struct {
+  ArenaBlock* block;  //当前块
+  ArenaBlock* spare;  //回退时保留的一个空块，避免在块边界上反复申请释放
+  void* last;         //最近一次分配的起始地址
+} Arena;
+
+//arena 中的一个位置，用于回退
+typedef struct {
+  ArenaBlock* block;
+  size_t used;
+} ArenaMark;
+
+
+void initArena(Arena* arena);
+void* arenaAlloc(Arena* arena, size_t size);
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena* arena);
+void arenaRelease(Arena* arena, ArenaMark mark);
+void freeArena(Arena* arena);
+
+#endif // clox_arena_h
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""生成用于测量编译吞吐量的大型 clox 脚本。
+
+用法：
+    python3 bench/gen_compile_input.py 50 > /tmp/big.clox
+    ./clox --bench-compile /tmp/big.clox
+
+参数为目标大小（MB）。生成的代码覆盖全局变量、局部变量、闭包、循环、类和结构体，
+并夹杂局部变量很多的函数，用来暴露按名字线性查找的开销。
+"""
+import sys
+
+
+def unit(n):
+    return f"""var g{n} = {n};
+fun f{n}(a, b) {{
+  var x = a + b;
+  var y = x * 2 - g{n};
+  for (var i = 0; i < 10; i = i + 1) {{
+    if (i > 5) break;
+    y = y + i;
+  }}
+  while (y > 100) {{ y = y / 2; }}
+  fun inner(z) {{ return x + y + z + g{n}; }}
+  return inner;
+}}
+class C{n} {{
+  init(v) {{ this.v = v; }}
+  get() {{ return this.v + g{n}; }}
+}}
+struct S{n} {{ left, right }}
+var s{n} = S{n}("s{n}", g{n});
+s{n}.left = C{n}(s{n}.right).get();
+"""
+
+
+def wide(n, count=300):
+    lines = [f"fun w{n}() {{"]
+    lines += [f"  var l{i} = {i};" for i in range(count)]
+    lines.append("  var total = 0;")
+    lines += [f"  total = total + l{i} + l{count - 1 - i};" for i in range(count)]
+    lines.append("  return total;")
+    lines.append("}")
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    target = float(sys.argv[1]) if len(sys.argv) > 1 else 10
+    limit = int(target * 1024 * 1024)
+    size = 0
+    n = 0
+    out = sys.stdout
+    while size < limit:
+        text = wide(n) if n % 50 == 49 else unit(n)
+        out.write(text)
+        size += len(text)
+        n += 1
+
+
+if __name__ == "__main__":
+    main()
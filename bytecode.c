@@ -0,0 +1,901 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+/* 文件头的魔数 */
+#define BYTECODE_MAGIC "CLOXC\r\n"
+#define BYTECODE_MAGIC_LENGTH 8
+/* 用于识别写入文件的机器字节序 */
+#define BYTECODE_BYTE_ORDER 0x01020304u
+/* 文件头标志位：编译时是否定义了 NAN_BOXING */
+#define BYTECODE_FLAG_NAN_BOXING 0x1u
+/* 函数记录中没有名字时的字符串下标 */
+#define BYTECODE_NO_NAME UINT32_MAX
+/* 函数嵌套的最大深度，防止构造的文件耗尽 C 栈 */
+#define BYTECODE_MAX_DEPTH 256
+
+//常量的类型标签
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_TRUE,
+  CONSTANT_FALSE,
+  CONSTANT_NUMBER,        //8 字节 double
+  CONSTANT_STRING,        //字符串表下标，加载为堆上的 ObjString
+  CONSTANT_SMALL_STRING,  //1 字节长度加字符，加载为短字符串立即数
+  CONSTANT_FUNCTION,      //内嵌的函数记录
+  CONSTANT_STRUCT,        //名字下标、字段个数、各字段名下标
+} ConstantTag;
+
+//指令操作数的种类，校验器据此检查每条指令
+typedef enum {
+  OPERAND_INVALID,        //未定义的操作码
+  OPERAND_NONE,
+  OPERAND_BYTE,           //一个字节的参数个数或局部变量槽位
+  OPERAND_LONG,           //三个字节的局部变量槽位
+  OPERAND_CONSTANT,
+  OPERAND_CONSTANT_LONG,
+  OPERAND_NAME,           //一个字节的名字常量下标
+  OPERAND_NAME_LONG,
+  OPERAND_NAME_BYTE,      //名字常量下标后跟一个字节（字段槽位或参数个数）
+  OPERAND_NAME_LONG_BYTE,
+  OPERAND_UPVALUE,
+  OPERAND_UPVALUE_LONG,
+  OPERAND_JUMP,           //两个字节的跳转距离
+  OPERAND_JUMP_LONG,
+  OPERAND_CLOSURE,
+  OPERAND_CLOSURE_LONG,
+} OperandKind;
+
+static const uint8_t operandKinds[] = {
+  [OP_CONSTANT] = OPERAND_CONSTANT,
+  [OP_CONSTANT_LONG] = OPERAND_CONSTANT_LONG,
+  [OP_NIL] = OPERAND_NONE,
+  [OP_TRUE] = OPERAND_NONE,
+  [OP_FALSE] = OPERAND_NONE,
+  [OP_POP] = OPERAND_NONE,
+  [OP_GET_LOCAL] = OPERAND_BYTE,
+  [OP_SET_LOCAL] = OPERAND_BYTE,
+  [OP_GET_GLOBAL] = OPERAND_NAME,
+  [OP_DEFINE_GLOBAL] = OPERAND_NAME,
+  [OP_SET_GLOBAL] = OPERAND_NAME,
+  [OP_GET_UPVALUE] = OPERAND_UPVALUE,
+  [OP_SET_UPVALUE] = OPERAND_UPVALUE,
+  [OP_GET_LOCAL_LONG] = OPERAND_LONG,
+  [OP_SET_LOCAL_LONG] = OPERAND_LONG,
+  [OP_GET_GLOBAL_LONG] = OPERAND_NAME_LONG,
+  [OP_DEFINE_GLOBAL_LONG] = OPERAND_NAME_LONG,
+  [OP_SET_GLOBAL_LONG] = OPERAND_NAME_LONG,
+  [OP_GET_UPVALUE_LONG] = OPERAND_UPVALUE_LONG,
+  [OP_SET_UPVALUE_LONG] = OPERAND_UPVALUE_LONG,
+  [OP_GET_PROPERTY_LONG] = OPERAND_NAME_LONG,
+  [OP_SET_PROPERTY_LONG] = OPERAND_NAME_LONG,
+  [OP_GET_FIELD_LONG] = OPERAND_NAME_LONG_BYTE,
+  [OP_SET_FIELD_LONG] = OPERAND_NAME_LONG_BYTE,
+  [OP_GET_SUPER_LONG] = OPERAND_NAME_LONG,
+  [OP_GET_PROPERTY] = OPERAND_NAME,
+  [OP_SET_PROPERTY] = OPERAND_NAME,
+  [OP_GET_FIELD] = OPERAND_NAME_BYTE,
+  [OP_SET_FIELD] = OPERAND_NAME_BYTE,
+  [OP_GET_SUPER] = OPERAND_NAME,
+  [OP_EQUAL] = OPERAND_NONE,
+  [OP_NOT_EQUAL] = OPERAND_NONE,
+  [OP_GREATER] = OPERAND_NONE,
+  [OP_GREATER_EQUAL] = OPERAND_NONE,
+  [OP_LESS] = OPERAND_NONE,
+  [OP_LESS_EQUAL] = OPERAND_NONE,
+  [OP_TERNARY] = OPERAND_NONE,
+  [OP_ADD] = OPERAND_NONE,
+  [OP_ADD_NUMBER] = OPERAND_NONE,
+  [OP_ADD_STRING] = OPERAND_NONE,
+  [OP_SUBTRACT] = OPERAND_NONE,
+  [OP_MULTIPLY] = OPERAND_NONE,
+  [OP_DIVIDE] = OPERAND_NONE,
+  [OP_NOT] = OPERAND_NONE,
+  [OP_NEGATE] = OPERAND_NONE,
+  [OP_PRINT] = OPERAND_NONE,
+  [OP_JUMP] = OPERAND_JUMP,
+  [OP_JUMP_IF_FALSE] = OPERAND_JUMP,
+  [OP_LOOP] = OPERAND_JUMP,
+  [OP_JUMP_LONG] = OPERAND_JUMP_LONG,
+  [OP_JUMP_IF_FALSE_LONG] = OPERAND_JUMP_LONG,
+  [OP_LOOP_LONG] = OPERAND_JUMP_LONG,
+  [OP_CALL] = OPERAND_BYTE,
+  [OP_CALL_CLOSURE] = OPERAND_BYTE,
+  [OP_INVOKE] = OPERAND_NAME_BYTE,
+  [OP_SUPER_INVOKE] = OPERAND_NAME_BYTE,
+  [OP_INVOKE_LONG] = OPERAND_NAME_LONG_BYTE,
+  [OP_SUPER_INVOKE_LONG] = OPERAND_NAME_LONG_BYTE,
+  [OP_CLOSURE] = OPERAND_CLOSURE,
+  [OP_CLOSURE_LONG] = OPERAND_CLOSURE_LONG,
+  [OP_CLOSE_UPVALUE] = OPERAND_NONE,
+  [OP_RETURN] = OPERAND_NONE,
+  [OP_THROW] = OPERAND_NONE,
+  [OP_YIELD] = OPERAND_NONE,
+  [OP_RESUME] = OPERAND_NONE,
+  [OP_CLASS] = OPERAND_NAME,
+  [OP_INHERIT] = OPERAND_NONE,
+  [OP_METHOD] = OPERAND_NAME,
+  [OP_CLASS_LONG] = OPERAND_NAME_LONG,
+  [OP_METHOD_LONG] = OPERAND_NAME_LONG,
+  [OP_IMPORT] = OPERAND_NAME,
+  [OP_IMPORT_LONG] = OPERAND_NAME_LONG,
+  [OP_IMPORT_GLOBALS] = OPERAND_NONE,
+};
+
+#define OPERAND_KIND_COUNT ((int)(sizeof(operandKinds) / sizeof(operandKinds[0])))
+
+//保存时的字符串表：index 把 ObjString 映射到下标，strings 按下标存放
+typedef struct {
+  Table index;
+  ValueArray strings;
+} StringTable;
+
+//加载过程中已经创建的字符串，加载期间作为 GC 根
+static THREAD_LOCAL ValueArray loadedStrings;
+//加载的内容是否需要校验：来自文件时校验，本进程刚编码的模块不必校验
+static THREAD_LOCAL bool verifyLoaded;
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static uint64_t hashSource64(const char* source);
+static uint32_t headerFlags();
+static bool collectStrings(ObjFunction* function, StringTable* table, int depth);
+static void addString(StringTable* table, ObjString* string);
+static uint32_t stringIndex(StringTable* table, ObjString* string);
+static bool writeFunction(Writer* writer, ObjFunction* function, StringTable* table);
+static bool writeConstant(Writer* writer, Value value, StringTable* table);
+static ObjString* readString(Reader* reader);
+static ObjFunction* readScript(Reader* reader, const char* source);
+static ObjFunction* readFunction(Reader* reader, int depth);
+static bool readConstant(Reader* reader, int depth);
+static int verifyInstruction(ObjFunction* function, int offset);
+static int jumpTarget(Chunk* chunk, int offset);
+static bool isName(Chunk* chunk, uint32_t constant);
+static void cachePath(char* buffer, size_t size, const char* cacheDir,
+                      const char* source);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 把编译得到的顶层函数及其嵌套的全部函数写入字节码文件。
+ * 文件先写到同目录下的临时文件再改名，并发写同一路径不会读到半个文件。
+ *
+ * @param script 顶层函数，调用者需保证它在 GC 中可达
+ * @param source 对应的源码，其长度和哈希写入文件头；为 NULL 时不记录
+ * @param path 输出文件路径
+ * @return 成功返回 true；函数中含有无法序列化的常量或写文件失败时返回 false
+ */
+bool saveBytecode(ObjFunction* script, const char* source, const char* path) {
+  Writer writer = {NULL, 0, 0};
+  bool ok = encodeBytecode(script, source, &writer) && writeFile(path, &writer);
+  freeWriter(&writer);
+  return ok;
+}
+
+/**
+ * 把顶层函数编码为字节码文件的内容，追加到 writer 中。
+ * 模块的工作线程用它把编译结果交给主线程，不经过文件。
+ *
+ * @return 函数中含有无法序列化的常量时返回 false
+ */
+bool encodeBytecode(ObjFunction* script, const char* source, Writer* writer) {
+  StringTable table;
+  initTable(&table.index);
+  initValueArray(&table.strings);
+
+  bool ok = collectStrings(script, &table, 0);
+  if (ok) {
+    writeBytes(writer, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+    write32(writer, BYTECODE_VERSION);
+    write32(writer, BYTECODE_BYTE_ORDER);
+    write32(writer, headerFlags());
+    write32(writer, source != NULL ? (uint32_t)strlen(source) : 0);
+    write64(writer, source != NULL ? hashSource64(source) : 0);
+
+    write32(writer, (uint32_t)table.strings.count);
+    for (int i = 0; i < table.strings.count; i++) {
+      ObjString* string = AS_STRING(table.strings.values[i]);
+      write32(writer, (uint32_t)string->length);
+      writeBytes(writer, string->chars, string->length);
+    }
+
+    ok = writeFunction(writer, script, &table);
+  }
+
+  freeTable(&table.index);
+  freeValueArray(&table.strings);
+  return ok;
+}
+
+/**
+ * 读取并校验字节码文件。
+ * 文件通过 mmap 只读映射后解析，代码和位置表复制到内存池中：
+ * 运行时的快速化和 profile 重排都会就地改写代码，不能直接指向映射。
+ *
+ * @param path 字节码文件路径
+ * @param source 期望的源码；不为 NULL 时文件头记录的长度和哈希必须与之一致
+ * @return 顶层函数；文件不存在、已损坏、版本不符或校验失败时返回 NULL
+ */
+ObjFunction* loadBytecode(const char* path, const char* source) {
+  Reader reader;
+  if (!mapFile(path, &reader)) return NULL;
+  ObjFunction* script = decodeBytecode(reader.bytes, reader.size, source, true);
+  unmapFile(&reader);
+  return script;
+}
+
+/**
+ * 从内存中的字节码文件内容创建函数，字符串重新驻留到当前线程的字符串池。
+ *
+ * @param verify 是否校验函数的字节码；内容由本进程的 encodeBytecode 生成时可以跳过
+ * @return 顶层函数；内容无效或校验失败时返回 NULL
+ */
+ObjFunction* decodeBytecode(const uint8_t* bytes, size_t size,
+                            const char* source, bool verify) {
+  Reader reader = {bytes, size, 0, false};
+  verifyLoaded = verify;
+  Value* stackBase = vm.stackTop;
+  ObjFunction* script = readScript(&reader, source);
+  //失败时丢弃加载途中压栈的对象，它们在下一次 GC 时回收
+  vm.stackTop = stackBase;
+
+  freeValueArray(&loadedStrings);
+  return script;
+}
+
+/**
+ * 按源码哈希在缓存目录中查找编译结果。
+ *
+ * @return 命中时返回顶层函数，未命中或缓存文件无效时返回 NULL
+ */
+ObjFunction* loadCachedScript(const char* cacheDir, const char* source) {
+  char path[4096];
+  cachePath(path, sizeof(path), cacheDir, source);
+  return loadBytecode(path, source);
+}
+
+/**
+ * 把编译结果写入缓存目录，目录不存在时创建。写入失败不影响本次执行。
+ */
+void cacheScript(const char* cacheDir, const char* source, ObjFunction* script) {
+  mkdir(cacheDir, 0755);
+  char path[4096];
+  cachePath(path, sizeof(path), cacheDir, source);
+  saveBytecode(script, source, path);
+}
+
+void markBytecodeRoots() {
+  for (int i = 0; i < loadedStrings.count; i++) {
+    markValue(loadedStrings.values[i]);
+  }
+}
+
+/**
+ * 校验函数的字节码，保证解释器执行时不会越界读取代码或常量表：
+ * 每条指令的操作码合法、操作数完整，常量、名字和上值下标在范围内，
+ * 跳转目标和异常处理入口落在指令边界上，最后一条指令不会顺序执行到代码末尾：
+ * 编译器生成的代码以 OP_RETURN 结束，profile 重排之后冷块移到末尾，可能以跳转结束。
+ * 栈深度和局部变量槽位不做校验。
+ */
+bool verifyBytecode(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* starts = ALLOCATE(uint8_t, chunk->count);
+  memset(starts, 0, chunk->count);
+
+  bool ok = true;
+  int offset = 0;
+  int last = 0;
+  while (offset < chunk->count) {
+    int length = verifyInstruction(function, offset);
+    if (length <= 0) {
+      ok = false;
+      break;
+    }
+    starts[offset] = 1;
+    last = offset;
+    offset += length;
+  }
+  if (ok) {
+    switch (chunk->code[last]) {
+      case OP_RETURN:
+      case OP_THROW:
+      case OP_JUMP:
+      case OP_JUMP_LONG:
+      case OP_LOOP:
+      case OP_LOOP_LONG:
+        break;
+      default:
+        ok = false;
+    }
+  }
+
+  for (offset = 0; ok && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target == -1) continue;
+    ok = target >= 0 && target < chunk->count && starts[target];
+  }
+
+  for (int i = 0; ok && i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    ok = handler->start >= 0 && handler->start <= handler->end &&
+         handler->end <= chunk->count && handler->target >= 0 &&
+         handler->target < chunk->count && starts[handler->target] &&
+         handler->stackDepth >= 0;
+  }
+
+  FREE_ARRAY(uint8_t, starts, chunk->count);
+  return ok;
+}
+
+void writeBytes(Writer* writer, const void* bytes, size_t length) {
+  if (writer->count + length > writer->capacity) {
+    size_t oldCapacity = writer->capacity;
+    size_t capacity = oldCapacity < 256 ? 256 : oldCapacity * 2;
+    while (capacity < writer->count + length) capacity *= 2;
+    writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, capacity);
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->count, bytes, length);
+  writer->count += length;
+}
+
+void write8(Writer* writer, uint8_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+//多字节整数按本机字节序写入，文件头的字节序标记保证读写两端一致
+void write32(Writer* writer, uint32_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+void write64(Writer* writer, uint64_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+void freeWriter(Writer* writer) {
+  FREE_ARRAY(uint8_t, writer->bytes, writer->capacity);
+  writer->bytes = NULL;
+  writer->count = 0;
+  writer->capacity = 0;
+}
+
+/**
+ * 把缓冲区写入文件：先写同目录下的临时文件再改名，
+ * 并发写同一路径时读者不会看到半个文件。
+ */
+bool writeFile(const char* path, Writer* writer) {
+  char temp[4096];
+  int length = snprintf(temp, sizeof(temp), "%s.tmp.%ld", path, (long)getpid());
+  if (length < 0 || length >= (int)sizeof(temp)) return false;
+
+  FILE* file = fopen(temp, "wb");
+  if (file == NULL) return false;
+  bool ok = fwrite(writer->bytes, 1, writer->count, file) == writer->count;
+  ok = fclose(file) == 0 && ok;
+  if (ok) ok = rename(temp, path) == 0;
+  if (!ok) remove(temp);
+  return ok;
+}
+
+/**
+ * 以只读方式映射整个文件。
+ *
+ * @return 文件不存在、为空或映射失败时返回 false
+ */
+bool mapFile(const char* path, Reader* reader) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  reader->bytes = (const uint8_t*)data;
+  reader->size = size;
+  reader->position = 0;
+  reader->error = false;
+  return true;
+}
+
+void unmapFile(Reader* reader) {
+  munmap((void*)reader->bytes, reader->size);
+}
+
+const uint8_t* readSpan(Reader* reader, size_t length) {
+  if (reader->error || length > reader->size - reader->position) {
+    reader->error = true;
+    return NULL;
+  }
+  const uint8_t* span = reader->bytes + reader->position;
+  reader->position += length;
+  return span;
+}
+
+uint8_t read8(Reader* reader) {
+  const uint8_t* span = readSpan(reader, 1);
+  return span != NULL ? span[0] : 0;
+}
+
+uint32_t read32(Reader* reader) {
+  uint32_t value = 0;
+  const uint8_t* span = readSpan(reader, sizeof(value));
+  if (span != NULL) memcpy(&value, span, sizeof(value));
+  return value;
+}
+
+uint64_t read64(Reader* reader) {
+  uint64_t value = 0;
+  const uint8_t* span = readSpan(reader, sizeof(value));
+  if (span != NULL) memcpy(&value, span, sizeof(value));
+  return value;
+}
+
+/**
+ * 写入代码块中与常量无关的部分：代码、位置表和异常表。
+ */
+void writeChunkBody(Writer* writer, Chunk* chunk) {
+  write32(writer, (uint32_t)chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  write32(writer, (uint32_t)chunk->lines.count);
+  writeBytes(writer, chunk->lines.bytes, chunk->lines.count);
+
+  write32(writer, (uint32_t)chunk->handlerCount);
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    write32(writer, (uint32_t)handler->start);
+    write32(writer, (uint32_t)handler->end);
+    write32(writer, (uint32_t)handler->target);
+    write32(writer, (uint32_t)handler->stackDepth);
+  }
+}
+
+/**
+ * 读取 writeChunkBody 写入的内容。代码和位置表复制到内存池中：
+ * 运行时的快速化和 profile 重排都会就地改写代码，不能直接指向映射。
+ * 可能分配内存，调用者需保证代码块所属的函数在 GC 中可达。
+ */
+bool readChunkBody(Reader* reader, Chunk* chunk) {
+  uint32_t codeCount = read32(reader);
+  const uint8_t* code = readSpan(reader, codeCount);
+  if (code == NULL || codeCount == 0 || codeCount > INT32_MAX) return false;
+  chunk->code = ALLOCATE(uint8_t, codeCount);
+  memcpy(chunk->code, code, codeCount);
+  chunk->count = chunk->capacity = (int)codeCount;
+
+  uint32_t lineCount = read32(reader);
+  const uint8_t* lines = readSpan(reader, lineCount);
+  if (lines == NULL || lineCount > INT32_MAX) return false;
+  chunk->lines.bytes = ALLOCATE(uint8_t, lineCount);
+  memcpy(chunk->lines.bytes, lines, lineCount);
+  chunk->lines.count = chunk->lines.capacity = (int)lineCount;
+  if (!rebuildLineTable(&chunk->lines, chunk->count)) return false;
+
+  uint32_t handlerCount = read32(reader);
+  if (handlerCount > (reader->size - reader->position) / 16) return false;
+  for (uint32_t i = 0; i < handlerCount; i++) {
+    int start = (int)read32(reader);
+    int end = (int)read32(reader);
+    int target = (int)read32(reader);
+    int stackDepth = (int)read32(reader);
+    addHandler(chunk, start, end, target, stackDepth);
+  }
+  return !reader->error;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static uint64_t hashSource64(const char* source) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* c = source; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static uint32_t headerFlags() {
+  uint32_t flags = 0;
+#ifdef NAN_BOXING
+  flags |= BYTECODE_FLAG_NAN_BOXING;
+#endif
+  return flags;
+}
+
+/**
+ * 收集函数树中引用的全部堆字符串，同时检查常量是否都能序列化。
+ * 惰性编译时先补齐尚未编译的函数体。
+ */
+static bool collectStrings(ObjFunction* function, StringTable* table, int depth) {
+  if (depth > BYTECODE_MAX_DEPTH) return false;
+#ifdef LAZY_COMPILE
+  if (function->lazy != NULL && !compileFunction(function)) return false;
+#endif
+  if (function->name != NULL) addString(table, function->name);
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    if (IS_NIL(value) || IS_BOOL(value) || IS_NUMBER(value) ||
+        IS_SMALL_STRING(value)) {
+      continue;
+    }
+    if (IS_STRING(value)) {
+      addString(table, AS_STRING(value));
+    } else if (IS_FUNCTION(value)) {
+      if (!collectStrings(AS_FUNCTION(value), table, depth + 1)) return false;
+    } else if (IS_STRUCT(value)) {
+      ObjStruct* type = AS_STRUCT(value);
+      addString(table, type->name);
+      for (int j = 0; j < type->fieldCount; j++) {
+        addString(table, type->fields[j]);
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void addString(StringTable* table, ObjString* string) {
+  Value index;
+  if (tableGet(&table->index, string, &index)) return;
+  tableSet(&table->index, string, NUMBER_VAL(table->strings.count));
+  writeValueArray(&table->strings, OBJ_VAL(string));
+}
+
+static uint32_t stringIndex(StringTable* table, ObjString* string) {
+  Value index;
+  tableGet(&table->index, string, &index);
+  return (uint32_t)AS_NUMBER(index);
+}
+
+/**
+ * 写入一个函数记录：名字、参数和上值个数、标志、代码、位置表、异常表、常量。
+ * 嵌套函数作为常量内嵌在父函数的记录中。
+ */
+static bool writeFunction(Writer* writer, ObjFunction* function, StringTable* table) {
+  Chunk* chunk = &function->chunk;
+  write32(writer, function->name != NULL ? stringIndex(table, function->name)
+                                         : BYTECODE_NO_NAME);
+  write32(writer, (uint32_t)function->arity);
+  write32(writer, (uint32_t)function->upvalueCount);
+  write8(writer, (uint8_t)((function->isMemo ? 1 : 0) |
+                           (function->isGenerator ? 2 : 0)));
+  writeChunkBody(writer, chunk);
+
+  write32(writer, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!writeConstant(writer, chunk->constants.values[i], table)) return false;
+  }
+  return true;
+}
+
+static bool writeConstant(Writer* writer, Value value, StringTable* table) {
+  if (IS_NIL(value)) {
+    write8(writer, CONSTANT_NIL);
+  } else if (IS_BOOL(value)) {
+    write8(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    write8(writer, CONSTANT_NUMBER);
+    write64(writer, bits);
+#ifdef NAN_BOXING
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[SMALL_STRING_MAX + 1];
+    int length = smallStringChars(value, chars);
+    write8(writer, CONSTANT_SMALL_STRING);
+    write8(writer, (uint8_t)length);
+    writeBytes(writer, chars, length);
+#endif
+  } else if (IS_STRING(value)) {
+    write8(writer, CONSTANT_STRING);
+    write32(writer, stringIndex(table, AS_STRING(value)));
+  } else if (IS_FUNCTION(value)) {
+    write8(writer, CONSTANT_FUNCTION);
+    return writeFunction(writer, AS_FUNCTION(value), table);
+  } else if (IS_STRUCT(value)) {
+    ObjStruct* type = AS_STRUCT(value);
+    write8(writer, CONSTANT_STRUCT);
+    write32(writer, stringIndex(table, type->name));
+    write32(writer, (uint32_t)type->fieldCount);
+    for (int i = 0; i < type->fieldCount; i++) {
+      write32(writer, stringIndex(table, type->fields[i]));
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * 读取一个字符串表下标，返回对应的字符串；下标越界时置位 error。
+ */
+static ObjString* readString(Reader* reader) {
+  uint32_t index = read32(reader);
+  if (reader->error || index >= (uint32_t)loadedStrings.count) {
+    reader->error = true;
+    return NULL;
+  }
+  return AS_STRING(loadedStrings.values[index]);
+}
+
+/**
+ * 解析文件头和字符串表，然后读取顶层函数。
+ */
+static ObjFunction* readScript(Reader* reader, const char* source) {
+  const uint8_t* magic = readSpan(reader, BYTECODE_MAGIC_LENGTH);
+  if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) != 0) {
+    return NULL;
+  }
+  if (read32(reader) != BYTECODE_VERSION) return NULL;
+  if (read32(reader) != BYTECODE_BYTE_ORDER) return NULL;
+  if (read32(reader) != headerFlags()) return NULL;
+  uint32_t sourceLength = read32(reader);
+  uint64_t sourceHash = read64(reader);
+  if (reader->error) return NULL;
+  if (source != NULL &&
+      (sourceLength != (uint32_t)strlen(source) ||
+       sourceHash != hashSource64(source))) {
+    return NULL;
+  }
+
+  uint32_t stringCount = read32(reader);
+  //每个字符串至少占 4 个字节的长度字段
+  if (stringCount > (reader->size - reader->position) / 4) return NULL;
+  for (uint32_t i = 0; i < stringCount; i++) {
+    uint32_t length = read32(reader);
+    const uint8_t* chars = readSpan(reader, length);
+    if (chars == NULL || length > INT32_MAX) return NULL;
+    ObjString* string = copyString((const char*)chars, (int)length);
+    push(OBJ_VAL(string));
+    writeValueArray(&loadedStrings, OBJ_VAL(string));
+    pop();
+  }
+
+  ObjFunction* script = readFunction(reader, 0);
+  if (script == NULL || reader->position != reader->size) return NULL;
+  return script;
+}
+
+/**
+ * 读取一个函数记录并校验其字节码。
+ * 返回的函数留在 VM 栈上，由调用者存入父函数的常量表后再弹出。
+ */
+static ObjFunction* readFunction(Reader* reader, int depth) {
+  if (depth > BYTECODE_MAX_DEPTH) return NULL;
+
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+
+  uint32_t name = read32(reader);
+  if (name != BYTECODE_NO_NAME) {
+    if (name >= (uint32_t)loadedStrings.count) return NULL;
+    function->name = AS_STRING(loadedStrings.values[name]);
+  }
+  uint32_t arity = read32(reader);
+  uint32_t upvalueCount = read32(reader);
+  uint8_t flags = read8(reader);
+  if (reader->error || arity > UINT8_MAX ||
+      upvalueCount > CONSTANT_LONG_MAX + 1 || flags > 3) {
+    return NULL;
+  }
+  function->arity = (int)arity;
+  function->upvalueCount = (int)upvalueCount;
+  function->isMemo = (flags & 1) != 0;
+  function->isGenerator = (flags & 2) != 0;
+
+  Chunk* chunk = &function->chunk;
+  if (!readChunkBody(reader, chunk)) return NULL;
+
+  uint32_t constantCount = read32(reader);
+  if (reader->error || constantCount > reader->size - reader->position ||
+      constantCount > CONSTANT_LONG_MAX + 1) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < constantCount; i++) {
+    if (!readConstant(reader, depth)) return NULL;
+    writeValueArray(&chunk->constants, vm.stackTop[-1]);
+    writeBarrier((Obj*)function, vm.stackTop[-1]);
+    pop();
+  }
+
+  if (verifyLoaded && !verifyBytecode(function)) return NULL;
+  return function;
+}
+
+/**
+ * 读取一个常量并把它压入 VM 栈。
+ */
+static bool readConstant(Reader* reader, int depth) {
+  uint8_t tag = read8(reader);
+  if (reader->error) return false;
+
+  switch (tag) {
+    case CONSTANT_NIL: push(NIL_VAL); return true;
+    case CONSTANT_TRUE: push(BOOL_VAL(true)); return true;
+    case CONSTANT_FALSE: push(BOOL_VAL(false)); return true;
+    case CONSTANT_NUMBER: {
+      uint64_t bits = read64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      push(NUMBER_VAL(number));
+      return !reader->error;
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(reader);
+      if (string == NULL) return false;
+      push(OBJ_VAL(string));
+      return true;
+    }
+    case CONSTANT_SMALL_STRING: {
+      uint8_t length = read8(reader);
+      if (reader->error || length > SMALL_STRING_MAX) return false;
+      const uint8_t* chars = readSpan(reader, length);
+      if (chars == NULL) return false;
+      push(stringValue((const char*)chars, length));
+      return true;
+    }
+    case CONSTANT_FUNCTION:
+      return readFunction(reader, depth + 1) != NULL;
+    case CONSTANT_STRUCT: {
+      ObjString* name = readString(reader);
+      uint32_t fieldCount = read32(reader);
+      if (name == NULL || fieldCount > UINT8_COUNT) return false;
+      ObjStruct* type = newStruct(name, (int)fieldCount);
+      push(OBJ_VAL(type));
+      for (uint32_t i = 0; i < fieldCount; i++) {
+        type->fields[i] = readString(reader);
+        if (type->fields[i] == NULL) return false;
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/**
+ * 校验 offset 处的一条指令。
+ *
+ * @return 指令长度；指令非法时返回 -1
+ */
+static int verifyInstruction(ObjFunction* function, int offset) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code + offset;
+  int remaining = chunk->count - offset;
+  uint8_t kind = code[0] < OPERAND_KIND_COUNT ? operandKinds[code[0]]
+                                              : OPERAND_INVALID;
+
+#define NEED(length) do { if (remaining < (length)) return -1; } while (false)
+#define THREE(at) ((uint32_t)(code[at] << 16 | code[(at) + 1] << 8 | code[(at) + 2]))
+
+  switch (kind) {
+    case OPERAND_NONE:
+      return 1;
+    case OPERAND_BYTE:
+      NEED(2);
+      return 2;
+    case OPERAND_LONG:
+      NEED(4);
+      return 4;
+    case OPERAND_CONSTANT:
+      NEED(2);
+      return code[1] < chunk->constants.count ? 2 : -1;
+    case OPERAND_CONSTANT_LONG:
+      NEED(4);
+      return THREE(1) < (uint32_t)chunk->constants.count ? 4 : -1;
+    case OPERAND_NAME:
+      NEED(2);
+      return isName(chunk, code[1]) ? 2 : -1;
+    case OPERAND_NAME_LONG:
+      NEED(4);
+      return isName(chunk, THREE(1)) ? 4 : -1;
+    case OPERAND_NAME_BYTE:
+      NEED(3);
+      return isName(chunk, code[1]) ? 3 : -1;
+    case OPERAND_NAME_LONG_BYTE:
+      NEED(5);
+      return isName(chunk, THREE(1)) ? 5 : -1;
+    case OPERAND_UPVALUE:
+      NEED(2);
+      return code[1] < function->upvalueCount ? 2 : -1;
+    case OPERAND_UPVALUE_LONG:
+      NEED(4);
+      return THREE(1) < (uint32_t)function->upvalueCount ? 4 : -1;
+    case OPERAND_JUMP:
+      NEED(3);
+      return 3;
+    case OPERAND_JUMP_LONG:
+      NEED(4);
+      return 4;
+    case OPERAND_CLOSURE:
+    case OPERAND_CLOSURE_LONG: {
+      bool wide = kind == OPERAND_CLOSURE_LONG;
+      int operand = wide ? 3 : 1;
+      NEED(1 + operand);
+      uint32_t constant = wide ? THREE(1) : code[1];
+      if (constant >= (uint32_t)chunk->constants.count ||
+          !IS_FUNCTION(chunk->constants.values[constant])) {
+        return -1;
+      }
+      ObjFunction* closed = AS_FUNCTION(chunk->constants.values[constant]);
+      int length = 1 + operand + closed->upvalueCount * (1 + operand);
+      NEED(length);
+      for (int i = 1 + operand; i < length; i += 1 + operand) {
+        uint8_t isLocal = code[i];
+        uint32_t index = wide ? THREE(i + 1) : code[i + 1];
+        if (isLocal > 1) return -1;
+        if (!isLocal && index >= (uint32_t)function->upvalueCount) return -1;
+      }
+      return length;
+    }
+    default:
+      return -1;
+  }
+
+#undef THREE
+#undef NEED
+}
+
+/**
+ * 求跳转指令的目标偏移，非跳转指令返回 -1。
+ * 指令已经通过 verifyInstruction 校验，操作数完整。
+ */
+static int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      return offset + 3 + (code[1] << 8 | code[2]);
+    case OP_LOOP: {
+      int target = offset + 3 - (code[1] << 8 | code[2]);
+      return target < 0 ? -2 : target;
+    }
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+      return offset + 4 + GET_THREE_BYTE(chunk, offset + 1);
+    case OP_LOOP_LONG: {
+      int target = offset + 4 - GET_THREE_BYTE(chunk, offset + 1);
+      return target < 0 ? -2 : target;
+    }
+    default:
+      return -1;
+  }
+}
+
+/**
+ * 以名字为操作数的指令要求常量是堆上的字符串（标识符常量不会打包成立即数）。
+ */
+static bool isName(Chunk* chunk, uint32_t constant) {
+  return constant < (uint32_t)chunk->constants.count &&
+         IS_STRING(chunk->constants.values[constant]);
+}
+
+static void cachePath(char* buffer, size_t size, const char* cacheDir,
+                      const char* source) {
+  snprintf(buffer, size, "%s/%016llx" BYTECODE_EXTENSION, cacheDir,
+           (unsigned long long)hashSource64(source));
+}
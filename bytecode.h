@@ -0,0 +1,57 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 字节码文件格式版本，格式或操作码有任何变化都要加一 */
+#define BYTECODE_VERSION 2
+
+/* 字节码文件的扩展名 */
+#define BYTECODE_EXTENSION ".cloxc"
+
+//写入缓冲区，文件内容先完整写入内存再一次性落盘
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Writer;
+
+//读取游标，任何越界读取都会置位 error，之后的读取一律返回 0
+typedef struct {
+  const uint8_t* bytes;
+  size_t size;
+  size_t position;
+  bool error;
+} Reader;
+
+
+bool saveBytecode(ObjFunction* script, const char* source, const char* path);
+ObjFunction* loadBytecode(const char* path, const char* source);
+bool encodeBytecode(ObjFunction* script, const char* source, Writer* writer);
+ObjFunction* decodeBytecode(const uint8_t* bytes, size_t size,
+                            const char* source, bool verify);
+ObjFunction* loadCachedScript(const char* cacheDir, const char* source);
+void cacheScript(const char* cacheDir, const char* source, ObjFunction* script);
+void markBytecodeRoots();
+bool verifyBytecode(ObjFunction* function);
+
+void writeBytes(Writer* writer, const void* bytes, size_t length);
+void write8(Writer* writer, uint8_t value);
+void write32(Writer* writer, uint32_t value);
+void write64(Writer* writer, uint64_t value);
+void freeWriter(Writer* writer);
+bool writeFile(const char* path, Writer* writer);
+bool mapFile(const char* path, Reader* reader);
+void unmapFile(Reader* reader);
+const uint8_t* readSpan(Reader* reader, size_t length);
+uint8_t read8(Reader* reader);
+uint32_t read32(Reader* reader);
+uint64_t read64(Reader* reader);
+void writeChunkBody(Writer* writer, Chunk* chunk);
+bool readChunkBody(Reader* reader, Chunk* chunk);
+
+#endif // clox_bytecode_h
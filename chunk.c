@@ -1,11 +1,23 @@
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "vm.h"
 #include "memory.h"
 /****************************************/
 /****    static function declaration  ***/
 /****************************************/
-static void addLine(Chunk *chunk, int line);
+static void initLineTable(LineTable *table);
+static void addPosition(LineTable *table, int offset, int line, int column);
+static void addCheckpoint(LineTable *table, int position);
+static int entryLength(const uint8_t *bytes, int position, int count);
+static int writeVarint(uint8_t *bytes, int position, uint32_t value);
+static int readVarint(const uint8_t *bytes, int position, uint32_t *value);
+static int decodePosition(const uint8_t *bytes, int position,
+                          int *offset, int *line, int *column);
+static bool findPosition(Chunk *chunk, int offset, int *line, int *column);
+static int findConstant(Chunk *chunk, Value value);
+static void indexConstant(Chunk *chunk, int constant);
+static bool sameConstant(Value a, Value b);
 
 
 /****************************************/
@@ -16,23 +28,28 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
-  chunk->rle = NULL;
-  chunk->rleIndex = 0;
-  chunk->rleCapacity = 0;
+  initLineTable(&chunk->lines);
+  chunk->handlers = NULL;
+  chunk->handlerCount = 0;
+  chunk->handlerCapacity = 0;
+  chunk->profile = NULL;
+  chunk->constantSlots = NULL;
+  chunk->constantSlotCapacity = 0;
 
   initValueArray(&chunk->constants);
 }
 
 
 /**
- * 向当前Chunk写入一个字节，并更新行号信息。
+ * 向当前Chunk写入一个字节，并更新位置信息。
  * 如果当前Chunk的容量不足以容纳新的字节，则会自动扩容。
  *
  * @param chunk 要写入的Chunk指针
  * @param byte 要写入的字节
  * @param line 字节对应的源代码行号
+ * @param column 字节对应的源代码列号
  */
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+void writeChunk(Chunk *chunk, uint8_t byte, int line, int column) {
   
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
@@ -40,8 +57,8 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
+  addPosition(&chunk->lines, chunk->count, line, column);
   chunk->count++;
-  addLine(chunk, line);
 }
 
 /**
@@ -54,7 +71,10 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
  */
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(uint8_t, chunk->rle, chunk->rleCapacity);
+  freeLineTable(&chunk->lines);
+  FREE_ARRAY(ExceptionHandler, chunk->handlers, chunk->handlerCapacity);
+  freeBranchProfile(chunk);
+  freeConstantIndex(chunk);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -62,16 +82,31 @@ void freeChunk(Chunk *chunk) {
 
 /**
  * 向给定的Chunk中添加一个常量值，并返回该常量在常量表中的索引。
+ * 常量表中已有相同的常量时直接返回已有的索引，同一个标识符或字面量只占一项。
  *
  * @param chunk 要添加常量的Chunk指针
  * @param value 要添加的常量值
- * @return 返回新添加的常量在常量表中的索引
+ * @return 返回该常量在常量表中的索引
  */
 int addConstant(Chunk *chunk, Value value) {
+  int constant = findConstant(chunk, value);
+  if (constant >= 0) return constant;
+
   push(value);
   writeValueArray(&chunk->constants, value);
+  constant = VALUE_COUNT(chunk->constants) - 1;
+  indexConstant(chunk, constant);
   pop();
-  return VALUE_COUNT(chunk->constants) - 1;
+  return constant;
+}
+
+/**
+ * 释放常量去重索引。函数编译结束后不会再添加常量，运行时不需要这份索引。
+ */
+void freeConstantIndex(Chunk *chunk) {
+  FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+  chunk->constantSlots = NULL;
+  chunk->constantSlotCapacity = 0;
 }
 
 /**
@@ -82,42 +117,462 @@ int addConstant(Chunk *chunk, Value value) {
  * @return 如果找到，则返回指定偏移量的字节码行号；否则返回-1。
  */
 int getLine(Chunk *chunk, int offset) {
-  int proOpCodeCount = 0;
-  int i = 0;
-  while (i <= chunk->rleIndex) {
-    proOpCodeCount += chunk->rle[i];
-    if (proOpCodeCount > offset) {
-      return chunk->rle[i + 1];
+  int line, column;
+  return findPosition(chunk, offset, &line, &column) ? line : -1;
+}
+
+/**
+ * 从给定的Chunk中获取指定偏移量的字节码所在列号。
+ *
+ * @return 如果找到，则返回列号；否则返回-1。
+ */
+int getColumn(Chunk *chunk, int offset) {
+  int line, column;
+  return findPosition(chunk, offset, &line, &column) ? column : -1;
+}
+
+/**
+ * 根据编码数据重建位置表的检查点和末尾状态，并校验编码：条目必须完整，
+ * 第一个条目的偏移为 0，之后的偏移严格递增且都小于 codeCount。
+ * 字节码文件中只保存编码数据，载入时用它补全其余字段。
+ *
+ * @param table bytes 和 count 已经填好的位置表
+ * @param codeCount 代码块的字节数
+ * @return 编码合法返回 true
+ */
+bool rebuildLineTable(LineTable *table, int codeCount) {
+  FREE_ARRAY(LineCheckpoint, table->checkpoints, table->checkpointCapacity);
+  table->checkpoints = NULL;
+  table->checkpointCount = 0;
+  table->checkpointCapacity = 0;
+  table->entryCount = 0;
+  table->lastOffset = 0;
+  table->lastLine = 0;
+  table->lastColumn = 0;
+
+  int position = 0;
+  while (position < table->count) {
+    int length = entryLength(table->bytes, position, table->count);
+    if (length < 0) return false;
+    int offset = table->lastOffset;
+    int line = table->lastLine;
+    int column = table->lastColumn;
+    decodePosition(table->bytes, position, &offset, &line, &column);
+    bool ordered = table->entryCount == 0 ? offset == 0
+                                          : offset > table->lastOffset;
+    if (!ordered || offset >= codeCount) return false;
+
+    position += length;
+    table->lastOffset = offset;
+    table->lastLine = line;
+    table->lastColumn = column;
+    if (table->entryCount++ % LINE_CHECKPOINT_INTERVAL == 0) {
+      addCheckpoint(table, position);
     }
-    i += 2;
   }
-  return -1;
+  return codeCount == 0 || table->entryCount > 0;
+}
+
+void freeLineTable(LineTable *table) {
+  FREE_ARRAY(uint8_t, table->bytes, table->capacity);
+  FREE_ARRAY(LineCheckpoint, table->checkpoints, table->checkpointCapacity);
+  initLineTable(table);
+}
+
+/**
+ * 向异常表追加一项。
+ * 编译器在 try 语句结束时调用，因此内层 try 总是排在外层 try 之前。
+ *
+ * @param chunk 代码块
+ * @param start 受保护区间的起始偏移
+ * @param end 受保护区间的结束偏移（不含）
+ * @param target catch 块入口偏移
+ * @param stackDepth 进入 try 时调用帧内的栈深度
+ */
+void addHandler(Chunk *chunk, int start, int end, int target, int stackDepth) {
+  if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+    int oldCapacity = chunk->handlerCapacity;
+    chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->handlers = GROW_ARRAY(ExceptionHandler, chunk->handlers,
+                                 oldCapacity, chunk->handlerCapacity);
+  }
+  ExceptionHandler* handler = &chunk->handlers[chunk->handlerCount++];
+  handler->start = start;
+  handler->end = end;
+  handler->target = target;
+  handler->stackDepth = stackDepth;
+}
+
+/**
+ * 查找覆盖指定偏移的最内层异常处理器。
+ * 只有抛出异常时才会查表，正常执行路径没有任何开销。
+ *
+ * @param chunk 代码块
+ * @param offset 正在执行的指令中某个字节的偏移
+ * @return 找到的处理器，没有则返回 NULL
+ */
+ExceptionHandler* findHandler(Chunk *chunk, int offset) {
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    if (handler->start <= offset && offset < handler->end) {
+      return handler;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * 计算指定偏移处指令的字节数（操作码加操作数）。
+ *
+ * @param chunk 代码块
+ * @param offset 指令的起始偏移
+ * @return 指令长度
+ */
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CALL_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_IMPORT:
+      return 2;
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_IMPORT_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+      return 4;
+    case OP_GET_FIELD_LONG:
+    case OP_SET_FIELD_LONG:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+      return 5;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(
+          VALUE_AT(chunk->constants, chunk->code[offset + 1]));
+      return 2 + function->upvalueCount * 2;
+    }
+    case OP_CLOSURE_LONG: {
+      ObjFunction* function = AS_FUNCTION(
+          VALUE_AT(chunk->constants, GET_THREE_BYTE(chunk, offset + 1)));
+      return 4 + function->upvalueCount * 4;
+    }
+    default:
+      return 1;
+  }
+}
+
+/**
+ * 标记代码块中每条指令的起点。代码必须是编译器生成的或已经通过校验的。
+ *
+ * @return 长度为 chunk->count 的数组，指令起点处为 1，由调用者用 FREE_ARRAY 释放
+ */
+uint8_t* instructionStarts(Chunk* chunk) {
+  uint8_t* starts = ALLOCATE(uint8_t, chunk->count);
+  memset(starts, 0, chunk->count);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    starts[offset] = 1;
+  }
+  return starts;
+}
+
+void freeBranchProfile(Chunk *chunk) {
+  if (chunk->profile == NULL) return;
+  FREE_ARRAY(uint32_t, chunk->profile->counts, chunk->count + 1);
+  FREE(BranchProfile, chunk->profile);
+  chunk->profile = NULL;
 }
 
 /****************************************/
 /****    static function definition  ****/
 /****************************************/
 
+static void initLineTable(LineTable *table) {
+  table->bytes = NULL;
+  table->count = 0;
+  table->capacity = 0;
+  table->checkpoints = NULL;
+  table->checkpointCount = 0;
+  table->checkpointCapacity = 0;
+  table->entryCount = 0;
+  table->lastOffset = 0;
+  table->lastLine = 0;
+  table->lastColumn = 0;
+}
+
 /**
- * 向Chunk中添加一行代码，并记录行号。如果连续的行号相同，则增加计数器，否则添加新的行号记录。
- * @param chunk 要添加行号的Chunk结构体指针
- * @param line 要添加的行号
+ * 记录从 offset 开始的字节码对应的源码位置。位置与上一个条目相同时不追加条目。
+ * 最常见的两种情况——同一行内向后推进几列、进入下一行——分别只占一个和两个字节。
+ *
+ * @param table 位置表
+ * @param offset 字节码偏移，必须大于上一个条目的偏移
+ * @param line 行号
+ * @param column 列号
  */
-static void addLine(Chunk *chunk, int line) {
-  if (chunk->rleIndex + 2 > chunk->rleCapacity) {
-    int oldCapacity = chunk->rleCapacity;
-    chunk->rleCapacity = GROW_CAPACITY(oldCapacity);
-    chunk->rle = GROW_ARRAY(uint8_t, chunk->rle, oldCapacity, chunk->rleCapacity);
+static void addPosition(LineTable *table, int offset, int line, int column) {
+  if (table->entryCount > 0 &&
+      line == table->lastLine && column == table->lastColumn) {
+    return;
+  }
+
+  //长条目最多 1 + 3 * 5 个字节
+  if (table->capacity < table->count + 16) {
+    int oldCapacity = table->capacity;
+    table->capacity = GROW_CAPACITY(oldCapacity);
+    if (table->capacity < table->count + 16) table->capacity = table->count + 16;
+    table->bytes = GROW_ARRAY(uint8_t, table->bytes, oldCapacity, table->capacity);
   }
 
-  if(chunk->rle[chunk->rleIndex] == 0) {
-    chunk->rle[chunk->rleIndex] = 1;
-    chunk->rle[chunk->rleIndex + 1] = line;
-  } else if (chunk->rle[chunk->rleIndex + 1] == line) {
-    chunk->rle[chunk->rleIndex] += 1;
+  int offsetDelta = offset - table->lastOffset;
+  int lineDelta = line - table->lastLine;
+  int columnDelta = column - table->lastColumn;
+  if (table->entryCount > 0 && lineDelta == 0 &&
+      offsetDelta >= 1 && offsetDelta <= 8 &&
+      columnDelta >= 0 && columnDelta <= 15) {
+    table->bytes[table->count++] = (uint8_t)(((offsetDelta - 1) << 4) | columnDelta);
+  } else if (table->entryCount > 0 && lineDelta == 1 &&
+             offsetDelta >= 1 && offsetDelta <= 64 &&
+             column >= 0 && column <= UINT8_MAX) {
+    table->bytes[table->count++] = (uint8_t)(0x80 | (offsetDelta - 1));
+    table->bytes[table->count++] = (uint8_t)column;
   } else {
-    chunk->rleIndex += 2;
-    chunk->rle[chunk->rleIndex] = 1;
-    chunk->rle[chunk->rleIndex + 1] = line;
+    //行增量做 zigzag 编码，重排后的字节码里行号可能变小
+    uint32_t zigzag = lineDelta >= 0 ? (uint32_t)lineDelta << 1
+                                     : ((uint32_t)(-(int64_t)lineDelta) << 1) - 1;
+    table->bytes[table->count++] = 0xc0;
+    table->count = writeVarint(table->bytes, table->count, (uint32_t)offsetDelta);
+    table->count = writeVarint(table->bytes, table->count, zigzag);
+    table->count = writeVarint(table->bytes, table->count, (uint32_t)column);
+  }
+
+  table->lastOffset = offset;
+  table->lastLine = line;
+  table->lastColumn = column;
+  if (table->entryCount++ % LINE_CHECKPOINT_INTERVAL == 0) {
+    addCheckpoint(table, table->count);
+  }
+}
+
+/**
+ * 以最后一个条目解码后的状态追加一个检查点。
+ *
+ * @param position 下一个条目在编码数据中的位置
+ */
+static void addCheckpoint(LineTable *table, int position) {
+  if (table->checkpointCapacity < table->checkpointCount + 1) {
+    int oldCapacity = table->checkpointCapacity;
+    table->checkpointCapacity = GROW_CAPACITY(oldCapacity);
+    table->checkpoints = GROW_ARRAY(LineCheckpoint, table->checkpoints,
+                                    oldCapacity, table->checkpointCapacity);
   }
-}
\ No newline at end of file
+  LineCheckpoint* checkpoint = &table->checkpoints[table->checkpointCount++];
+  checkpoint->offset = table->lastOffset;
+  checkpoint->line = table->lastLine;
+  checkpoint->column = table->lastColumn;
+  checkpoint->position = position;
+}
+
+/**
+ * 计算 position 处条目的字节数，条目不完整时返回 -1。
+ */
+static int entryLength(const uint8_t *bytes, int position, int count) {
+  uint8_t head = bytes[position];
+  if (head < 0x80) return 1;
+  if (head < 0xc0) return position + 2 <= count ? 2 : -1;
+
+  int end = position + 1;
+  for (int i = 0; i < 3; i++) {
+    int start = end;
+    do {
+      if (end >= count || end - start >= 5) return -1;
+    } while (bytes[end++] & 0x80);
+  }
+  return end - position;
+}
+
+/**
+ * 写入一个 varint：每个字节低 7 位存数据，最高位表示后面还有字节。
+ *
+ * @return 写入后的位置
+ */
+static int writeVarint(uint8_t *bytes, int position, uint32_t value) {
+  while (value >= 0x80) {
+    bytes[position++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[position++] = (uint8_t)value;
+  return position;
+}
+
+static int readVarint(const uint8_t *bytes, int position, uint32_t *value) {
+  uint32_t result = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    byte = bytes[position++];
+    result |= (uint32_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  *value = result;
+  return position;
+}
+
+/**
+ * 解码 position 处的条目，把它应用到 offset、line、column 上。
+ *
+ * @return 下一个条目的位置
+ */
+static int decodePosition(const uint8_t *bytes, int position,
+                          int *offset, int *line, int *column) {
+  uint8_t head = bytes[position++];
+  if (head < 0x80) {
+    *offset += (head >> 4) + 1;
+    *column += head & 0x0f;
+    return position;
+  }
+  if (head < 0xc0) {
+    *offset += (head & 0x3f) + 1;
+    *line += 1;
+    *column = bytes[position++];
+    return position;
+  }
+
+  uint32_t value;
+  position = readVarint(bytes, position, &value);
+  *offset += (int)value;
+  position = readVarint(bytes, position, &value);
+  *line += (value & 1) ? -(int)((value + 1) >> 1) : (int)(value >> 1);
+  position = readVarint(bytes, position, &value);
+  *column = (int)value;
+  return position;
+}
+
+/**
+ * 查找指定偏移处字节码的源码位置：先在检查点上二分查找，再顺序解码。
+ *
+ * @return 偏移越界时返回 false
+ */
+static bool findPosition(Chunk *chunk, int offset, int *line, int *column) {
+  LineTable* table = &chunk->lines;
+  if (offset < 0 || offset >= chunk->count || table->checkpointCount == 0) {
+    return false;
+  }
+
+  //最后一个起始偏移不大于 offset 的检查点，第一个检查点的偏移总是 0
+  int low = 0;
+  int high = table->checkpointCount - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (table->checkpoints[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  LineCheckpoint* checkpoint = &table->checkpoints[low];
+  int currentOffset = checkpoint->offset;
+  *line = checkpoint->line;
+  *column = checkpoint->column;
+  int position = checkpoint->position;
+  while (position < table->count) {
+    int nextOffset = currentOffset;
+    int nextLine = *line;
+    int nextColumn = *column;
+    int next = decodePosition(table->bytes, position,
+                              &nextOffset, &nextLine, &nextColumn);
+    if (nextOffset > offset) break;
+    currentOffset = nextOffset;
+    *line = nextLine;
+    *column = nextColumn;
+    position = next;
+  }
+  return true;
+}
+
+/**
+ * 在去重索引中查找与 value 相同的常量。
+ *
+ * @return 常量下标，没有找到返回 -1
+ */
+static int findConstant(Chunk *chunk, Value value) {
+  if (chunk->constantSlotCapacity == 0) return -1;
+  uint32_t mask = chunk->constantSlotCapacity - 1;
+  uint32_t index = hashValue(value) & mask;
+  for (;;) {
+    int constant = chunk->constantSlots[index];
+    if (constant == -1) return -1;
+    if (sameConstant(VALUE_AT(chunk->constants, constant), value)) {
+      return constant;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+/**
+ * 把常量表中下标为 constant 的常量加入去重索引，装载因子超过 1/2 时扩容并重建。
+ */
+static void indexConstant(Chunk *chunk, int constant) {
+  if ((constant + 1) * 2 > chunk->constantSlotCapacity) {
+    int oldCapacity = chunk->constantSlotCapacity;
+    int capacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+    FREE_ARRAY(int, chunk->constantSlots, oldCapacity);
+    chunk->constantSlots = ALLOCATE(int, capacity);
+    chunk->constantSlotCapacity = capacity;
+    for (int i = 0; i < capacity; i++) chunk->constantSlots[i] = -1;
+    //新常量也在常量表中，一起重新插入
+    for (int i = 0; i < constant; i++) indexConstant(chunk, i);
+  }
+
+  uint32_t mask = chunk->constantSlotCapacity - 1;
+  uint32_t index = hashValue(VALUE_AT(chunk->constants, constant)) & mask;
+  while (chunk->constantSlots[index] != -1) {
+    index = (index + 1) & mask;
+  }
+  chunk->constantSlots[index] = constant;
+}
+
+/**
+ * 判断两个常量能否共用一项。
+ * 数字按位比较：0 和 -0 虽然相等，但不能合并成同一个常量。
+ */
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+}
@@ -11,12 +11,18 @@
 // 获取三个字节的值
 #define CONSTANT_LONG_MAX (0x00ffffff)
 
+//位置表中每隔多少个条目记录一个检查点
+#define LINE_CHECKPOINT_INTERVAL 64
+
+//指令编码的版本：增删操作码或改变操作数的编码都要加一，profile 文件据此判断是否过期
+#define OPCODE_VERSION 5
+
 #define GET_THREE_BYTE(chunk, offset) (chunk->code[offset] << 16 | chunk->code[offset + 1] << 8 | chunk->code[offset + 2])
 
 //操作码
 typedef enum {
   OP_CONSTANT, //从常量池中获取一个常量， 包含一个操作数
-  // OP_CONSTANT_LONG, //从常量池中获取一个常量， 包含三个操作数
+  OP_CONSTANT_LONG, //从常量池中获取一个常量， 包含三个操作数
  
   OP_NIL,     //nil
   OP_TRUE,    //true
@@ -32,8 +38,23 @@ typedef enum {
   OP_SET_GLOBAL,
   OP_GET_UPVALUE, //获取上值
   OP_SET_UPVALUE, //设置上值
+  //以下 _LONG 指令的操作数为三个字节，只在索引超出一个字节时使用
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_FIELD_LONG,
+  OP_SET_FIELD_LONG,
+  OP_GET_SUPER_LONG,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
+  OP_GET_FIELD,    //按槽位读取结构体字段，槽位不匹配时退回按名字查找
+  OP_SET_FIELD,    //按槽位写入结构体字段
   OP_GET_SUPER,
 
   OP_EQUAL,     //==
@@ -46,6 +67,8 @@ typedef enum {
   OP_TERNARY, //  三元操作
 
   OP_ADD,   //  +
+  OP_ADD_NUMBER, //  +，两个操作数都是数字时的特化指令
+  OP_ADD_STRING, //  +，两个操作数都是字符串时的特化指令
   OP_SUBTRACT, // -
   OP_MULTIPLY,  // *
   OP_DIVIDE,    // /
@@ -59,21 +82,80 @@ typedef enum {
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
+  OP_JUMP_LONG,          //跳转距离为三个字节，跳转距离超出 16 位时使用
+  OP_JUMP_IF_FALSE_LONG,
+  OP_LOOP_LONG,
 
   OP_CALL,
+  OP_CALL_CLOSURE, //被调用者是闭包时的特化指令
   OP_INVOKE, // 这是一个复杂指令，帮助调用类方法
   OP_SUPER_INVOKE, //这是一个复杂指令，调用父类方法
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
   OP_CLOSURE,
+  OP_CLOSURE_LONG, //函数常量和上值索引都是三个字节
   OP_CLOSE_UPVALUE,
   
   OP_RETURN, //返回
+  OP_THROW,  //抛出异常
+  OP_YIELD,  //挂起当前协程
+  OP_RESUME, //恢复协程
    
   OP_CLASS, //类
   OP_INHERIT, //继承
-  OP_METHOD //类方法
+  OP_METHOD, //类方法
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+
+  OP_IMPORT,         //加载模块，首次导入时执行模块的顶层代码
+  OP_IMPORT_LONG,
+  OP_IMPORT_GLOBALS  //把模块的全局变量复制到当前模块
 } OpCode;
 
 
+//异常表项：描述一段受 try 保护的字节码区间
+typedef struct {
+  int start;      //受保护区间的起始偏移
+  int end;        //受保护区间的结束偏移（不含）
+  int target;     //catch 块入口偏移
+  int stackDepth; //进入 try 时调用帧内的栈深度
+} ExceptionHandler;
+
+//训练运行时收集的执行计数，只在训练模式下分配
+typedef struct {
+  uint32_t entries;   //函数被调用的次数
+  uint32_t* counts;   //按指令偏移记录跳转指令的执行次数，
+                      //OP_JUMP_IF_FALSE 发生跳转的次数记在 offset + 1
+} BranchProfile;
+
+//位置表检查点：记录第 k * LINE_CHECKPOINT_INTERVAL 个条目解码后的状态
+typedef struct {
+  int offset;     //条目对应的起始指令偏移
+  int line;
+  int column;
+  int position;   //下一个条目在编码数据中的位置
+} LineCheckpoint;
+
+//位置表：每当字节码的源码位置改变时追加一个条目，条目按变长编码存储
+//  同行条目（一个字节，0xxxxxxx）：位 4-6 为偏移增量减一，位 0-3 为列增量
+//  换行条目（两个字节，10xxxxxx）：行号加一，低 6 位为偏移增量减一，第二个字节为列
+//  通用条目：0xc0 后跟三个 varint，依次为偏移增量、zigzag 编码的行增量、列
+//查找时先在检查点上二分，再从检查点开始顺序解码至多 LINE_CHECKPOINT_INTERVAL 个条目
+typedef struct {
+  uint8_t* bytes;
+  int count;
+  int capacity;
+
+  LineCheckpoint* checkpoints;
+  int checkpointCount;
+  int checkpointCapacity;
+
+  int entryCount;
+  int lastOffset;   //最后一个条目的状态，追加条目时据此求增量
+  int lastLine;
+  int lastColumn;
+} LineTable;
+
 //代码块
 typedef struct {
   //动态数组  
@@ -83,18 +165,34 @@ typedef struct {
 
   ValueArray constants; //代码块中常量的数组
 
-  //利用游程长度编码
-  uint8_t* rle;               
-  int rleIndex;          
-  int rleCapacity;    
+  //编译期的常量去重索引：开放寻址，存放常量下标，空槽为 -1
+  int* constantSlots;
+  int constantSlotCapacity;
+
+  LineTable lines; //指令偏移到源码行列的映射
+
+  //异常表，内层 try 排在外层之前
+  ExceptionHandler* handlers;
+  int handlerCount;
+  int handlerCapacity;
 
+  BranchProfile* profile;  //分支计数，非训练模式下为 NULL
 } Chunk;
 
 
 void initChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeChunk(Chunk* chunk, uint8_t byte, int line, int column);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+void freeConstantIndex(Chunk* chunk);
 int getLine(Chunk* chunk, int offset);
+int getColumn(Chunk* chunk, int offset);
+void freeLineTable(LineTable* table);
+bool rebuildLineTable(LineTable* table, int codeCount);
+void addHandler(Chunk* chunk, int start, int end, int target, int stackDepth);
+ExceptionHandler* findHandler(Chunk* chunk, int offset);
+int instructionLength(Chunk* chunk, int offset);
+uint8_t* instructionStarts(Chunk* chunk);
+void freeBranchProfile(Chunk* chunk);
 
 #endif // clox_chunk_h
\ No newline at end of file
@@ -13,6 +13,16 @@
 
 #define NAN_BOXING  // NAN 装箱
 
+// #define MEMO_WEAK_CACHE   // memo 函数缓存对 GC 为弱引用
+#define MEMO_CACHE_MAX 1024  // 每个 memo 函数缓存的最大条目数
+
+// #define COMPRESSED_REFS   // 堆内引用使用相对内存池的 32 位偏移
+
+// #define LAZY_COMPILE      // 函数体在首次调用时才编译
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+//虚拟机、内存池和编译器的全局状态每个线程一份，工作线程可以独立编译模块
+#define THREAD_LOCAL _Thread_local
+
 #endif  // clox_common_h
\ No newline at end of file
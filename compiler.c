@@ -7,11 +7,14 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "arena.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+/* 编译期名字表的最大负载因子 */
+#define NAME_TABLE_MAX_LOAD 0.75
 
 
 typedef void (*ParseFn)(bool canAssign);
@@ -26,8 +29,12 @@ typedef enum {
 
 typedef struct {
   Token name;
+  uint32_t hash;    //名字的哈希值
   int depth;
   bool isCaptured;
+  int shadowed;     //被它遮蔽的同名局部变量下标，没有时为 -1
+  int capturedBy;   //最近一个捕获它的内层函数序号
+  int capturedAs;   //在该内层函数中的上值下标
 } Local;
 
 
@@ -61,29 +68,69 @@ typedef struct {
 } ParseRule;
 
 typedef struct {
-  uint8_t index;
+  Token name;       //捕获的变量名
+  int index;
   bool isLocal;
+  int capturedBy;   //最近一个引用它的内层函数序号
+  int capturedAs;   //在该内层函数中的上值下标
 } Upvalue;
 
 typedef struct Circulation{
   struct Circulation* enclosing;
   int loopStart; //记录循环开始位置
-  int _break[UINT8_COUNT];  //记录break指令位置
+  int scopeDepth; //进入循环时的作用域深度
+  int* _break;              //记录break指令位置
   int _break_count;         //break指令数量
+  int _break_capacity;
 } Circulation;
 
+//名字到整数的哈希表，键直接指向源码中的词素，只在编译期间使用
+typedef struct {
+  const char* start;
+  int length;
+  uint32_t hash;
+  int value;        //-1 表示这个名字当前没有对应的值
+} NameEntry;
+
+typedef struct {
+  NameEntry* entries;
+  int count;
+  int capacity;
+} NameTable;
+
 typedef struct Compiler{
   struct Compiler* enclosing;
   ObjFunction* function; //当前处理的函数
   FunctionType type;
+  int ordinal;           //函数在本遍编译中的序号
+  bool wideJumps;        //前向跳转是否使用三字节的长跳转
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
+  int localCapacity;
   int scopeDepth;
+  NameTable localNames;     //名字到最内层同名局部变量的下标
+
+  Upvalue* upvalues;        //内层函数编译期间还会增长，所以不放在 arena 中
+  int upvalueCapacity;
 
-  Upvalue upvalues[UINT8_COUNT];
+  struct Circulation* enclosingCirculation; //外层函数中正在编译的循环
+  NameTable upvalueNames;   //延迟编译时，外层变量名到本函数上值下标
+  NameTable constantNames;  //名字到常量表下标，同一个名字只驻留一次
+  ArenaMark arenaMark;      //函数开始编译时 arena 的位置，结束时回退到这里
 } Compiler;
 
+//前向跳转在生成时还不知道距离。某个函数的跳转超出 16 位时记下它的序号，
+//整个脚本重新编译一遍，这些函数改用长跳转，其余函数保持紧凑的编码
+typedef struct {
+  int* functions;     //需要长跳转的函数序号
+  int count;
+  int capacity;
+  int nextOrdinal;    //本遍编译中下一个函数的序号
+  bool overflow;      //本遍编译中是否有前向跳转超出 16 位
+} WideJumps;
+
+
 typedef struct ClassCompiler {
   struct ClassCompiler* enclosing;
   bool hasSuperclass;
@@ -92,19 +139,45 @@ typedef struct ClassCompiler {
 
 
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL; //用于记录类，防止在顶层定义this
-Circulation * currentCirculation = NULL; //用于记录循环
+//编译状态每个线程一份，不同线程可以同时编译各自的模块
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler* current = NULL;
+THREAD_LOCAL ClassCompiler* currentClass = NULL; //用于记录类，防止在顶层定义this
+THREAD_LOCAL Circulation * currentCirculation = NULL; //用于记录循环
+THREAD_LOCAL NameTable structFields;   //已声明的结构体字段名及其槽位，用于生成按槽位访问的指令
+THREAD_LOCAL WideJumps wideJumps;
+THREAD_LOCAL Arena compilerArena;      //编译器内部状态，按函数嵌套的顺序分配和回退
+#ifdef LAZY_COMPILE
+THREAD_LOCAL ObjString* lazySource;    //正在编译的源码，延迟编译的函数体记录在其中的位置
+#endif
 
 /****************************************/
 /****    private function declaration  **/
 /****************************************/
-static void initCompiler(Compiler* compiler,  FunctionType type);
+static void initCompiler(Compiler* compiler, FunctionType type,
+                         ObjFunction* function);
+static void freeCompiler(Compiler* compiler);
+static void parameters();
+#ifdef LAZY_COMPILE
+static void compileLazyPass(ObjFunction* function);
+static void skimBody();
+static void captureName(Token name);
+static ObjFunction* endSkim(Token* start);
+#endif
+static uint32_t hashName(Token* name);
+static void initNameTable(NameTable* table);
+static void freeNameTable(NameTable* table);
+static NameEntry* findName(NameEntry* entries, int capacity,
+                           Token* name, uint32_t hash);
+static int getName(NameTable* table, Token* name, uint32_t hash);
+static void setName(NameTable* table, Token* name, uint32_t hash, int value);
+static ObjFunction* compilePass(const char* source);
 static void advance();
 static void consume(TokenType type, const char* message);
 static bool match(TokenType type);
 static ObjFunction* endCompiler();
+static void addLocal(Token name);
+static Token syntheticToken(const char* text);
 
 // compile expression
 static void expression();
@@ -122,6 +195,10 @@ static void dot(bool canAssign);
 static void this_(bool canAssign);
 static void super_(bool canAssign);
 static void ternary(bool canAssign);
+static int fieldSlot(Token* name);
+static void addFieldSlot(Token name, uint8_t slot);
+static void yield(bool canAssign);
+static void resume(bool canAssign);
 
 // compile statement
 static void declaration();
@@ -130,7 +207,10 @@ static void statement();
 /* declaration  */
 static void varDeclaration();
 static void funDeclaration();
+static void memoDeclaration();
 static void classDeclaration();
+static void structDeclaration();
+static void importDeclaration();
 
 /* statement */
 static void printStatement();
@@ -141,10 +221,13 @@ static void ifStatement();
 static void whileStatement();
 static void forStatement();
 static void returnStatement();
+static void tryStatement();
+static void throwStatement();
 static void beginScope();
 static void endScope();
+static void discardLocals(int depth);
 static void block();
-static void function(FunctionType type);
+static ObjFunction* function(FunctionType type);
 
 
 
@@ -177,6 +260,7 @@ ParseRule rules[] = {
   [TOKEN_FALSE]         = {literal,     NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_MEMO]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,     NULL,   PREC_NONE},
   [TOKEN_OR]            = {NULL,     or_,   PREC_OR},
@@ -190,6 +274,10 @@ ParseRule rules[] = {
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_QUESTION]      = {NULL,     ternary,   PREC_ASSIGNMENT},
+  [TOKEN_YIELD]         = {yield,    NULL,   PREC_NONE},
+  [TOKEN_RESUME]        = {resume,   NULL,   PREC_NONE},
+  [TOKEN_STRUCT]        = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
 };
 
 
@@ -197,21 +285,29 @@ ParseRule rules[] = {
 /****    public function definition  ****/
 /****************************************/
 ObjFunction*  compile(const char* source) {
-  initScanner(source);
-  parser.hadError = false;
-  parser.panicMode = false;
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
-
-  advance();
-  
-  while (!match(TOKEN_EOF)) {
-    declaration();
-  }
+  wideJumps.functions = NULL;
+  wideJumps.count = 0;
+  wideJumps.capacity = 0;
+  initArena(&compilerArena);
+#ifdef LAZY_COMPILE
+  //函数体在首次调用时才编译，源码要复制一份随函数一起保留
+  lazySource = copyString(source, (int)strlen(source));
+  source = lazySource->chars;
+#endif
 
-  consume(TOKEN_EOF, "Expect end of expression.");
-  ObjFunction* function = endCompiler();
-  return parser.hadError ? NULL : function;
+  ObjFunction* function;
+  do {
+    wideJumps.nextOrdinal = 0;
+    wideJumps.overflow = false;
+    function = compilePass(source);
+  } while (wideJumps.overflow && !parser.hadError);
+
+  FREE_ARRAY(int, wideJumps.functions, wideJumps.capacity);
+  freeArena(&compilerArena);
+#ifdef LAZY_COMPILE
+  lazySource = NULL;
+#endif
+  return function;
 }
 
 
@@ -221,37 +317,231 @@ void markCompilerRoots() {
     markObject((Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
+#ifdef LAZY_COMPILE
+  markObject((Obj*)lazySource);
+#endif
 }
 
 
+#ifdef LAZY_COMPILE
+/**
+ * 编译延迟编译的函数体，由虚拟机在函数首次被调用时调用。
+ * 函数体内部的函数同样只扫描，等到它们被调用时再编译。
+ *
+ * @param function 函数体尚未编译的函数，已经编译过时直接返回
+ * @return 编译成功返回 true；有编译错误时函数保持未编译状态，返回 false
+ */
+bool compileFunction(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  if (lazy == NULL) return true;
+  int arity = function->arity;
+
+  wideJumps.functions = NULL;
+  wideJumps.count = 0;
+  wideJumps.capacity = 0;
+  initArena(&compilerArena);
+  lazySource = lazy->source;
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = lazy->hasSuperclass;
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  do {
+    wideJumps.nextOrdinal = 0;
+    wideJumps.overflow = false;
+    compileLazyPass(function);
+  } while (wideJumps.overflow && !parser.hadError);
+
+  currentClass = NULL;
+  lazySource = NULL;
+  FREE_ARRAY(int, wideJumps.functions, wideJumps.capacity);
+  freeArena(&compilerArena);
+
+  if (parser.hadError) {
+    freeChunk(&function->chunk);
+    function->arity = arity;
+    return false;
+  }
+  function->lazy = NULL;
+  freeLazyBody(lazy);
+  return true;
+}
+#endif
+
+
 
 /****************************************/
 /****    private function definition  ***/
 /****************************************/
-static void initCompiler(Compiler* compiler,  FunctionType type) {
+
+/**
+ * 完整地编译一遍脚本。
+ */
+static ObjFunction* compilePass(const char* source) {
+  initScanner(source);
+  parser.hadError = false;
+  parser.panicMode = false;
+  initNameTable(&structFields);
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
+
+  advance();
+  
+  while (!match(TOKEN_EOF)) {
+    declaration();
+  }
+
+  consume(TOKEN_EOF, "Expect end of expression.");
+  ObjFunction* function = endCompiler();
+  freeCompiler(&compiler);
+  freeNameTable(&structFields);
+  return parser.hadError ? NULL : function;
+}
+
+
+/**
+ * @param function 已经创建好的函数（延迟编译时），为 NULL 时新建函数
+ */
+static void initCompiler(Compiler* compiler, FunctionType type,
+                         ObjFunction* function) {
   compiler->enclosing = current;
  
   compiler->function = NULL;
   compiler->type = type;
+  compiler->ordinal = wideJumps.nextOrdinal++;
+  compiler->wideJumps = false;
+  for (int i = 0; i < wideJumps.count; i++) {
+    if (wideJumps.functions[i] == compiler->ordinal) compiler->wideJumps = true;
+  }
+  compiler->arenaMark = arenaMark(&compilerArena);
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  initNameTable(&compiler->localNames);
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
+  initNameTable(&compiler->constantNames);
+  initNameTable(&compiler->upvalueNames);
+  //break/continue 不能跨越函数边界
+  compiler->enclosingCirculation = currentCirculation;
+  currentCirculation = NULL;
+  compiler->function = function != NULL ? function : newFunction();
   current = compiler;
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name = copyString(parser.previous.start,
                                          parser.previous.length);
+    writeBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
+  }
+  //新建的嵌套函数与外层函数属于同一个模块（延迟编译时外层函数已经关联了模块）
+  if (function == NULL && compiler->enclosing != NULL) {
+    current->function->module = compiler->enclosing->function->module;
   }
-  Local* local = &current->locals[current->localCount++];
-  local->depth = 0;
-  local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
-    local->name.start = "this";
-    local->name.length = 4;
+    addLocal(syntheticToken("this"));
   } else {
-    local->name.start = "";
-    local->name.length = 0;
+    addLocal(syntheticToken(""));
+  }
+  current->locals[0].depth = 0;
+}
+
+
+/**
+ * 释放编译器的内部状态，arena 回退到函数开始编译时的位置。
+ * 上值表在 endCompiler 之后还要用来生成 OP_CLOSURE，所以单独释放。
+ */
+static void freeCompiler(Compiler* compiler) {
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+  freeNameTable(&compiler->localNames);
+  freeNameTable(&compiler->constantNames);
+  freeNameTable(&compiler->upvalueNames);
+  currentCirculation = compiler->enclosingCirculation;
+  arenaRelease(&compilerArena, compiler->arenaMark);
+}
+
+
+/**
+ * 计算标识符的 FNV-1a 哈希值。
+ */
+static uint32_t hashName(Token* name) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < name->length; i++) {
+    hash ^= (uint8_t)name->start[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+
+static void initNameTable(NameTable* table) {
+  table->entries = NULL;
+  table->count = 0;
+  table->capacity = 0;
+}
+
+
+static void freeNameTable(NameTable* table) {
+  FREE_ARRAY(NameEntry, table->entries, table->capacity);
+  initNameTable(table);
+}
+
+
+static NameEntry* findName(NameEntry* entries, int capacity,
+                           Token* name, uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
+  for (;;) {
+    NameEntry* entry = &entries[index];
+    if (entry->start == NULL ||
+        (entry->hash == hash && entry->length == name->length &&
+         memcmp(entry->start, name->start, name->length) == 0)) {
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
   }
+}
+
 
+/**
+ * 查找名字对应的值。
+ *
+ * @return 名字对应的值，不存在时返回 -1
+ */
+static int getName(NameTable* table, Token* name, uint32_t hash) {
+  if (table->count == 0) return -1;
+  NameEntry* entry = findName(table->entries, table->capacity, name, hash);
+  return entry->start != NULL ? entry->value : -1;
+}
+
+
+/**
+ * 设置名字对应的值。键不会被删除，把值设为 -1 即表示删除。
+ */
+static void setName(NameTable* table, Token* name, uint32_t hash, int value) {
+  if (table->count + 1 > table->capacity * NAME_TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    NameEntry* entries = ALLOCATE(NameEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+      entries[i].start = NULL;
+    }
+    for (int i = 0; i < table->capacity; i++) {
+      NameEntry* entry = &table->entries[i];
+      if (entry->start == NULL) continue;
+      Token key = {.start = entry->start, .length = entry->length};
+      *findName(entries, capacity, &key, entry->hash) = *entry;
+    }
+    FREE_ARRAY(NameEntry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
+
+  NameEntry* entry = findName(table->entries, table->capacity, name, hash);
+  if (entry->start == NULL) {
+    entry->start = name->start;
+    entry->length = name->length;
+    entry->hash = hash;
+    table->count++;
+  }
+  entry->value = value;
 }
 
 
@@ -259,6 +549,8 @@ static void errorAt(Token* token, const char* message) {
   if (parser.panicMode) return;
     parser.panicMode = true;
 
+  //工作线程并行编译模块时，一条错误信息不能被其他线程的输出打断
+  flockfile(stderr);
   fprintf(stderr, "[line %d column %d] Error", token->line, token->column);
 
   if (token->type == TOKEN_EOF) {
@@ -270,6 +562,7 @@ static void errorAt(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
+  funlockfile(stderr);
   parser.hadError = true;
 }
 
@@ -355,12 +648,12 @@ static void consume(TokenType type, const char *message) {
 
 
 /**
- * 向当前代码块写入一个字节，并记录该字节的行号。
+ * 向当前代码块写入一个字节，并记录该字节的行号和列号。
  *
  * @param byte 要写入的字节
  */
 static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+  writeChunk(currentChunk(), byte, parser.previous.line, parser.previous.column);
 }
 
 
@@ -370,31 +663,62 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 
+/**
+ * 以大端序写入三个字节的操作数。
+ */
+static void emitLong(int operand) {
+  emitByte((operand >> 16) & 0xff);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
+
+/**
+ * 生成带一个索引操作数的指令：索引放得进一个字节时用短指令，否则用三字节的长指令。
+ *
+ * @param instruction 短指令
+ * @param longInstruction 对应的长指令
+ * @param operand 常量下标或槽位
+ */
+static void emitOperand(uint8_t instruction, uint8_t longInstruction,
+                        int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)operand);
+  } else {
+    emitByte(longInstruction);
+    emitLong(operand);
+  }
+}
+
+
 /**
  * 将给定的值放入当前代码块中的常量池中，并返回该常量的索引。
+ * 常量池中已有相同的值时返回已有的索引。
  *
  * @param value 要添加到常量池的值
  * @return 添加的常量的索引，如果出错则返回 0
  */
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX)
+  //编译中的函数可能已经在 GC 中晋升到老年代
+  writeBarrier((Obj*)current->function, value);
+  if (constant > CONSTANT_LONG_MAX)
   {
     errorAtPrevious("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
 }
 
 
 /**
  * @param value 要添加到常量池的值
  * 
- * 添加OP_CONSTANT OP_CONSTANT_INDEX 到字节码中。
+ * 添加OP_CONSTANT OP_CONSTANT_INDEX 到字节码中，常量下标超过一个字节时使用 OP_CONSTANT_LONG。
  */
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
 
@@ -404,9 +728,15 @@ static void emitConstant(Value value) {
  * @param name 词法单元
  * @return 添加的常量的索引，如果出错则返回 0
  */
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
-                                         name->length)));
+static int identifierConstant(Token* name) {
+  uint32_t hash = hashName(name);
+  int constant = getName(&current->constantNames, name, hash);
+  if (constant != -1) return constant;
+
+  constant = makeConstant(OBJ_VAL(copyString(name->start,
+                                             name->length)));
+  setName(&current->constantNames, name, hash, constant);
+  return constant;
 }
 
 
@@ -446,12 +776,18 @@ static void emitReturn() {
  *
  * 此函数用于发射一个跳转指令到当前正在构建的代码块中。它首先发射指令本身，
  * 然后发射两个字节的占位符（0xff），这两个字节将在后续的代码生成过程中被替换为实际的跳转偏移量。
+ * 当前函数需要长跳转时改为发射对应的 _LONG 指令和三个字节的占位符。
  *
  * @param instruction 要发射的跳转指令字节。
- * @return 返回当前代码块中的计数器减去2的值，即跳转指令的实际地址。
+ * @return 返回跳转偏移量占位符的地址。
  */
 static int emitJump(uint8_t instruction)
 {
+  if (current->wideJumps) {
+    emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+    emitLong(0xffffff);
+    return currentChunk()->count - 3;
+  }
   emitByte(instruction);
   emitByte(0xff);
   emitByte(0xff);
@@ -459,6 +795,24 @@ static int emitJump(uint8_t instruction)
 }
 
 
+/**
+ * 记录当前函数的前向跳转超出了 16 位，本遍编译结束后重新编译。
+ */
+static void requestWideJumps() {
+  wideJumps.overflow = true;
+  for (int i = 0; i < wideJumps.count; i++) {
+    if (wideJumps.functions[i] == current->ordinal) return;
+  }
+  if (wideJumps.capacity < wideJumps.count + 1) {
+    int oldCapacity = wideJumps.capacity;
+    wideJumps.capacity = GROW_CAPACITY(oldCapacity);
+    wideJumps.functions = GROW_ARRAY(int, wideJumps.functions,
+                                     oldCapacity, wideJumps.capacity);
+  }
+  wideJumps.functions[wideJumps.count++] = current->ordinal;
+}
+
+
 /**
  * @brief 修补跳转指令的偏移量
  *
@@ -472,12 +826,24 @@ static int emitJump(uint8_t instruction)
  */
 static void patchJump(int offset)
 {
+  uint8_t instruction = currentChunk()->code[offset - 1];
+  if (instruction == OP_JUMP_LONG || instruction == OP_JUMP_IF_FALSE_LONG) {
+    int jump = currentChunk()->count - offset - 3;
+    if (jump > CONSTANT_LONG_MAX) {
+      errorAtPrevious("Too much code to jump over.");
+    }
+    currentChunk()->code[offset] = (jump >> 16) & 0xff;
+    currentChunk()->code[offset + 1] = (jump >> 8) & 0xff;
+    currentChunk()->code[offset + 2] = jump & 0xff;
+    return;
+  }
+
   // -2 to adjust for the bytecode for the jump offset itself.
   // 这里计算的是相对偏移量
   int jump = currentChunk()->count - offset - 2;
 
   if (jump > UINT16_MAX) {
-    errorAtPrevious("Too much code to jump over.");
+    requestWideJumps();
   }
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
@@ -485,12 +851,20 @@ static void patchJump(int offset)
 }
 
 
+/**
+ * 生成跳回循环开始处的指令。向后跳转的距离已知，超出 16 位时直接使用 OP_LOOP_LONG。
+ */
 static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
-
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) errorAtPrevious("Loop body too large.");
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset > UINT16_MAX) {
+    offset++;
+    if (offset > CONSTANT_LONG_MAX) errorAtPrevious("Loop body too large.");
+    emitByte(OP_LOOP_LONG);
+    emitLong(offset);
+    return;
+  }
 
+  emitByte(OP_LOOP);
   emitByte((offset >> 8) & 0xff);
   emitByte(offset & 0xff);
 }
@@ -504,12 +878,17 @@ static void synchronize() {
     switch (parser.current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
+      case TOKEN_MEMO:
       case TOKEN_VAR:
       case TOKEN_FOR:
       case TOKEN_IF:
       case TOKEN_WHILE:
       case TOKEN_PRINT:
       case TOKEN_RETURN:
+      case TOKEN_STRUCT:
+      case TOKEN_TRY:
+      case TOKEN_THROW:
+      case TOKEN_IMPORT:
         return;
 
       default:
@@ -561,15 +940,26 @@ static void parsePrecedence(Precedence precedence) {
  */
 static void addLocal(Token name)
 {
-  if (current->localCount == UINT8_COUNT)
+  if (current->localCount > CONSTANT_LONG_MAX)
   {
     errorAtPrevious("Too many local variables in function.");
     return;
   }
-  Local* local = &current->locals[current->localCount++];
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = ARENA_GROW_ARRAY(&compilerArena, Local, current->locals,
+                                       oldCapacity, current->localCapacity);
+  }
+  Local* local = &current->locals[current->localCount];
   local->name = name;
+  local->hash = hashName(&name);
   local->depth = -1;
   local->isCaptured = false;
+  local->capturedBy = -1;
+  local->shadowed = getName(&current->localNames, &name, local->hash);
+  setName(&current->localNames, &name, local->hash, current->localCount);
+  current->localCount++;
 }
 
 
@@ -581,13 +971,11 @@ static void declareVariable()
   if (current->scopeDepth == 0)
     return;
   Token *name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
-      break; 
-    }
-
-    if (identifiersEqual(name, &local->name)) {
+  //同名变量中只需检查最内层的那个是否属于当前作用域
+  int index = getName(&current->localNames, name, hashName(name));
+  if (index != -1) {
+    Local* local = &current->locals[index];
+    if (local->depth == -1 || local->depth >= current->scopeDepth) {
       errorAtPrevious("Already a variable with this name in this scope.");
     }
   }
@@ -596,7 +984,7 @@ static void declareVariable()
 }
 
 
-static uint32_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   if (current->scopeDepth > 0) return 0;
@@ -611,12 +999,12 @@ static void markInitialized() {
 }
 
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 
@@ -629,54 +1017,68 @@ static void defineVariable(uint8_t global) {
  * @return 局部变量在局部变量表中的索引，如果未找到则返回-1
  */
 static int resolveLocal(Compiler* compiler, Token* name) {
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local* local = &compiler->locals[i];
-    if (identifiersEqual(name, &local->name)) {
-      // 变量字节给自己赋值
-      if (local->depth == -1) {
-        errorAtPrevious("Can't read local variable in its own initializer.");
-      }
-      return i;
-    }
+  int i = getName(&compiler->localNames, name, hashName(name));
+  // 变量字节给自己赋值
+  if (i != -1 && compiler->locals[i].depth == -1) {
+    errorAtPrevious("Can't read local variable in its own initializer.");
   }
-
-  return -1;
+  return i;
 }
 
 
-static int addUpvalue(Compiler* compiler, uint8_t index,
-                      bool isLocal) {
+/**
+ * 为 compiler 添加一个上值，同一个变量只添加一次。
+ * 被捕获的变量（外层函数的局部变量或上值）记录了最近一个捕获它的函数，
+ * 用来代替逐个比较已有上值。
+ *
+ * @param index 外层函数中局部变量的槽位或上值下标
+ * @param isLocal 捕获的是否是外层函数的局部变量
+ */
+static int addUpvalue(Compiler* compiler, int index,
+                      bool isLocal, Token* name) {
   int upvalueCount = compiler->function->upvalueCount;
-  
-  for (int i = 0; i < upvalueCount; i++) {
-    Upvalue* upvalue = &compiler->upvalues[i];
-    if (upvalue->index == index && upvalue->isLocal == isLocal) {
-      return i;
-    }
-  }
-
-  if (upvalueCount == UINT8_COUNT) {
+  Compiler* enclosing = compiler->enclosing;
+  int* capturedBy = isLocal ? &enclosing->locals[index].capturedBy
+                            : &enclosing->upvalues[index].capturedBy;
+  int* capturedAs = isLocal ? &enclosing->locals[index].capturedAs
+                            : &enclosing->upvalues[index].capturedAs;
+  if (*capturedBy == compiler->ordinal) return *capturedAs;
+
+  if (upvalueCount > CONSTANT_LONG_MAX) {
     errorAtPrevious("Too many closure variables in function.");
     return 0;
   }
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                    oldCapacity, compiler->upvalueCapacity);
+  }
 
+  compiler->upvalues[upvalueCount].name = *name;
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
+  compiler->upvalues[upvalueCount].capturedBy = -1;
+  *capturedBy = compiler->ordinal;
+  *capturedAs = upvalueCount;
   return compiler->function->upvalueCount++;
 }
 
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  if (compiler->enclosing == NULL) {
+    //延迟编译的函数没有外层编译器，按首次扫描时记录的变量名解析
+    return getName(&compiler->upvalueNames, name, hashName(name));
+  }
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true, name);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false, name);
   }
 
   return -1;
@@ -684,32 +1086,38 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
 
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    getLongOp = OP_GET_UPVALUE_LONG;
+    setLongOp = OP_SET_UPVALUE_LONG;
   } else {
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = OP_GET_GLOBAL_LONG;
+    setLongOp = OP_SET_GLOBAL_LONG;
   }
   //arg 对于全局变量来说是常量池索引，
   //对于局部变量来说是执行栈位置。
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitOperand(setOp, setLongOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitOperand(getOp, getLongOp, arg);
     //处理后缀++ --
     if (match(TOKEN_DECREASE) || match(TOKEN_INCREASE)) {
-      emitBytes(getOp, (uint8_t)arg);
+      emitOperand(getOp, getLongOp, arg);
       emitConstant(NUMBER_VAL(1));
       emitByte(parser.previous.type == TOKEN_DECREASE ? OP_SUBTRACT : OP_ADD);
-      emitBytes(setOp, (uint8_t)arg);
+      emitOperand(setOp, setLongOp, arg);
       emitByte(OP_POP);
     } 
   }  
@@ -734,7 +1142,7 @@ static uint8_t argumentList() {
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
   FunctionType type =  TYPE_METHOD;
 
   if (parser.previous.length == 4 &&
@@ -744,7 +1152,7 @@ static void method() {
 
 
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitOperand(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 /**
@@ -879,8 +1287,8 @@ END:
 
 
 static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+  emitConstant(stringValue(parser.previous.start + 1,
+                           parser.previous.length - 2));
 }
 
 static void variable(bool canAssign) {
@@ -912,20 +1320,46 @@ static void or_(bool canAssign) {
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  Token property = parser.previous;
+  int name = identifierConstant(&parser.previous);
+  //属性名是某个结构体的字段时按槽位访问，运行时再校验接收者的布局
+  int slot = fieldSlot(&property);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    if (slot >= 0) {
+      emitOperand(OP_SET_FIELD, OP_SET_FIELD_LONG, name);
+      emitByte((uint8_t)slot);
+    } else {
+      emitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+    }
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitOperand(OP_INVOKE, OP_INVOKE_LONG, name);
     emitByte(argCount);
+  } else if (slot >= 0) {
+    emitOperand(OP_GET_FIELD, OP_GET_FIELD_LONG, name);
+    emitByte((uint8_t)slot);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
   }
 }
 
+/**
+ * 查找字段名在已声明结构体中的槽位，同名字段以最先声明的结构体为准。
+ *
+ * @return 槽位下标，不是任何结构体的字段时返回 -1
+ */
+static int fieldSlot(Token* name) {
+  return getName(&structFields, name, hashName(name));
+}
+
+static void addFieldSlot(Token name, uint8_t slot) {
+  uint32_t hash = hashName(&name);
+  if (getName(&structFields, &name, hash) >= 0) return;
+  setName(&structFields, &name, hash, slot);
+}
+
 static void this_(bool canAssign) {
   if (currentClass == NULL) {
     errorAtPrevious("Can't use 'this' outside of a class.");
@@ -934,6 +1368,43 @@ static void this_(bool canAssign) {
   variable(false);
 } 
 
+/**
+ * yield 表达式：挂起当前协程，把值交给 resume 的调用者，
+ * 表达式的结果是下一次 resume 传入的值。
+ * 包含 yield 的函数是生成器，调用它只会创建协程而不执行函数体。
+ */
+static void yield(bool canAssign) {
+  if (current->type == TYPE_SCRIPT) {
+    errorAtPrevious("Can't yield from top-level code.");
+  } else if (current->type == TYPE_INITIALIZER) {
+    errorAtPrevious("Can't yield from an initializer.");
+  }
+  current->function->isGenerator = true;
+
+  if (check(TOKEN_SEMICOLON) || check(TOKEN_RIGHT_PAREN) ||
+      check(TOKEN_RIGHT_BRACE) || check(TOKEN_COMMA)) {
+    emitByte(OP_NIL);
+  } else {
+    parsePrecedence(PREC_ASSIGNMENT);
+  }
+  emitByte(OP_YIELD);
+}
+
+/**
+ * resume(fiber[, value])：切换到协程执行，直到它 yield 或返回。
+ */
+static void resume(bool canAssign) {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'resume'.");
+  expression();
+  if (match(TOKEN_COMMA)) {
+    expression();
+  } else {
+    emitByte(OP_NIL);
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after resume arguments.");
+  emitByte(OP_RESUME);
+}
+
 static void super_(bool canAssign) {
   if (currentClass == NULL) {
     errorAtPrevious("Can't use 'super' outside of a class.");
@@ -943,18 +1414,18 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous); //方法名称
+  int name = identifierConstant(&parser.previous); //方法名称
   
   namedVariable(syntheticToken("this"), false); //绑定方法的this
   
    if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitOperand(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false); //super类 
-    emitBytes(OP_GET_SUPER, name);
+    emitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
   
 }
@@ -977,10 +1448,16 @@ static void ternary(bool canAssign) {
 static void declaration() {
   if (match(TOKEN_CLASS)) {
     classDeclaration();
-  }else if (match(TOKEN_FUN)) {
+  } else if (match(TOKEN_STRUCT)) {
+    structDeclaration();
+  } else if (match(TOKEN_FUN)) {
     funDeclaration();
+  } else if (match(TOKEN_MEMO)) {
+    memoDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
+  } else if (match(TOKEN_IMPORT)) {
+    importDeclaration();
   } else {
     statement();
   }
@@ -989,8 +1466,28 @@ static void declaration() {
 }
 
 
+/**
+ * import "path"; 加载模块并把它的全局变量复制到当前模块。
+ * 只能出现在顶层，这样编译完顶层函数就知道全部依赖，可以预先并行编译。
+ */
+static void importDeclaration() {
+  if (current->type != TYPE_SCRIPT || current->scopeDepth > 0) {
+    errorAtPrevious("Can only import at top level.");
+  }
+  consume(TOKEN_STRING, "Expect module path after 'import'.");
+  //模块路径作为名字常量，总是堆上的字符串
+  int constant = makeConstant(OBJ_VAL(copyString(parser.previous.start + 1,
+                                                 parser.previous.length - 2)));
+  consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+  //OP_IMPORT 压入模块和模块顶层代码的返回值
+  emitOperand(OP_IMPORT, OP_IMPORT_LONG, constant);
+  emitByte(OP_POP);
+  emitByte(OP_IMPORT_GLOBALS);
+}
+
+
 static void varDeclaration() {
-  int32_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1003,11 +1500,10 @@ static void varDeclaration() {
   defineVariable(global);
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope(); 
-
+/**
+ * 编译参数列表，直到函数体的 '{'。
+ */
+static void parameters() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -1016,7 +1512,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -1024,34 +1520,191 @@ static void function(FunctionType type) {
 
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+}
+
+
+/**
+ * 编译函数声明或方法，并生成创建闭包的指令。
+ * 定义 LAZY_COMPILE 时只扫描函数体，字节码在函数首次被调用时由 compileFunction 生成。
+ */
+static ObjFunction* function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+#ifdef LAZY_COMPILE
+  Token start = parser.current;
+#endif
+  beginScope(); 
+  parameters();
 
+#ifdef LAZY_COMPILE
+  skimBody();
+  ObjFunction* function = endSkim(&start);
+#else
+  block();
   ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+#endif
+  int constant = makeConstant(OBJ_VAL(function));
+  //常量下标和上值索引都放得进一个字节时用紧凑的 OP_CLOSURE
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+  }
+  if (wide) {
+    emitByte(OP_CLOSURE_LONG);
+    emitLong(constant);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t)constant);
+  }
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (wide) {
+      emitLong(compiler.upvalues[i].index);
+    } else {
+      emitByte((uint8_t)compiler.upvalues[i].index);
+    }
   }
+  freeCompiler(&compiler);
+  return function;
 }
 
 
+#ifdef LAZY_COMPILE
+/**
+ * 跳过函数体，只做捕获分析：函数体中出现的名字（属性名除外）能在外层函数中解析到的，
+ * 都当作被这个函数捕获。函数体里声明的同名变量也会导致捕获，这只是多一个用不到的上值，
+ * 不影响语义。
+ */
+static void skimBody() {
+  int depth = 1;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    TokenType before = parser.previous.type;
+    advance();
+    switch (parser.previous.type) {
+      case TOKEN_LEFT_BRACE:  depth++; break;
+      case TOKEN_RIGHT_BRACE: depth--; break;
+      case TOKEN_IDENTIFIER:
+        if (before != TOKEN_DOT) captureName(parser.previous);
+        break;
+      case TOKEN_THIS:
+        captureName(syntheticToken("this"));
+        break;
+      case TOKEN_SUPER:
+        captureName(syntheticToken("this"));
+        captureName(syntheticToken("super"));
+        break;
+      default:
+        break;
+    }
+  }
+  if (depth > 0) errorAtCurrent("Expect '}' after block.");
+}
+
+
+static void captureName(Token name) {
+  if (resolveLocal(current, &name) == -1) resolveUpvalue(current, &name);
+}
+
+
+/**
+ * 结束函数体的扫描：记录编译函数体时需要的位置、类上下文和上值的变量名。
+ * 函数的代码块保持为空。
+ *
+ * @param start 参数列表的 '('
+ */
+static ObjFunction* endSkim(Token* start) {
+  ObjFunction* function = current->function;
+  LazyBody* lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = lazySource;
+  lazy->offset = (int)(start->start - lazySource->chars);
+  lazy->line = start->line;
+  lazy->column = start->column;
+  lazy->type = current->type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  lazy->upvalueNameCount = 0;
+  lazy->upvalueNames = NULL;
+  function->lazy = lazy;
+
+  lazy->upvalueNames = ALLOCATE(ObjString*, function->upvalueCount);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Token* name = &current->upvalues[i].name;
+    lazy->upvalueNames[i] = copyString(name->start, name->length);
+    writeBarrier((Obj*)function, OBJ_VAL(lazy->upvalueNames[i]));
+    lazy->upvalueNameCount++;
+  }
+
+  current = current->enclosing;
+  return function;
+}
+
+
+/**
+ * 完整地编译一遍延迟编译的函数体。
+ * 没有外层编译器，外层变量按记录的上值名字解析。
+ */
+static void compileLazyPass(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  initScannerAt(lazy->source->chars + lazy->offset, lazy->line, lazy->column);
+  parser.hadError = false;
+  parser.panicMode = false;
+  initNameTable(&structFields);
+  freeChunk(&function->chunk);
+  function->arity = 0;
+
+  Compiler compiler;
+  initCompiler(&compiler, (FunctionType)lazy->type, function);
+  compiler.upvalueCapacity = function->upvalueCount;
+  compiler.upvalues = ALLOCATE(Upvalue, compiler.upvalueCapacity);
+  for (int i = 0; i < lazy->upvalueNameCount; i++) {
+    ObjString* name = lazy->upvalueNames[i];
+    Token token = {.start = name->chars, .length = name->length};
+    compiler.upvalues[i].name = token;
+    compiler.upvalues[i].capturedBy = -1;
+    setName(&compiler.upvalueNames, &token, hashName(&token), i);
+  }
+
+  advance();
+  beginScope();
+  parameters();
+  block();
+  endCompiler();
+  freeCompiler(&compiler);
+  freeNameTable(&structFields);
+}
+#endif
+
+
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
 }
 
+/**
+ * 编译 memo fun 声明。
+ * 函数体与普通函数相同，只是在 ObjFunction 上打上 memo 标记，
+ * 由虚拟机在调用时查询结果缓存。
+ */
+static void memoDeclaration() {
+  consume(TOKEN_FUN, "Expect 'fun' after 'memo'.");
+  int global = parseVariable("Expect function name.");
+  markInitialized();
+  ObjFunction* memo = function(TYPE_FUNCTION);
+  memo->isMemo = true;
+  defineVariable(global);
+}
+
 
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   //获取类名
   Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
+  emitOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
   defineVariable(nameConstant);
 
 
@@ -1092,6 +1745,47 @@ static void classDeclaration() {
 
 }
 
+/**
+ * 结构体声明：struct Point { x, y }
+ * 字段布局在编译期确定，结构体描述作为常量直接加载，不需要运行时创建。
+ */
+static void structDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect struct name.");
+  int nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  Token fields[UINT8_COUNT];
+  int fieldCount = 0;
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before struct fields.");
+  if (!check(TOKEN_RIGHT_BRACE)) {
+    do {
+      consume(TOKEN_IDENTIFIER, "Expect field name.");
+      for (int i = 0; i < fieldCount; i++) {
+        if (identifiersEqual(&fields[i], &parser.previous)) {
+          errorAtPrevious("Already a field with this name in this struct.");
+        }
+      }
+      if (fieldCount == UINT8_COUNT) {
+        errorAtPrevious("Can't have more than 256 fields in a struct.");
+        break;
+      }
+      fields[fieldCount++] = parser.previous;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after struct fields.");
+
+  ObjString* name = AS_STRING(VALUE_AT(currentChunk()->constants, nameConstant));
+  ObjStruct* type = newStruct(name, fieldCount);
+  emitConstant(OBJ_VAL(type));
+  //描述已经在常量表中，填入字段名时的分配不会回收它
+  for (int i = 0; i < fieldCount; i++) {
+    type->fields[i] = copyString(fields[i].start, fields[i].length);
+    writeBarrier((Obj*)type, OBJ_VAL(type->fields[i]));
+    addFieldSlot(fields[i], (uint8_t)i);
+  }
+  defineVariable(nameConstant);
+}
+
 static void statement() {
   if (match(TOKEN_PRINT)) {
     printStatement();
@@ -1107,6 +1801,10 @@ static void statement() {
     ifStatement();
   }  else if (match(TOKEN_WHILE)) {
     whileStatement();
+  } else if (match(TOKEN_TRY)) {
+    tryStatement();
+  } else if (match(TOKEN_THROW)) {
+    throwStatement();
   } else if (match(TOKEN_LEFT_BRACE)) {
     beginScope();
     block();
@@ -1129,8 +1827,16 @@ static void breakStatement(){
     errorAtPrevious("Can't use 'break' outside of a Circulation.");
     return;
   }
+  discardLocals(currentCirculation->scopeDepth);
   int breakJump = emitJump(OP_JUMP);
-  currentCirculation->_break[currentCirculation->_break_count++] = breakJump;
+  Circulation* loop = currentCirculation;
+  if (loop->_break_capacity < loop->_break_count + 1) {
+    int oldCapacity = loop->_break_capacity;
+    loop->_break_capacity = GROW_CAPACITY(oldCapacity);
+    loop->_break = ARENA_GROW_ARRAY(&compilerArena, int, loop->_break,
+                                    oldCapacity, loop->_break_capacity);
+  }
+  loop->_break[loop->_break_count++] = breakJump;
   consume(TOKEN_SEMICOLON, "Expect ';' after break.");
 }
 
@@ -1139,6 +1845,7 @@ static void continueStatement(){
     errorAtPrevious("Can't use 'continue' outside of a Circulation.");
     return;
   }
+  discardLocals(currentCirculation->scopeDepth);
   emitLoop(currentCirculation->loopStart);
   consume(TOKEN_SEMICOLON, "Expect ';' after break.");
 }
@@ -1158,11 +1865,14 @@ static void endScope() {
   while (current->localCount > 0 &&
          current->locals[current->localCount - 1].depth >
             current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
+    Local* local = &current->locals[current->localCount - 1];
+    if (local->isCaptured) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
     }
+    //名字重新指向被它遮蔽的外层同名变量
+    setName(&current->localNames, &local->name, local->hash, local->shadowed);
     current->localCount--;
   }
 
@@ -1170,6 +1880,24 @@ static void endScope() {
 }
 
 
+/**
+ * 为 break/continue 丢弃比 depth 更深的局部变量，但不把它们移出编译器的作用域，
+ * 跳转之后的代码仍按原作用域编译。
+ *
+ * @param depth 循环开始时的作用域深度
+ */
+static void discardLocals(int depth) {
+  for (int i = current->localCount - 1;
+       i >= 0 && current->locals[i].depth > depth; i--) {
+    if (current->locals[i].isCaptured) {
+      emitByte(OP_CLOSE_UPVALUE);
+    } else {
+      emitByte(OP_POP);
+    }
+  }
+}
+
+
 static void block() {
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
     declaration();
@@ -1199,7 +1927,10 @@ static void whileStatement() {
   int loopStart = currentChunk()->count;   
   Circulation loop;
   loop.loopStart = loopStart;
+  loop.scopeDepth = current->scopeDepth;
+  loop._break = NULL;
   loop._break_count = 0;
+  loop._break_capacity = 0;
   loop.enclosing = currentCirculation;
   currentCirculation = &loop;
 
@@ -1213,16 +1944,14 @@ static void whileStatement() {
 
   emitLoop(loopStart);
 
- 
+  patchJump(exitJump);
+  emitByte(OP_POP);
 
-  //为break填充位置信息
+  //为break填充位置信息，break 时条件值已经弹出，跳过上面的 OP_POP
   for (size_t i = 0; i < loop._break_count; i++)
   {
     patchJump(loop._break[i]);
   }
-  
-  patchJump(exitJump);
-  emitByte(OP_POP);
 
   currentCirculation = currentCirculation->enclosing;
 }
@@ -1243,7 +1972,10 @@ static void forStatement() {
 
   Circulation loop;
   loop.loopStart = loopStart;
+  loop.scopeDepth = current->scopeDepth;
+  loop._break = NULL;
   loop._break_count = 0;
+  loop._break_capacity = 0;
   loop.enclosing = currentCirculation;
   currentCirculation = &loop;
 
@@ -1272,18 +2004,18 @@ static void forStatement() {
   statement();
   emitLoop(loopStart);
 
-  //为break填充位置信息
-  for (size_t i = 0; i < loop._break_count; i++)
-  {
-    patchJump(loop._break[i]);
-  }
-
   if (exitJump != -1) {
     patchJump(exitJump);
     emitByte(OP_POP); // Condition.
   }
 
-  beginScope();
+  //为break填充位置信息，break 时条件值已经弹出，跳过上面的 OP_POP
+  for (size_t i = 0; i < loop._break_count; i++)
+  {
+    patchJump(loop._break[i]);
+  }
+
+  endScope();
   currentCirculation = currentCirculation->enclosing;
 }
 
@@ -1294,10 +2026,11 @@ static void forStatement() {
  */
 static ObjFunction*  endCompiler() {
   emitReturn();
+  freeConstantIndex(currentChunk());
  
   ObjFunction* function = current->function;
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser.hadError && !wideJumps.overflow) {
     disassembleChunk(currentChunk(), function->name != NULL
         ? function->name->chars : "<script>");
   }
@@ -1322,4 +2055,43 @@ static void returnStatement() {
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
     emitByte(OP_RETURN);
   }
-}
\ No newline at end of file
+}
+
+
+/**
+ * 编译 try { ... } catch (e) { ... } 语句。
+ * try 块不生成任何指令，只在代码块的异常表中登记受保护区间、
+ * catch 入口和进入 try 时的栈深度；抛出异常时由虚拟机查表展开。
+ * catch 入口处虚拟机已经把异常值压在栈上，正好作为局部变量 e。
+ */
+static void tryStatement() {
+  int stackDepth = current->localCount;
+  consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+  int start = currentChunk()->count;
+  beginScope();
+  block();
+  endScope();
+  int end = currentChunk()->count;
+  int skipJump = emitJump(OP_JUMP);
+
+  consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+  int target = currentChunk()->count;
+  beginScope();
+  int constant = parseVariable("Expect exception variable name.");
+  defineVariable(constant);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after exception variable.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before catch body.");
+  block();
+  endScope();
+  patchJump(skipJump);
+
+  addHandler(currentChunk(), start, end, target, stackDepth);
+}
+
+
+static void throwStatement() {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after thrown value.");
+  emitByte(OP_THROW);
+}
@@ -4,5 +4,8 @@
 
 ObjFunction*  compile(const char* source);
 void markCompilerRoots();
+#ifdef LAZY_COMPILE
+bool compileFunction(ObjFunction* function);
+#endif
 
 #endif
\ No newline at end of file
@@ -10,8 +10,56 @@ static int simpleInstruction(const char* name, int offset);
 static int constantInstruction(const char *name, Chunk *chunk, int offset);
 static int constantLongInstruction(const char *name, Chunk *chunk, int offset);
 static int byteInstruction(const char* name, Chunk* chunk, int offset);
+static int longInstruction(const char* name, Chunk* chunk, int offset);
+/**
+ * 打印三字节操作数的局部变量或上值指令。
+ */
+static int longInstruction(const char *name, Chunk *chunk, int offset) {
+  uint32_t slot = (uint32_t)GET_THREE_BYTE(chunk, offset + 1);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
-static int invokeInstruction(const char* name, Chunk* chunk, int offset);
+static int longJumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
+static int closureInstruction(const char* name, bool wide, Chunk* chunk, int offset);
+static int longJumpInstruction(const char* name, int sign,
+                               Chunk* chunk, int offset) {
+  int jump = GET_THREE_BYTE(chunk, offset + 1);
+  printf("%-16s %4d -> %d\n", name, offset,
+         offset + 4 + sign * jump);
+  return offset + 4;
+}
+
+/**
+ * 打印闭包指令及其捕获的上值，wide 为 true 时常量下标和上值索引都是三个字节。
+ */
+static int closureInstruction(const char* name, bool wide,
+                              Chunk* chunk, int offset) {
+  offset++;
+  int constantIndex = wide ? GET_THREE_BYTE(chunk, offset)
+                           : chunk->code[offset];
+  offset += wide ? 3 : 1;
+  printf("%-16s %4d ", name, constantIndex);
+  printValue(chunk->constants.values[constantIndex]);
+  printf("\n");
+
+  ObjFunction* function = AS_FUNCTION(
+      chunk->constants.values[constantIndex]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int start = offset;
+    int isLocal = chunk->code[offset++];
+    int index = wide ? GET_THREE_BYTE(chunk, offset) : chunk->code[offset];
+    offset += wide ? 3 : 1;
+    printf("%04d      |                     %s %d\n",
+           start, isLocal ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
+static int invokeInstruction(const char* name, bool wide, Chunk* chunk, int offset);
+static int fieldInstruction(const char* name, bool wide, Chunk* chunk, int offset);
 
 /****************************************/
 /****    public function definition  ****/
@@ -28,6 +76,11 @@ void disassembleChunk(Chunk *chunk, const char *name) {
   {
     offset = disassembleInstruction(chunk, offset);
   }
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    printf("handler [%04d, %04d) -> %04d depth %d\n", handler->start,
+           handler->end, handler->target, handler->stackDepth);
+  }
 }
 
 
@@ -44,6 +97,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
   switch (instruction) {
     case OP_CONSTANT:
       return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
       return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -71,10 +126,38 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+      return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+      return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+      return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_GET_UPVALUE_LONG:
+      return longInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+    case OP_SET_UPVALUE_LONG:
+      return longInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+    case OP_GET_PROPERTY_LONG:
+      return constantLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+    case OP_SET_PROPERTY_LONG:
+      return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+    case OP_GET_FIELD_LONG:
+      return fieldInstruction("OP_GET_FIELD_LONG", true, chunk, offset);
+    case OP_SET_FIELD_LONG:
+      return fieldInstruction("OP_SET_FIELD_LONG", true, chunk, offset);
+    case OP_GET_SUPER_LONG:
+      return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
     case OP_GET_PROPERTY:
       return constantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
       return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    case OP_GET_FIELD:
+      return fieldInstruction("OP_GET_FIELD", false, chunk, offset);
+    case OP_SET_FIELD:
+      return fieldInstruction("OP_SET_FIELD", false, chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
 
@@ -94,6 +177,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_TERNARY", offset);
     case OP_ADD:
       return simpleInstruction("OP_ADD", offset);
+    case OP_ADD_NUMBER:
+      return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+      return simpleInstruction("OP_ADD_STRING", offset);
     case OP_SUBTRACT:
           return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
@@ -114,42 +201,55 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_JUMP_LONG:
+      return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:
+      return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
 
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_CALL_CLOSURE:
+      return byteInstruction("OP_CALL_CLOSURE", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return invokeInstruction("OP_INVOKE", false, chunk, offset);
     case OP_SUPER_INVOKE:
-      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constantIndex = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constantIndex);
-      printValue(chunk->constants.values[constantIndex]);
-      printf("\n");
-
-      ObjFunction* function = AS_FUNCTION(
-          chunk->constants.values[constantIndex]);
-      for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
-      }
-
-
-      return offset;
-    }
+      return invokeInstruction("OP_SUPER_INVOKE", false, chunk, offset);
+    case OP_INVOKE_LONG:
+      return invokeInstruction("OP_INVOKE_LONG", true, chunk, offset);
+    case OP_SUPER_INVOKE_LONG:
+      return invokeInstruction("OP_SUPER_INVOKE_LONG", true, chunk, offset);
+    case OP_CLOSURE:
+      return closureInstruction("OP_CLOSURE", false, chunk, offset);
+    case OP_CLOSURE_LONG:
+      return closureInstruction("OP_CLOSURE_LONG", true, chunk, offset);
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
+    case OP_THROW:
+      return simpleInstruction("OP_THROW", offset);
+    case OP_YIELD:
+      return simpleInstruction("OP_YIELD", offset);
+    case OP_RESUME:
+      return simpleInstruction("OP_RESUME", offset);
     case OP_CLASS:
       return constantInstruction("OP_CLASS", chunk, offset);
     case OP_INHERIT:
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_CLASS_LONG:
+      return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+    case OP_METHOD_LONG:
+      return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+    case OP_IMPORT:
+      return constantInstruction("OP_IMPORT", chunk, offset);
+    case OP_IMPORT_LONG:
+      return constantLongInstruction("OP_IMPORT_LONG", chunk, offset);
+    case OP_IMPORT_GLOBALS:
+      return simpleInstruction("OP_IMPORT_GLOBALS", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -227,13 +327,28 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk,
+static int invokeInstruction(const char* name, bool wide, Chunk* chunk,
                                 int offset) {
-  //opcode name_index arg_count                                  
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t argCount = chunk->code[offset + 2];
+  //opcode name_index arg_count，wide 时 name_index 为三个字节
+  int width = wide ? 3 : 1;
+  int constant = wide ? GET_THREE_BYTE(chunk, offset + 1)
+                      : chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 1 + width];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
-  return offset + 3;
+  return offset + 2 + width;
+}
+
+static int fieldInstruction(const char* name, bool wide, Chunk* chunk,
+                            int offset) {
+  //opcode name_index slot，wide 时 name_index 为三个字节
+  int width = wide ? 3 : 1;
+  int constant = wide ? GET_THREE_BYTE(chunk, offset + 1)
+                      : chunk->code[offset + 1];
+  uint8_t slot = chunk->code[offset + 1 + width];
+  printf("%-16s (slot %d) %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 2 + width;
 }
\ No newline at end of file
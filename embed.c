@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "embed.h"
+#include "memory.h"
+#include "module.h"
+#include "object.h"
+#include "region.h"
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 固定一个值，返回的句柄在 releaseHandle 之前一直是 GC 的根。
+ * 句柄从内存池分配，不计入 GC 的堆大小，分配时不会触发回收。
+ */
+Handle* pinValue(Value value) {
+  Handle* handle = (Handle*)clox_malloc(sizeof(Handle));
+  if (handle == NULL) exit(1);
+  handle->value = value;
+  handle->prev = NULL;
+  handle->next = vm.handles;
+  if (vm.handles != NULL) vm.handles->prev = handle;
+  vm.handles = handle;
+  return handle;
+}
+
+Value handleValue(Handle* handle) {
+  return handle->value;
+}
+
+/**
+ * 释放句柄，它固定的值不再被宿主程序持有。handle 可以为 NULL。
+ */
+void releaseHandle(Handle* handle) {
+  if (handle == NULL) return;
+  if (handle->prev != NULL) {
+    handle->prev->next = handle->next;
+  } else {
+    vm.handles = handle->next;
+  }
+  if (handle->next != NULL) handle->next->prev = handle->prev;
+  clox_free(handle);
+}
+
+/**
+ * 编译脚本并加载它导入的模块，返回顶层函数的闭包。
+ * 用 callHandle 调用它执行顶层代码；脚本的全局变量在 vm.globals 中，
+ * 多个脚本共享，与 REPL 相同。
+ *
+ * @return 编译错误或模块加载失败时返回 NULL，错误已经打印
+ */
+Handle* compileHandle(const char* source) {
+  ObjFunction* function = compileScript(source);
+  if (function == NULL) return NULL;
+  push(OBJ_VAL(function));
+  if (!loadImports(function)) {
+    pop();
+    return NULL;
+  }
+  ObjClosure* closure = newClosure(function);
+  pop();
+  return pinValue(OBJ_VAL(closure));
+}
+
+/**
+ * 查找主脚本的全局变量并固定它，通常用于取得要反复调用的函数。
+ *
+ * @return 变量未定义时返回 NULL
+ */
+Handle* globalHandle(const char* name) {
+  ObjString* key = copyString(name, (int)strlen(name));
+  Value value;
+  if (!tableGet(&vm.globals, key, &value)) return NULL;
+  return pinValue(value);
+}
+
+/**
+ * 调用句柄固定的值，每次调用只进入一次 run()。
+ *
+ * @param result 返回值，可以为 NULL
+ * @return 有未捕获的异常时返回 INTERPRET_RUNTIME_ERROR，错误已经打印
+ */
+InterpretResult callHandle(Handle* callee, int argCount, const Value* args,
+                           Value* result) {
+  Value ignored;
+  return callFunction(callee->value, argCount, args,
+                      result != NULL ? result : &ignored);
+}
+
+/**
+ * 在区域中调用句柄固定的值，参见 region.h。已经在区域中时与 callHandle 相同。
+ *
+ * @param result 返回值，已经复制到主堆；可以为 NULL
+ */
+InterpretResult callInRegion(Handle* callee, int argCount, const Value* args,
+                             Value* result) {
+  if (vm.region != NULL) return callHandle(callee, argCount, args, result);
+  Value value = NIL_VAL;
+  Region region;
+  enterRegion(&region);
+  InterpretResult status = callFunction(callee->value, argCount, args, &value);
+  //不需要返回值时不复制它
+  leaveRegion(&region, result != NULL ? &value : NULL);
+  if (result != NULL) *result = value;
+  return status;
+}
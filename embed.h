@@ -0,0 +1,37 @@
+#ifndef clox_embed_h
+#define clox_embed_h
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * 嵌入接口：宿主程序编译一次脚本，之后反复调用其中的函数。
+ *
+ *   initVM();
+ *   Handle* script = compileHandle(source);
+ *   callHandle(script, 0, NULL, NULL);            //执行顶层代码，定义全局变量
+ *   Handle* handler = globalHandle("handle");
+ *   for (每个请求) callHandle(handler, 1, &request, &response);
+ *   releaseHandle(handler);
+ *   releaseHandle(script);
+ *   freeVM();
+ *
+ * 宿主程序的函数用 defineNative(&vm.globals, ...) 注册，可以用 callClosure 回调脚本。
+ * 句柄固定的值在释放之前不会被 GC 回收。宿主程序拿到的其他对象值
+ * （参数、返回值）在下一次分配内存时可能被回收，需要跨调用持有时用 pinValue 固定。
+ *
+ * 每个请求用 callInRegion 代替 callHandle 时，请求期间的对象分配在区域中，
+ * 请求结束时整体释放，只有保存到全局变量、句柄或返回值中的对象复制到主堆。
+ */
+
+Handle* pinValue(Value value);
+Value handleValue(Handle* handle);
+void releaseHandle(Handle* handle);
+Handle* compileHandle(const char* source);
+Handle* globalHandle(const char* name);
+InterpretResult callHandle(Handle* callee, int argCount, const Value* args,
+                           Value* result);
+InterpretResult callInRegion(Handle* callee, int argCount, const Value* args,
+                             Value* result);
+
+#endif // clox_embed_h
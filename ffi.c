@@ -0,0 +1,357 @@
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ffi.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+ * 外部函数接口。
+ *
+ * 签名写作 "返回类型(参数类型...)"，类型字符：
+ *   d double       i int（32 位）    l int64_t
+ *   s 字符串（const char*，nil 为 NULL；返回值复制为字符串）
+ *   p 指针：缓冲区传内容地址，字符串传字符地址（只读），数字传地址，nil 为 NULL；
+ *     返回值为地址数字，NULL 为 nil
+ *   v 无返回值，只能作为返回类型
+ *
+ * 不生成机器码：在 x86-64 System V 和 AArch64 调用约定中，整数类参数和浮点参数
+ * 各自按出现顺序放入两组寄存器，互不影响。因此任何签名都可以改写为
+ * “6 个整数类参数在前、8 个 double 在后”的固定形式，多余的寄存器被调用者忽略。
+ * 调用桩只按返回类型分三种，签名在绑定时解析一次，每次调用只做参数转换。
+ * 不支持可变参数函数、结构体参数和需要经栈传递的参数。
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(_WIN32)
+#define FOREIGN_REGISTER_CALLS
+#endif
+
+/* 经寄存器传递的整数类参数和浮点参数个数 */
+#define FOREIGN_INTEGER_MAX 6
+#define FOREIGN_DOUBLE_MAX 8
+
+#define FOREIGN_STUB_PARAMS \
+    int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, \
+    double, double, double, double, double, double, double, double
+
+//按返回类型区分的三种调用桩
+typedef int64_t (*IntegerStub)(FOREIGN_STUB_PARAMS);
+typedef double (*DoubleStub)(FOREIGN_STUB_PARAMS);
+typedef void (*VoidStub)(FOREIGN_STUB_PARAMS);
+
+#define FOREIGN_STUB_ARGS(ints, doubles) \
+    ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], \
+    doubles[0], doubles[1], doubles[2], doubles[3], \
+    doubles[4], doubles[5], doubles[6], doubles[7]
+
+//解析后的签名，校验通过之后才复制到外部函数对象中
+typedef struct {
+  char returnType;
+  int arity;
+  char argTypes[FOREIGN_ARGS_MAX];
+} Signature;
+
+//dlclose 会释放 dlerror 返回的字符串，关闭库之前把错误描述复制到这里
+static THREAD_LOCAL char bindError[256];
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static bool parseSignature(const char* text, Signature* signature);
+static bool toInteger(Value value, int64_t* integer);
+static ObjBuffer* bufferArgument(VM* vm, Value value);
+static bool bufferIndex(VM* vm, ObjBuffer* buffer, Value value, int* index);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 解析共享库中的符号，按签名创建外部函数。绑定成功后库不再关闭，
+ * 失败时关闭本次打开的库。
+ *
+ * @param library 库路径，空字符串表示进程本身和它已经加载的库
+ * @param error 失败时输出错误描述
+ * @return 库或符号找不到、签名无效时返回 NULL
+ */
+ObjForeign* bindForeign(ObjString* library, ObjString* symbol,
+                        ObjString* signature, const char** error) {
+  Signature parsed;
+  if (!parseSignature(signature->chars, &parsed)) {
+    *error = "invalid signature";
+    return NULL;
+  }
+
+  void* handle = dlopen(library->length == 0 ? NULL : library->chars,
+                        RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    *error = dlerror();
+    return NULL;
+  }
+  dlerror();
+  void* function = dlsym(handle, symbol->chars);
+  if (function == NULL) {
+    const char* message = dlerror();
+    snprintf(bindError, sizeof(bindError), "%s",
+             message != NULL ? message : "symbol is NULL");
+    *error = bindError;
+    dlclose(handle);
+    return NULL;
+  }
+
+  ObjForeign* foreign = newForeign(function, library, symbol, signature);
+  foreign->returnType = parsed.returnType;
+  foreign->arity = parsed.arity;
+  memcpy(foreign->argTypes, parsed.argTypes, parsed.arity);
+  return foreign;
+}
+
+/**
+ * 调用外部函数。参数个数已经由 callValue 检查。
+ *
+ * @return 参数类型不符时经 nativeError 报告错误并返回 false
+ */
+bool callForeign(ObjForeign* foreign, Value* args, Value* result) {
+#ifdef FOREIGN_REGISTER_CALLS
+  int64_t ints[FOREIGN_INTEGER_MAX] = {0};
+  double doubles[FOREIGN_DOUBLE_MAX] = {0};
+  //短字符串是立即数，转换为 C 字符串时需要放在缓冲区中
+  char smallStrings[FOREIGN_ARGS_MAX][SMALL_STRING_MAX + 1];
+  int intCount = 0;
+  int doubleCount = 0;
+
+  for (int i = 0; i < foreign->arity; i++) {
+    Value arg = args[i];
+    char type = foreign->argTypes[i];
+    if (type == 'd') {
+      if (!IS_NUMBER(arg)) {
+        return nativeError(&vm, "Argument %d of %s must be a number.",
+                           i + 1, foreign->symbol->chars);
+      }
+      doubles[doubleCount++] = AS_NUMBER(arg);
+      continue;
+    }
+
+    int64_t integer = 0;
+    if (type == 'i' || type == 'l') {
+      if (!toInteger(arg, &integer)) {
+        return nativeError(&vm, "Argument %d of %s must be an integer.",
+                           i + 1, foreign->symbol->chars);
+      }
+      if (type == 'i') integer = (int32_t)integer;
+    } else if (IS_NIL(arg)) {
+      integer = 0;
+    } else if (IS_ANY_STRING(arg)) {
+      int length;
+      integer = (int64_t)(intptr_t)stringChars(arg, smallStrings[i], &length);
+    } else if (type == 'p' && IS_BUFFER(arg)) {
+      integer = (int64_t)(intptr_t)AS_BUFFER(arg)->bytes;
+    } else if (type == 'p' && toInteger(arg, &integer)) {
+      //地址数字原样传入
+    } else {
+      return nativeError(&vm, type == 's'
+                             ? "Argument %d of %s must be a string."
+                             : "Argument %d of %s must be a buffer or pointer.",
+                         i + 1, foreign->symbol->chars);
+    }
+    ints[intCount++] = integer;
+  }
+
+  switch (foreign->returnType) {
+    case 'v':
+      ((VoidStub)foreign->function)(FOREIGN_STUB_ARGS(ints, doubles));
+      *result = NIL_VAL;
+      return true;
+    case 'd':
+      *result = NUMBER_VAL(((DoubleStub)foreign->function)(
+          FOREIGN_STUB_ARGS(ints, doubles)));
+      return true;
+    default:
+      break;
+  }
+
+  int64_t value = ((IntegerStub)foreign->function)(
+      FOREIGN_STUB_ARGS(ints, doubles));
+  switch (foreign->returnType) {
+    case 'i':
+      //int 返回值只有低 32 位有效
+      *result = NUMBER_VAL((double)(int32_t)value);
+      break;
+    case 'l':
+      *result = NUMBER_VAL((double)value);
+      break;
+    case 's': {
+      const char* chars = (const char*)(intptr_t)value;
+      *result = chars == NULL ? NIL_VAL : stringValue(chars, (int)strlen(chars));
+      break;
+    }
+    case 'p':
+      *result = value == 0 ? NIL_VAL : NUMBER_VAL((double)(uintptr_t)value);
+      break;
+  }
+  return true;
+#else
+  return nativeError(&vm, "Foreign calls are not supported on this platform.");
+#endif
+}
+
+/**
+ * foreign(library, symbol, signature)：绑定共享库中的函数，返回可调用的外部函数。
+ * 每个函数只需绑定一次，之后的调用不再查找符号和解析签名。
+ */
+bool foreignNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_ANY_STRING(args[0]) || !IS_ANY_STRING(args[1]) ||
+      !IS_ANY_STRING(args[2])) {
+    return nativeError(vm, "Library, symbol and signature must be strings.");
+  }
+  //短字符串立即数转换为堆字符串，外部函数对象引用它们，参数槽保证它们可达
+  for (int i = 0; i < 3; i++) {
+    if (IS_SMALL_STRING(args[i])) {
+      char buffer[SMALL_STRING_MAX + 1];
+      int length;
+      const char* chars = stringChars(args[i], buffer, &length);
+      ObjString* string = copyString(chars, length);
+      //copyString 可能触发 GC，但不会扩容栈，args 仍然有效
+      args[i] = OBJ_VAL(string);
+    }
+  }
+
+  const char* error = NULL;
+  ObjForeign* foreign = bindForeign(AS_STRING(args[0]), AS_STRING(args[1]),
+                                    AS_STRING(args[2]), &error);
+  if (foreign == NULL) {
+    return nativeError(vm, "Could not bind %s: %s", AS_CSTRING(args[1]), error);
+  }
+  *result = OBJ_VAL(foreign);
+  return true;
+}
+
+/**
+ * buffer(length)：创建内容全为 0 的字节缓冲区，作为 'p' 参数传给外部函数。
+ */
+bool bufferNative(VM* vm, int argCount, Value* args, Value* result) {
+  int64_t length;
+  if (!toInteger(args[0], &length) || length < 0 || length > INT32_MAX) {
+    return nativeError(vm, "Buffer length must be a non-negative integer.");
+  }
+  *result = OBJ_VAL(newBuffer((int)length));
+  return true;
+}
+
+/**
+ * bufferLength(buffer)：缓冲区的字节数。
+ */
+bool bufferLengthNative(VM* vm, int argCount, Value* args, Value* result) {
+  ObjBuffer* buffer = bufferArgument(vm, args[0]);
+  if (buffer == NULL) return false;
+  *result = NUMBER_VAL(buffer->length);
+  return true;
+}
+
+/**
+ * bufferGet(buffer, index)：读取一个字节（0 到 255）。
+ */
+bool bufferGetNative(VM* vm, int argCount, Value* args, Value* result) {
+  ObjBuffer* buffer = bufferArgument(vm, args[0]);
+  int index = 0;
+  if (buffer == NULL || !bufferIndex(vm, buffer, args[1], &index)) return false;
+  *result = NUMBER_VAL(buffer->bytes[index]);
+  return true;
+}
+
+/**
+ * bufferSet(buffer, index, byte)：写入一个字节，byte 取低 8 位。
+ */
+bool bufferSetNative(VM* vm, int argCount, Value* args, Value* result) {
+  ObjBuffer* buffer = bufferArgument(vm, args[0]);
+  int index = 0;
+  if (buffer == NULL || !bufferIndex(vm, buffer, args[1], &index)) return false;
+  int64_t byte;
+  if (!toInteger(args[2], &byte)) {
+    return nativeError(vm, "Byte must be an integer.");
+  }
+  buffer->bytes[index] = (uint8_t)byte;
+  *result = NIL_VAL;
+  return true;
+}
+
+/**
+ * bufferString(buffer, start, length)：把一段内容复制为字符串。
+ */
+bool bufferStringNative(VM* vm, int argCount, Value* args, Value* result) {
+  ObjBuffer* buffer = bufferArgument(vm, args[0]);
+  if (buffer == NULL) return false;
+  int64_t start, length;
+  if (!toInteger(args[1], &start) || !toInteger(args[2], &length) ||
+      start < 0 || length < 0 || start + length > buffer->length) {
+    return nativeError(vm, "Buffer range out of bounds.");
+  }
+  *result = stringValue((const char*)buffer->bytes + start, (int)length);
+  return true;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+/**
+ * 解析签名，填入返回类型和参数类型，并检查寄存器个数的限制。
+ */
+static bool parseSignature(const char* text, Signature* signature) {
+  if (text[0] == '\0' || strchr("vdilsp", text[0]) == NULL ||
+      text[1] != '(') {
+    return false;
+  }
+  signature->returnType = text[0];
+  int intCount = 0;
+  int doubleCount = 0;
+  int arity = 0;
+  const char* c = text + 2;
+  for (; *c != ')'; c++) {
+    if (*c == '\0' || strchr("dilsp", *c) == NULL) return false;
+    if (*c == 'd') {
+      if (++doubleCount > FOREIGN_DOUBLE_MAX) return false;
+    } else {
+      if (++intCount > FOREIGN_INTEGER_MAX) return false;
+    }
+    signature->argTypes[arity++] = *c;
+  }
+  if (c[1] != '\0') return false;
+  signature->arity = arity;
+  return true;
+}
+
+/**
+ * 把数字转换为整数，小数部分截断；不是数字或超出 int64_t 范围时返回 false。
+ */
+static bool toInteger(Value value, int64_t* integer) {
+  if (!IS_NUMBER(value)) return false;
+  double number = AS_NUMBER(value);
+  if (!isfinite(number) || number >= 9223372036854775808.0 ||
+      number < -9223372036854775808.0) {
+    return false;
+  }
+  *integer = (int64_t)number;
+  return true;
+}
+
+static ObjBuffer* bufferArgument(VM* vm, Value value) {
+  if (!IS_BUFFER(value)) {
+    nativeError(vm, "Argument must be a buffer.");
+    return NULL;
+  }
+  return AS_BUFFER(value);
+}
+
+static bool bufferIndex(VM* vm, ObjBuffer* buffer, Value value, int* index) {
+  int64_t integer;
+  if (!toInteger(value, &integer) || integer < 0 || integer >= buffer->length) {
+    return nativeError(vm, "Buffer index out of bounds.");
+  }
+  *index = (int)integer;
+  return true;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_ffi_h
+#define clox_ffi_h
+
+#include "common.h"
+#include "object.h"
+
+ObjForeign* bindForeign(ObjString* library, ObjString* symbol,
+                        ObjString* signature, const char** error);
+bool callForeign(ObjForeign* foreign, Value* args, Value* result);
+
+bool foreignNative(VM* vm, int argCount, Value* args, Value* result);
+bool bufferNative(VM* vm, int argCount, Value* args, Value* result);
+bool bufferLengthNative(VM* vm, int argCount, Value* args, Value* result);
+bool bufferGetNative(VM* vm, int argCount, Value* args, Value* result);
+bool bufferSetNative(VM* vm, int argCount, Value* args, Value* result);
+bool bufferStringNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif // clox_ffi_h
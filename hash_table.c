@@ -64,10 +64,10 @@ bool tableSet(Table *table, ObjString *key, Value value)
     adjustCapacity(table, capacity);
   }
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
+  bool isNewKey = entry->key == NULL_REF;
   if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-  entry->key = key;
+  entry->key = toRef(key);
   entry->value = value;
   return isNewKey;
 }
@@ -84,8 +84,8 @@ void tableAddAll(Table *from, Table *to)
   for (int i = 0; i < from->capacity; i++)
   {
     Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (entry->key != NULL_REF) {
+      tableSet(to, ENTRY_KEY(entry), entry->value);
     }
   }
 }
@@ -106,7 +106,7 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     return false;
 
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (entry->key == NULL_REF) return false;
 
   *value = entry->value;
   return true;
@@ -128,10 +128,10 @@ bool tableDelete(Table *table, ObjString *key)
 
   // Find the entry.
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (entry->key == NULL_REF) return false;
 
   // Place a tombstone in the entry.
-  entry->key = NULL;
+  entry->key = NULL_REF;
   entry->value = BOOL_VAL(true);
   return true;
 }
@@ -157,14 +157,16 @@ ObjString *tableFindString(Table *table, const char *chars,
   uint32_t index = hash & (table->capacity - 1);
   for (;;) {
     Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
+    if (entry->key == NULL_REF) {
       // Stop if we find an empty non-tombstone entry.
       if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+    } else {
+      ObjString* key = ENTRY_KEY(entry);
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        // We found it.
+        return key;
+      }
     }
 
     index = (index + 1) & (table->capacity - 1);
@@ -181,7 +183,7 @@ void markTable(Table *table)
   for (int i = 0; i < table->capacity; i++)
   {
     Entry *entry = &table->entries[i];
-    markObject((Obj*)entry->key);
+    markObject((Obj*)ENTRY_KEY(entry));
     markValue(entry->value);
   }
 }
@@ -190,8 +192,8 @@ void markTable(Table *table)
 void tableRemoveWhite(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (entry->key != NULL_REF && !isMarked(&ENTRY_KEY(entry)->obj)) {
+      tableDelete(table, ENTRY_KEY(entry));
     }
   }
 }
@@ -215,10 +217,11 @@ static Entry *findEntry(Entry *entries, int capacity,
                         ObjString *key)
 {
   uint32_t index = key->hash & (capacity - 1);
+  Ref keyRef = toRef(key);
   Entry* tombstone = NULL;
   for (;;) {
     Entry* entry = &entries[index];
-    if (entry->key == NULL) {
+    if (entry->key == NULL_REF) {
       if (IS_NIL(entry->value)) {
         // Empty entry.
         return tombstone != NULL ? tombstone : entry;
@@ -226,7 +229,7 @@ static Entry *findEntry(Entry *entries, int capacity,
         // We found a tombstone.
         if (tombstone == NULL) tombstone = entry;
       }
-    } else if (entry->key == key) {
+    } else if (entry->key == keyRef) {
       // We found the key.
       return entry;
     }
@@ -248,16 +251,16 @@ static void adjustCapacity(Table *table, int capacity)
   Entry *entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++)
   {
-    entries[i].key = NULL;
+    entries[i].key = NULL_REF;
     entries[i].value = NIL_VAL;
   }
 
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+    if (entry->key == NULL_REF) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
+    Entry* dest = findEntry(entries, capacity, ENTRY_KEY(entry));
     dest->key = entry->key;
     dest->value = entry->value;
     table->count++;
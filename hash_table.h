@@ -3,10 +3,18 @@
 
 #include "common.h"
 #include "value.h"
+#include "ref.h"
 
+/* 取得条目的键 */
+#define ENTRY_KEY(entry) ((ObjString*)fromRef((entry)->key))
 
+//压缩引用时取消对齐填充，条目从 16 字节缩小到 12 字节
+#ifdef COMPRESSED_REFS
+typedef struct __attribute__((packed)) {
+#else
 typedef struct {
-  ObjString* key;
+#endif
+  Ref key;      //ObjString*
   Value value;
 } Entry;
 
@@ -0,0 +1,960 @@
+#include <string.h>
+
+#include "image.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "ffi.h"
+#include "memory.h"
+#include "vm.h"
+
+/* 文件头的魔数 */
+#define IMAGE_MAGIC "CLOXI\r\n"
+#define IMAGE_MAGIC_LENGTH 8
+/* 用于识别写入文件的机器字节序 */
+#define IMAGE_BYTE_ORDER 0x01020304u
+/* 文件头标志位：编译时是否定义了 NAN_BOXING */
+#define IMAGE_FLAG_NAN_BOXING 0x1u
+/* 函数没有名字时的对象下标 */
+#define IMAGE_NO_OBJECT UINT32_MAX
+
+//值的类型标签
+typedef enum {
+  VALUE_NIL,
+  VALUE_TRUE,
+  VALUE_FALSE,
+  VALUE_NUMBER,         //8 字节 double
+  VALUE_SMALL_STRING,   //1 字节长度加字符
+  VALUE_OBJECT,         //对象下标
+} ValueTag;
+
+//镜像中对象记录的排列顺序。每类对象创建时只引用排在它前面的对象，
+//加载时先按此顺序创建全部对象，再回填对象之间的引用
+static const ObjType imageOrder[] = {
+  OBJ_STRING,
+  OBJ_FUNCTION,       //创建时只需要上值个数，闭包依赖它
+  OBJ_NATIVE,
+  OBJ_FOREIGN,        //库名、符号名和签名，加载时重新解析
+  OBJ_BUFFER,
+  OBJ_MODULE,         //路径
+  OBJ_STRUCT,         //名字和字段名
+  OBJ_CLASS,          //名字
+  OBJ_UPVALUE,
+  OBJ_CLOSURE,        //函数
+  OBJ_INSTANCE,       //类
+  OBJ_RECORD,         //结构体描述
+  OBJ_BOUND_METHOD,   //方法闭包
+  OBJ_FIBER,
+};
+
+#define IMAGE_ORDER_COUNT ((int)(sizeof(imageOrder) / sizeof(imageOrder[0])))
+
+//保存时收集到的对象，按 imageOrder 排列，下标即对象在镜像中的编号
+typedef struct {
+  Obj** objects;
+  int count;
+  int capacity;
+} ObjectList;
+
+//对象指针到编号的索引：开放寻址，空槽的 object 为 NULL
+typedef struct {
+  Obj* object;
+  uint32_t index;
+} IndexEntry;
+
+typedef struct {
+  IndexEntry* entries;
+  int capacity;
+} ObjectIndex;
+
+//加载过程中已经创建的对象，加载期间作为 GC 根
+static THREAD_LOCAL Obj** loadedObjects = NULL;
+static THREAD_LOCAL int loadedCount = 0;
+static THREAD_LOCAL int loadedCapacity = 0;
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static uint32_t headerFlags();
+static bool collectObjects(ObjectList* list);
+static void appendObject(ObjectList* list, Obj* object);
+static void buildIndex(ObjectIndex* index, ObjectList* list);
+static uint32_t findIndex(ObjectIndex* index, Obj* object);
+static bool writeValue(Writer* writer, Value value, ObjectIndex* index);
+static bool writeRef(Writer* writer, Obj* object, ObjectIndex* index);
+static bool writeTable(Writer* writer, Table* table, ObjectIndex* index);
+static bool writeObject(Writer* writer, Obj* object, ObjectIndex* index);
+static bool readImage(Reader* reader);
+static Obj* readRef(Reader* reader, ObjType type, int limit);
+static bool readValue(Reader* reader, Value* value);
+static bool readTable(Reader* reader, Table* table);
+static bool readModules(Reader* reader, Table* table);
+static Obj* createObject(ObjType type, Reader* record);
+static bool fillObject(Obj* object, Reader* record);
+static bool fillFiber(ObjFiber* fiber, Reader* record);
+static bool verifyFiber(ObjFiber* fiber);
+static int instructionBefore(Chunk* chunk, int offset);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 把全局变量表、已加载的模块及从它们可达的全部对象写入堆镜像。
+ * 通常在预加载脚本执行完毕后调用，之后的进程用 loadImage 恢复这些全局变量，
+ * 跳过预加载脚本的编译和顶层初始化。
+ * memo 缓存和分支计数不写入镜像；正在运行的协程无法保存。
+ *
+ * @param path 输出文件路径
+ * @return 成功返回 true；含有无法保存的对象或写文件失败时返回 false
+ */
+bool saveImage(const char* path) {
+  ObjectList list = {NULL, 0, 0};
+  if (!collectObjects(&list)) {
+    clox_free(list.objects);
+    return false;
+  }
+  ObjectIndex index;
+  buildIndex(&index, &list);
+
+  Writer writer = {NULL, 0, 0};
+  writeBytes(&writer, IMAGE_MAGIC, IMAGE_MAGIC_LENGTH);
+  write32(&writer, IMAGE_VERSION);
+  write32(&writer, IMAGE_BYTE_ORDER);
+  write32(&writer, headerFlags());
+
+  bool ok = true;
+  write32(&writer, (uint32_t)list.count);
+  for (int i = 0; ok && i < list.count; i++) {
+    ok = writeObject(&writer, list.objects[i], &index);
+  }
+  ok = ok && writeTable(&writer, &vm.globals, &index) &&
+       writeTable(&writer, &vm.modules, &index) && writeFile(path, &writer);
+
+  freeWriter(&writer);
+  clox_free(index.entries);
+  clox_free(list.objects);
+  return ok;
+}
+
+/**
+ * 读取堆镜像，把其中的全局变量合并到 vm.globals，模块合并到 vm.modules。
+ * 文件通过 mmap 映射后解析：先按记录顺序创建全部对象，再按编号回填引用。
+ * 字符串经由 copyString 重新驻留，函数在恢复前都经过字节码校验，
+ * 协程的调用帧必须停在调用指令或 yield 之后，槽 0 是帧的被调用者。
+ * 与 .cloxc 相同，校验只保证结构合法，不检查栈深度、局部变量槽位和值的类型：
+ * 被改写过内容的镜像仍可能通过校验，执行时出错。镜像不用于不可信的输入。
+ *
+ * @param path 由 saveImage 写出的文件
+ * @return 文件不存在、被截断、结构不合法或版本不符时返回 false，
+ *         此时 vm.globals 和 vm.modules 不变
+ */
+bool loadImage(const char* path) {
+  Reader reader;
+  if (!mapFile(path, &reader)) return false;
+
+  bool ok = readImage(&reader);
+
+  FREE_ARRAY(Obj*, loadedObjects, loadedCapacity);
+  loadedObjects = NULL;
+  loadedCount = 0;
+  loadedCapacity = 0;
+  unmapFile(&reader);
+  return ok;
+}
+
+void markImageRoots() {
+  for (int i = 0; i < loadedCount; i++) {
+    markObject(loadedObjects[i]);
+  }
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static uint32_t headerFlags() {
+  uint32_t flags = 0;
+#ifdef NAN_BOXING
+  flags |= IMAGE_FLAG_NAN_BOXING;
+#endif
+  return flags;
+}
+
+/**
+ * 借助 GC 的标记过程找出从全局变量可达的对象，再按 imageOrder 排列。
+ * 惰性编译时先补齐这些函数的函数体，新编译出的嵌套函数需要重新收集。
+ */
+static bool collectObjects(ObjectList* list) {
+  ObjectList reachable = {NULL, 0, 0};
+  for (;;) {
+    reachable.count = 0;
+    //标记和遍历之间不能经由 reallocate 分配内存，列表用 clox_realloc 增长
+    markReachable(&vm.globals);
+    markReachable(&vm.modules);
+    for (int id = 0; id < vm.heap.count; id++) {
+      Obj* object = vm.heap.objects[id];
+      if (object != NULL && isMarked(object)) appendObject(&reachable, object);
+    }
+    clearMarks();
+
+#ifdef LAZY_COMPILE
+    bool compiled = false;
+    for (int i = 0; i < reachable.count; i++) {
+      Obj* object = reachable.objects[i];
+      if (object->type != OBJ_FUNCTION) continue;
+      ObjFunction* function = (ObjFunction*)object;
+      if (function->lazy == NULL) continue;
+      if (!compileFunction(function)) {
+        clox_free(reachable.objects);
+        return false;
+      }
+      compiled = true;
+    }
+    if (compiled) continue;
+#endif
+    break;
+  }
+
+  for (int order = 0; order < IMAGE_ORDER_COUNT; order++) {
+    for (int i = 0; i < reachable.count; i++) {
+      if (reachable.objects[i]->type == imageOrder[order]) {
+        appendObject(list, reachable.objects[i]);
+      }
+    }
+  }
+  clox_free(reachable.objects);
+  return true;
+}
+
+static void appendObject(ObjectList* list, Obj* object) {
+  if (list->count == list->capacity) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->objects = (Obj**)clox_realloc(list->objects,
+                                        sizeof(Obj*) * list->capacity);
+  }
+  list->objects[list->count++] = object;
+}
+
+static void buildIndex(ObjectIndex* index, ObjectList* list) {
+  int capacity = 16;
+  while (capacity < list->count * 2) capacity *= 2;
+  index->capacity = capacity;
+  index->entries = (IndexEntry*)clox_malloc(sizeof(IndexEntry) * capacity);
+  for (int i = 0; i < capacity; i++) {
+    index->entries[i].object = NULL;
+  }
+
+  for (int i = 0; i < list->count; i++) {
+    uint32_t slot = (uint32_t)((uintptr_t)list->objects[i] >> 3) & (capacity - 1);
+    while (index->entries[slot].object != NULL) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    index->entries[slot].object = list->objects[i];
+    index->entries[slot].index = (uint32_t)i;
+  }
+}
+
+/**
+ * 求对象在镜像中的编号，对象不在镜像中时返回 IMAGE_NO_OBJECT。
+ */
+static uint32_t findIndex(ObjectIndex* index, Obj* object) {
+  uint32_t slot = (uint32_t)((uintptr_t)object >> 3) & (index->capacity - 1);
+  for (;;) {
+    IndexEntry* entry = &index->entries[slot];
+    if (entry->object == object) return entry->index;
+    if (entry->object == NULL) return IMAGE_NO_OBJECT;
+    slot = (slot + 1) & (index->capacity - 1);
+  }
+}
+
+static bool writeValue(Writer* writer, Value value, ObjectIndex* index) {
+  if (IS_NIL(value)) {
+    write8(writer, VALUE_NIL);
+  } else if (IS_BOOL(value)) {
+    write8(writer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    write8(writer, VALUE_NUMBER);
+    write64(writer, bits);
+#ifdef NAN_BOXING
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[SMALL_STRING_MAX + 1];
+    int length = smallStringChars(value, chars);
+    write8(writer, VALUE_SMALL_STRING);
+    write8(writer, (uint8_t)length);
+    writeBytes(writer, chars, length);
+#endif
+  } else {
+    write8(writer, VALUE_OBJECT);
+    return writeRef(writer, AS_OBJ(value), index);
+  }
+  return true;
+}
+
+static bool writeRef(Writer* writer, Obj* object, ObjectIndex* index) {
+  uint32_t number = findIndex(index, object);
+  write32(writer, number);
+  return number != IMAGE_NO_OBJECT;
+}
+
+static bool writeTable(Writer* writer, Table* table, ObjectIndex* index) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (ENTRY_KEY(&table->entries[i]) != NULL) count++;
+  }
+  write32(writer, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (ENTRY_KEY(entry) == NULL) continue;
+    if (!writeRef(writer, (Obj*)ENTRY_KEY(entry), index) ||
+        !writeValue(writer, entry->value, index)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * 写入一条对象记录：类型、记录长度，然后是创建对象所需的字段，最后是回填的引用。
+ */
+static bool writeObject(Writer* writer, Obj* object, ObjectIndex* index) {
+  write8(writer, (uint8_t)object->type);
+  size_t lengthAt = writer->count;
+  write32(writer, 0);
+  size_t start = writer->count;
+  bool ok = true;
+
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      write32(writer, (uint32_t)string->length);
+      writeBytes(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      write32(writer, (uint32_t)function->upvalueCount);
+      if (function->name != NULL) {
+        ok = writeRef(writer, (Obj*)function->name, index);
+      } else {
+        write32(writer, IMAGE_NO_OBJECT);
+      }
+      if (ok && function->module != NULL) {
+        ok = writeRef(writer, (Obj*)function->module, index);
+      } else {
+        write32(writer, IMAGE_NO_OBJECT);
+      }
+      write32(writer, (uint32_t)function->arity);
+      write8(writer, (uint8_t)((function->isMemo ? 1 : 0) |
+                               (function->isGenerator ? 2 : 0)));
+      writeChunkBody(writer, &function->chunk);
+      ValueArray* constants = &function->chunk.constants;
+      write32(writer, (uint32_t)constants->count);
+      for (int i = 0; ok && i < constants->count; i++) {
+        ok = writeValue(writer, constants->values[i], index);
+      }
+      break;
+    }
+    case OBJ_NATIVE: {
+      const char* name = nativeName(((ObjNative*)object)->function);
+      if (name == NULL) return false;
+      write32(writer, (uint32_t)strlen(name));
+      writeBytes(writer, name, strlen(name));
+      break;
+    }
+    case OBJ_FOREIGN: {
+      ObjForeign* foreign = (ObjForeign*)object;
+      ok = writeRef(writer, (Obj*)foreign->library, index) &&
+           writeRef(writer, (Obj*)foreign->symbol, index) &&
+           writeRef(writer, (Obj*)foreign->signature, index);
+      break;
+    }
+    case OBJ_BUFFER: {
+      ObjBuffer* buffer = (ObjBuffer*)object;
+      write32(writer, (uint32_t)buffer->length);
+      writeBytes(writer, buffer->bytes, buffer->length);
+      break;
+    }
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      ok = writeRef(writer, (Obj*)type->name, index);
+      write32(writer, (uint32_t)type->fieldCount);
+      for (int i = 0; ok && i < type->fieldCount; i++) {
+        ok = writeRef(writer, (Obj*)type->fields[i], index);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      ok = writeRef(writer, (Obj*)klass->name, index) &&
+           writeTable(writer, &klass->methods, index);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      //打开的上值由所属协程的记录指回它的栈槽
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      bool open = upvalue->location != &upvalue->closed;
+      write8(writer, open ? 1 : 0);
+      if (!open) ok = writeValue(writer, upvalue->closed, index);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      ok = writeRef(writer, (Obj*)closure->function, index);
+      write32(writer, (uint32_t)closure->upvalueCount);
+      for (int i = 0; ok && i < closure->upvalueCount; i++) {
+        ok = writeRef(writer, (Obj*)CLOSURE_UPVALUE(closure, i), index);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      ok = writeRef(writer, (Obj*)instance->klass, index) &&
+           writeTable(writer, &instance->fields, index);
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      ok = writeRef(writer, (Obj*)record->type, index);
+      write32(writer, (uint32_t)record->fieldCount);
+      for (int i = 0; ok && i < record->fieldCount; i++) {
+        ok = writeValue(writer, record->fields[i], index);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      ok = writeRef(writer, (Obj*)bound->method, index) &&
+           writeValue(writer, bound->receiver, index);
+      break;
+    }
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      ok = writeRef(writer, (Obj*)module->path, index) &&
+           writeRef(writer, (Obj*)module->function, index) &&
+           writeTable(writer, &module->globals, index);
+      write8(writer, module->executed ? 1 : 0);
+      break;
+    }
+    case OBJ_FIBER: {
+      //正在运行或等待被恢复的协程的状态在 C 栈和 vm 中，无法保存
+      ObjFiber* fiber = (ObjFiber*)object;
+      if (fiber->state == FIBER_RUNNING || fiber->caller != NULL) return false;
+      write8(writer, (uint8_t)fiber->state);
+      int stackCount = (int)(fiber->stackTop - fiber->stack);
+      write32(writer, (uint32_t)stackCount);
+      for (int i = 0; ok && i < stackCount; i++) {
+        ok = writeValue(writer, fiber->stack[i], index);
+      }
+      write32(writer, (uint32_t)fiber->frameCount);
+      for (int i = 0; ok && i < fiber->frameCount; i++) {
+        CallFrame* frame = &fiber->frames[i];
+        ok = writeRef(writer, (Obj*)frame->closure, index);
+        write32(writer, (uint32_t)(frame->ip - frame->closure->function->chunk.code));
+        write32(writer, (uint32_t)(frame->slots - fiber->stack));
+      }
+      uint32_t openCount = 0;
+      for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+           upvalue = upvalue->next) {
+        openCount++;
+      }
+      write32(writer, openCount);
+      for (ObjUpvalue* upvalue = fiber->openUpvalues; ok && upvalue != NULL;
+           upvalue = upvalue->next) {
+        ok = writeRef(writer, (Obj*)upvalue, index);
+        write32(writer, (uint32_t)(upvalue->location - fiber->stack));
+      }
+      break;
+    }
+    case OBJ_CHANNEL:
+    case OBJ_THREAD:
+      //通道和线程属于正在运行的进程，不在 imageOrder 中，不会写入镜像
+      return false;
+  }
+
+  uint32_t length = (uint32_t)(writer->count - start);
+  memcpy(writer->bytes + lengthAt, &length, sizeof(length));
+  return ok;
+}
+
+/**
+ * 解析镜像。任何一步失败都返回 false，已经创建的对象留给 GC 回收。
+ */
+static bool readImage(Reader* reader) {
+  const uint8_t* magic = readSpan(reader, IMAGE_MAGIC_LENGTH);
+  if (magic == NULL || memcmp(magic, IMAGE_MAGIC, IMAGE_MAGIC_LENGTH) != 0) {
+    return false;
+  }
+  if (read32(reader) != IMAGE_VERSION) return false;
+  if (read32(reader) != IMAGE_BYTE_ORDER) return false;
+  if (read32(reader) != headerFlags()) return false;
+
+  //每条记录至少有 1 字节类型和 4 字节长度
+  uint32_t objectCount = read32(reader);
+  if (reader->error || objectCount > (reader->size - reader->position) / 5) {
+    return false;
+  }
+  loadedObjects = ALLOCATE(Obj*, objectCount);
+  loadedCapacity = (int)objectCount;
+  Reader* records = ALLOCATE(Reader, objectCount);
+  bool ok = true;
+
+  //第一遍：创建全部对象，记录中回填引用的部分留给第二遍
+  for (uint32_t i = 0; ok && i < objectCount; i++) {
+    uint8_t type = read8(reader);
+    uint32_t length = read32(reader);
+    const uint8_t* bytes = readSpan(reader, length);
+    if (bytes == NULL) {
+      ok = false;
+      break;
+    }
+    records[i] = (Reader){bytes, length, 0, false};
+    Obj* object = createObject((ObjType)type, &records[i]);
+    if (object == NULL || records[i].error) {
+      ok = false;
+      break;
+    }
+    loadedObjects[loadedCount++] = object;
+  }
+
+  //第二遍：回填对象之间的引用，每条记录必须恰好读完
+  for (int i = 0; ok && i < loadedCount; i++) {
+    ok = fillObject(loadedObjects[i], &records[i]) && !records[i].error &&
+         records[i].position == records[i].size;
+    //先创建的对象可能已经在 GC 中晋升，引用的对象却是之后才创建的
+    rememberWrite(loadedObjects[i]);
+  }
+  FREE_ARRAY(Reader, records, objectCount);
+
+  for (int i = 0; ok && i < loadedCount; i++) {
+    Obj* object = loadedObjects[i];
+    if (object->type == OBJ_FUNCTION) {
+      ok = verifyBytecode((ObjFunction*)object);
+    } else if (object->type == OBJ_UPVALUE) {
+      //打开的上值必须被某个协程认领
+      ok = ((ObjUpvalue*)object)->location != NULL;
+    }
+  }
+  //协程的调用帧要按指令边界检查，必须等全部函数通过校验之后
+  for (int i = 0; ok && i < loadedCount; i++) {
+    if (loadedObjects[i]->type == OBJ_FIBER) {
+      ok = verifyFiber((ObjFiber*)loadedObjects[i]);
+    }
+  }
+  if (!ok) return false;
+
+  //全局变量和模块表先完整校验一遍，确保失败时 vm.globals 和 vm.modules 不变
+  size_t globalsAt = reader->position;
+  Table scratch;
+  initTable(&scratch);
+  ok = readTable(reader, &scratch) && readModules(reader, &scratch) &&
+       reader->position == reader->size;
+  freeTable(&scratch);
+  if (!ok) return false;
+  reader->position = globalsAt;
+  return readTable(reader, &vm.globals) && readModules(reader, &vm.modules);
+}
+
+/**
+ * 读取对象编号，要求对象已经创建（编号小于 limit）且类型为 type。
+ */
+static Obj* readRef(Reader* reader, ObjType type, int limit) {
+  uint32_t number = read32(reader);
+  if (reader->error || number >= (uint32_t)limit ||
+      loadedObjects[number]->type != type) {
+    reader->error = true;
+    return NULL;
+  }
+  return loadedObjects[number];
+}
+
+static bool readValue(Reader* reader, Value* value) {
+  switch (read8(reader)) {
+    case VALUE_NIL: *value = NIL_VAL; break;
+    case VALUE_TRUE: *value = BOOL_VAL(true); break;
+    case VALUE_FALSE: *value = BOOL_VAL(false); break;
+    case VALUE_NUMBER: {
+      uint64_t bits = read64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      *value = NUMBER_VAL(number);
+      break;
+    }
+#ifdef NAN_BOXING
+    case VALUE_SMALL_STRING: {
+      uint8_t length = read8(reader);
+      if (length > SMALL_STRING_MAX) return false;
+      const uint8_t* chars = readSpan(reader, length);
+      if (chars == NULL) return false;
+      *value = smallStringValue((const char*)chars, length);
+      break;
+    }
+#endif
+    case VALUE_OBJECT: {
+      uint32_t number = read32(reader);
+      if (reader->error || number >= (uint32_t)loadedCount) return false;
+      *value = OBJ_VAL(loadedObjects[number]);
+      break;
+    }
+    default:
+      return false;
+  }
+  return !reader->error;
+}
+
+static bool readTable(Reader* reader, Table* table) {
+  uint32_t count = read32(reader);
+  for (uint32_t i = 0; !reader->error && i < count; i++) {
+    ObjString* key = (ObjString*)readRef(reader, OBJ_STRING, loadedCount);
+    Value value;
+    if (key == NULL || !readValue(reader, &value)) return false;
+    tableSet(table, key, value);
+  }
+  return !reader->error;
+}
+
+/**
+ * 读取模块表，值必须都是模块。
+ */
+static bool readModules(Reader* reader, Table* table) {
+  uint32_t count = read32(reader);
+  for (uint32_t i = 0; !reader->error && i < count; i++) {
+    ObjString* key = (ObjString*)readRef(reader, OBJ_STRING, loadedCount);
+    Value module;
+    if (key == NULL || !readValue(reader, &module) || !IS_MODULE(module)) {
+      return false;
+    }
+    tableSet(table, key, module);
+  }
+  return !reader->error;
+}
+
+/**
+ * 按记录开头的字段创建对象。被引用的对象必须排在前面，已经创建。
+ */
+static Obj* createObject(ObjType type, Reader* record) {
+  switch (type) {
+    case OBJ_STRING: {
+      uint32_t length = read32(record);
+      const uint8_t* chars = readSpan(record, length);
+      if (chars == NULL || length > INT32_MAX) return NULL;
+      return (Obj*)copyString((const char*)chars, (int)length);
+    }
+    case OBJ_FUNCTION: {
+      uint32_t upvalueCount = read32(record);
+      if (record->error || upvalueCount > CONSTANT_LONG_MAX + 1) return NULL;
+      ObjFunction* function = newFunction();
+      function->upvalueCount = (int)upvalueCount;
+      return (Obj*)function;
+    }
+    case OBJ_NATIVE: {
+      uint32_t length = read32(record);
+      const uint8_t* name = readSpan(record, length);
+      if (name == NULL) return NULL;
+      int arity;
+      NativeFn function = findNative((const char*)name, (int)length, &arity);
+      if (function == NULL) return NULL;
+      push(OBJ_VAL(copyString((const char*)name, (int)length)));
+      ObjNative* native = newNative(function, AS_STRING(vm.stackTop[-1]), arity);
+      pop();
+      return (Obj*)native;
+    }
+    case OBJ_FOREIGN: {
+      ObjString* library = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      ObjString* symbol = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      ObjString* signature =
+          (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      if (library == NULL || symbol == NULL || signature == NULL) return NULL;
+      const char* error;
+      return (Obj*)bindForeign(library, symbol, signature, &error);
+    }
+    case OBJ_BUFFER: {
+      uint32_t length = read32(record);
+      const uint8_t* bytes = readSpan(record, length);
+      if (bytes == NULL || length > INT32_MAX) return NULL;
+      ObjBuffer* buffer = newBuffer((int)length);
+      memcpy(buffer->bytes, bytes, length);
+      return (Obj*)buffer;
+    }
+    case OBJ_STRUCT: {
+      ObjString* name = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      uint32_t fieldCount = read32(record);
+      if (name == NULL || fieldCount > UINT8_COUNT ||
+          fieldCount > (record->size - record->position) / 4) {
+        return NULL;
+      }
+      ObjStruct* type = newStruct(name, (int)fieldCount);
+      //字段名都是已经创建的字符串，填入时不再分配内存
+      for (uint32_t i = 0; i < fieldCount; i++) {
+        type->fields[i] = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      }
+      return record->error ? NULL : (Obj*)type;
+    }
+    case OBJ_CLASS: {
+      ObjString* name = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      if (name == NULL) return NULL;
+      return (Obj*)newClass(name);
+    }
+    case OBJ_UPVALUE:
+      //位置在第二遍确定：关闭的上值指向自身，打开的由协程填入
+      return (Obj*)newUpvalue(NULL);
+    case OBJ_CLOSURE: {
+      ObjFunction* function =
+          (ObjFunction*)readRef(record, OBJ_FUNCTION, loadedCount);
+      if (function == NULL) return NULL;
+      return (Obj*)newClosure(function);
+    }
+    case OBJ_INSTANCE: {
+      ObjClass* klass = (ObjClass*)readRef(record, OBJ_CLASS, loadedCount);
+      if (klass == NULL) return NULL;
+      return (Obj*)newInstance(klass);
+    }
+    case OBJ_RECORD: {
+      ObjStruct* type = (ObjStruct*)readRef(record, OBJ_STRUCT, loadedCount);
+      if (type == NULL) return NULL;
+      return (Obj*)newRecord(type);
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjClosure* method = (ObjClosure*)readRef(record, OBJ_CLOSURE, loadedCount);
+      if (method == NULL) return NULL;
+      return (Obj*)newBoundMethod(NIL_VAL, method);
+    }
+    case OBJ_FIBER:
+      //栈和调用帧在第二遍分配
+      return (Obj*)newFiber(NULL, 0);
+    case OBJ_MODULE: {
+      ObjString* path = (ObjString*)readRef(record, OBJ_STRING, loadedCount);
+      if (path == NULL) return NULL;
+      return (Obj*)newModule(path, NULL);
+    }
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * 读取记录中余下的部分，回填对象之间的引用。
+ */
+static bool fillObject(Obj* object, Reader* record) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+    case OBJ_FOREIGN:
+    case OBJ_BUFFER:
+    case OBJ_STRUCT:
+      return true;
+    case OBJ_CHANNEL:
+    case OBJ_THREAD:
+      return false;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      uint32_t name = read32(record);
+      if (name != IMAGE_NO_OBJECT) {
+        if (name >= (uint32_t)loadedCount ||
+            loadedObjects[name]->type != OBJ_STRING) {
+          return false;
+        }
+        function->name = (ObjString*)loadedObjects[name];
+      }
+      uint32_t module = read32(record);
+      if (module != IMAGE_NO_OBJECT) {
+        if (module >= (uint32_t)loadedCount ||
+            loadedObjects[module]->type != OBJ_MODULE) {
+          return false;
+        }
+        function->module = (ObjModule*)loadedObjects[module];
+      }
+      uint32_t arity = read32(record);
+      uint8_t flags = read8(record);
+      if (record->error || arity > UINT8_MAX || flags > 3) return false;
+      function->arity = (int)arity;
+      function->isMemo = (flags & 1) != 0;
+      function->isGenerator = (flags & 2) != 0;
+      if (!readChunkBody(record, &function->chunk)) return false;
+
+      uint32_t constantCount = read32(record);
+      if (constantCount > record->size - record->position) return false;
+      for (uint32_t i = 0; i < constantCount; i++) {
+        Value value;
+        if (!readValue(record, &value)) return false;
+        writeValueArray(&function->chunk.constants, value);
+      }
+      return true;
+    }
+    case OBJ_CLASS:
+      return readTable(record, &((ObjClass*)object)->methods);
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      uint8_t open = read8(record);
+      if (open > 1) return false;
+      if (open) return true;
+      upvalue->location = &upvalue->closed;
+      return readValue(record, &upvalue->closed);
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      if (read32(record) != (uint32_t)closure->upvalueCount) return false;
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        Obj* upvalue = readRef(record, OBJ_UPVALUE, loadedCount);
+        if (upvalue == NULL) return false;
+        closure->upvalues[i] = toRef(upvalue);
+      }
+      return true;
+    }
+    case OBJ_INSTANCE:
+      return readTable(record, &((ObjInstance*)object)->fields);
+    case OBJ_RECORD: {
+      ObjRecord* instance = (ObjRecord*)object;
+      if (read32(record) != (uint32_t)instance->fieldCount) return false;
+      for (int i = 0; i < instance->fieldCount; i++) {
+        if (!readValue(record, &instance->fields[i])) return false;
+      }
+      return true;
+    }
+    case OBJ_BOUND_METHOD:
+      return readValue(record, &((ObjBoundMethod*)object)->receiver);
+    case OBJ_FIBER:
+      return fillFiber((ObjFiber*)object, record);
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      module->function = (ObjFunction*)readRef(record, OBJ_FUNCTION, loadedCount);
+      if (module->function == NULL) return false;
+      if (!readTable(record, &module->globals)) return false;
+      uint8_t executed = read8(record);
+      if (record->error || executed > 1) return false;
+      module->executed = executed == 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * 恢复挂起的协程：值栈、调用帧（ip 和槽位按偏移保存）以及指向其栈槽的打开上值。
+ * 栈中的值先写入新分配的数组再挂到协程上，分配触发的 GC 不会看到未初始化的槽。
+ */
+static bool fillFiber(ObjFiber* fiber, Reader* record) {
+  uint8_t state = read8(record);
+  if (state != FIBER_NEW && state != FIBER_SUSPENDED && state != FIBER_DONE) {
+    return false;
+  }
+  uint32_t stackCount = read32(record);
+  if (record->error || stackCount > record->size - record->position) return false;
+
+  int stackCapacity = GROW_CAPACITY(0);
+  while (stackCapacity < (int)stackCount) stackCapacity = GROW_CAPACITY(stackCapacity);
+  Value* stack = ALLOCATE(Value, stackCapacity);
+  for (uint32_t i = 0; i < stackCount; i++) {
+    if (!readValue(record, &stack[i])) {
+      FREE_ARRAY(Value, stack, stackCapacity);
+      return false;
+    }
+  }
+  fiber->stack = stack;
+  fiber->stackTop = stack + stackCount;
+  fiber->stackCapacity = stackCapacity;
+  fiber->state = (FiberState)state;
+
+  uint32_t frameCount = read32(record);
+  if (record->error || frameCount > record->size - record->position) return false;
+  int frameCapacity = frameCount > 0 ? (int)frameCount : 1;
+  fiber->frames = ALLOCATE(CallFrame, frameCapacity);
+  fiber->frameCapacity = frameCapacity;
+  for (uint32_t i = 0; i < frameCount; i++) {
+    ObjClosure* closure = (ObjClosure*)readRef(record, OBJ_CLOSURE, loadedCount);
+    uint32_t ip = read32(record);
+    uint32_t slots = read32(record);
+    //函数记录排在协程之前，此时代码已经读入
+    if (closure == NULL || ip >= (uint32_t)closure->function->chunk.count ||
+        slots >= stackCount) {
+      return false;
+    }
+    CallFrame* frame = &fiber->frames[i];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code + ip;
+    frame->slots = stack + slots;
+    frame->memo = NULL;
+    fiber->frameCount = (int)i + 1;
+  }
+
+  uint32_t openCount = read32(record);
+  ObjUpvalue** link = &fiber->openUpvalues;
+  for (uint32_t i = 0; !record->error && i < openCount; i++) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)readRef(record, OBJ_UPVALUE, loadedCount);
+    uint32_t slot = read32(record);
+    if (upvalue == NULL || upvalue->location != NULL || slot >= stackCount) {
+      return false;
+    }
+    upvalue->location = stack + slot;
+    *link = upvalue;
+    link = &upvalue->next;
+  }
+  return !record->error;
+}
+
+/**
+ * 校验恢复的协程能从保存的位置继续执行：新协程只有入口帧，停在第一条指令；
+ * 已结束的协程没有调用帧；挂起的协程最上层的帧停在 yield 之后，其余的帧停在调用指令之后。
+ * 每一帧的栈槽在上一帧之后，槽 0 是帧的闭包，方法和初始化器中是接收者实例。
+ */
+static bool verifyFiber(ObjFiber* fiber) {
+  if (fiber->state == FIBER_DONE) return fiber->frameCount == 0;
+  if (fiber->frameCount == 0) return false;
+  if (fiber->state == FIBER_NEW && fiber->frameCount != 1) return false;
+
+  for (int i = 0; i < fiber->frameCount; i++) {
+    CallFrame* frame = &fiber->frames[i];
+    if (i > 0 && frame->slots <= fiber->frames[i - 1].slots) return false;
+    Value callee = frame->slots[0];
+    if (!IS_INSTANCE(callee) &&
+        !(IS_CLOSURE(callee) && AS_CLOSURE(callee) == frame->closure)) {
+      return false;
+    }
+
+    Chunk* chunk = &frame->closure->function->chunk;
+    int offset = (int)(frame->ip - chunk->code);
+    if (fiber->state == FIBER_NEW) {
+      if (offset != 0) return false;
+      continue;
+    }
+    int previous = instructionBefore(chunk, offset);
+    if (i == fiber->frameCount - 1) {
+      if (previous != OP_YIELD) return false;
+      continue;
+    }
+    switch (previous) {
+      case OP_CALL:
+      case OP_CALL_CLOSURE:
+      case OP_INVOKE:
+      case OP_INVOKE_LONG:
+      case OP_SUPER_INVOKE:
+      case OP_SUPER_INVOKE_LONG:
+      case OP_IMPORT:
+      case OP_IMPORT_LONG:
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * 返回恰好在 offset 处结束的那条指令的操作码。代码必须已经通过校验。
+ *
+ * @return offset 不是指令边界或者是第一条指令时返回 -1
+ */
+static int instructionBefore(Chunk* chunk, int offset) {
+  if (offset <= 0 || offset >= chunk->count) return -1;
+  uint8_t* starts = instructionStarts(chunk);
+  int start = -1;
+  if (starts[offset]) {
+    start = offset - 1;
+    while (!starts[start]) start--;
+  }
+  FREE_ARRAY(uint8_t, starts, chunk->count);
+  return start < 0 ? -1 : chunk->code[start];
+}
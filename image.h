@@ -0,0 +1,17 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 堆镜像格式版本，对象布局或字节码格式有任何变化都要加一 */
+#define IMAGE_VERSION 3
+
+
+bool saveImage(const char* path);
+bool loadImage(const char* path);
+void markImageRoots();
+
+#endif // clox_image_h
@@ -0,0 +1,806 @@
+#define _GNU_SOURCE   //pipe2、accept4
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "memory.h"
+#include "region.h"
+#include "vm.h"
+
+/*
+ * 非阻塞 I/O 和事件循环。
+ *
+ * pipe、open、listen、connect、accept 创建的文件描述符都是非阻塞的：
+ * read 和 accept 在没有数据时返回 nil，write 返回实际写入的字节数，不会阻塞线程。
+ * 等待用 epoll：
+ *   onReadable(fd, callback)、onWritable(fd, callback)  fd 就绪时调用一次 callback(fd)
+ *   setTimeout(ms, callback)                            ms 毫秒后调用一次 callback(nil)
+ *   runLoop()                                           分派事件，直到没有登记的回调
+ * 回调是一次性的，需要继续等待时在回调中重新登记。事件可能是虚假的，
+ * read 或 accept 返回 nil 时重新等待即可。
+ *
+ * 回调也可以是协程：就绪时由事件循环恢复它。协程 yield readable(fd)、
+ * writable(fd) 或 sleep(ms) 时，事件循环替它登记，就绪后从 yield 处继续，
+ * 相当于 await：
+ *   fun echo(conn) {
+ *     var data = read(conn);
+ *     while (data == nil) { yield readable(conn); data = read(conn); }
+ *     ...
+ *   }
+ *   setTimeout(0, echo(conn));
+ * yield 其他值时协程保持挂起，由脚本自己 resume。
+ *
+ * 普通文件不能加入 epoll，它们总是就绪，回调在下一轮循环中直接调用。
+ * 事件循环属于虚拟机，每个隔离区和工作线程有自己的循环。
+ */
+
+//等待请求的种类，readable、writable、sleep 返回的 Wait(kind, value) 中的 kind
+typedef enum {
+  WAIT_READABLE,
+  WAIT_WRITABLE,
+  WAIT_TIMER,
+} WaitKind;
+
+typedef struct {
+  Value readable;     //可读时调用的回调，没有时为 nil
+  Value writable;     //可写时调用的回调
+  uint32_t events;    //已经向 epoll 登记的事件
+  bool polled;        //fd 已经加入 epoll
+  bool alwaysReady;   //普通文件，不经 epoll，总是就绪
+} Watcher;
+
+typedef struct {
+  double deadline;    //到期时间，CLOCK_MONOTONIC 毫秒
+  uint64_t sequence;  //同时到期的定时器按登记的顺序触发
+  Value callback;
+} Timer;
+
+struct EventLoop {
+  int epoll;
+  Watcher* watchers;      //以 fd 为下标
+  int watcherCapacity;
+  int pending;            //登记在 fd 上的回调个数
+  int readyFiles;         //其中登记在普通文件上的个数，不为 0 时 epoll_wait 不等待
+  Timer* timers;          //按到期时间排列的最小堆
+  int timerCount;
+  int timerCapacity;
+  uint64_t timerSequence;
+  ObjStruct* waitType;    //Wait(kind, value)
+  ObjStruct* pipeType;    //Pipe(read, write)
+};
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static EventLoop* getLoop();
+static ObjStruct* makeStruct(const char* name, const char* first,
+                             const char* second);
+static bool fdArgument(VM* context, Value value, int* fd);
+static bool addressArgument(VM* context, int argCount, Value* args,
+                            struct sockaddr_in* address);
+static void ignoreBrokenPipe();
+static double now();
+static Watcher* watcherFor(EventLoop* loop, int fd);
+static bool updateInterest(EventLoop* loop, int fd);
+static bool watch(VM* context, int fd, bool readable, Value callback);
+static void forget(EventLoop* loop, int fd);
+static bool fire(VM* context, EventLoop* loop, int fd, bool readable);
+static void addTimer(EventLoop* loop, double ms, Value callback);
+static Value popTimer(EventLoop* loop);
+static bool timerBefore(Timer* a, Timer* b);
+static Value waitRequest(VM* context, WaitKind kind, double value);
+static bool invokeCallback(VM* context, Value callback, Value argument);
+static bool await(VM* context, ObjFiber* fiber, Value request);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+void markEventLoop() {
+  EventLoop* loop = vm.loop;
+  if (loop == NULL) return;
+  markObject((Obj*)loop->waitType);
+  markObject((Obj*)loop->pipeType);
+  for (int i = 0; i < loop->watcherCapacity; i++) {
+    markValue(loop->watchers[i].readable);
+    markValue(loop->watchers[i].writable);
+  }
+  for (int i = 0; i < loop->timerCount; i++) {
+    markValue(loop->timers[i].callback);
+  }
+}
+
+/**
+ * 离开区域时改写事件循环中对区域对象的引用。
+ */
+void forwardEventLoop() {
+  EventLoop* loop = vm.loop;
+  if (loop == NULL) return;
+  loop->waitType = (ObjStruct*)forwardObject((Obj*)loop->waitType);
+  loop->pipeType = (ObjStruct*)forwardObject((Obj*)loop->pipeType);
+  for (int i = 0; i < loop->watcherCapacity; i++) {
+    loop->watchers[i].readable = forwardValue(loop->watchers[i].readable);
+    loop->watchers[i].writable = forwardValue(loop->watchers[i].writable);
+  }
+  for (int i = 0; i < loop->timerCount; i++) {
+    loop->timers[i].callback = forwardValue(loop->timers[i].callback);
+  }
+}
+
+/**
+ * 释放事件循环。登记的回调被丢弃，脚本打开的文件描述符不关闭。
+ */
+void freeEventLoop() {
+  EventLoop* loop = vm.loop;
+  if (loop == NULL) return;
+  close(loop->epoll);
+  free(loop->watchers);
+  free(loop->timers);
+  free(loop);
+  vm.loop = NULL;
+}
+
+/**
+ * pipe()：创建管道，返回 Pipe(read, write)。
+ */
+bool pipeNative(VM* vm, int argCount, Value* args, Value* result) {
+  EventLoop* loop = getLoop();
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return nativeError(vm, "Could not create pipe: %s", strerror(errno));
+  }
+  ObjRecord* record = newRecord(loop->pipeType);
+  record->fields[0] = NUMBER_VAL(fds[0]);
+  record->fields[1] = NUMBER_VAL(fds[1]);
+  *result = OBJ_VAL(record);
+  return true;
+}
+
+/**
+ * open(path, mode)：打开文件，mode 为 "r"、"w"（截断）或 "a"（追加）。
+ */
+bool openNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_ANY_STRING(args[0]) || !IS_ANY_STRING(args[1])) {
+    return nativeError(vm, "Path and mode must be strings.");
+  }
+  char pathBuffer[SMALL_STRING_MAX + 1];
+  char modeBuffer[SMALL_STRING_MAX + 1];
+  int length;
+  const char* path = stringChars(args[0], pathBuffer, &length);
+  const char* mode = stringChars(args[1], modeBuffer, &length);
+  int flags;
+  if (strcmp(mode, "r") == 0) {
+    flags = O_RDONLY;
+  } else if (strcmp(mode, "w") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (strcmp(mode, "a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    return nativeError(vm, "Mode must be \"r\", \"w\" or \"a\".");
+  }
+
+  int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return nativeError(vm, "Could not open \"%s\": %s", path, strerror(errno));
+  }
+  *result = NUMBER_VAL(fd);
+  return true;
+}
+
+/**
+ * listen(port[, host])：在 host 的 port 端口上监听 TCP 连接，返回监听的 fd。
+ * port 为 0 时由系统选择端口，用 localPort 查询。
+ */
+bool listenNative(VM* vm, int argCount, Value* args, Value* result) {
+  struct sockaddr_in address;
+  if (!addressArgument(vm, argCount, args, &address)) return false;
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return nativeError(vm, "Could not create socket: %s", strerror(errno));
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    int error = errno;
+    close(fd);
+    return nativeError(vm, "Could not listen on port %d: %s",
+                       ntohs(address.sin_port), strerror(error));
+  }
+  *result = NUMBER_VAL(fd);
+  return true;
+}
+
+/**
+ * connect(port[, host])：发起 TCP 连接，立即返回 fd。
+ * 连接建立时 fd 可写；连接失败的错误在之后的 read 或 write 中报告。
+ */
+bool connectNative(VM* vm, int argCount, Value* args, Value* result) {
+  struct sockaddr_in address;
+  if (!addressArgument(vm, argCount, args, &address)) return false;
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return nativeError(vm, "Could not create socket: %s", strerror(errno));
+  }
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 &&
+      errno != EINPROGRESS) {
+    int error = errno;
+    close(fd);
+    return nativeError(vm, "Could not connect to port %d: %s",
+                       ntohs(address.sin_port), strerror(error));
+  }
+  *result = NUMBER_VAL(fd);
+  return true;
+}
+
+/**
+ * accept(fd)：接受一个连接，返回新的 fd；没有等待中的连接时返回 nil。
+ */
+bool acceptNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  int connection = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (connection < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ||
+        errno == EINTR) {
+      *result = NIL_VAL;
+      return true;
+    }
+    return nativeError(vm, "Could not accept: %s", strerror(errno));
+  }
+  *result = NUMBER_VAL(connection);
+  return true;
+}
+
+/**
+ * localPort(fd)：套接字绑定的本地端口。
+ */
+bool localPortNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getsockname(fd, (struct sockaddr*)&address, &length) != 0 ||
+      address.sin_family != AF_INET) {
+    return nativeError(vm, "fd %d is not a bound socket.", fd);
+  }
+  *result = NUMBER_VAL(ntohs(address.sin_port));
+  return true;
+}
+
+/**
+ * read(fd[, max])：读取最多 max 个字节（默认 IO_READ_SIZE）。
+ * 返回读到的字符串；没有数据时返回 nil；文件结束或对端关闭时返回 ""。
+ */
+bool readNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (argCount < 1 || argCount > 2) {
+    return nativeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+  }
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  int max = IO_READ_SIZE;
+  if (argCount == 2) {
+    double number = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : 0;
+    if (number < 1 || number > INT32_MAX || number != (double)(int)number) {
+      return nativeError(vm, "Read size must be a positive integer.");
+    }
+    max = (int)number;
+  }
+
+  char stackBuffer[IO_READ_SIZE];
+  char* buffer = max <= IO_READ_SIZE ? stackBuffer : (char*)malloc(max);
+  if (buffer == NULL) return nativeError(vm, "Read size is too large.");
+  ssize_t count;
+  do {
+    count = read(fd, buffer, max);
+  } while (count < 0 && errno == EINTR);
+
+  bool ok = true;
+  if (count >= 0) {
+    *result = stringValue(buffer, (int)count);
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    *result = NIL_VAL;
+  } else {
+    ok = nativeError(vm, "Could not read fd %d: %s", fd, strerror(errno));
+  }
+  if (buffer != stackBuffer) free(buffer);
+  return ok;
+}
+
+/**
+ * write(fd, string)：写入尽量多的字节，返回写入的字节数；写不进时返回 0。
+ */
+bool writeNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  if (!IS_ANY_STRING(args[1])) return nativeError(vm, "Can only write strings.");
+  char smallBuffer[SMALL_STRING_MAX + 1];
+  int length;
+  const char* chars = stringChars(args[1], smallBuffer, &length);
+
+  //对端关闭后写入管道或套接字时报告 EPIPE，而不是让进程收到 SIGPIPE 退出
+  ignoreBrokenPipe();
+  ssize_t count;
+  do {
+    count = write(fd, chars, length);
+  } while (count < 0 && errno == EINTR);
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return nativeError(vm, "Could not write fd %d: %s", fd, strerror(errno));
+    }
+    count = 0;
+  }
+  *result = NUMBER_VAL((double)count);
+  return true;
+}
+
+/**
+ * close(fd)：关闭文件描述符，丢弃登记在它上面的回调。
+ */
+bool closeNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  if (vm->loop != NULL && fd < vm->loop->watcherCapacity) forget(vm->loop, fd);
+  if (close(fd) != 0) {
+    return nativeError(vm, "Could not close fd %d: %s", fd, strerror(errno));
+  }
+  *result = NIL_VAL;
+  return true;
+}
+
+/**
+ * onReadable(fd, callback)：fd 可读（或对端关闭、出错）时调用一次 callback(fd)。
+ * 每个 fd 同时只能登记一个可读回调。
+ */
+bool onReadableNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  *result = NIL_VAL;
+  return watch(vm, fd, true, args[1]);
+}
+
+/**
+ * onWritable(fd, callback)：fd 可写时调用一次 callback(fd)。
+ */
+bool onWritableNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  *result = NIL_VAL;
+  return watch(vm, fd, false, args[1]);
+}
+
+/**
+ * setTimeout(ms, callback)：ms 毫秒后调用一次 callback(nil)。
+ */
+bool setTimeoutNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+    return nativeError(vm, "Timeout must be a non-negative number.");
+  }
+  addTimer(getLoop(), AS_NUMBER(args[0]), args[1]);
+  *result = NIL_VAL;
+  return true;
+}
+
+/**
+ * readable(fd)：等待请求，协程 yield 它以等待 fd 可读，恢复时得到 fd。
+ */
+bool readableNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  *result = waitRequest(vm, WAIT_READABLE, fd);
+  return true;
+}
+
+/**
+ * writable(fd)：等待请求，协程 yield 它以等待 fd 可写，恢复时得到 fd。
+ */
+bool writableNative(VM* vm, int argCount, Value* args, Value* result) {
+  int fd = -1;
+  if (!fdArgument(vm, args[0], &fd)) return false;
+  *result = waitRequest(vm, WAIT_WRITABLE, fd);
+  return true;
+}
+
+/**
+ * sleep(ms)：等待请求，协程 yield 它以等待 ms 毫秒，恢复时得到 nil。
+ */
+bool sleepNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+    return nativeError(vm, "Sleep time must be a non-negative number.");
+  }
+  *result = waitRequest(vm, WAIT_TIMER, AS_NUMBER(args[0]));
+  return true;
+}
+
+/**
+ * runLoop()：分派 I/O 事件和到期的定时器，直到没有登记的回调和定时器。
+ * 回调抛出的异常结束循环，在 runLoop() 调用处重新抛出，其余的回调保留。
+ */
+bool runLoopNative(VM* vm, int argCount, Value* args, Value* result) {
+  EventLoop* loop = getLoop();
+  struct epoll_event events[IO_EVENTS_MAX];
+
+  while (loop->pending > 0 || loop->timerCount > 0) {
+    int timeout = -1;
+    if (loop->readyFiles > 0) {
+      timeout = 0;
+    } else if (loop->timerCount > 0) {
+      double wait = loop->timers[0].deadline - now();
+      timeout = wait <= 0 ? 0 : (int)ceil(wait);
+    }
+
+    int count = 0;
+    if (loop->pending > loop->readyFiles) {
+      count = epoll_wait(loop->epoll, events, IO_EVENTS_MAX, timeout);
+      if (count < 0) {
+        if (errno == EINTR) continue;
+        return nativeError(vm, "epoll_wait failed: %s", strerror(errno));
+      }
+    } else if (timeout > 0) {
+      //只有定时器：睡到最早的定时器到期
+      struct timespec delay = {timeout / 1000, (timeout % 1000) * 1000000L};
+      nanosleep(&delay, NULL);
+    }
+
+    //回调可能登记新的 fd 使 watchers 扩容，每次都重新取 Watcher
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      uint32_t ready = events[i].events;
+      if ((ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+          fd < loop->watcherCapacity &&
+          !IS_NIL(loop->watchers[fd].readable)) {
+        if (!fire(vm, loop, fd, true)) return false;
+      }
+      if ((ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+          fd < loop->watcherCapacity &&
+          !IS_NIL(loop->watchers[fd].writable)) {
+        if (!fire(vm, loop, fd, false)) return false;
+      }
+    }
+
+    if (loop->readyFiles > 0) {
+      for (int fd = 0; fd < loop->watcherCapacity; fd++) {
+        if (!loop->watchers[fd].alwaysReady) continue;
+        if (!IS_NIL(loop->watchers[fd].readable) && !fire(vm, loop, fd, true)) {
+          return false;
+        }
+        if (!IS_NIL(loop->watchers[fd].writable) && !fire(vm, loop, fd, false)) {
+          return false;
+        }
+      }
+    }
+
+    //只触发这一轮之前到期的定时器，回调中登记的 0 毫秒定时器留到下一轮，
+    //不会饿死 I/O
+    double current = now();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= current) {
+      Value callback = popTimer(loop);
+      if (!invokeCallback(vm, callback, NIL_VAL)) return false;
+    }
+  }
+  *result = NIL_VAL;
+  return true;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+static EventLoop* getLoop() {
+  if (vm.loop != NULL) return vm.loop;
+
+  EventLoop* loop = (EventLoop*)malloc(sizeof(EventLoop));
+  if (loop == NULL) exit(1);
+  loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll < 0) {
+    fprintf(stderr, "Could not create epoll instance: %s\n", strerror(errno));
+    exit(74);
+  }
+  loop->watchers = NULL;
+  loop->watcherCapacity = 0;
+  loop->pending = 0;
+  loop->readyFiles = 0;
+  loop->timers = NULL;
+  loop->timerCount = 0;
+  loop->timerCapacity = 0;
+  loop->timerSequence = 0;
+  loop->waitType = NULL;
+  loop->pipeType = NULL;
+  //先挂到虚拟机上，创建结构体描述时触发的 GC 会标记已经创建的部分
+  vm.loop = loop;
+  loop->waitType = makeStruct("Wait", "kind", "value");
+  loop->pipeType = makeStruct("Pipe", "read", "write");
+  return loop;
+}
+
+static ObjStruct* makeStruct(const char* name, const char* first,
+                             const char* second) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  ObjStruct* type = newStruct(AS_STRING(vm.stackTop[-1]), 2);
+  push(OBJ_VAL(type));
+  type->fields[0] = copyString(first, (int)strlen(first));
+  writeBarrier((Obj*)type, OBJ_VAL(type->fields[0]));
+  type->fields[1] = copyString(second, (int)strlen(second));
+  writeBarrier((Obj*)type, OBJ_VAL(type->fields[1]));
+  pop();
+  pop();
+  return type;
+}
+
+static bool fdArgument(VM* context, Value value, int* fd) {
+  double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+  if (number < 0 || number > INT32_MAX || number != (double)(int)number) {
+    return nativeError(context, "Expected a file descriptor.");
+  }
+  *fd = (int)number;
+  return true;
+}
+
+/**
+ * 解析 (port[, host]) 参数。
+ */
+static bool addressArgument(VM* context, int argCount, Value* args,
+                            struct sockaddr_in* address) {
+  if (argCount < 1 || argCount > 2) {
+    return nativeError(context, "Expected 1 or 2 arguments but got %d.",
+                       argCount);
+  }
+  double port = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+  if (port < 0 || port > 65535 || port != (double)(int)port) {
+    return nativeError(context, "Port must be an integer between 0 and 65535.");
+  }
+
+  memset(address, 0, sizeof(*address));
+  address->sin_family = AF_INET;
+  address->sin_port = htons((uint16_t)port);
+  const char* host = IO_DEFAULT_HOST;
+  char hostBuffer[SMALL_STRING_MAX + 1];
+  if (argCount == 2) {
+    if (!IS_ANY_STRING(args[1])) return nativeError(context, "Host must be a string.");
+    int length;
+    host = stringChars(args[1], hostBuffer, &length);
+  }
+  if (inet_pton(AF_INET, host, &address->sin_addr) != 1) {
+    return nativeError(context, "Invalid IPv4 address \"%s\".", host);
+  }
+  return true;
+}
+
+static void ignoreSignal() {
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void ignoreBrokenPipe() {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, ignoreSignal);
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+static Watcher* watcherFor(EventLoop* loop, int fd) {
+  if (fd >= loop->watcherCapacity) {
+    int capacity = loop->watcherCapacity < 64 ? 64 : loop->watcherCapacity;
+    while (capacity <= fd) capacity *= 2;
+    Watcher* watchers = (Watcher*)realloc(loop->watchers,
+                                          sizeof(Watcher) * capacity);
+    if (watchers == NULL) exit(1);
+    for (int i = loop->watcherCapacity; i < capacity; i++) {
+      watchers[i].readable = NIL_VAL;
+      watchers[i].writable = NIL_VAL;
+      watchers[i].events = 0;
+      watchers[i].polled = false;
+      watchers[i].alwaysReady = false;
+    }
+    loop->watchers = watchers;
+    loop->watcherCapacity = capacity;
+  }
+  return &loop->watchers[fd];
+}
+
+/**
+ * 让 epoll 中登记的事件与 fd 上的回调一致。
+ *
+ * @return epoll_ctl 失败时返回 false，errno 说明原因
+ */
+static bool updateInterest(EventLoop* loop, int fd) {
+  Watcher* watcher = &loop->watchers[fd];
+  uint32_t events = (IS_NIL(watcher->readable) ? 0 : EPOLLIN) |
+                    (IS_NIL(watcher->writable) ? 0 : EPOLLOUT);
+  if (events == watcher->events && (events == 0 || watcher->polled)) {
+    return true;
+  }
+
+  if (events == 0) {
+    //保留在 epoll 中会继续报告水平触发的事件；fd 已经关闭时删除失败也无妨
+    if (watcher->polled) epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, NULL);
+    watcher->polled = false;
+    watcher->events = 0;
+    return true;
+  }
+  struct epoll_event event;
+  event.events = events;
+  event.data.u64 = 0;
+  event.data.fd = fd;
+  int op = watcher->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(loop->epoll, op, fd, &event) != 0) return false;
+  watcher->polled = true;
+  watcher->events = events;
+  return true;
+}
+
+static bool watch(VM* context, int fd, bool readable, Value callback) {
+  EventLoop* loop = getLoop();
+  Watcher* watcher = watcherFor(loop, fd);
+  Value* slot = readable ? &watcher->readable : &watcher->writable;
+  if (!IS_NIL(*slot)) {
+    return nativeError(context, "fd %d already has a %s callback.", fd,
+                       readable ? "readable" : "writable");
+  }
+  if (IS_NIL(callback)) return nativeError(context, "Callback can't be nil.");
+
+  *slot = callback;
+  loop->pending++;
+  if (watcher->alwaysReady) {
+    loop->readyFiles++;
+    return true;
+  }
+  if (!updateInterest(loop, fd)) {
+    if (errno == EPERM) {
+      //普通文件和目录不支持 epoll
+      watcher->alwaysReady = true;
+      loop->readyFiles++;
+      return true;
+    }
+    int error = errno;
+    *slot = NIL_VAL;
+    loop->pending--;
+    return nativeError(context, "Can't watch fd %d: %s", fd, strerror(error));
+  }
+  return true;
+}
+
+/**
+ * 丢弃 fd 上的回调并把它移出 epoll，在关闭 fd 之前调用。
+ */
+static void forget(EventLoop* loop, int fd) {
+  Watcher* watcher = &loop->watchers[fd];
+  int callbacks = (IS_NIL(watcher->readable) ? 0 : 1) +
+                  (IS_NIL(watcher->writable) ? 0 : 1);
+  loop->pending -= callbacks;
+  if (watcher->alwaysReady) loop->readyFiles -= callbacks;
+  watcher->readable = NIL_VAL;
+  watcher->writable = NIL_VAL;
+  updateInterest(loop, fd);
+  watcher->alwaysReady = false;
+}
+
+/**
+ * 取下 fd 上的一次性回调并调用它。
+ */
+static bool fire(VM* context, EventLoop* loop, int fd, bool readable) {
+  Watcher* watcher = &loop->watchers[fd];
+  Value* slot = readable ? &watcher->readable : &watcher->writable;
+  Value callback = *slot;
+  *slot = NIL_VAL;
+  loop->pending--;
+  if (watcher->alwaysReady) {
+    loop->readyFiles--;
+  } else {
+    updateInterest(loop, fd);
+  }
+  return invokeCallback(context, callback, NUMBER_VAL(fd));
+}
+
+static void addTimer(EventLoop* loop, double ms, Value callback) {
+  if (loop->timerCount == loop->timerCapacity) {
+    loop->timerCapacity = loop->timerCapacity < 8 ? 8 : loop->timerCapacity * 2;
+    loop->timers = (Timer*)realloc(loop->timers,
+                                   sizeof(Timer) * loop->timerCapacity);
+    if (loop->timers == NULL) exit(1);
+  }
+  Timer timer = {now() + ms, loop->timerSequence++, callback};
+
+  //上浮
+  int index = loop->timerCount++;
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!timerBefore(&timer, &loop->timers[parent])) break;
+    loop->timers[index] = loop->timers[parent];
+    index = parent;
+  }
+  loop->timers[index] = timer;
+}
+
+static Value popTimer(EventLoop* loop) {
+  Value callback = loop->timers[0].callback;
+  Timer last = loop->timers[--loop->timerCount];
+
+  //下沉
+  int index = 0;
+  for (;;) {
+    int child = index * 2 + 1;
+    if (child >= loop->timerCount) break;
+    if (child + 1 < loop->timerCount &&
+        timerBefore(&loop->timers[child + 1], &loop->timers[child])) {
+      child++;
+    }
+    if (!timerBefore(&loop->timers[child], &last)) break;
+    loop->timers[index] = loop->timers[child];
+    index = child;
+  }
+  if (loop->timerCount > 0) loop->timers[index] = last;
+  return callback;
+}
+
+static bool timerBefore(Timer* a, Timer* b) {
+  if (a->deadline != b->deadline) return a->deadline < b->deadline;
+  return a->sequence < b->sequence;
+}
+
+static Value waitRequest(VM* context, WaitKind kind, double value) {
+  ObjRecord* request = newRecord(getLoop()->waitType);
+  request->fields[0] = NUMBER_VAL(kind);
+  request->fields[1] = NUMBER_VAL(value);
+  return OBJ_VAL(request);
+}
+
+/**
+ * 调用回调或恢复协程。协程 yield 等待请求时替它登记。
+ */
+static bool invokeCallback(VM* context, Value callback, Value argument) {
+  //回调已经从 watchers 或定时器中取下，压栈防止被回收
+  push(callback);
+  bool ok;
+  Value result;
+  if (IS_FIBER(callback)) {
+    ObjFiber* fiber = AS_FIBER(callback);
+    if (fiber->state == FIBER_DONE) {
+      ok = nativeError(context, "Can't resume a finished fiber.");
+    } else if (fiber->state == FIBER_RUNNING) {
+      ok = nativeError(context, "Fiber is already running.");
+    } else {
+      ok = resumeFiber(fiber, argument, &result) == INTERPRET_OK;
+      if (ok && fiber->state != FIBER_DONE) ok = await(context, fiber, result);
+    }
+  } else {
+    ok = callClosure(context, callback, 1, &argument, &result);
+  }
+  pop();
+  return ok;
+}
+
+static bool await(VM* context, ObjFiber* fiber, Value request) {
+  if (!IS_RECORD(request) || AS_RECORD(request)->type != vm.loop->waitType) {
+    return true;
+  }
+  ObjRecord* record = AS_RECORD(request);
+  WaitKind kind = (WaitKind)AS_NUMBER(record->fields[0]);
+  double value = AS_NUMBER(record->fields[1]);
+  if (kind == WAIT_TIMER) {
+    addTimer(vm.loop, value, OBJ_VAL(fiber));
+    return true;
+  }
+  return watch(context, (int)value, kind == WAIT_READABLE, OBJ_VAL(fiber));
+}
@@ -0,0 +1,39 @@
+#ifndef clox_io_h
+#define clox_io_h
+
+#include "common.h"
+#include "object.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* read(fd) 不指定长度时一次最多读取的字节数 */
+#define IO_READ_SIZE 4096
+/* 一次 epoll_wait 最多取回的事件数 */
+#define IO_EVENTS_MAX 64
+/* listen 和 connect 不指定地址时使用的地址 */
+#define IO_DEFAULT_HOST "127.0.0.1"
+
+
+void markEventLoop();
+void forwardEventLoop();
+void freeEventLoop();
+
+bool pipeNative(VM* vm, int argCount, Value* args, Value* result);
+bool openNative(VM* vm, int argCount, Value* args, Value* result);
+bool listenNative(VM* vm, int argCount, Value* args, Value* result);
+bool connectNative(VM* vm, int argCount, Value* args, Value* result);
+bool acceptNative(VM* vm, int argCount, Value* args, Value* result);
+bool localPortNative(VM* vm, int argCount, Value* args, Value* result);
+bool readNative(VM* vm, int argCount, Value* args, Value* result);
+bool writeNative(VM* vm, int argCount, Value* args, Value* result);
+bool closeNative(VM* vm, int argCount, Value* args, Value* result);
+bool onReadableNative(VM* vm, int argCount, Value* args, Value* result);
+bool onWritableNative(VM* vm, int argCount, Value* args, Value* result);
+bool setTimeoutNative(VM* vm, int argCount, Value* args, Value* result);
+bool readableNative(VM* vm, int argCount, Value* args, Value* result);
+bool writableNative(VM* vm, int argCount, Value* args, Value* result);
+bool sleepNative(VM* vm, int argCount, Value* args, Value* result);
+bool runLoopNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif // clox_io_h
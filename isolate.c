@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isolate.h"
+#include "compiler.h"
+#include "memory.h"
+
+#ifndef COMPRESSED_REFS
+//冻结过程中收集到的对象
+typedef struct {
+  Obj** objects;
+  int count;
+  int capacity;
+} FrozenList;
+#endif
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+//压缩引用下不能共享代码，这些函数只在共享的实现中使用
+#ifndef COMPRESSED_REFS
+#ifdef LAZY_COMPILE
+static bool compileBodies(ObjFunction* function);
+#endif
+static bool freezeObject(Obj* object, FrozenList* list);
+static void appendFrozen(FrozenList* list, Obj* object);
+static void thaw(FrozenList* list);
+static void unlinkFrozen(FrozenList* list);
+#endif
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 在当前虚拟机中编译脚本并冻结，得到可以在隔离区之间共享的代码。
+ *
+ * 冻结的对象置于 SPACE_FROZEN，并从当前虚拟机的对象表中摘下：
+ * 任何隔离区的 GC 都视它们为已标记，不写共享内存，也不会回收它们。
+ * 因此冻结的对象图必须是闭合的：函数、字符串和结构体描述，不能含有
+ * memo 函数（缓存可变）或模块中的函数（全局变量表可变）。共享的函数
+ * 执行时不做指令特化；import 需要在各个隔离区中加载模块，冻结的脚本中不可用。
+ *
+ * 冻结的对象仍然在当前虚拟机的内存池中，当前虚拟机必须在所有使用它的
+ * 隔离区释放之后才能释放。
+ *
+ * @return 编译错误或代码不能共享时返回 NULL，错误已经打印
+ */
+SharedCode* compileShared(const char* source) {
+#ifdef COMPRESSED_REFS
+  //压缩引用是相对各自内存池的偏移，无法指向其他隔离区的内存池
+  fprintf(stderr, "Shared code is not supported with COMPRESSED_REFS.\n");
+  return NULL;
+#else
+  ObjFunction* function = compileScript(source);
+  if (function == NULL) return NULL;
+
+  push(OBJ_VAL(function));
+#ifdef LAZY_COMPILE
+  //冻结之后不能再编译函数体；编译会分配内存，必须在冻结之前完成
+  if (!compileBodies(function)) {
+    pop();
+    return NULL;
+  }
+#endif
+  FrozenList list = {NULL, 0, 0};
+  bool ok = freezeObject((Obj*)function, &list);
+  pop();
+  if (!ok) {
+    thaw(&list);
+    fprintf(stderr, "Script can't be shared between isolates.\n");
+    return NULL;
+  }
+  unlinkFrozen(&list);
+
+  SharedCode* code = (SharedCode*)malloc(sizeof(SharedCode));
+  if (code == NULL) exit(1);
+  code->function = function;
+  //多分配一个，没有字符串时也不是零长度的分配
+  code->strings = (ObjString**)malloc(sizeof(ObjString*) * (list.count + 1));
+  if (code->strings == NULL) exit(1);
+  code->stringCount = 0;
+  for (int i = 0; i < list.count; i++) {
+    if (list.objects[i]->type == OBJ_STRING) {
+      code->strings[code->stringCount++] = (ObjString*)list.objects[i];
+    }
+  }
+  free(list.objects);
+  return code;
+#endif
+}
+
+/**
+ * 释放共享代码的描述。冻结的对象随编译它的虚拟机的内存池一起释放。
+ */
+void freeSharedCode(SharedCode* code) {
+  free(code->strings);
+  free(code);
+}
+
+/**
+ * 创建隔离区。新的虚拟机在当前线程上初始化，然后换回原来的状态，
+ * 创建之后需要 enterIsolate 才能使用。
+ *
+ * @param code 隔离区要执行的共享代码，可以为 NULL
+ */
+Isolate* newIsolate(SharedCode* code) {
+  Isolate* isolate = (Isolate*)malloc(sizeof(Isolate));
+  if (isolate == NULL) exit(1);
+  isolate->saved = vm;
+  isolate->savedHeap = currentHeap();
+
+  if (code != NULL) {
+    initSharedVM(code->strings, code->stringCount);
+  } else {
+    initVM();
+  }
+
+  isolate->vm = vm;
+  isolate->heap = currentHeap();
+  vm = isolate->saved;
+  switchHeap(isolate->savedHeap);
+  return isolate;
+}
+
+/**
+ * 把隔离区换到当前线程上，之后的 API 调用都作用于它。
+ * 一个隔离区同一时间只能在一个线程上进入。
+ */
+void enterIsolate(Isolate* isolate) {
+  isolate->saved = vm;
+  isolate->savedHeap = currentHeap();
+  vm = isolate->vm;
+  switchHeap(isolate->heap);
+}
+
+/**
+ * 离开隔离区，恢复进入之前当前线程上的状态。
+ */
+void leaveIsolate(Isolate* isolate) {
+  isolate->vm = vm;
+  isolate->heap = currentHeap();
+  vm = isolate->saved;
+  switchHeap(isolate->savedHeap);
+}
+
+/**
+ * 释放隔离区的堆和全部对象。隔离区不能处于进入状态。
+ */
+void freeIsolate(Isolate* isolate) {
+  enterIsolate(isolate);
+  freeVM();
+  vm = isolate->saved;
+  switchHeap(isolate->savedHeap);
+  free(isolate);
+}
+
+/**
+ * 在当前隔离区中为共享的顶层函数创建闭包并固定，用 callHandle 执行顶层代码。
+ */
+Handle* sharedHandle(SharedCode* code) {
+  return pinValue(OBJ_VAL(newClosure(code->function)));
+}
+
+/**
+ * 冻结运行中的函数或结构体描述及其引用的对象，之后可以按指针交给其他线程。
+ * 与 compileShared 的限制相同；已经冻结的对象直接返回 true。
+ *
+ * @param object 必须从栈或全局变量可达，延迟编译函数体时可能发生 GC
+ * @return 对象图中有不能共享的对象时返回 false，对象保持原样
+ */
+bool freezeShared(Obj* object) {
+#ifdef COMPRESSED_REFS
+  return false;
+#else
+  if (object->space == SPACE_FROZEN) return true;
+#ifdef LAZY_COMPILE
+  if (object->type == OBJ_FUNCTION && !compileBodies((ObjFunction*)object)) {
+    return false;
+  }
+#endif
+  FrozenList list = {NULL, 0, 0};
+  if (!freezeObject(object, &list)) {
+    thaw(&list);
+    return false;
+  }
+  unlinkFrozen(&list);
+  free(list.objects);
+  return true;
+#endif
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+#ifndef COMPRESSED_REFS
+#ifdef LAZY_COMPILE
+/**
+ * 编译函数及其嵌套函数中尚未编译的函数体。
+ */
+static bool compileBodies(ObjFunction* function) {
+  if (function->lazy != NULL && !compileFunction(function)) return false;
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i]) &&
+        !compileBodies(AS_FUNCTION(constants->values[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+/**
+ * 冻结对象及其引用的全部对象：置于 SPACE_FROZEN 并记录下来。
+ *
+ * @return 遇到不能共享的对象时返回 false，区域中的对象也不能共享
+ */
+static bool freezeObject(Obj* object, FrozenList* list) {
+  if (object == NULL || object->space == SPACE_FROZEN) return true;
+  if (object->space == SPACE_REGION) return false;
+  object->space = SPACE_FROZEN;
+  appendFrozen(list, object);
+
+  switch (object->type) {
+    case OBJ_STRING:
+      return true;
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      if (!freezeObject((Obj*)type->name, list)) return false;
+      for (int i = 0; i < type->fieldCount; i++) {
+        if (!freezeObject((Obj*)type->fields[i], list)) return false;
+      }
+      return true;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      if (function->isMemo || function->module != NULL) return false;
+      function->isShared = true;
+      if (!freezeObject((Obj*)function->name, list)) return false;
+      ValueArray* constants = &function->chunk.constants;
+      for (int i = 0; i < constants->count; i++) {
+        if (IS_OBJ(constants->values[i]) &&
+            !freezeObject(AS_OBJ(constants->values[i]), list)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static void appendFrozen(FrozenList* list, Obj* object) {
+  if (list->count == list->capacity) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->objects = (Obj**)realloc(list->objects,
+                                   sizeof(Obj*) * list->capacity);
+    if (list->objects == NULL) exit(1);
+  }
+  list->objects[list->count++] = object;
+}
+
+/**
+ * 冻结失败：恢复已经处理过的对象。
+ */
+static void thaw(FrozenList* list) {
+  for (int i = 0; i < list->count; i++) {
+    list->objects[i]->space = SPACE_HEAP;
+    if (list->objects[i]->type == OBJ_FUNCTION) {
+      ((ObjFunction*)list->objects[i])->isShared = false;
+    }
+  }
+  free(list->objects);
+}
+
+/**
+ * 把冻结的对象从当前虚拟机的对象表中摘下。
+ */
+static void unlinkFrozen(FrozenList* list) {
+  for (int i = 0; i < list->count; i++) {
+    unregisterObject(list->objects[i]);
+  }
+}
+#endif
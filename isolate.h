@@ -0,0 +1,51 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "embed.h"
+#include "vm.h"
+
+/*
+ * 隔离区：各自拥有堆、全局变量、字符串池和栈的虚拟机。
+ * 虚拟机状态是线程局部的，进入隔离区就是把它的状态换到当前线程上，
+ * 与切换协程的方式相同。不同线程上的隔离区互不加锁地并行执行。
+ *
+ *   //主线程：编译一次并冻结
+ *   initVM();
+ *   SharedCode* code = compileShared(source);
+ *   //每个工作线程
+ *   Isolate* isolate = newIsolate(code);
+ *   enterIsolate(isolate);
+ *   Handle* script = sharedHandle(code);
+ *   callHandle(script, 0, NULL, NULL);
+ *   ...
+ *   releaseHandle(script);
+ *   leaveIsolate(isolate);
+ *   freeIsolate(isolate);
+ */
+
+//冻结的顶层函数及其嵌套的函数、常量字符串和结构体描述。
+//这些对象留在编译它的虚拟机的内存池中，不再被任何隔离区回收或修改
+typedef struct {
+  ObjFunction* function;
+  ObjString** strings;  //全部字符串，新隔离区先驻留它们
+  int stringCount;
+} SharedCode;
+
+typedef struct {
+  VM vm;              //隔离区的虚拟机状态，进入时换到当前线程上
+  void* heap;         //隔离区的内存池
+  VM saved;           //进入之前当前线程上的状态，离开时恢复
+  void* savedHeap;
+} Isolate;
+
+SharedCode* compileShared(const char* source);
+void freeSharedCode(SharedCode* code);
+Isolate* newIsolate(SharedCode* code);
+void enterIsolate(Isolate* isolate);
+void leaveIsolate(Isolate* isolate);
+void freeIsolate(Isolate* isolate);
+Handle* sharedHandle(SharedCode* code);
+bool freezeShared(Obj* object);
+
+#endif // clox_isolate_h
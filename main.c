@@ -1,8 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "vm.h"
 #include "common.h"
+#include "compiler.h"
 #include "memory.h"
+#include "bytecode.h"
+#include "image.h"
+#include "scheduler.h"
+
+//启动时恢复的堆镜像，为 NULL 时不使用
+static const char* imagePath = NULL;
+//脚本执行完毕后把全局变量写入的堆镜像，为 NULL 时不写
+static const char* snapshotPath = NULL;
 
 
 static char* readFile(const char* path) {
@@ -47,28 +58,168 @@ static void repl() {
 }
 
 
+/**
+ * 判断路径是否以字节码文件的扩展名结尾。
+ */
+static bool isBytecodePath(const char* path) {
+  size_t length = strlen(path);
+  size_t extension = strlen(BYTECODE_EXTENSION);
+  return length >= extension &&
+         strcmp(path + length - extension, BYTECODE_EXTENSION) == 0;
+}
+
+
 static void runFile(const char* path) {
+  vm.scriptPath = path;
+  if (isBytecodePath(path)) {
+    InterpretResult result = interpretBytecode(path);
+    if (result == INTERPRET_COMPILE_ERROR) {
+      fprintf(stderr, "Invalid bytecode file \"%s\".\n", path);
+      exit(65);
+    }
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    return;
+  }
+
+  //profile 文件与脚本放在一起：训练运行写入，之后的运行读取并重排字节码
+  char profilePath[1024];
+  snprintf(profilePath, sizeof(profilePath), "%s.profile", path);
+  vm.profilePath = profilePath;
+
   char* source = readFile(path);
   InterpretResult result = interpret(source);
   clox_free(source); 
+  vm.profilePath = NULL;
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+
+  if (snapshotPath != NULL && !saveImage(snapshotPath)) {
+    fprintf(stderr, "Could not write image \"%s\".\n", snapshotPath);
+    exit(74);
+  }
+}
+
+
+/**
+ * 只编译不运行，把结果写到脚本旁边的字节码文件。
+ */
+static void compileFile(const char* path) {
+  char* source = readFile(path);
+  ObjFunction* function = compile(source);
+  if (function == NULL) exit(65);
+
+  //foo.clox 写到 foo.cloxc，其他文件名直接追加扩展名
+  char outputPath[1024];
+  snprintf(outputPath, sizeof(outputPath), "%sc", path);
+  if (!isBytecodePath(outputPath)) {
+    snprintf(outputPath, sizeof(outputPath), "%s" BYTECODE_EXTENSION, path);
+  }
+  push(OBJ_VAL(function));
+  bool saved = saveBytecode(function, source, outputPath);
+  pop();
+  clox_free(source);
+  if (!saved) {
+    fprintf(stderr, "Could not write \"%s\".\n", outputPath);
+    exit(74);
+  }
+}
+
+
+/**
+ * 把每个脚本作为一个任务，在当前线程上分时间片轮流执行。
+ * 各个脚本的输出按时间片交错；任何一个失败时以对应的退出码结束。
+ */
+static void runTasksFiles(const char** paths, int count) {
+  Scheduler scheduler;
+  initScheduler(&scheduler, SCHEDULER_QUANTUM);
+  int compileErrors = 0;
+  for (int i = 0; i < count; i++) {
+    char* source = readFile(paths[i]);
+    if (!addTask(&scheduler, source, paths[i], 1)) compileErrors++;
+    clox_free(source);
+  }
+  int failed = runTasks(&scheduler);
+  freeScheduler(&scheduler);
+  if (compileErrors > 0) exit(65);
+  if (failed > 0) exit(70);
 }
 
 
+/**
+ * 只编译不运行，报告编译吞吐量和编译期间堆的峰值。
+ */
+static void benchCompile(const char* path) {
+  char* source = readFile(path);
+  size_t length = strlen(source);
+  size_t heapBefore = vm.bytesAllocated;
+  vm.peakAllocated = vm.bytesAllocated;
+
+  clock_t start = clock();
+  ObjFunction* function = compile(source);
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  clox_free(source);
+  if (function == NULL) exit(65);
+
+  double megabytes = length / (1024.0 * 1024.0);
+  printf("compiled %.2f MB in %.3f s: %.1f MB/s, peak heap %.1f MB\n",
+         megabytes, seconds, seconds > 0 ? megabytes / seconds : 0,
+         (vm.peakAllocated - heapBefore) / (1024.0 * 1024.0));
+}
+
 
 int main(int argc, const char* argv[]) {
   initVM();
-  // if (argc == 1) {
-  //   repl();
-  // } else if (argc == 2) {
-  //   runFile(argv[1]);
-  // } else {
-  //   fprintf(stderr, "Usage: clox [path]\n");
-  //   exit(64);
-  // }
-  runFile("./test.js");
+  const char* path = "./test.js";
+  bool bench = false;
+  bool compileOnly = false;
+  bool tasks = false;
+  const char** paths = (const char**)malloc(sizeof(const char*) * argc);
+  int pathCount = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--train") == 0) {
+      vm.profiling = true;
+    } else if (strcmp(argv[i], "--bench-compile") == 0) {
+      bench = true;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "--tasks") == 0) {
+      tasks = true;
+    } else if (strcmp(argv[i], "--no-gc") == 0) {
+      //一次性脚本：内存池快用完时才回收，退出时整块释放内存池
+      vm.batch = true;
+      vm.nextGC = BATCH_GC_THRESHOLD;
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      vm.cacheDir = argv[++i];
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      imagePath = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshotPath = argv[++i];
+    } else if (argv[i][0] != '-') {
+      path = argv[i];
+      paths[pathCount++] = argv[i];
+    } else {
+      fprintf(stderr, "Usage: clox [--train | --bench-compile | --compile] "
+                      "[--no-gc] [--cache dir] [--image file] "
+                      "[--snapshot file] [path]\n"
+                      "       clox --tasks path...\n");
+      exit(64);
+    }
+  }
+  if (imagePath != NULL && !loadImage(imagePath)) {
+    fprintf(stderr, "Invalid image file \"%s\".\n", imagePath);
+    exit(65);
+  }
+  if (tasks) {
+    runTasksFiles(paths, pathCount);
+  } else if (bench) {
+    benchCompile(path);
+  } else if (compileOnly) {
+    compileFile(path);
+  } else {
+    runFile(path);
+  }
+  free(paths);
   freeVM();
   return 0;
 }
\ No newline at end of file
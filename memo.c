@@ -0,0 +1,338 @@
+#include <stdlib.h>
+
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+#include "region.h"
+
+#define MEMO_MAX_LOAD 0.75
+/* 索引表中的墓碑标记 */
+#define MEMO_TOMBSTONE ((MemoEntry*)1)
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static MemoCache* newMemoCache(int keyLength);
+static uint32_t hashArgs(Value* args, int length);
+static bool argsEqual(Value* a, Value* b, int length);
+static MemoEntry** findSlot(MemoCache* cache, Value* args, uint32_t hash);
+static void adjustCapacity(MemoCache* cache, int capacity);
+static void unlinkEntry(MemoCache* cache, MemoEntry* entry);
+static void linkHead(MemoCache* cache, MemoEntry* entry);
+static void removeEntry(MemoCache* cache, MemoEntry* entry);
+static void evictLeastRecent(MemoCache* cache);
+static size_t entrySize(int keyLength);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 缓存的键在栈上的起点。键通常就是参数列表；函数捕获了上值时，
+ * 同一个函数的不同闭包结果不同，键从栈上的被调用者（闭包自身）开始。
+ *
+ * @param args 栈上的参数列表，紧挨在被调用者之后
+ */
+Value* memoKey(ObjFunction* function, Value* args) {
+  return function->upvalueCount > 0 ? args - 1 : args;
+}
+
+/**
+ * 在 memo 函数的缓存中查找键对应的返回值。
+ * 命中时会把条目移动到 LRU 链表头部。
+ *
+ * @param function memo 函数
+ * @param args memoKey 返回的键
+ * @param result 命中时写入的返回值
+ * @return 命中返回 true，否则返回 false
+ */
+bool memoLookup(ObjFunction* function, Value* args, Value* result) {
+  MemoCache* cache = function->memo;
+  if (cache == NULL || cache->live == 0) return false;
+
+  MemoEntry** slot = findSlot(cache, args, hashArgs(args, cache->keyLength));
+  MemoEntry* entry = *slot;
+  if (entry == NULL || entry == MEMO_TOMBSTONE || !entry->ready) {
+    return false;
+  }
+
+  unlinkEntry(cache, entry);
+  linkHead(cache, entry);
+  *result = entry->result;
+  return true;
+}
+
+/**
+ * 为一次未命中的调用预留缓存条目，条目在函数返回时由 memoComplete 填充。
+ * 缓存已满时淘汰最久未使用的条目。
+ *
+ * @param function memo 函数
+ * @param args memoKey 返回的键
+ * @return 新建的条目；若同样的参数已有一个尚未返回的调用，返回 NULL
+ */
+MemoEntry* memoReserve(ObjFunction* function, Value* args) {
+  if (function->memo == NULL) {
+    int keyLength = function->arity + (function->upvalueCount > 0 ? 1 : 0);
+    function->memo = newMemoCache(keyLength);
+  }
+  MemoCache* cache = function->memo;
+
+  if (cache->live >= MEMO_CACHE_MAX) evictLeastRecent(cache);
+  if (cache->count + 1 > cache->capacity * MEMO_MAX_LOAD) {
+    adjustCapacity(cache, GROW_CAPACITY(cache->capacity));
+  }
+
+  uint32_t hash = hashArgs(args, cache->keyLength);
+  MemoEntry** slot = findSlot(cache, args, hash);
+  if (*slot != NULL && *slot != MEMO_TOMBSTONE) return NULL;
+
+  MemoEntry* entry = (MemoEntry*)reallocate(NULL, 0, entrySize(cache->keyLength));
+  //reallocate 可能触发 GC 并清理缓存，重新查找插入位置
+  slot = findSlot(cache, args, hash);
+  entry->hash = hash;
+  entry->ready = false;
+  entry->result = NIL_VAL;
+  for (int i = 0; i < cache->keyLength; i++) {
+    entry->args[i] = args[i];
+  }
+
+  if (*slot == NULL) cache->count++;
+  *slot = entry;
+  cache->live++;
+  linkHead(cache, entry);
+  return entry;
+}
+
+/**
+ * 函数返回时写入缓存结果。
+ */
+void memoComplete(MemoEntry* entry, Value result) {
+  entry->result = result;
+  entry->ready = true;
+}
+
+/**
+ * 放弃一个尚未返回的调用所预留的条目（调用被异常或错误中断时使用）。
+ */
+void memoAbandon(ObjFunction* function, MemoEntry* entry) {
+  if (function->memo == NULL || entry->ready) return;
+  removeEntry(function->memo, entry);
+}
+
+/**
+ * 清空 memo 函数的缓存。
+ * 尚未返回的调用所预留的条目会被保留，它们仍被调用帧引用。
+ */
+void memoClear(ObjFunction* function) {
+  MemoCache* cache = function->memo;
+  if (cache == NULL) return;
+
+  MemoEntry* entry = cache->head;
+  while (entry != NULL) {
+    MemoEntry* next = entry->next;
+    if (entry->ready) removeEntry(cache, entry);
+    entry = next;
+  }
+}
+
+void freeMemoCache(MemoCache* cache) {
+  if (cache == NULL) return;
+  MemoEntry* entry = cache->head;
+  while (entry != NULL) {
+    MemoEntry* next = entry->next;
+    reallocate(entry, entrySize(cache->keyLength), 0);
+    entry = next;
+  }
+  FREE_ARRAY(MemoEntry*, cache->slots, cache->capacity);
+  FREE(MemoCache, cache);
+}
+
+/**
+ * 标记缓存中的值。
+ * 定义 MEMO_WEAK_CACHE 时只标记尚未返回的条目，其余条目在标记结束后由
+ * memoRemoveWhite 清理；否则缓存对所有参数和返回值都是强引用。
+ */
+void markMemoCache(MemoCache* cache) {
+  if (cache == NULL) return;
+#ifdef MEMO_WEAK_CACHE
+  cache->nextWeak = vm.weakMemos;
+  vm.weakMemos = cache;
+#endif
+  for (MemoEntry* entry = cache->head; entry != NULL; entry = entry->next) {
+#ifdef MEMO_WEAK_CACHE
+    if (entry->ready) continue;
+#endif
+    for (int i = 0; i < cache->keyLength; i++) {
+      markValue(entry->args[i]);
+    }
+    markValue(entry->result);
+  }
+}
+
+/**
+ * 删除引用了未标记对象的条目（弱缓存模式）。
+ */
+void memoRemoveWhite(MemoCache* cache) {
+  MemoEntry* entry = cache->head;
+  while (entry != NULL) {
+    MemoEntry* next = entry->next;
+    if (entry->ready) {
+      bool white = IS_OBJ(entry->result) && !isMarked(AS_OBJ(entry->result));
+      for (int i = 0; i < cache->keyLength && !white; i++) {
+        white = IS_OBJ(entry->args[i]) && !isMarked(AS_OBJ(entry->args[i]));
+      }
+      if (white) removeEntry(cache, entry);
+    }
+    entry = next;
+  }
+}
+
+/**
+ * 离开区域时改写缓存中对区域对象的引用。参数按对象地址求哈希，
+ * 有参数换成主堆中的副本时重新计算哈希并重建索引表。
+ */
+void memoForward(MemoCache* cache) {
+  if (cache == NULL) return;
+  bool moved = false;
+  for (MemoEntry* entry = cache->head; entry != NULL; entry = entry->next) {
+    bool entryMoved = false;
+    for (int i = 0; i < cache->keyLength; i++) {
+      Value arg = entry->args[i];
+      if (IS_OBJ(arg) && AS_OBJ(arg)->space == SPACE_REGION) {
+        entry->args[i] = forwardValue(arg);
+        entryMoved = true;
+      }
+    }
+    entry->result = forwardValue(entry->result);
+    if (entryMoved) {
+      entry->hash = hashArgs(entry->args, cache->keyLength);
+      moved = true;
+    }
+  }
+  if (moved) adjustCapacity(cache, cache->capacity);
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static MemoCache* newMemoCache(int keyLength) {
+  MemoCache* cache = ALLOCATE(MemoCache, 1);
+  cache->keyLength = keyLength;
+  cache->count = 0;
+  cache->live = 0;
+  cache->capacity = 0;
+  cache->slots = NULL;
+  cache->head = NULL;
+  cache->tail = NULL;
+  cache->nextWeak = NULL;
+  return cache;
+}
+
+static size_t entrySize(int keyLength) {
+  return sizeof(MemoEntry) + sizeof(Value) * keyLength;
+}
+
+/**
+ * 计算参数列表的哈希值。
+ */
+static uint32_t hashArgs(Value* args, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= hashValue(args[i]);
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static bool argsEqual(Value* a, Value* b, int length) {
+  for (int i = 0; i < length; i++) {
+    if (!valuesEqual(a[i], b[i])) return false;
+  }
+  return true;
+}
+
+/**
+ * 在索引表中查找参数列表对应的槽位。
+ * 找到时返回该条目所在槽位，否则返回第一个可插入的槽位（优先复用墓碑）。
+ */
+static MemoEntry** findSlot(MemoCache* cache, Value* args, uint32_t hash) {
+  uint32_t index = hash & (cache->capacity - 1);
+  MemoEntry** tombstone = NULL;
+  for (;;) {
+    MemoEntry** slot = &cache->slots[index];
+    if (*slot == NULL) {
+      return tombstone != NULL ? tombstone : slot;
+    } else if (*slot == MEMO_TOMBSTONE) {
+      if (tombstone == NULL) tombstone = slot;
+    } else if ((*slot)->hash == hash &&
+               argsEqual((*slot)->args, args, cache->keyLength)) {
+      return slot;
+    }
+    index = (index + 1) & (cache->capacity - 1);
+  }
+}
+
+static void adjustCapacity(MemoCache* cache, int capacity) {
+  MemoEntry** slots = ALLOCATE(MemoEntry*, capacity);
+  for (int i = 0; i < capacity; i++) {
+    slots[i] = NULL;
+  }
+
+  for (MemoEntry* entry = cache->head; entry != NULL; entry = entry->next) {
+    uint32_t index = entry->hash & (capacity - 1);
+    while (slots[index] != NULL) {
+      index = (index + 1) & (capacity - 1);
+    }
+    slots[index] = entry;
+  }
+
+  FREE_ARRAY(MemoEntry*, cache->slots, cache->capacity);
+  cache->slots = slots;
+  cache->capacity = capacity;
+  cache->count = cache->live;
+}
+
+static void unlinkEntry(MemoCache* cache, MemoEntry* entry) {
+  if (entry->prev != NULL) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+}
+
+static void linkHead(MemoCache* cache, MemoEntry* entry) {
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) cache->head->prev = entry;
+  cache->head = entry;
+  if (cache->tail == NULL) cache->tail = entry;
+}
+
+/**
+ * 从索引表和 LRU 链表中删除条目并释放其内存。
+ */
+static void removeEntry(MemoCache* cache, MemoEntry* entry) {
+  MemoEntry** slot = findSlot(cache, entry->args, entry->hash);
+  while (*slot != entry) {
+    //同样参数的条目只会有一个，这里只是防御性地继续探测
+    slot++;
+    if (slot == cache->slots + cache->capacity) slot = cache->slots;
+  }
+  *slot = MEMO_TOMBSTONE;
+  cache->live--;
+  unlinkEntry(cache, entry);
+  reallocate(entry, entrySize(cache->keyLength), 0);
+}
+
+/**
+ * 淘汰最久未使用且已经返回的条目。
+ */
+static void evictLeastRecent(MemoCache* cache) {
+  for (MemoEntry* entry = cache->tail; entry != NULL; entry = entry->prev) {
+    if (entry->ready) {
+      removeEntry(cache, entry);
+      return;
+    }
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef clox_memo_h
+#define clox_memo_h
+
+#include "common.h"
+#include "value.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 每个 memo 函数缓存的最大条目数，超出后按 LRU 淘汰 */
+#ifndef MEMO_CACHE_MAX
+#define MEMO_CACHE_MAX 1024
+#endif
+
+typedef struct ObjFunction ObjFunction;
+
+//缓存条目：以参数列表为键，函数返回值为值
+typedef struct MemoEntry {
+  struct MemoEntry* prev;   //LRU 链表中更近使用的条目
+  struct MemoEntry* next;   //LRU 链表中更久未使用的条目
+  uint32_t hash;            //参数列表的哈希值
+  bool ready;               //返回值是否已经写入（调用未返回时为 false）
+  Value result;             //函数返回值
+  Value args[];             //键：参数列表，捕获了上值的函数在前面加上闭包
+} MemoEntry;
+
+//memo 函数的结果缓存
+typedef struct MemoCache {
+  int keyLength;            //键的长度
+  int count;                //索引表中已使用的槽位数量（包含墓碑）
+  int live;                 //有效条目数量
+  int capacity;             //索引表容量
+  MemoEntry** slots;        //开放寻址索引表
+  MemoEntry* head;          //最近使用的条目
+  MemoEntry* tail;          //最久未使用的条目
+  struct MemoCache* nextWeak; //GC 期间需要清理的弱缓存链表
+} MemoCache;
+
+
+Value* memoKey(ObjFunction* function, Value* args);
+bool memoLookup(ObjFunction* function, Value* args, Value* result);
+MemoEntry* memoReserve(ObjFunction* function, Value* args);
+void memoComplete(MemoEntry* entry, Value result);
+void memoAbandon(ObjFunction* function, MemoEntry* entry);
+void memoClear(ObjFunction* function);
+void freeMemoCache(MemoCache* cache);
+void markMemoCache(MemoCache* cache);
+void memoRemoveWhite(MemoCache* cache);
+void memoForward(MemoCache* cache);
+
+#endif // clox_memo_h
@@ -1,8 +1,14 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "tlsf/tlsf.h"
 #include "compiler.h"
+#include "bytecode.h"
+#include "image.h"
+#include "thread.h"
+#include "io.h"
+#include "region.h"
 
 #include <stdio.h>
 #ifdef DEBUG_LOG_GC
@@ -13,7 +19,13 @@
 /****************************************/
 /**********  gloal variables   **********/
 /****************************************/
-tlsf_t *memoryPool = NULL;
+THREAD_LOCAL tlsf_t *memoryPool = NULL;
+#ifdef COMPRESSED_REFS
+#if MEMORY_HEAP_SIZE > 0xffffffff
+#error "COMPRESSED_REFS requires MEMORY_HEAP_SIZE to fit in 32-bit offsets"
+#endif
+THREAD_LOCAL char* heapBase = NULL;
+#endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
@@ -26,6 +38,10 @@ static void traceReferences();
 static void blackenObject(Obj* object);
 static void markArray(ValueArray* array);
 static void sweep();
+static void sweepYoung();
+static void removeWeakReferences();
+static void resetGenerations();
+static void appendId(int** ids, int* count, int* capacity, int id);
 
 /****************************************/
 /****    public function definition  ****/
@@ -45,12 +61,29 @@ void initializeMemory() {
     exit(1);
   memoryPool = tlsf_create_with_pool(memory, MEMORY_HEAP_SIZE);
   if (memoryPool == NULL) exit(1);
+#ifdef COMPRESSED_REFS
+  heapBase = (char*)memory;
+#endif
 }
 
 void freeMemory() {
   free(memoryPool);
 }
 
+/**
+ * 当前线程使用的内存池，切换隔离区时与虚拟机状态一起保存和恢复。
+ */
+void* currentHeap() {
+  return memoryPool;
+}
+
+void switchHeap(void* heap) {
+  memoryPool = heap;
+#ifdef COMPRESSED_REFS
+  heapBase = (char*)heap;
+#endif
+}
+
 
 /**
  * @brief 重新分配内存块的大小。
@@ -67,13 +100,19 @@ void freeMemory() {
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
+    if (vm.bytesAllocated > vm.peakAllocated) {
+      vm.peakAllocated = vm.bytesAllocated;
+    }
     #ifdef DEBUG_STRESS_GC
-      collectGarbage();
+      collectYoung();
     #endif
-  }
 
-  if (vm.bytesAllocated > vm.nextGC) {
-    collectGarbage();
+    //只在申请内存时触发 GC，避免 GC 释放对象时递归进入 GC
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    } else if (!vm.batch && vm.bytesAllocated > vm.nextMinorGC) {
+      collectYoung();
+    }
   }
 
   if (newSize == 0) {
@@ -101,28 +140,86 @@ void clox_free(void* pointer) {
 
 /**
  * 释放所有对象及其相关资源。
- * 该函数遍历对象链表，逐个释放每个对象，并清空灰色栈。
+ * 该函数遍历对象表，逐个释放每个对象，并清空灰色栈。
+ * 批处理模式下内存池随后整块释放，只释放与其他线程共享的通道和线程状态。
  */
 void freeObjects()
 {
-  Obj *object = vm.objects;
-  while (object != NULL)
-  {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  for (int id = 0; id < vm.heap.count; id++) {
+    Obj* object = vm.heap.objects[id];
+    if (object == NULL) continue;
+    if (!vm.batch) {
+      freeObject(object);
+    } else if (object->type == OBJ_CHANNEL || object->type == OBJ_THREAD) {
+      releaseObject(object);
+    }
   }
+  clox_free(vm.heap.objects);
+  clox_free(vm.heap.freeSlots);
+  clox_free(vm.heap.marks);
+  clox_free(vm.heap.old);
+  clox_free(vm.heap.young);
+  clox_free(vm.heap.remembered);
   clox_free(vm.grayStack);
 }
 
+/**
+ * 把新创建的对象登记到对象表，优先复用空闲的槽位。新对象属于新生代。
+ * 表和位图用 clox_realloc 增长，不触发 GC。
+ */
+void registerObject(Obj* object) {
+  ObjectTable* heap = &vm.heap;
+  if (heap->freeCount > 0) {
+    object->id = heap->freeSlots[--heap->freeCount];
+  } else {
+    if (heap->count == heap->capacity) {
+      int oldWords = (heap->capacity + 63) / 64;
+      heap->capacity = GROW_CAPACITY(heap->capacity);
+      int words = (heap->capacity + 63) / 64;
+      heap->objects = (Obj**)clox_realloc(heap->objects,
+                                          sizeof(Obj*) * heap->capacity);
+      heap->marks = (uint64_t*)clox_realloc(heap->marks,
+                                            sizeof(uint64_t) * words);
+      heap->old = (uint64_t*)clox_realloc(heap->old, sizeof(uint64_t) * words);
+      if (heap->objects == NULL || heap->marks == NULL || heap->old == NULL) {
+        exit(1);
+      }
+      memset(heap->marks + oldWords, 0, sizeof(uint64_t) * (words - oldWords));
+      memset(heap->old + oldWords, 0, sizeof(uint64_t) * (words - oldWords));
+    }
+    object->id = heap->count++;
+  }
+  heap->objects[object->id] = object;
+  //复用的槽位可能来自冻结时摘下的老年代对象
+  heap->old[object->id >> 6] &= ~((uint64_t)1 << (object->id & 63));
+  appendId(&heap->young, &heap->youngCount, &heap->youngCapacity, object->id);
+}
+
+/**
+ * 把对象从对象表中摘下但不释放，用于冻结的对象。
+ */
+void unregisterObject(Obj* object) {
+  ObjectTable* heap = &vm.heap;
+  heap->objects[object->id] = NULL;
+  if (heap->freeCount == heap->freeCapacity) {
+    heap->freeCapacity = GROW_CAPACITY(heap->freeCapacity);
+    heap->freeSlots = (int*)clox_realloc(heap->freeSlots,
+                                         sizeof(int) * heap->freeCapacity);
+    if (heap->freeSlots == NULL) exit(1);
+  }
+  heap->freeSlots[heap->freeCount++] = object->id;
+}
+
 /**
  * 执行垃圾回收的函数。
  * 该函数首先标记所有根对象，然后追踪它们的引用，移除白色对象，并进行清理。
+ * 存活的对象全部进入老年代，新生代和记忆集清空。
  * 最后，根据当前分配的字节数更新下一次垃圾回收的阈值。
  * 如果定义了 DEBUG_LOG_GC，还会在垃圾回收前后打印日志信息。
  */
 void collectGarbage()
 {
+  if (vm.gcPaused > 0) return;
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
@@ -130,10 +227,16 @@ void collectGarbage()
 
   markRoots();
   traceReferences();
-  tableRemoveWhite(&vm.strings);
+  removeWeakReferences();
   sweep();
+  //存活的对象全部进入老年代
+  memcpy(vm.heap.old, vm.heap.marks,
+         sizeof(uint64_t) * ((vm.heap.count + 63) / 64));
+  resetGenerations();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR + GC_NURSERY_SIZE;
+  if (vm.batch && vm.nextGC < BATCH_GC_THRESHOLD) vm.nextGC = BATCH_GC_THRESHOLD;
+  vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
 
   #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -143,82 +246,202 @@ void collectGarbage()
   #endif
 }
 
+/**
+ * 只回收新生代：老年代对象预先视为已标记，不再遍历；
+ * 记忆集中的老年代对象作为额外的根，重新遍历它们引用的对象。
+ * 新生代中存活的对象晋升到老年代，对象不移动，只改写位图。
+ */
+void collectYoung() {
+  if (vm.gcPaused > 0 || vm.heap.count == 0) return;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  ObjectTable* heap = &vm.heap;
+  memcpy(heap->marks, heap->old, sizeof(uint64_t) * ((heap->count + 63) / 64));
+  for (int i = 0; i < heap->rememberedCount; i++) {
+    markObject(heap->objects[heap->remembered[i]]);
+  }
+  markRoots();
+  traceReferences();
+  removeWeakReferences();
+  sweepYoung();
+  resetGenerations();
+
+  vm.nextMinorGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated,
+         vm.nextMinorGC);
+#endif
+}
+
+/**
+ * 老年代对象 container 写入了可能属于新生代的引用，加入记忆集。
+ * 同时清掉它的老年代位，之后的写入不再重复记录，下一次 GC 时恢复。
+ */
+void rememberOld(Obj* container) {
+  ObjectTable* heap = &vm.heap;
+  heap->old[container->id >> 6] &= ~((uint64_t)1 << (container->id & 63));
+  appendId(&heap->remembered, &heap->rememberedCount,
+           &heap->rememberedCapacity, container->id);
+}
+
 void markValue(Value value) {
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
 void markObject(Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
+  if (isMarked(object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
+  vm.heap.marks[object->id >> 6] |= (uint64_t)1 << (object->id & 63);
+  traceObject(object);
+
+}
+
+/**
+ * 标记从 roots 中的值可达的全部对象，但不回收任何对象。
+ * 调用者随后遍历 vm.heap 收集 isMarked 的对象，期间不能经由
+ * reallocate 分配内存（会触发 GC 打乱标记），用完后必须调用 clearMarks。
+ */
+void markReachable(Table* roots) {
+  markTable(roots);
+  traceReferences();
+}
+
+void clearMarks() {
+  if (vm.heap.marks == NULL) return;
+  memset(vm.heap.marks, 0, sizeof(uint64_t) * ((vm.heap.count + 63) / 64));
+#ifdef MEMO_WEAK_CACHE
+  vm.weakMemos = NULL;
+#endif
+}
 
+/**
+ * 不论是否已经标记，把对象放入灰色栈，由 traceReferences 遍历它引用的对象。
+ * 用于不由 GC 回收、但引用了主堆对象的区域对象。
+ */
+void traceObject(Obj* object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack = (Obj**)clox_realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+    if (vm.grayStack == NULL) exit(1);
   }
   vm.grayStack[vm.grayCount++] = object;
-
 }
 
-/****************************************/
-/****    static function definition  ****/
-/****************************************/
-static void freeObject(Obj* object) {
-  #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-  #endif
+/**
+ * 对象头（连同内联的字段或内容）占用的字节数。
+ */
+size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_INSTANCE:     return sizeof(ObjInstance);
+    case OBJ_CLASS:        return sizeof(ObjClass);
+    case OBJ_CLOSURE:      return sizeof(ObjClosure);
+    case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+    case OBJ_FUNCTION:     return sizeof(ObjFunction);
+    case OBJ_NATIVE:       return sizeof(ObjNative);
+    case OBJ_STRING:       return sizeof(ObjString);
+    case OBJ_FIBER:        return sizeof(ObjFiber);
+    case OBJ_STRUCT:       return sizeof(ObjStruct);
+    case OBJ_RECORD:
+      return sizeof(ObjRecord) +
+             sizeof(Value) * ((ObjRecord*)object)->fieldCount;
+    case OBJ_MODULE:       return sizeof(ObjModule);
+    case OBJ_FOREIGN:      return sizeof(ObjForeign);
+    case OBJ_BUFFER:
+      return sizeof(ObjBuffer) + ((ObjBuffer*)object)->length;
+    case OBJ_CHANNEL:      return sizeof(ObjChannel);
+    case OBJ_THREAD:       return sizeof(ObjThread);
+  }
+  return 0;
+}
 
+/**
+ * 释放对象持有的数组和外部资源，不释放对象头。
+ */
+void releaseObject(Obj* object) {
   switch (object->type) {
-    case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+    case OBJ_INSTANCE:
+      freeTable(&((ObjInstance*)object)->fields);
       break;
-    case OBJ_INSTANCE: {
-      ObjInstance* instance = (ObjInstance*)object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
-      break;
-    }
-    case OBJ_CLASS: {
-      ObjClass* klass = (ObjClass*)object;
-      freeTable(&klass->methods);
-      FREE(ObjClass, object);
+    case OBJ_CLASS:
+      freeTable(&((ObjClass*)object)->methods);
       break;
-    } 
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
+      FREE_ARRAY(Ref, closure->upvalues,
                  closure->upvalueCount);
-      FREE(ObjClosure, object);
       break;
     }
-    case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
-      break;
     case OBJ_FUNCTION: {
       //不用显式地释放函数名称
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+      freeMemoCache(function->memo);
+#ifdef LAZY_COMPILE
+      freeLazyBody(function->lazy);
+#endif
       break;
     }
-    case OBJ_NATIVE:
-      FREE(ObjNative, object);
-      break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
       break;
     }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+      FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+      break;
+    }
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      FREE_ARRAY(ObjString*, type->fields, type->fieldCount);
+      break;
+    }
+    case OBJ_MODULE:
+      freeTable(&((ObjModule*)object)->globals);
+      break;
+    case OBJ_CHANNEL:
+      releaseChannel(((ObjChannel*)object)->channel);
+      break;
+    case OBJ_THREAD:
+      abandonWorker(((ObjThread*)object)->worker);
+      break;
+    case OBJ_BOUND_METHOD:
+    case OBJ_UPVALUE:
+    case OBJ_NATIVE:
+    case OBJ_RECORD:
+    case OBJ_FOREIGN:
+    case OBJ_BUFFER:
+      break;
   }
 }
 
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static void freeObject(Obj* object) {
+  #ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+  #endif
+
+  size_t size = objectSize(object);
+  releaseObject(object);
+  reallocate(object, size, 0);
+}
+
 
 
 static void markRoots() {
@@ -234,9 +457,21 @@ static void markRoots() {
     markObject((Obj*)upvalue);
   }
 
+  markObject((Obj*)vm.fiber);
+  markValue(vm.pendingError);
+
+  for (Handle* handle = vm.handles; handle != NULL; handle = handle->next) {
+    markValue(handle->value);
+  }
+
   markTable(&vm.globals);
+  markTable(&vm.modules);
 
   markCompilerRoots();
+  markBytecodeRoots();
+  markImageRoots();
+  markEventLoop();
+  markRegion();
 
   markObject((Obj*)vm.initString);
 }
@@ -280,20 +515,84 @@ static void blackenObject(Obj* object) {
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markObject((Obj*)CLOSURE_UPVALUE(closure, i));
       }
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
+      markObject((Obj*)function->module);
       markArray(&function->chunk.constants);
+      markMemoCache(function->memo);
+#ifdef LAZY_COMPILE
+      if (function->lazy != NULL) {
+        markObject((Obj*)function->lazy->source);
+        for (int i = 0; i < function->lazy->upvalueNameCount; i++) {
+          markObject((Obj*)function->lazy->upvalueNames[i]);
+        }
+      }
+#endif
       break;
     }
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
     break;
-    case OBJ_NATIVE:
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      markObject((Obj*)fiber->caller);
+      //正在运行的协程的执行状态在 vm 中，已经作为根标记过
+      if (fiber == vm.fiber) break;
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(*slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        markObject((Obj*)fiber->frames[i].closure);
+      }
+      for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+           upvalue = upvalue->next) {
+        markObject((Obj*)upvalue);
+      }
+      break;
+    }
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      markObject((Obj*)type->name);
+      for (int i = 0; i < type->fieldCount; i++) {
+        markObject((Obj*)type->fields[i]);
+      }
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      markObject((Obj*)record->type);
+      for (int i = 0; i < record->fieldCount; i++) {
+        markValue(record->fields[i]);
+      }
+      break;
+    }
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      markObject((Obj*)module->path);
+      markObject((Obj*)module->function);
+      markTable(&module->globals);
+      break;
+    }
+    case OBJ_NATIVE: {
+      ObjNative* native = (ObjNative*)object;
+      markObject((Obj*)native->name);
+      break;
+    }
+    case OBJ_FOREIGN: {
+      ObjForeign* foreign = (ObjForeign*)object;
+      markObject((Obj*)foreign->library);
+      markObject((Obj*)foreign->symbol);
+      markObject((Obj*)foreign->signature);
+      break;
+    }
+    case OBJ_BUFFER:
+    case OBJ_CHANNEL:
+    case OBJ_THREAD:
     case OBJ_STRING:
       break;
     
@@ -316,23 +615,77 @@ static void markArray(ValueArray *array)
 }
 
 
+/**
+ * 释放没有标记的对象，然后清空标记位图。
+ * 存活的对象既不清标记也不改链接，它们所在的页不被写入。
+ */
 static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+  ObjectTable* heap = &vm.heap;
+  for (int word = 0; word < (heap->count + 63) / 64; word++) {
+    uint64_t marks = heap->marks[word];
+    //整个字全部存活时跳过，不读这 64 个对象
+    if (marks == UINT64_MAX) continue;
+    int end = word * 64 + 64 < heap->count ? word * 64 + 64 : heap->count;
+    for (int id = word * 64; id < end; id++) {
+      Obj* object = heap->objects[id];
+      if (object == NULL || ((marks >> (id & 63)) & 1) != 0) continue;
+      unregisterObject(object);
+      freeObject(object);
+    }
+  }
+}
+
+/**
+ * 只清扫新生代：存活的对象晋升，其余的释放。
+ * 记忆集中的对象恢复老年代位。
+ */
+static void sweepYoung() {
+  ObjectTable* heap = &vm.heap;
+  for (int i = 0; i < heap->youngCount; i++) {
+    int id = heap->young[i];
+    Obj* object = heap->objects[id];
+    //已经释放或者冻结时摘下的对象
+    if (object == NULL) continue;
+    if (((heap->marks[id >> 6] >> (id & 63)) & 1) != 0) {
+      heap->old[id >> 6] |= (uint64_t)1 << (id & 63);
     } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
-      freeObject(unreached);
+      unregisterObject(object);
+      freeObject(object);
     }
   }
+  for (int i = 0; i < heap->rememberedCount; i++) {
+    int id = heap->remembered[i];
+    heap->old[id >> 6] |= (uint64_t)1 << (id & 63);
+  }
+}
+
+/**
+ * 清理弱引用：字符串池和弱 memo 缓存中没有标记的项。
+ */
+static void removeWeakReferences() {
+  tableRemoveWhite(&vm.strings);
+#ifdef MEMO_WEAK_CACHE
+  for (MemoCache* cache = vm.weakMemos; cache != NULL; cache = cache->nextWeak) {
+    memoRemoveWhite(cache);
+  }
+  vm.weakMemos = NULL;
+#endif
+}
+
+/**
+ * 一次 GC 结束：新生代和记忆集清空，标记位图清零。
+ */
+static void resetGenerations() {
+  vm.heap.youngCount = 0;
+  vm.heap.rememberedCount = 0;
+  clearMarks();
+}
+
+static void appendId(int** ids, int* count, int* capacity, int id) {
+  if (*count == *capacity) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *ids = (int*)clox_realloc(*ids, sizeof(int) * *capacity);
+    if (*ids == NULL) exit(1);
+  }
+  (*ids)[(*count)++] = id;
 }
\ No newline at end of file
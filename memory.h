@@ -4,12 +4,17 @@
 #include "common.h"
 #include "object.h"
 #include "vm.h"
+#include "region.h"
 
 /****************************************/
 /********    macro definition  **********/
 /****************************************/
 /* 堆内存大小 */
 #define MEMORY_HEAP_SIZE (1024 * 1024 * 1024)
+/* 批处理模式下第一次 GC 的阈值：对象表、灰色栈和分配器的开销不计入 bytesAllocated，留出余量 */
+#define BATCH_GC_THRESHOLD (MEMORY_HEAP_SIZE / 2)
+/* 新生代大小：上次 GC 之后分配的字节数超过它时回收一次新生代 */
+#define GC_NURSERY_SIZE (1024 * 1024)
 
 /* 申请内存 */
 #define ALLOCATE(type, count) \
@@ -36,15 +41,68 @@
 
 void initializeMemory();
 void freeMemory();
+void* currentHeap();
+void switchHeap(void* heap);
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void* clox_malloc(size_t size);
 void* clox_realloc(void* ptr, size_t size);
 void clox_free(void* pointer);
 void freeObjects();
+void registerObject(Obj* object);
+void unregisterObject(Obj* object);
 
 
 void collectGarbage();
+void collectYoung();
+void rememberOld(Obj* container);
 void markValue(Value value);
 void markObject(Obj* object);
+void traceObject(Obj* object);
+size_t objectSize(Obj* object);
+void releaseObject(Obj* object);
+void markReachable(Table* roots);
+void clearMarks();
+
+/**
+ * GC 中对象是否已经标记。冻结的对象和区域中的对象总是视为已标记：
+ * 前者可能属于其他虚拟机，后者不由 GC 回收，id 在对象表中都没有意义。
+ */
+static inline bool isMarked(Obj* object) {
+  return object->space != SPACE_HEAP ||
+         ((vm.heap.marks[object->id >> 6] >> (object->id & 63)) & 1) != 0;
+}
+
+/**
+ * 主堆对象是否属于老年代。只对 SPACE_HEAP 的对象有意义；
+ * 进入记忆集的老年代对象暂时清掉这一位，直到下一次 GC。
+ */
+static inline bool isOld(Obj* object) {
+  return ((vm.heap.old[object->id >> 6] >> (object->id & 63)) & 1) != 0;
+}
+
+/**
+ * 主堆对象 container 的内容整体改变（表合并、保存协程栈等）之后调用：
+ * 区域期间加入区域的记忆集，老年代对象加入新生代回收的记忆集。
+ */
+static inline void rememberWrite(Obj* container) {
+  if (container->space != SPACE_HEAP) return;
+  if (vm.region != NULL) rememberObject(container);
+  if (isOld(container)) rememberOld(container);
+}
+
+/**
+ * 写屏障：在 container 中写入 value 之后调用。
+ * 主堆对象引用区域对象，或者老年代对象引用新生代对象时记录 container。
+ */
+static inline void writeBarrier(Obj* container, Value value) {
+  if (!IS_OBJ(value) || container->space != SPACE_HEAP) return;
+  Obj* object = AS_OBJ(value);
+  if (object->space == SPACE_REGION) {
+    rememberObject(container);
+  } else if (object->space == SPACE_HEAP && isOld(container) &&
+             !isOld(object)) {
+    rememberOld(container);
+  }
+}
 
 #endif
\ No newline at end of file
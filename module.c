@@ -0,0 +1,452 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "module.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+//一个待编译的模块。路径和编译结果用 malloc 分配，不属于任何线程的内存池，
+//工作线程退出后主线程仍然可以读取
+typedef struct {
+  char* path;       //规范化的绝对路径
+  uint8_t* bytes;   //工作线程的编译结果（字节码文件格式），失败时为 NULL
+  size_t size;
+  bool done;        //工作线程已经编译完（无论成败）
+  bool linked;      //主线程已经领取它去链接，或者由主线程自己编译
+} ModuleJob;
+
+//编译队列：jobs 按发现的顺序排列，下标小于 next 的已经被领走。
+//编译完一个模块后把它导入的模块加入队列，没有空闲线程时再启动新的工作线程
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;   //有模块入队，或有线程编译完成
+  ModuleJob** jobs;
+  int count;
+  int capacity;
+  int next;
+  int busy;                 //正在编译的线程数（包括主线程）
+  int idle;                 //等待新模块的线程数
+  pthread_t workers[MODULE_WORKERS_MAX];
+  int workerCount;
+  int workerMax;            //主线程也编译模块，工作线程比处理器少一个
+} ModuleQueue;
+
+//模块中导入的路径，已经相对导入者解析
+typedef struct {
+  char** paths;
+  int count;
+  int capacity;
+} PathList;
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static void* compileWorker(void* arg);
+static void compileJob(ModuleJob* job, PathList* imports);
+static bool compileLocal(ModuleJob* job, PathList* imports);
+static void collectImports(ObjFunction* script, const char* importer,
+                           PathList* imports);
+static void appendPath(PathList* list, char* path);
+static void addJob(ModuleQueue* queue, char* path);
+static bool isLoaded(const char* path);
+static bool linkModule(ModuleJob* job);
+static void defineModule(const char* path, ObjFunction* function);
+static void setModule(ObjFunction* function, ObjModule* module);
+static char* resolvePath(const char* importer, const char* path);
+static char* readSource(const char* path);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 编译并链接脚本直接和间接导入的全部模块，在脚本执行之前调用。
+ *
+ * 每个工作线程有自己的虚拟机、内存池和编译器状态（都是线程局部变量），
+ * 互不加锁地扫描和编译模块，结果编码为字节码文件格式交给主线程。
+ * 主线程一边把已经完成的模块解码到自己的堆中（链接：字符串在这一步驻留到
+ * 主线程的字符串池，函数关联到新建的模块对象，模块按规范化路径存入
+ * vm.modules），一边直接在自己的堆中编译队列里的模块，这部分不需要编解码。
+ * 编译的总耗时接近其中最大的模块，而不是全部模块之和；单核时不启动工作线程。
+ *
+ * @param script 顶层函数，调用者需保证它在 GC 中可达
+ * @return 有模块无法读取或编译错误时返回 false
+ */
+bool loadImports(ObjFunction* script) {
+  PathList imports = {NULL, 0, 0};
+  collectImports(script, vm.scriptPath, &imports);
+  if (imports.count == 0) return true;
+
+  ModuleQueue queue;
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.changed, NULL);
+  queue.jobs = NULL;
+  queue.count = 0;
+  queue.capacity = 0;
+  queue.next = 0;
+  queue.busy = 0;
+  queue.idle = 0;
+  queue.workerCount = 0;
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  queue.workerMax = processors <= 1 ? 0
+                  : processors > MODULE_WORKERS_MAX ? MODULE_WORKERS_MAX
+                  : (int)processors - 1;
+
+  pthread_mutex_lock(&queue.lock);
+  for (int i = 0; i < imports.count; i++) {
+    //REPL 中重复导入的模块已经加载过
+    if (isLoaded(imports.paths[i])) {
+      free(imports.paths[i]);
+    } else {
+      addJob(&queue, imports.paths[i]);
+    }
+  }
+  free(imports.paths);
+
+  bool ok = true;
+  for (;;) {
+    //优先链接工作线程的结果，尽早释放它们占用的内存
+    ModuleJob* ready = NULL;
+    for (int i = 0; i < queue.count && ready == NULL; i++) {
+      if (queue.jobs[i]->done && !queue.jobs[i]->linked) ready = queue.jobs[i];
+    }
+    if (ready != NULL) {
+      //链接和编译只读写主线程的堆，不持有锁，工作线程可以继续入队和编译
+      ready->linked = true;
+      pthread_mutex_unlock(&queue.lock);
+      ok = linkModule(ready) && ok;
+      free(ready->bytes);
+      ready->bytes = NULL;
+      pthread_mutex_lock(&queue.lock);
+      continue;
+    }
+    if (queue.next < queue.count) {
+      ModuleJob* job = queue.jobs[queue.next++];
+      job->linked = true;
+      queue.busy++;
+      pthread_mutex_unlock(&queue.lock);
+      PathList found = {NULL, 0, 0};
+      ok = compileLocal(job, &found) && ok;
+      pthread_mutex_lock(&queue.lock);
+      for (int i = 0; i < found.count; i++) {
+        addJob(&queue, found.paths[i]);
+      }
+      free(found.paths);
+      job->done = true;
+      queue.busy--;
+      pthread_cond_broadcast(&queue.changed);
+      continue;
+    }
+    if (queue.busy == 0) break;
+    pthread_cond_wait(&queue.changed, &queue.lock);
+  }
+  pthread_mutex_unlock(&queue.lock);
+  //队列已经清空，不会再有线程启动
+  for (int i = 0; i < queue.workerCount; i++) {
+    pthread_join(queue.workers[i], NULL);
+  }
+
+  for (int i = 0; i < queue.count; i++) {
+    free(queue.jobs[i]->path);
+    free(queue.jobs[i]);
+  }
+  free(queue.jobs);
+  pthread_cond_destroy(&queue.changed);
+  pthread_mutex_destroy(&queue.lock);
+  return ok;
+}
+
+/**
+ * 查找 import 指令要加载的模块。
+ *
+ * @param importer 执行 import 的函数所属的模块，主脚本为 NULL
+ * @param path import 中写的路径
+ * @return 模块；路径不在 vm.modules 中时返回 NULL
+ */
+ObjModule* findModule(ObjModule* importer, ObjString* path) {
+  char* resolved = resolvePath(
+      importer != NULL ? importer->path->chars : vm.scriptPath, path->chars);
+  ObjString* key = copyString(resolved, (int)strlen(resolved));
+  free(resolved);
+  Value module;
+  if (!tableGet(&vm.modules, key, &module)) return NULL;
+  return AS_MODULE(module);
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+/**
+ * 工作线程：反复从队列领取模块编译，队列为空且没有线程在编译时退出。
+ */
+static void* compileWorker(void* arg) {
+  ModuleQueue* queue = (ModuleQueue*)arg;
+  initVM();
+
+  pthread_mutex_lock(&queue->lock);
+  for (;;) {
+    while (queue->next == queue->count && queue->busy > 0) {
+      queue->idle++;
+      pthread_cond_wait(&queue->changed, &queue->lock);
+      queue->idle--;
+    }
+    if (queue->next == queue->count) break;
+    ModuleJob* job = queue->jobs[queue->next++];
+    queue->busy++;
+    pthread_mutex_unlock(&queue->lock);
+
+    PathList imports = {NULL, 0, 0};
+    compileJob(job, &imports);
+
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < imports.count; i++) {
+      addJob(queue, imports.paths[i]);
+    }
+    free(imports.paths);
+    job->done = true;
+    queue->busy--;
+    pthread_cond_broadcast(&queue->changed);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  freeVM();
+  return NULL;
+}
+
+/**
+ * 在工作线程中编译一个模块，编译结果和模块导入的路径写回 job 和 imports。
+ * 编译出的对象都在本线程的内存池中，随后的 GC 会回收它们。
+ */
+static void compileJob(ModuleJob* job, PathList* imports) {
+  char* source = readSource(job->path);
+  if (source == NULL) {
+    fprintf(stderr, "Could not open module \"%s\".\n", job->path);
+    return;
+  }
+  ObjFunction* function = compile(source);
+  free(source);
+  if (function == NULL) {
+    fprintf(stderr, "Could not compile module \"%s\".\n", job->path);
+    return;
+  }
+
+  push(OBJ_VAL(function));
+  Writer writer = {NULL, 0, 0};
+  if (encodeBytecode(function, NULL, &writer)) {
+    job->bytes = (uint8_t*)malloc(writer.count);
+    if (job->bytes != NULL) {
+      memcpy(job->bytes, writer.bytes, writer.count);
+      job->size = writer.count;
+    }
+  }
+  freeWriter(&writer);
+  collectImports(function, job->path, imports);
+  pop();
+}
+
+/**
+ * 在主线程中直接编译一个模块并定义它，不经过编码和解码。
+ */
+static bool compileLocal(ModuleJob* job, PathList* imports) {
+  if (isLoaded(job->path)) return true;
+  char* source = readSource(job->path);
+  if (source == NULL) {
+    fprintf(stderr, "Could not open module \"%s\".\n", job->path);
+    return false;
+  }
+  ObjFunction* function = compile(source);
+  free(source);
+  if (function == NULL) {
+    fprintf(stderr, "Could not compile module \"%s\".\n", job->path);
+    return false;
+  }
+
+  push(OBJ_VAL(function));
+  collectImports(function, job->path, imports);
+  defineModule(job->path, function);
+  pop();
+  return true;
+}
+
+/**
+ * 找出顶层函数中的全部 import。import 只能出现在顶层，不需要遍历嵌套函数。
+ *
+ * @param importer 脚本或模块的路径，导入路径相对它所在的目录解析
+ */
+static void collectImports(ObjFunction* script, const char* importer,
+                           PathList* imports) {
+  Chunk* chunk = &script->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction != OP_IMPORT && instruction != OP_IMPORT_LONG) continue;
+    uint32_t constant = instruction == OP_IMPORT
+                            ? chunk->code[offset + 1]
+                            : (uint32_t)GET_THREE_BYTE(chunk, offset + 1);
+    ObjString* path = AS_STRING(VALUE_AT(chunk->constants, constant));
+    appendPath(imports, resolvePath(importer, path->chars));
+  }
+}
+
+static void appendPath(PathList* list, char* path) {
+  if (list->count == list->capacity) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->paths = (char**)realloc(list->paths, sizeof(char*) * list->capacity);
+    if (list->paths == NULL) exit(1);
+  }
+  list->paths[list->count++] = path;
+}
+
+/**
+ * 把模块加入队列，已经在队列中的模块不重复编译。调用者持有队列的锁。
+ *
+ * @param path 规范化的路径，所有权交给队列
+ */
+static void addJob(ModuleQueue* queue, char* path) {
+  for (int i = 0; i < queue->count; i++) {
+    if (strcmp(queue->jobs[i]->path, path) == 0) {
+      free(path);
+      return;
+    }
+  }
+
+  if (queue->count == queue->capacity) {
+    queue->capacity = GROW_CAPACITY(queue->capacity);
+    queue->jobs = (ModuleJob**)realloc(queue->jobs,
+                                       sizeof(ModuleJob*) * queue->capacity);
+    if (queue->jobs == NULL) exit(1);
+  }
+  ModuleJob* job = (ModuleJob*)malloc(sizeof(ModuleJob));
+  if (job == NULL) exit(1);
+  job->path = path;
+  job->bytes = NULL;
+  job->size = 0;
+  job->done = false;
+  job->linked = false;
+  queue->jobs[queue->count++] = job;
+
+  //等待中的线程不够领取全部模块时再启动一个线程
+  if (queue->count - queue->next > queue->idle &&
+      queue->workerCount < queue->workerMax &&
+      pthread_create(&queue->workers[queue->workerCount], NULL,
+                     compileWorker, queue) == 0) {
+    queue->workerCount++;
+  }
+  pthread_cond_broadcast(&queue->changed);
+}
+
+static bool isLoaded(const char* path) {
+  ObjString* key = copyString(path, (int)strlen(path));
+  Value module;
+  return tableGet(&vm.modules, key, &module);
+}
+
+/**
+ * 在主线程中解码工作线程的编译结果并定义模块。
+ * 编译失败的模块已经由工作线程报告过错误。
+ */
+static bool linkModule(ModuleJob* job) {
+  if (job->bytes == NULL) return false;
+  if (isLoaded(job->path)) return true;
+  ObjFunction* function = decodeBytecode(job->bytes, job->size, NULL, false);
+  if (function == NULL) {
+    fprintf(stderr, "Could not load module \"%s\".\n", job->path);
+    return false;
+  }
+  push(OBJ_VAL(function));
+  defineModule(job->path, function);
+  pop();
+  return true;
+}
+
+/**
+ * 为模块的顶层函数创建模块对象并存入 vm.modules。
+ */
+static void defineModule(const char* path, ObjFunction* function) {
+  push(OBJ_VAL(function));
+  ObjString* name = copyString(path, (int)strlen(path));
+  push(OBJ_VAL(name));
+  ObjModule* module = newModule(name, function);
+  push(OBJ_VAL(module));
+  //模块可能在定义期间的 GC 中晋升，之后新建的原生函数写入表中时没有写屏障
+  vm.gcPaused++;
+  defineNatives(&module->globals);
+  vm.gcPaused--;
+  setModule(function, module);
+  tableSet(&vm.modules, name, OBJ_VAL(module));
+  pop();
+  pop();
+  pop();
+}
+
+/**
+ * 把函数及其嵌套的全部函数关联到模块，全局变量指令据此找到模块的全局变量表。
+ * 延迟编译的函数体中的函数在编译时从外层函数继承模块。
+ */
+static void setModule(ObjFunction* function, ObjModule* module) {
+  function->module = module;
+  writeBarrier((Obj*)function, OBJ_VAL(module));
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      setModule(AS_FUNCTION(constants->values[i]), module);
+    }
+  }
+}
+
+/**
+ * 解析导入路径：相对路径相对导入者所在的目录，导入者为 NULL 时相对当前目录。
+ * 文件存在时返回规范化的绝对路径，不存在时返回拼接后的路径，读取时再报错。
+ *
+ * @return malloc 分配的路径，由调用者释放
+ */
+static char* resolvePath(const char* importer, const char* path) {
+  const char* slash = importer != NULL ? strrchr(importer, '/') : NULL;
+  size_t directoryLength = 0;
+  if (path[0] != '/' && slash != NULL) {
+    directoryLength = (size_t)(slash - importer) + 1;
+  }
+
+  size_t length = strlen(path);
+  char* joined = (char*)malloc(directoryLength + length + 1);
+  if (joined == NULL) exit(1);
+  if (directoryLength > 0) memcpy(joined, importer, directoryLength);
+  memcpy(joined + directoryLength, path, length + 1);
+
+  char* resolved = realpath(joined, NULL);
+  if (resolved == NULL) return joined;
+  free(joined);
+  return resolved;
+}
+
+/**
+ * 读取模块源码。工作线程调用它，不使用内存池。
+ *
+ * @return malloc 分配的源码；文件无法读取时返回 NULL
+ */
+static char* readSource(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = fileSize < 0 ? NULL : (char*)malloc((size_t)fileSize + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t bytesRead = fread(buffer, sizeof(char), (size_t)fileSize, file);
+  buffer[bytesRead] = '\0';
+  fclose(file);
+  return buffer;
+}
@@ -0,0 +1,17 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "common.h"
+#include "object.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 并行编译模块的工作线程数上限 */
+#define MODULE_WORKERS_MAX 16
+
+
+bool loadImports(ObjFunction* script);
+ObjModule* findModule(ObjModule* importer, ObjString* path);
+
+#endif // clox_module_h
@@ -3,6 +3,7 @@
 
 #include "memory.h"
 #include "object.h"
+#include "region.h"
 #include "value.h"
 #include "vm.h"
 
@@ -57,15 +58,28 @@ ObjFunction* newFunction() {
   function->arity = 0;
   function->name = NULL;
   function->upvalueCount = 0;
+  function->isMemo = false;
+  function->isGenerator = false;
+  function->isShared = false;
+  function->memo = NULL;
+  function->module = NULL;
+#ifdef LAZY_COMPILE
+  function->lazy = NULL;
+#endif
   initChunk(&function->chunk);
   return function;
 }
 
+void freeLazyBody(LazyBody* lazy) {
+  if (lazy == NULL) return;
+  FREE_ARRAY(ObjString*, lazy->upvalueNames, lazy->upvalueNameCount);
+  FREE(LazyBody, lazy);
+}
+
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                   function->upvalueCount);
+  Ref* upvalues = ALLOCATE(Ref, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
+    upvalues[i] = NULL_REF;
   }
 
   ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
@@ -83,13 +97,152 @@ ObjUpvalue* newUpvalue(Value* slot) {
   return upvalue;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(NativeFn function, ObjString* name, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
+  native->arity = arity;
   return native;
 }
 
 
+/**
+ * 创建协程。
+ * 值栈和调用帧数组都按需增长，初始只分配很小的空间，
+ * 以便大量挂起的协程可以同时存在。
+ *
+ * @param closure 协程的入口闭包，为 NULL 时创建主协程（执行状态由 vm 提供）
+ * @param slotCount 初始需要的栈槽数量（被调用者加参数）
+ */
+ObjFiber* newFiber(ObjClosure* closure, int slotCount) {
+  Value* stack = NULL;
+  int stackCapacity = 0;
+  CallFrame* frames = NULL;
+  int frameCapacity = 0;
+  if (closure != NULL) {
+    stackCapacity = GROW_CAPACITY(0);
+    while (stackCapacity < slotCount) stackCapacity = GROW_CAPACITY(stackCapacity);
+    stack = ALLOCATE(Value, stackCapacity);
+    frameCapacity = 1;
+    frames = ALLOCATE(CallFrame, frameCapacity);
+  }
+
+  ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+  fiber->stack = stack;
+  fiber->stackTop = stack;
+  fiber->stackCapacity = stackCapacity;
+  fiber->frames = frames;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = frameCapacity;
+  fiber->openUpvalues = NULL;
+  fiber->caller = NULL;
+  fiber->state = closure != NULL ? FIBER_NEW : FIBER_RUNNING;
+  return fiber;
+}
+
+
+/**
+ * 创建结构体描述，字段名由调用者随后填入（填入前为 NULL）。
+ *
+ * @param name 结构体名
+ * @param fieldCount 字段个数
+ */
+ObjStruct* newStruct(ObjString* name, int fieldCount) {
+  ObjString** fields = ALLOCATE(ObjString*, fieldCount);
+  for (int i = 0; i < fieldCount; i++) {
+    fields[i] = NULL;
+  }
+
+  ObjStruct* type = ALLOCATE_OBJ(ObjStruct, OBJ_STRUCT);
+  type->name = name;
+  type->fieldCount = fieldCount;
+  type->fields = fields;
+  return type;
+}
+
+/**
+ * 创建结构体实例，对象头和字段数组一次分配，字段初始化为 nil。
+ */
+ObjRecord* newRecord(ObjStruct* type) {
+  ObjRecord* record = (ObjRecord*)allocateObject(
+      sizeof(ObjRecord) + sizeof(Value) * type->fieldCount, OBJ_RECORD);
+  record->type = type;
+  record->fieldCount = type->fieldCount;
+  for (int i = 0; i < type->fieldCount; i++) {
+    record->fields[i] = NIL_VAL;
+  }
+  return record;
+}
+
+/**
+ * 创建模块，全局变量表为空，由调用者定义内建函数。
+ *
+ * @param path 模块文件的规范化路径
+ * @param function 模块的顶层函数
+ */
+ObjModule* newModule(ObjString* path, ObjFunction* function) {
+  ObjModule* module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
+  module->path = path;
+  module->function = function;
+  initTable(&module->globals);
+  module->executed = false;
+  return module;
+}
+
+/**
+ * 创建外部函数，返回类型和参数类型由调用者按签名填入。
+ */
+ObjForeign* newForeign(void* function, ObjString* library, ObjString* symbol,
+                       ObjString* signature) {
+  ObjForeign* foreign = ALLOCATE_OBJ(ObjForeign, OBJ_FOREIGN);
+  foreign->function = function;
+  foreign->library = library;
+  foreign->symbol = symbol;
+  foreign->signature = signature;
+  foreign->returnType = 'v';
+  foreign->arity = 0;
+  return foreign;
+}
+
+/**
+ * 创建字节缓冲区，对象头和内容一次分配，内容初始化为 0。
+ */
+ObjBuffer* newBuffer(int length) {
+  ObjBuffer* buffer = (ObjBuffer*)allocateObject(
+      sizeof(ObjBuffer) + length, OBJ_BUFFER);
+  buffer->length = length;
+  memset(buffer->bytes, 0, length);
+  return buffer;
+}
+
+/**
+ * 创建通道对象，持有调用者已经取得的一个队列引用。
+ */
+ObjChannel* newChannel(Channel* channel) {
+  ObjChannel* object = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+  object->channel = channel;
+  return object;
+}
+
+ObjThread* newThread(Worker* worker) {
+  ObjThread* thread = ALLOCATE_OBJ(ObjThread, OBJ_THREAD);
+  thread->worker = worker;
+  return thread;
+}
+
+/**
+ * 查找字段名在结构体中的槽位，字段名都是驻留字符串，直接比较指针。
+ *
+ * @return 槽位下标，不存在时返回 -1
+ */
+int structFieldIndex(ObjStruct* type, ObjString* name) {
+  for (int i = 0; i < type->fieldCount; i++) {
+    if (type->fields[i] == name) return i;
+  }
+  return -1;
+}
+
+
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
@@ -121,6 +274,38 @@ ObjString* takeString(char* chars, int length) {
 
 
 
+/**
+ * 创建字符串值：长度不超过 SMALL_STRING_MAX 时直接打包为立即数，不分配内存；
+ * 否则创建驻留的 ObjString。
+ * 脚本可见的字符串值都必须经由这里创建，保证短字符串只有立即数一种形式。
+ */
+Value stringValue(const char* chars, int length) {
+#ifdef NAN_BOXING
+  if (length <= SMALL_STRING_MAX) return smallStringValue(chars, length);
+#endif
+  return OBJ_VAL(copyString(chars, length));
+}
+
+/**
+ * 取得字符串值的字符序列，两种字符串形式都适用。
+ *
+ * @param value 字符串值（IS_ANY_STRING 为真）
+ * @param buffer 短字符串解包用的缓冲区，至少 SMALL_STRING_MAX + 1 字节
+ * @param length 写入字符串长度
+ * @return 以 '\0' 结尾的字符序列，短字符串时指向 buffer
+ */
+const char* stringChars(Value value, char* buffer, int* length) {
+#ifdef NAN_BOXING
+  if (IS_SMALL_STRING(value)) {
+    *length = smallStringChars(value, buffer);
+    return buffer;
+  }
+#endif
+  *length = AS_STRING(value)->length;
+  return AS_CSTRING(value);
+}
+
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
@@ -148,6 +333,37 @@ void printObject(Value value) {
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
+    case OBJ_FIBER:
+      printf("<fiber>");
+      break;
+    case OBJ_STRUCT:
+      printf("<struct %s>", AS_STRUCT(value)->name->chars);
+      break;
+    case OBJ_RECORD: {
+      ObjRecord* record = AS_RECORD(value);
+      printf("%s(", record->type->name->chars);
+      for (int i = 0; i < record->type->fieldCount; i++) {
+        if (i > 0) printf(", ");
+        printValue(record->fields[i]);
+      }
+      printf(")");
+      break;
+    }
+    case OBJ_MODULE:
+      printf("<module %s>", AS_MODULE(value)->path->chars);
+      break;
+    case OBJ_FOREIGN:
+      printf("<foreign %s>", AS_FOREIGN(value)->symbol->chars);
+      break;
+    case OBJ_BUFFER:
+      printf("<buffer %d>", AS_BUFFER(value)->length);
+      break;
+    case OBJ_CHANNEL:
+      printf("<channel>");
+      break;
+    case OBJ_THREAD:
+      printf("<thread>");
+      break;
   }
 }
 
@@ -156,11 +372,12 @@ void printObject(Value value) {
 /****    static function definition  ****/
 /****************************************/
 static Obj* allocateObject(size_t size, ObjType type) {
+  if (vm.region != NULL) return regionAlloc(size, type);
+
   Obj* object = (Obj*)reallocate(NULL, 0, size);
-  object->next = vm.objects;
-  vm.objects = object;
   object->type = type;
-  object->isMarked = false;
+  object->space = SPACE_HEAP;
+  registerObject(object);
   #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
   #endif
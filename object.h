@@ -5,6 +5,8 @@
 #include "value.h"
 #include "chunk.h"
 #include "hash_table.h"
+#include "memo.h"
+#include "ref.h"
 
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
@@ -15,7 +17,17 @@
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+/* 任意形式的字符串值：短字符串立即数或堆上的 ObjString */
+#define IS_ANY_STRING(value)   (IS_SMALL_STRING(value) || IS_STRING(value))
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
+#define IS_STRUCT(value)       isObjType(value, OBJ_STRUCT)
+#define IS_RECORD(value)       isObjType(value, OBJ_RECORD)
+#define IS_MODULE(value)       isObjType(value, OBJ_MODULE)
+#define IS_FOREIGN(value)      isObjType(value, OBJ_FOREIGN)
+#define IS_BUFFER(value)       isObjType(value, OBJ_BUFFER)
+#define IS_CHANNEL(value)      isObjType(value, OBJ_CHANNEL)
+#define IS_THREAD(value)       isObjType(value, OBJ_THREAD)
 
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -23,10 +35,17 @@
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
+#define AS_STRUCT(value)       ((ObjStruct*)AS_OBJ(value))
+#define AS_RECORD(value)       ((ObjRecord*)AS_OBJ(value))
+#define AS_MODULE(value)       ((ObjModule*)AS_OBJ(value))
+#define AS_FOREIGN(value)      ((ObjForeign*)AS_OBJ(value))
+#define AS_BUFFER(value)       ((ObjBuffer*)AS_OBJ(value))
+#define AS_CHANNEL(value)      ((ObjChannel*)AS_OBJ(value))
+#define AS_THREAD(value)       ((ObjThread*)AS_OBJ(value))
 
 
 typedef enum {
@@ -38,13 +57,30 @@ typedef enum {
   OBJ_FUNCTION,   //函数对象
   OBJ_NATIVE,     //原生函数对象
   OBJ_STRING,     //字符串对象
+  OBJ_FIBER,      //协程对象
+  OBJ_STRUCT,     //结构体描述
+  OBJ_RECORD,     //结构体实例
+  OBJ_MODULE,     //模块
+  OBJ_FOREIGN,    //共享库中的外部函数
+  OBJ_BUFFER,     //原始字节缓冲区
+  OBJ_CHANNEL,    //线程之间的消息通道
+  OBJ_THREAD,     //spawn 启动的工作线程
 } ObjType;
 
 
+//对象所在的空间
+typedef enum {
+  SPACE_HEAP,     //主堆：登记在对象表中，由 GC 回收
+  SPACE_FROZEN,   //冻结的共享对象：不在任何对象表中，GC 视为已标记
+  SPACE_REGION,   //区域：随区域整体释放，离开区域时逃逸的对象复制到主堆
+} ObjSpace;
+
+//对象头在创建和冻结之后只读：GC 的标记位在对象表的位图中，
+//回收时也不改写存活对象，fork 出的子进程与父进程继续共享这些页
 struct Obj {
   ObjType type;
-  bool isMarked;
-  struct Obj* next;  //所有对象的链表
+  uint8_t space;  //ObjSpace
+  int id;         //主堆中是对象表的槽位和标记位图的位号，区域中是区域内的序号
 };
 
 
@@ -55,22 +91,98 @@ struct ObjString {
   uint32_t hash;
 };
 
+//尚未编译的函数体：记录它在源码中的位置和编译它所需的外层上下文
 typedef struct {
+  ObjString* source;        //函数所在的整个源码
+  int offset;               //参数列表的 '(' 在源码中的偏移
+  int line;                 //'(' 所在的行
+  int column;               //'(' 所在的列
+  int type;                 //编译器中的函数类型
+  bool inClass;             //是否定义在类中
+  bool hasSuperclass;       //所在的类是否有父类
+  int upvalueNameCount;
+  ObjString** upvalueNames; //每个上值捕获的外层变量名
+} LazyBody;
+
+typedef struct ObjModule ObjModule;
+
+struct ObjFunction {
   Obj obj;
   int arity;         //参数个数
   Chunk chunk;      //函数体
   ObjString* name;  //函数名
   int upvalueCount; //上值个数
-} ObjFunction;
+  bool isMemo;      //是否为 memo 函数
+  bool isGenerator; //是否为生成器函数（函数体中含有 yield）
+  bool isShared;    //已冻结，在隔离区之间共享，执行时不再改写字节码
+  MemoCache* memo;  //memo 函数的结果缓存，首次调用时创建
+  ObjModule* module; //函数所属的模块，主脚本中的函数为 NULL
+#ifdef LAZY_COMPILE
+  LazyBody* lazy;   //函数体尚未编译时不为 NULL
+#endif
+};
+
+typedef struct VM VM;
+
+/*
+ * 原生函数。参数个数已经按 arity 检查过，args 指向栈上的参数，
+ * 调用 callClosure（可能扩容值栈）之后不能再读 args。
+ * 成功时把返回值写入 result 并返回 true；失败时返回 nativeError 的结果，
+ * 或者把 callClosure 返回的 false 原样返回，异常由调用者重新抛出。
+ */
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args, Value* result);
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/* 原生函数接受任意个参数 */
+#define NATIVE_VARIADIC (-1)
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  ObjString* name;
+  int arity;        //参数个数，NATIVE_VARIADIC 时不检查
 } ObjNative;
 
 
+/* 外部函数参数个数的上限：整数类参数和浮点参数都只经寄存器传递 */
+#define FOREIGN_ARGS_MAX 14
+
+//外部函数：按签名绑定的共享库函数。签名在绑定时解析一次，
+//调用时按参数类型转换后经调用桩传入
+typedef struct {
+  Obj obj;
+  void* function;
+  ObjString* library;    //库路径，空字符串表示进程本身；堆镜像据此重新解析
+  ObjString* symbol;
+  ObjString* signature;  //例如 "d(di)"：返回类型，括号中是参数类型
+  char returnType;
+  int arity;
+  char argTypes[FOREIGN_ARGS_MAX];
+} ObjForeign;
+
+//字节缓冲区：内容紧跟在对象头之后，传给外部函数的是内容的地址
+typedef struct {
+  Obj obj;
+  int length;
+  uint8_t bytes[];
+} ObjBuffer;
+
+typedef struct Channel Channel;
+typedef struct Worker Worker;
+
+//通道：队列在所有线程之间共享，按引用计数释放。
+//每个持有它的线程在自己的堆中有一个 ObjChannel
+typedef struct {
+  Obj obj;
+  Channel* channel;
+} ObjChannel;
+
+//工作线程的句柄。线程的状态由启动它的虚拟机持有，句柄被回收时不等待线程结束
+typedef struct {
+  Obj obj;
+  Worker* worker;
+} ObjThread;
+
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -81,10 +193,13 @@ typedef struct ObjUpvalue {
 typedef struct {
   Obj obj;
   ObjFunction* function;
-  ObjUpvalue** upvalues;
+  Ref* upvalues;     //ObjUpvalue* 数组，通过 CLOSURE_UPVALUE 读取
   int upvalueCount;
 } ObjClosure;
 
+#define CLOSURE_UPVALUE(closure, index) \
+    ((ObjUpvalue*)fromRef((closure)->upvalues[index]))
+
 
 typedef struct {
   Obj obj;
@@ -101,6 +216,23 @@ typedef struct {
 
 
 
+//结构体描述：字段布局在编译期确定，作为常量保存在函数的常量表中
+typedef struct {
+  Obj obj;
+  ObjString* name;
+  int fieldCount;
+  ObjString** fields;   //字段名，下标即字段在实例中的槽位
+} ObjStruct;
+
+//结构体实例：对象头之后直接是定长的字段数组，没有哈希表
+typedef struct {
+  Obj obj;
+  ObjStruct* type;
+  int fieldCount;       //释放时描述可能已先被回收，这里单独保存字段个数
+  Value fields[];
+} ObjRecord;
+
+
 typedef struct {
   Obj obj;
   Value receiver;
@@ -108,16 +240,69 @@ typedef struct {
 } ObjBoundMethod; //类实例方法都是绑定方法
 
 
+//模块：import 加载的一个源文件，拥有独立的全局变量表
+struct ObjModule {
+  Obj obj;
+  ObjString* path;        //规范化的绝对路径，也是模块缓存的键
+  ObjFunction* function;  //模块的顶层函数
+  Table globals;
+  bool executed;          //顶层代码是否已经开始执行，循环导入时不再重复执行
+};
+
+
+typedef struct {
+  ObjClosure* closure;
+  uint8_t* ip;
+  Value* slots;
+  MemoEntry* memo;   //memo 函数未命中时预留的缓存条目
+} CallFrame;
+
+typedef enum {
+  FIBER_NEW,        //已创建，尚未开始执行
+  FIBER_SUSPENDED,  //在 yield 处挂起
+  FIBER_RUNNING,    //正在执行，或正在等待它 resume 的协程
+  FIBER_DONE,       //已经返回或因未捕获的异常结束
+} FiberState;
+
+//协程：拥有独立的值栈和调用帧数组。
+//正在运行的协程的执行状态保存在 vm 中，挂起时才写回协程对象。
+typedef struct ObjFiber {
+  Obj obj;
+  Value* stack;
+  Value* stackTop;
+  int stackCapacity;
+  CallFrame* frames;
+  int frameCount;
+  int frameCapacity;
+  ObjUpvalue* openUpvalues;
+  struct ObjFiber* caller;  //resume 该协程的协程，yield 或返回时切换回去
+  FiberState state;
+} ObjFiber;
+
+
 ObjBoundMethod* newBoundMethod(Value receiver,
                                ObjClosure* method);
 ObjInstance* newInstance(ObjClass* klass);
 ObjClass* newClass(ObjString* name);
 ObjFunction* newFunction();
+void freeLazyBody(LazyBody* lazy);
 ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue* newUpvalue(Value* slot);
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(NativeFn function, ObjString* name, int arity);
+ObjFiber* newFiber(ObjClosure* closure, int slotCount);
+ObjStruct* newStruct(ObjString* name, int fieldCount);
+ObjRecord* newRecord(ObjStruct* type);
+ObjModule* newModule(ObjString* path, ObjFunction* function);
+ObjForeign* newForeign(void* function, ObjString* library, ObjString* symbol,
+                       ObjString* signature);
+ObjBuffer* newBuffer(int length);
+ObjChannel* newChannel(Channel* channel);
+ObjThread* newThread(Worker* worker);
+int structFieldIndex(ObjStruct* type, ObjString* name);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+Value stringValue(const char* chars, int length);
+const char* stringChars(Value value, char* buffer, int* length);
 void printObject(Value value);
 
 
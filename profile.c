@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "profile.h"
+#include "memory.h"
+#include "vm.h"
+#include "compiler.h"
+
+//特化指令与对应的通用指令，profile 文件中按名字记录，不依赖操作码的数值
+typedef struct {
+  OpCode quick;
+  OpCode generic;
+  const char* name;
+} QuickOp;
+
+static const QuickOp quickOps[] = {
+  {OP_ADD_NUMBER,   OP_ADD,  "add_number"},
+  {OP_ADD_STRING,   OP_ADD,  "add_string"},
+  {OP_CALL_CLOSURE, OP_CALL, "call_closure"},
+};
+
+#define QUICK_OP_COUNT ((int)(sizeof(quickOps) / sizeof(quickOps[0])))
+
+//函数列表：按前序遍历常量表得到，同一份源码每次编译的顺序都相同
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+//基本块
+typedef struct {
+  int start;        //起始偏移
+  int last;         //最后一条指令（块的出口）的偏移
+  int end;          //结束偏移（不含）
+  int target;       //跳转目标块，没有则为 -1
+  int fallthrough;  //顺序执行的后继块，没有则为 -1
+  uint32_t count;   //估算的执行次数
+  int newStart;     //重排后的起始偏移，尚未放置时为 -1
+} Block;
+
+//重排时尚未确定目标位置的向前跳转
+typedef struct {
+  int position;     //跳转指令操作码的位置
+  int block;        //目标块
+} JumpPatch;
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static void collectFunctions(ObjFunction* function, FunctionList* list);
+static void freeFunctionList(FunctionList* list);
+static uint32_t hashSource(const char* source);
+static void allocateProfile(Chunk* chunk);
+static void relayout(Chunk* chunk);
+static int jumpTarget(Chunk* chunk, int offset);
+static void applyQuickening(Chunk* chunk, const uint8_t* starts, int offset,
+                            const char* name);
+static bool emitJumpTo(Chunk* out, Block* blocks, int block, int line,
+                       int column, JumpPatch* patches, int* patchCount);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 进入训练模式：为脚本中的每个函数分配分支计数。
+ * 必须在脚本开始执行之前调用。
+ *
+ * @param script 编译得到的顶层函数
+ */
+void profileStart(ObjFunction* script) {
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(script, &list);
+  for (int i = 0; i < list.count; i++) {
+    allocateProfile(&list.functions[i]->chunk);
+  }
+  freeFunctionList(&list);
+  vm.profiling = true;
+}
+
+/**
+ * 记录一次函数调用。
+ */
+void profileEnter(ObjFunction* function) {
+  if (function->chunk.profile != NULL) function->chunk.profile->entries++;
+}
+
+/**
+ * 记录一次跳转指令的执行。
+ *
+ * @param chunk 跳转指令所在的代码块
+ * @param instruction 跳转指令的操作码位置
+ * @param taken 条件跳转是否发生了跳转
+ */
+void profileBranch(Chunk* chunk, uint8_t* instruction, bool taken) {
+  if (chunk->profile == NULL) return;
+  int offset = (int)(instruction - chunk->code);
+  chunk->profile->counts[offset]++;
+  if (taken) chunk->profile->counts[offset + 1]++;
+}
+
+/**
+ * 把训练得到的分支计数和类型反馈写入 profile 文件。
+ * 类型反馈就是运行结束时字节码中已经特化的指令，按偏移记录。
+ * 文件头记录源码的哈希值，源码改动后旧的 profile 不会被使用。
+ *
+ * @return 写入成功返回 true
+ */
+bool profileSave(ObjFunction* script, const char* source, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(script, &list);
+
+  fprintf(file, "clox-profile %d %d %u\n", PROFILE_VERSION, OPCODE_VERSION,
+          hashSource(source));
+  for (int i = 0; i < list.count; i++) {
+    Chunk* chunk = &list.functions[i]->chunk;
+    if (chunk->profile == NULL) continue;
+    fprintf(file, "function %d %d %u\n", i, chunk->count,
+            chunk->profile->entries);
+    for (int offset = 0; offset <= chunk->count; offset++) {
+      uint32_t count = chunk->profile->counts[offset];
+      if (count != 0) fprintf(file, "%d %u\n", offset, count);
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      for (int j = 0; j < QUICK_OP_COUNT; j++) {
+        if (chunk->code[offset] == quickOps[j].quick) {
+          fprintf(file, "quicken %d %s\n", offset, quickOps[j].name);
+        }
+      }
+    }
+    fprintf(file, "end\n");
+  }
+
+  freeFunctionList(&list);
+  fclose(file);
+  return true;
+}
+
+/**
+ * 读取 profile 文件：先把记录过的指令直接改写为特化指令，
+ * 再按其中的计数重排各函数的字节码，热的基本块保持原有顺序连续排列，冷块移到函数末尾。
+ * 文件不存在、文件格式或指令编码的版本、源码哈希不匹配时不做任何改动。
+ *
+ * @return 成功应用返回 true
+ */
+bool profileApply(ObjFunction* script, const char* source, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+
+  int version, opcodeVersion;
+  unsigned int hash;
+  if (fscanf(file, "clox-profile %d %d %u", &version, &opcodeVersion,
+             &hash) != 3 ||
+      version != PROFILE_VERSION || opcodeVersion != OPCODE_VERSION ||
+      hash != hashSource(source)) {
+    fclose(file);
+    return false;
+  }
+
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(script, &list);
+
+  int index, codeCount;
+  unsigned int entries;
+  while (fscanf(file, " function %d %d %u", &index, &codeCount, &entries) == 3) {
+    Chunk* chunk = NULL;
+    if (index >= 0 && index < list.count &&
+        list.functions[index]->chunk.count == codeCount) {
+      chunk = &list.functions[index]->chunk;
+      allocateProfile(chunk);
+      chunk->profile->entries = entries;
+    }
+
+    int offset;
+    unsigned int count;
+    while (fscanf(file, " %d %u", &offset, &count) == 2) {
+      if (chunk != NULL && offset >= 0 && offset <= codeCount) {
+        chunk->profile->counts[offset] = count;
+      }
+    }
+    //特化指令与通用指令长度相同，改写之后指令起点不变
+    uint8_t* starts = chunk != NULL ? instructionStarts(chunk) : NULL;
+    char name[32];
+    while (fscanf(file, " quicken %d %31s", &offset, name) == 2) {
+      if (chunk != NULL) applyQuickening(chunk, starts, offset, name);
+    }
+    if (chunk != NULL) FREE_ARRAY(uint8_t, starts, chunk->count);
+    int matched = 0;
+    if (fscanf(file, " end%n", &matched) == EOF || matched == 0) break;
+
+    if (chunk != NULL) {
+      relayout(chunk);
+      freeBranchProfile(chunk);
+    }
+  }
+
+  freeFunctionList(&list);
+  fclose(file);
+  return true;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+static void collectFunctions(ObjFunction* function, FunctionList* list) {
+#ifdef LAZY_COMPILE
+  //profile 按函数在常量表中出现的顺序编号，所有函数体都要先编译出来
+  compileFunction(function);
+#endif
+  if (list->count == list->capacity) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction*, list->functions,
+                                 oldCapacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(AS_FUNCTION(constants->values[i]), list);
+    }
+  }
+}
+
+static void freeFunctionList(FunctionList* list) {
+  FREE_ARRAY(ObjFunction*, list->functions, list->capacity);
+}
+
+static uint32_t hashSource(const char* source) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = source; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static void allocateProfile(Chunk* chunk) {
+  freeBranchProfile(chunk);
+  BranchProfile* profile = ALLOCATE(BranchProfile, 1);
+  profile->entries = 0;
+  //多留一个位置，函数末尾的 OP_JUMP_IF_FALSE 也有地方记录跳转次数
+  profile->counts = ALLOCATE(uint32_t, chunk->count + 1);
+  memset(profile->counts, 0, sizeof(uint32_t) * (chunk->count + 1));
+  chunk->profile = profile;
+}
+
+/**
+ * 返回跳转指令的目标偏移。
+ */
+static int jumpTarget(Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+/**
+ * 把偏移处的通用指令改写为记录中的特化指令。
+ * 偏移处不是指令的起点，或者不是对应的通用指令时忽略该记录，
+ * 过期的记录不会把操作数当作操作码改写。
+ */
+static void applyQuickening(Chunk* chunk, const uint8_t* starts, int offset,
+                            const char* name) {
+  if (offset < 0 || offset >= chunk->count || !starts[offset]) return;
+  for (int i = 0; i < QUICK_OP_COUNT; i++) {
+    if (strcmp(quickOps[i].name, name) == 0 &&
+        chunk->code[offset] == quickOps[i].generic) {
+      chunk->code[offset] = quickOps[i].quick;
+      return;
+    }
+  }
+}
+
+/**
+ * 按 profile 重排代码块。
+ * 先划分基本块，由调用次数和各跳转指令的计数推算每个块的执行次数，
+ * 再把热块按原顺序排在前面、冷块排在后面，重新生成跳转指令和位置信息。
+ * 顺序执行的后继块不再紧随其后时补一条跳转；跳转目标恰好紧随其后时省掉跳转。
+ * 含有异常表的函数不重排，异常表要求 try 区间在字节码中连续；
+ * 用到长跳转的函数也不重排，重新生成的跳转只有 16 位。
+ */
+static void relayout(Chunk* chunk) {
+  if (chunk->handlerCount > 0 || chunk->profile->entries == 0) return;
+
+  int count = chunk->count;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_JUMP_LONG || instruction == OP_JUMP_IF_FALSE_LONG ||
+        instruction == OP_LOOP_LONG) {
+      return;
+    }
+  }
+  uint32_t* counts = chunk->profile->counts;
+
+  //划分基本块：函数入口、跳转目标和跳转/返回之后的指令都是块的起点
+  int* blockOf = ALLOCATE(int, count + 1);
+  for (int i = 0; i <= count; i++) blockOf[i] = 0;
+  blockOf[0] = 1;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    switch (chunk->code[offset]) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_LOOP:
+        blockOf[jumpTarget(chunk, offset)] = 1;
+        blockOf[offset + 3] = 1;
+        break;
+      case OP_RETURN:
+      case OP_THROW:
+        blockOf[offset + 1] = 1;
+        break;
+    }
+  }
+
+  int blockCount = 0;
+  for (int i = 0; i < count; i++) {
+    if (blockOf[i]) blockCount++;
+  }
+  Block* blocks = ALLOCATE(Block, blockCount);
+  int current = -1;
+  for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+    if (blockOf[offset]) {
+      current++;
+      blocks[current].start = offset;
+      blocks[current].newStart = -1;
+      blocks[current].count = 0;
+    }
+    blocks[current].last = offset;
+    blocks[current].end = offset + instructionLength(chunk, offset);
+    blockOf[offset] = current;
+  }
+
+  //后继块
+  for (int i = 0; i < blockCount; i++) {
+    Block* block = &blocks[i];
+    uint8_t instruction = chunk->code[block->last];
+    bool isJump = instruction == OP_JUMP || instruction == OP_LOOP ||
+                  instruction == OP_JUMP_IF_FALSE;
+    block->target = isJump ? blockOf[jumpTarget(chunk, block->last)] : -1;
+    block->fallthrough = -1;
+    if (instruction != OP_JUMP && instruction != OP_LOOP &&
+        instruction != OP_RETURN && instruction != OP_THROW &&
+        i + 1 < blockCount) {
+      block->fallthrough = i + 1;
+    }
+  }
+
+  //推算执行次数：跳转边直接有计数，顺序执行的边来自前一个块，按顺序累加即可
+  blocks[0].count = chunk->profile->entries;
+  for (int i = 0; i < blockCount; i++) {
+    Block* block = &blocks[i];
+    uint8_t instruction = chunk->code[block->last];
+    if (instruction == OP_JUMP_IF_FALSE) {
+      blocks[block->target].count += counts[block->last + 1];
+    } else if (block->target >= 0) {
+      blocks[block->target].count += counts[block->last];
+    }
+  }
+  uint32_t maxCount = 0;
+  for (int i = 0; i < blockCount; i++) {
+    Block* block = &blocks[i];
+    if (block->count > maxCount) maxCount = block->count;
+    if (block->fallthrough < 0) continue;
+    if (chunk->code[block->last] == OP_JUMP_IF_FALSE) {
+      blocks[i + 1].count += counts[block->last] - counts[block->last + 1];
+    } else {
+      blocks[i + 1].count += block->count;
+    }
+  }
+
+  //入口块永远在最前面，其余块按冷热分成两段，各自保持原有顺序
+  int* order = ALLOCATE(int, blockCount);
+  int orderCount = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < blockCount; i++) {
+      bool cold = i != 0 &&
+          (uint64_t)blocks[i].count * PROFILE_COLD_RATIO < maxCount;
+      if (cold == (pass == 1)) order[orderCount++] = i;
+    }
+  }
+
+  bool changed = false;
+  for (int i = 0; i < blockCount; i++) {
+    if (order[i] != i) changed = true;
+  }
+
+  Chunk out;
+  initChunk(&out);
+  JumpPatch* patches = ALLOCATE(JumpPatch, blockCount * 2);
+  int patchCount = 0;
+  bool overflow = false;
+
+  for (int i = 0; changed && i < blockCount; i++) {
+    Block* block = &blocks[order[i]];
+    int next = i + 1 < blockCount ? order[i + 1] : -1;
+    block->newStart = out.count;
+
+    for (int offset = block->start; offset < block->last; offset++) {
+      writeChunk(&out, chunk->code[offset], getLine(chunk, offset),
+                 getColumn(chunk, offset));
+    }
+
+    uint8_t instruction = chunk->code[block->last];
+    int line = getLine(chunk, block->last);
+    int column = getColumn(chunk, block->last);
+    if (instruction == OP_JUMP || instruction == OP_LOOP) {
+      if (block->target != next) {
+        overflow |= !emitJumpTo(&out, blocks, block->target, line, column,
+                                patches, &patchCount);
+      }
+      continue;
+    }
+
+    if (instruction == OP_JUMP_IF_FALSE) {
+      if (blocks[block->target].newStart >= 0) {
+        //目标已经放在前面：条件跳转只能向前，借一条 OP_LOOP 跳回去
+        writeChunk(&out, OP_JUMP_IF_FALSE, line, column);
+        writeChunk(&out, 0, line, column);
+        writeChunk(&out, 3, line, column);
+        overflow |= !emitJumpTo(&out, blocks, block->fallthrough, line, column,
+                                patches, &patchCount);
+        overflow |= !emitJumpTo(&out, blocks, block->target, line, column,
+                                patches, &patchCount);
+        continue;
+      }
+      patches[patchCount].position = out.count;
+      patches[patchCount].block = block->target;
+      patchCount++;
+      writeChunk(&out, OP_JUMP_IF_FALSE, line, column);
+      writeChunk(&out, 0xff, line, column);
+      writeChunk(&out, 0xff, line, column);
+    } else {
+      for (int offset = block->last; offset < block->end; offset++) {
+        writeChunk(&out, chunk->code[offset], getLine(chunk, offset),
+                 getColumn(chunk, offset));
+      }
+    }
+
+    if (block->fallthrough >= 0 && block->fallthrough != next) {
+      overflow |= !emitJumpTo(&out, blocks, block->fallthrough, line, column,
+                              patches, &patchCount);
+    }
+  }
+
+  for (int i = 0; changed && i < patchCount; i++) {
+    int jump = blocks[patches[i].block].newStart - patches[i].position - 3;
+    if (jump > UINT16_MAX) {
+      overflow = true;
+      break;
+    }
+    out.code[patches[i].position + 1] = (jump >> 8) & 0xff;
+    out.code[patches[i].position + 2] = jump & 0xff;
+  }
+
+  if (changed && !overflow) {
+    //常量表保持不变，只替换字节码和位置信息
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    freeLineTable(&chunk->lines);
+    chunk->code = out.code;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->lines = out.lines;
+  } else {
+    FREE_ARRAY(uint8_t, out.code, out.capacity);
+    freeLineTable(&out.lines);
+  }
+
+  FREE_ARRAY(JumpPatch, patches, blockCount * 2);
+  FREE_ARRAY(int, order, blockCount);
+  FREE_ARRAY(Block, blocks, blockCount);
+  FREE_ARRAY(int, blockOf, count + 1);
+}
+
+/**
+ * 生成一条跳到指定块的无条件跳转：目标已放置时用 OP_LOOP 向后跳，
+ * 否则用 OP_JUMP 向前跳并记录下来，等所有块放置完后回填。
+ *
+ * @return 向后跳转的距离超出 16 位时返回 false
+ */
+static bool emitJumpTo(Chunk* out, Block* blocks, int block, int line,
+                       int column, JumpPatch* patches, int* patchCount) {
+  if (blocks[block].newStart >= 0) {
+    int jump = out->count + 3 - blocks[block].newStart;
+    writeChunk(out, OP_LOOP, line, column);
+    writeChunk(out, (jump >> 8) & 0xff, line, column);
+    writeChunk(out, jump & 0xff, line, column);
+    return jump <= UINT16_MAX;
+  }
+  patches[*patchCount].position = out->count;
+  patches[*patchCount].block = block;
+  (*patchCount)++;
+  writeChunk(out, OP_JUMP, line, column);
+  writeChunk(out, 0xff, line, column);
+  writeChunk(out, 0xff, line, column);
+  return true;
+}
@@ -0,0 +1,24 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 执行次数低于函数内最热基本块 1/PROFILE_COLD_RATIO 的基本块视为冷块 */
+#define PROFILE_COLD_RATIO 16
+
+/* profile 文件格式版本，文件头同时记录 OPCODE_VERSION */
+#define PROFILE_VERSION 3
+
+
+void profileStart(ObjFunction* script);
+void profileEnter(ObjFunction* function);
+void profileBranch(Chunk* chunk, uint8_t* instruction, bool taken);
+bool profileSave(ObjFunction* script, const char* source, const char* path);
+bool profileApply(ObjFunction* script, const char* source, const char* path);
+
+#endif // clox_profile_h
@@ -0,0 +1,46 @@
+#ifndef clox_ref_h
+#define clox_ref_h
+
+#include "common.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/*
+ * 堆内引用：对象头的 next、哈希表的键和闭包的上值数组都通过 Ref 保存。
+ * 定义 COMPRESSED_REFS 时 Ref 是相对内存池起始地址的 32 位偏移，
+ * 内存池不超过 4GB，且偏移 0 处是 TLSF 的控制结构，不会是任何对象，可以表示 NULL。
+ */
+#ifdef COMPRESSED_REFS
+
+typedef uint32_t Ref;
+
+#define NULL_REF ((Ref)0)
+
+extern THREAD_LOCAL char* heapBase;  //内存池起始地址
+
+static inline Ref toRef(const void* pointer) {
+  return pointer == NULL ? NULL_REF : (Ref)((const char*)pointer - heapBase);
+}
+
+static inline void* fromRef(Ref ref) {
+  return ref == NULL_REF ? NULL : heapBase + ref;
+}
+
+#else
+
+typedef void* Ref;
+
+#define NULL_REF NULL
+
+static inline Ref toRef(const void* pointer) {
+  return (Ref)pointer;
+}
+
+static inline void* fromRef(Ref ref) {
+  return ref;
+}
+
+#endif // COMPRESSED_REFS
+
+#endif // clox_ref_h
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "region.h"
+#include "io.h"
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static void appendObject(Obj*** objects, int* count, int* capacity,
+                         Obj* object);
+static void forwardTable(Table* table);
+static void forwardContents(Obj* object);
+static void forwardRoots(Region* region, Value* result);
+static void reinternStrings(Region* region);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 进入区域，之后创建的对象都分配在区域中。
+ */
+void enterRegion(Region* region) {
+  initArena(&region->arena);
+  region->objects = NULL;
+  region->count = 0;
+  region->capacity = 0;
+  region->remembered = NULL;
+  region->rememberedCount = 0;
+  region->rememberedCapacity = 0;
+  region->rememberedBits = NULL;
+  region->rememberedWords = 0;
+  region->forwards = NULL;
+  region->promoted = NULL;
+  region->promotedCount = 0;
+  region->promotedCapacity = 0;
+  vm.region = region;
+}
+
+/**
+ * 离开区域：把仍然可达的区域对象复制到主堆，然后整块释放 arena。
+ * 不可达的对象只释放它们持有的数组和外部资源，对象头不逐个释放。
+ *
+ * 复制期间暂停 GC，vm.region 保持不变直到 arena 释放，
+ * 复制出的对象直接登记到对象表，不经过 allocateObject。
+ *
+ * @param result 区域中执行的函数的返回值，改写为复制后的对象；可以为 NULL
+ */
+void leaveRegion(Region* region, Value* result) {
+  vm.gcPaused++;
+  region->forwards = (Obj**)clox_malloc(sizeof(Obj*) * (region->count + 1));
+  if (region->forwards == NULL) exit(1);
+  memset(region->forwards, 0, sizeof(Obj*) * (region->count + 1));
+
+  forwardRoots(region, result);
+  //按复制的顺序改写副本中的引用，途中复制出的对象追加到队列末尾
+  for (int i = 0; i < region->promotedCount; i++) {
+    forwardContents(region->promoted[i]);
+  }
+  reinternStrings(region);
+
+  for (int i = 0; i < region->count; i++) {
+    if (region->forwards[i] == NULL) releaseObject(region->objects[i]);
+  }
+  freeArena(&region->arena);
+  clox_free(region->objects);
+  clox_free(region->remembered);
+  clox_free(region->rememberedBits);
+  clox_free(region->forwards);
+  clox_free(region->promoted);
+  vm.region = NULL;
+  vm.gcPaused--;
+}
+
+/**
+ * 在当前区域中分配对象。对象清零后才加入区域，
+ * 区域期间的 GC 遍历全部区域对象，读到的是还没有初始化的空字段。
+ */
+Obj* regionAlloc(size_t size, ObjType type) {
+  Region* region = vm.region;
+  //arena 申请新块时可能触发 GC
+  Obj* object = (Obj*)arenaAlloc(&region->arena, size);
+  memset(object, 0, size);
+  object->type = type;
+  object->space = SPACE_REGION;
+  object->id = region->count;
+  appendObject(&region->objects, &region->count, &region->capacity, object);
+  return object;
+}
+
+/**
+ * 把主堆对象加入当前区域的记忆集，已经在记忆集中时不重复加入。
+ */
+void rememberObject(Obj* container) {
+  Region* region = vm.region;
+  int word = container->id >> 6;
+  if (word >= region->rememberedWords) {
+    int oldWords = region->rememberedWords;
+    int words = GROW_CAPACITY(oldWords);
+    while (words <= word) words *= 2;
+    region->rememberedBits = (uint64_t*)clox_realloc(
+        region->rememberedBits, sizeof(uint64_t) * words);
+    if (region->rememberedBits == NULL) exit(1);
+    memset(region->rememberedBits + oldWords, 0,
+           sizeof(uint64_t) * (words - oldWords));
+    region->rememberedWords = words;
+  }
+
+  uint64_t bit = (uint64_t)1 << (container->id & 63);
+  if ((region->rememberedBits[word] & bit) != 0) return;
+  region->rememberedBits[word] |= bit;
+  appendObject(&region->remembered, &region->rememberedCount,
+               &region->rememberedCapacity, container);
+}
+
+/**
+ * GC 的根：区域中的全部对象都视为存活，遍历它们引用的主堆对象。
+ * 记忆集中的对象离开区域时还要改写，区域期间也不能回收。
+ */
+void markRegion() {
+  Region* region = vm.region;
+  if (region == NULL) return;
+  for (int i = 0; i < region->count; i++) {
+    traceObject(region->objects[i]);
+  }
+  for (int i = 0; i < region->rememberedCount; i++) {
+    markObject(region->remembered[i]);
+  }
+}
+
+/**
+ * 离开区域时取得对象在主堆中的副本，第一次遇到时复制。
+ * 不在区域中的对象原样返回。
+ */
+Obj* forwardObject(Obj* object) {
+  if (object == NULL || object->space != SPACE_REGION) return object;
+  Region* region = vm.region;
+  Obj* copy = region->forwards[object->id];
+  if (copy != NULL) return copy;
+
+  size_t size = objectSize(object);
+  copy = (Obj*)reallocate(NULL, 0, size);
+  memcpy(copy, object, size);
+  copy->space = SPACE_HEAP;
+  registerObject(copy);
+  //关闭的上值指向自己的 closed 字段
+  if (object->type == OBJ_UPVALUE &&
+      ((ObjUpvalue*)object)->location == &((ObjUpvalue*)object)->closed) {
+    ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+  }
+
+  region->forwards[object->id] = copy;
+  appendObject(&region->promoted, &region->promotedCount,
+               &region->promotedCapacity, copy);
+  return copy;
+}
+
+Value forwardValue(Value value) {
+  if (!IS_OBJ(value) || AS_OBJ(value)->space != SPACE_REGION) return value;
+  return OBJ_VAL(forwardObject(AS_OBJ(value)));
+}
+
+/**
+ * region(fn, args...)：在区域中调用 fn(args...)，返回它的返回值。
+ * 区域中已经在执行时直接调用，嵌套的区域并入外层。
+ */
+bool regionNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (argCount < 1) return nativeError(vm, "Expected a function to call.");
+  if (vm->region != NULL) {
+    return callClosure(vm, args[0], argCount - 1, args + 1, result);
+  }
+
+  Region region;
+  enterRegion(&region);
+  bool ok = callClosure(vm, args[0], argCount - 1, args + 1, result);
+  leaveRegion(&region, ok ? result : NULL);
+  return ok;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+/**
+ * 向对象指针数组追加一个元素。数组用 clox_realloc 增长，不触发 GC。
+ */
+static void appendObject(Obj*** objects, int* count, int* capacity,
+                         Obj* object) {
+  if (*count == *capacity) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *objects = (Obj**)clox_realloc(*objects, sizeof(Obj*) * *capacity);
+    if (*objects == NULL) exit(1);
+  }
+  (*objects)[(*count)++] = object;
+}
+
+/**
+ * 改写哈希表的键和值。字符串的哈希值保存在对象中，副本的槽位不变。
+ */
+static void forwardTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    ObjString* key = ENTRY_KEY(entry);
+    if (key == NULL) continue;
+    entry->key = toRef(forwardObject((Obj*)key));
+    entry->value = forwardValue(entry->value);
+  }
+}
+
+/**
+ * 改写对象中对区域对象的引用，与 blackenObject 遍历的字段一致。
+ */
+static void forwardContents(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      bound->receiver = forwardValue(bound->receiver);
+      bound->method = (ObjClosure*)forwardObject((Obj*)bound->method);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      instance->klass = (ObjClass*)forwardObject((Obj*)instance->klass);
+      forwardTable(&instance->fields);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      klass->name = (ObjString*)forwardObject((Obj*)klass->name);
+      forwardTable(&klass->methods);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      closure->function = (ObjFunction*)forwardObject((Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] =
+            toRef(forwardObject((Obj*)CLOSURE_UPVALUE(closure, i)));
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      function->name = (ObjString*)forwardObject((Obj*)function->name);
+      function->module = (ObjModule*)forwardObject((Obj*)function->module);
+      ValueArray* constants = &function->chunk.constants;
+      for (int i = 0; i < constants->count; i++) {
+        constants->values[i] = forwardValue(constants->values[i]);
+      }
+      memoForward(function->memo);
+#ifdef LAZY_COMPILE
+      if (function->lazy != NULL) {
+        LazyBody* lazy = function->lazy;
+        lazy->source = (ObjString*)forwardObject((Obj*)lazy->source);
+        for (int i = 0; i < lazy->upvalueNameCount; i++) {
+          lazy->upvalueNames[i] =
+              (ObjString*)forwardObject((Obj*)lazy->upvalueNames[i]);
+        }
+      }
+#endif
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      upvalue->closed = forwardValue(upvalue->closed);
+      upvalue->next = (ObjUpvalue*)forwardObject((Obj*)upvalue->next);
+      break;
+    }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      fiber->caller = (ObjFiber*)forwardObject((Obj*)fiber->caller);
+      //正在运行的协程的执行状态在 vm 中，作为根改写
+      if (fiber == vm.fiber) break;
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        *slot = forwardValue(*slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        fiber->frames[i].closure =
+            (ObjClosure*)forwardObject((Obj*)fiber->frames[i].closure);
+      }
+      fiber->openUpvalues =
+          (ObjUpvalue*)forwardObject((Obj*)fiber->openUpvalues);
+      break;
+    }
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      type->name = (ObjString*)forwardObject((Obj*)type->name);
+      for (int i = 0; i < type->fieldCount; i++) {
+        type->fields[i] = (ObjString*)forwardObject((Obj*)type->fields[i]);
+      }
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      record->type = (ObjStruct*)forwardObject((Obj*)record->type);
+      for (int i = 0; i < record->fieldCount; i++) {
+        record->fields[i] = forwardValue(record->fields[i]);
+      }
+      break;
+    }
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      module->path = (ObjString*)forwardObject((Obj*)module->path);
+      module->function = (ObjFunction*)forwardObject((Obj*)module->function);
+      forwardTable(&module->globals);
+      break;
+    }
+    case OBJ_NATIVE: {
+      ObjNative* native = (ObjNative*)object;
+      native->name = (ObjString*)forwardObject((Obj*)native->name);
+      break;
+    }
+    case OBJ_FOREIGN: {
+      ObjForeign* foreign = (ObjForeign*)object;
+      foreign->library = (ObjString*)forwardObject((Obj*)foreign->library);
+      foreign->symbol = (ObjString*)forwardObject((Obj*)foreign->symbol);
+      foreign->signature = (ObjString*)forwardObject((Obj*)foreign->signature);
+      break;
+    }
+    case OBJ_BUFFER:
+    case OBJ_CHANNEL:
+    case OBJ_THREAD:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+/**
+ * 改写根和记忆集中的对象，与 markRoots 的根一致。
+ * 编译器和镜像加载的根只在它们执行期间存在，区域不会在其间结束。
+ */
+static void forwardRoots(Region* region, Value* result) {
+  if (result != NULL) *result = forwardValue(*result);
+
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    *slot = forwardValue(*slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure =
+        (ObjClosure*)forwardObject((Obj*)vm.frames[i].closure);
+  }
+  vm.openUpvalues = (ObjUpvalue*)forwardObject((Obj*)vm.openUpvalues);
+  vm.fiber = (ObjFiber*)forwardObject((Obj*)vm.fiber);
+  vm.pendingError = forwardValue(vm.pendingError);
+
+  for (Handle* handle = vm.handles; handle != NULL; handle = handle->next) {
+    handle->value = forwardValue(handle->value);
+  }
+
+  forwardTable(&vm.globals);
+  forwardTable(&vm.modules);
+  forwardEventLoop();
+
+  //复制出的副本属于新生代，老年代的容器改写后进入记忆集
+  for (int i = 0; i < region->rememberedCount; i++) {
+    Obj* container = region->remembered[i];
+    forwardContents(container);
+    if (isOld(container)) rememberOld(container);
+  }
+}
+
+/**
+ * 字符串池不是根：复制了的字符串换成副本，其余的从池中删除。
+ */
+static void reinternStrings(Region* region) {
+  for (int i = 0; i < region->count; i++) {
+    Obj* object = region->objects[i];
+    if (object->type != OBJ_STRING) continue;
+    tableDelete(&vm.strings, (ObjString*)object);
+    if (region->forwards[i] != NULL) {
+      tableSet(&vm.strings, (ObjString*)region->forwards[i], NIL_VAL);
+    }
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef clox_region_h
+#define clox_region_h
+
+#include "common.h"
+#include "arena.h"
+#include "vm.h"
+
+/*
+ * 区域：一次请求期间创建的对象从 arena 中按指针递增分配，不登记到对象表，
+ * 也不由 GC 逐个回收。请求结束时离开区域，整块释放 arena。
+ *
+ * 逃逸到区域之外的对象在离开区域时复制到主堆：从根、记忆集中的主堆对象
+ * 和已经复制的对象出发，把引用到的区域对象依次复制过去并改写引用。
+ * 主堆对象在区域期间写入区域对象的引用时经 writeBarrier（memory.h）进入记忆集。
+ *
+ *   Region region;
+ *   enterRegion(&region);
+ *   ok = callClosure(vm, handler, 1, &request, &response);
+ *   leaveRegion(&region, &response);
+ *
+ * 区域期间的 GC 把全部区域对象当作根，区域中的对象不会被提前回收。
+ * 区域中的对象不能冻结共享，spawn 的函数需要在区域之外创建和编译。
+ */
+
+struct Region {
+  Arena arena;
+  Obj** objects;      //区域中的全部对象，以对象的 id 为下标
+  int count;
+  int capacity;
+  Obj** remembered;   //写入过区域对象引用的主堆对象
+  int rememberedCount;
+  int rememberedCapacity;
+  uint64_t* rememberedBits;  //以主堆对象的 id 为位号，避免重复记录
+  int rememberedWords;
+  Obj** forwards;     //离开区域时：区域对象 id 到主堆中副本的映射
+  Obj** promoted;     //离开区域时：已经复制、尚未改写引用的副本
+  int promotedCount;
+  int promotedCapacity;
+};
+
+void enterRegion(Region* region);
+void leaveRegion(Region* region, Value* result);
+Obj* regionAlloc(size_t size, ObjType type);
+void rememberObject(Obj* container);
+void markRegion();
+Obj* forwardObject(Obj* object);
+Value forwardValue(Value value);
+bool regionNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif // clox_region_h
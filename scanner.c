@@ -16,7 +16,7 @@ typedef struct {
 } Scanner;
 
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 /****************************************/
 /****    static function declaration  ***/
@@ -40,10 +40,21 @@ static Token identifier();
 /****    public function definition  ****/
 /****************************************/
 void initScanner(const char* source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
-  scanner.column = 1;
+  initScannerAt(source, 1, 1);
+}
+
+/**
+ * 从源码中间的某个位置开始扫描，用于延迟编译的函数体。
+ *
+ * @param position 开始扫描的位置
+ * @param line position 所在的行
+ * @param column position 所在的列
+ */
+void initScannerAt(const char* position, int line, int column) {
+  scanner.start = position;
+  scanner.current = position;
+  scanner.line = line;
+  scanner.column = column;
 }
 
 /**
@@ -312,6 +323,9 @@ static TokenType identifierType()
       case 'l':
         return checkKeyword(2, 3, "ass", TOKEN_CLASS);
       case 'a':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 't') {
+          return checkKeyword(3, 2, "ch", TOKEN_CATCH);
+        }
         return checkKeyword(2, 2, "se", TOKEN_CASE);
       case 'o':
         return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
@@ -337,7 +351,19 @@ static TokenType identifierType()
     }
     break;
   case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
+    if (scanner.current - scanner.start > 1)
+    {
+      switch (scanner.start[1])
+      {
+      case 'f':
+        return checkKeyword(2, 0, "", TOKEN_IF);
+      case 'm':
+        return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+      }
+    }
+    break;
+  case 'm':
+    return checkKeyword(1, 3, "emo", TOKEN_MEMO);
   case 'n':
     return checkKeyword(1, 2, "il", TOKEN_NIL);
   case 'o':
@@ -345,14 +371,26 @@ static TokenType identifierType()
   case 'p':
     return checkKeyword(1, 4, "rint", TOKEN_PRINT);
   case 'r':
-    return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+    if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e')
+    {
+      switch (scanner.start[2])
+      {
+      case 't':
+        return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+      case 's':
+        return checkKeyword(3, 3, "ume", TOKEN_RESUME);
+      }
+    }
+    break;
   case 's':
     if (scanner.current - scanner.start > 1)
     {
       switch (scanner.start[1])
       {
+      case 't':
+        return checkKeyword(2, 4, "ruct", TOKEN_STRUCT);
       case 'u':
-        return checkKeyword(2, 4, "uper", TOKEN_SUPER);
+        return checkKeyword(2, 3, "per", TOKEN_SUPER);
       case 'w':
         return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
       }
@@ -364,8 +402,14 @@ static TokenType identifierType()
       switch (scanner.start[1])
       {
       case 'h':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'r') {
+          return checkKeyword(3, 2, "ow", TOKEN_THROW);
+        }
         return checkKeyword(2, 2, "is", TOKEN_THIS);
       case 'r':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'y') {
+          return checkKeyword(3, 0, "", TOKEN_TRY);
+        }
         return checkKeyword(2, 2, "ue", TOKEN_TRUE);
       }
     }
@@ -374,6 +418,8 @@ static TokenType identifierType()
     return checkKeyword(1, 2, "ar", TOKEN_VAR);
   case 'w':
     return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+  case 'y':
+    return checkKeyword(1, 4, "ield", TOKEN_YIELD);
   }
 
   return TOKEN_IDENTIFIER;
@@ -33,7 +33,10 @@ typedef enum {
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
   TOKEN_SWITCH, TOKEN_CASE, TOKEN_BREAK, TOKEN_DEFAULT,
-  TOKEN_CONTINUE,
+  TOKEN_CONTINUE, TOKEN_MEMO,
+  TOKEN_TRY, TOKEN_CATCH, TOKEN_THROW,
+  TOKEN_YIELD, TOKEN_RESUME, TOKEN_STRUCT,
+  TOKEN_IMPORT,
 
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -48,5 +51,6 @@ typedef struct {
 
 
 void initScanner(const char* source);
+void initScannerAt(const char* position, int line, int column);
 Token scanToken();
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include <limits.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "vm.h"
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static void removeCurrent(Scheduler* scheduler);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * @param quantum 优先级为 1 的任务每个时间片的预算，必须大于 0
+ */
+void initScheduler(Scheduler* scheduler, int quantum) {
+  scheduler->current = NULL;
+  scheduler->last = NULL;
+  scheduler->quantum = quantum;
+  scheduler->failed = 0;
+}
+
+/**
+ * 在新的隔离区中编译脚本，加入调度队列的末尾。
+ *
+ * @param path 脚本路径，import 相对它所在的目录解析；可以为 NULL
+ * @param priority 1 到 TASK_PRIORITY_MAX，超出范围时截断
+ * @return 编译错误时返回 false，错误已经打印，计入失败的任务数
+ */
+bool addTask(Scheduler* scheduler, const char* source, const char* path,
+             int priority) {
+  Isolate* isolate = newIsolate(NULL);
+  enterIsolate(isolate);
+  vm.scriptPath = path;
+  ObjFunction* function = compileScript(source);
+  bool ok = function != NULL && startScript(function);
+  leaveIsolate(isolate);
+  if (!ok) {
+    freeIsolate(isolate);
+    scheduler->failed++;
+    return false;
+  }
+
+  Task* task = (Task*)malloc(sizeof(Task));
+  if (task == NULL) exit(1);
+  task->isolate = isolate;
+  if (priority < 1) priority = 1;
+  if (priority > TASK_PRIORITY_MAX) priority = TASK_PRIORITY_MAX;
+  task->priority = priority;
+  if (scheduler->current == NULL) {
+    task->next = task;
+    scheduler->current = task;
+  } else {
+    task->next = scheduler->current;
+    scheduler->last->next = task;
+  }
+  scheduler->last = task;
+  return true;
+}
+
+/**
+ * 执行下一个任务的一个时间片。任务结束时释放它的隔离区。
+ *
+ * @return 还有任务没有结束时返回 true
+ */
+bool stepScheduler(Scheduler* scheduler) {
+  Task* task = scheduler->current;
+  if (task == NULL) return false;
+
+  int budget = scheduler->quantum > INT_MAX / task->priority
+                   ? INT_MAX
+                   : scheduler->quantum * task->priority;
+  enterIsolate(task->isolate);
+  InterpretResult result = resumeScript(budget);
+  leaveIsolate(task->isolate);
+
+  if (result == INTERPRET_PREEMPTED) {
+    scheduler->last = task;
+    scheduler->current = task->next;
+  } else {
+    if (result != INTERPRET_OK) scheduler->failed++;
+    removeCurrent(scheduler);
+  }
+  return scheduler->current != NULL;
+}
+
+/**
+ * 轮流执行全部任务直到它们都结束。
+ *
+ * @return 失败的任务数
+ */
+int runTasks(Scheduler* scheduler) {
+  while (stepScheduler(scheduler)) {}
+  return scheduler->failed;
+}
+
+/**
+ * 释放还没有结束的任务。
+ */
+void freeScheduler(Scheduler* scheduler) {
+  while (scheduler->current != NULL) {
+    removeCurrent(scheduler);
+  }
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+static void removeCurrent(Scheduler* scheduler) {
+  Task* task = scheduler->current;
+  if (task->next == task) {
+    scheduler->current = NULL;
+    scheduler->last = NULL;
+  } else {
+    scheduler->last->next = task->next;
+    scheduler->current = task->next;
+  }
+  freeIsolate(task->isolate);
+  free(task);
+}
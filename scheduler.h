@@ -0,0 +1,48 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include "common.h"
+#include "isolate.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* 优先级为 1 的任务每个时间片的预算：回边和调用的次数 */
+#define SCHEDULER_QUANTUM 10000
+/* 优先级的上限，时间片预算是 quantum 乘以优先级 */
+#define TASK_PRIORITY_MAX 100
+
+/*
+ * 调度器：在一个宿主线程上分时执行多个脚本。每个任务是一个隔离区，
+ * 拥有自己的堆和全局变量；任务轮流执行一个时间片，时间片的预算与优先级成正比，
+ * 死循环的任务也会在回边处让出，不会饿死其他任务。
+ *
+ *   Scheduler scheduler;
+ *   initScheduler(&scheduler, SCHEDULER_QUANTUM);
+ *   addTask(&scheduler, source, path, 1);
+ *   ...
+ *   int failed = runTasks(&scheduler);
+ *   freeScheduler(&scheduler);
+ */
+
+typedef struct Task {
+  Isolate* isolate;
+  int priority;
+  struct Task* next;    //环形链表中的下一个任务
+} Task;
+
+typedef struct {
+  Task* current;        //下一个执行的任务，没有任务时为 NULL
+  Task* last;           //current 的前一个任务，新任务插在它之后
+  int quantum;
+  int failed;           //因编译错误或未捕获的异常结束的任务数
+} Scheduler;
+
+void initScheduler(Scheduler* scheduler, int quantum);
+bool addTask(Scheduler* scheduler, const char* source, const char* path,
+             int priority);
+bool stepScheduler(Scheduler* scheduler);
+int runTasks(Scheduler* scheduler);
+void freeScheduler(Scheduler* scheduler);
+
+#endif // clox_scheduler_h
@@ -0,0 +1,109 @@
+/*
+ * 嵌入接口的宿主测试：编译一次之后反复调用，句柄固定的值经过强制 GC 仍然有效，
+ * 编译错误、运行时错误和参数个数错误都返回错误，之后虚拟机还能继续使用。
+ *
+ * 构建并运行（除 main.c 之外的全部源文件），全部通过时输出 ok 并返回 0：
+ *   cc -I. -o embed_host test/embed_host.c $(ls *.c | grep -v '^main.c$') \
+ *      tlsf/tlsf.c -ldl -lpthread -lm
+ *   ./embed_host
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "embed.h"
+#include "memory.h"
+#include "object.h"
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #condition);                                                 \
+      exit(1);                                                             \
+    }                                                                      \
+  } while (false)
+
+static const char* source =
+    "var hits = 0;\n"
+    "fun handle(n, s) { hits = hits + 1; return n * 2; }\n"
+    "fun count() { return hits; }\n"
+    "fun churn() {\n"
+    "  var s = \"\";\n"
+    "  for (var i = 0; i < 1000; i = i + 1) s = s + \"ab\";\n"
+    "  return s;\n"
+    "}\n"
+    "class Point { init(x) { this.x = x; } }\n"
+    "fun make(x) { return Point(x); }\n"
+    "fun check(s, p) { return s == \"pinned \" + \"string\" and p.x == 7; }\n"
+    "fun boom(x) { return x + nil; }\n";
+
+int main() {
+  initVM();
+
+  CHECK(compileHandle("print 1 +;") == NULL);
+
+  Handle* script = compileHandle(source);
+  CHECK(script != NULL);
+  CHECK(callHandle(script, 0, NULL, NULL) == INTERPRET_OK);
+  Handle* handler = globalHandle("handle");
+  Handle* count = globalHandle("count");
+  Handle* churn = globalHandle("churn");
+  Handle* make = globalHandle("make");
+  Handle* check = globalHandle("check");
+  Handle* boom = globalHandle("boom");
+  CHECK(handler != NULL && count != NULL && churn != NULL && make != NULL &&
+        check != NULL && boom != NULL);
+  CHECK(globalHandle("missing") == NULL);
+
+  //编译一次，反复调用；调用之间全局变量保持
+  Handle* text = pinValue(OBJ_VAL(copyString("pinned string", 13)));
+  double sum = 0;
+  for (int i = 0; i < 1000; i++) {
+    Value args[2] = {NUMBER_VAL(i), handleValue(text)};
+    Value result;
+    CHECK(callHandle(handler, 2, args, &result) == INTERPRET_OK);
+    CHECK(IS_NUMBER(result));
+    sum += AS_NUMBER(result);
+  }
+  CHECK(sum == 999000);
+  Value hits;
+  CHECK(callHandle(count, 0, NULL, &hits) == INTERPRET_OK);
+  CHECK(AS_NUMBER(hits) == 1000);
+
+  //返回值固定之后，强制 GC 不会回收它和参数中固定的字符串
+  Value seven = NUMBER_VAL(7);
+  Value point;
+  CHECK(callHandle(make, 1, &seven, &point) == INTERPRET_OK);
+  Handle* pinned = pinValue(point);
+  collectGarbage();
+  CHECK(callHandle(churn, 0, NULL, NULL) == INTERPRET_OK);
+  collectGarbage();
+  Value args[2] = {handleValue(text), handleValue(pinned)};
+  Value ok;
+  CHECK(callHandle(check, 2, args, &ok) == INTERPRET_OK);
+  CHECK(IS_BOOL(ok) && AS_BOOL(ok));
+
+  //运行时错误和参数个数错误：返回错误，之后还能继续调用
+  Value result;
+  CHECK(callHandle(boom, 1, &seven, &result) == INTERPRET_RUNTIME_ERROR);
+  CHECK(callHandle(handler, 1, &seven, &result) == INTERPRET_RUNTIME_ERROR);
+  CHECK(callHandle(count, 0, NULL, &hits) == INTERPRET_OK);
+  CHECK(AS_NUMBER(hits) == 1000);
+  CHECK(callHandle(handler, 2, args, &result) == INTERPRET_RUNTIME_ERROR);
+  CHECK(callHandle(count, 0, NULL, &hits) == INTERPRET_OK);
+  CHECK(AS_NUMBER(hits) == 1001);
+
+  releaseHandle(pinned);
+  releaseHandle(text);
+  releaseHandle(boom);
+  releaseHandle(check);
+  releaseHandle(make);
+  releaseHandle(churn);
+  releaseHandle(count);
+  releaseHandle(handler);
+  releaseHandle(script);
+  CHECK(vm.handles == NULL);
+  freeVM();
+  printf("ok\n");
+  return 0;
+}
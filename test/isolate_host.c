@@ -0,0 +1,109 @@
+/*
+ * 隔离区的宿主测试：四个线程各自在一个隔离区中执行同一份冻结的代码，
+ * 每个线程分配对象、触发 GC、调用共享的函数、类和结构体，结果互不影响；
+ * 之后所有者线程自己也执行共享代码并强制 GC。用 ThreadSanitizer 检查数据竞争。
+ *
+ * 构建并运行（除 main.c 之外的全部源文件），全部通过时输出 ok 并返回 0：
+ *   cc -I. -fsanitize=thread -g -o isolate_host test/isolate_host.c \
+ *      $(ls *.c | grep -v '^main.c$') tlsf/tlsf.c -ldl -lpthread -lm
+ *   ./isolate_host
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isolate.h"
+#include "memory.h"
+
+#define THREAD_COUNT 4
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #condition);                                                 \
+      exit(1);                                                             \
+    }                                                                      \
+  } while (false)
+
+static const char* source =
+    "class Acc {\n"
+    "  init(s) { this.s = s; }\n"
+    "  add(x) { this.s = this.s + x; return this; }\n"
+    "}\n"
+    "struct Pt { x, y }\n"
+    "fun work(seed) {\n"
+    "  var acc = Acc(seed);\n"
+    "  var label = \"\";\n"
+    "  for (var i = 0; i < 300; i = i + 1) {\n"
+    "    acc.add(i);\n"
+    "    label = label + \"ab\" + \"cd\";\n"
+    "    if (i == 0 and label != \"abcd\") return -1;\n"
+    "  }\n"
+    "  return acc.s + Pt(1, 2).y;\n"
+    "}\n";
+
+static SharedCode* code;
+static double results[THREAD_COUNT];
+
+/**
+ * 工作线程：在自己的隔离区中执行顶层代码，然后反复调用 work。
+ */
+static void* worker(void* argument) {
+  long id = (long)argument;
+  Isolate* isolate = newIsolate(code);
+  enterIsolate(isolate);
+  Handle* script = sharedHandle(code);
+  results[id] = -1;
+  if (callHandle(script, 0, NULL, NULL) == INTERPRET_OK) {
+    Handle* work = globalHandle("work");
+    Value seed = NUMBER_VAL(id);
+    Value result = NIL_VAL;
+    for (int i = 0; i < 50; i++) {
+      if (callHandle(work, 1, &seed, &result) != INTERPRET_OK) break;
+    }
+    if (IS_NUMBER(result)) results[id] = AS_NUMBER(result);
+    releaseHandle(work);
+  }
+  releaseHandle(script);
+  leaveIsolate(isolate);
+  freeIsolate(isolate);
+  return NULL;
+}
+
+int main() {
+  initVM();
+  code = compileShared(source);
+  CHECK(code != NULL);
+
+  pthread_t threads[THREAD_COUNT];
+  for (long i = 0; i < THREAD_COUNT; i++) {
+    CHECK(pthread_create(&threads[i], NULL, worker, (void*)i) == 0);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    CHECK(pthread_join(threads[i], NULL) == 0);
+  }
+  //0 + 1 + ... + 299 = 44850，再加上种子和 Pt(1, 2).y
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    CHECK(results[i] == 44850 + i + 2);
+  }
+
+  //所有者线程也可以执行共享代码，冻结的对象不受它的 GC 影响
+  Handle* script = sharedHandle(code);
+  CHECK(callHandle(script, 0, NULL, NULL) == INTERPRET_OK);
+  Handle* work = globalHandle("work");
+  Value seed = NUMBER_VAL(100);
+  Value result;
+  CHECK(callHandle(work, 1, &seed, &result) == INTERPRET_OK);
+  CHECK(AS_NUMBER(result) == 44952);
+  collectGarbage();
+  CHECK(callHandle(work, 1, &seed, &result) == INTERPRET_OK);
+  CHECK(AS_NUMBER(result) == 44952);
+  releaseHandle(work);
+  releaseHandle(script);
+
+  freeSharedCode(code);
+  freeVM();
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * 调度器的宿主测试：死循环的任务与其他任务混在一起，其他任务仍然全部执行完，
+ * 编译错误和未捕获的运行时错误计入失败的任务数，最后只剩下死循环的任务。
+ *
+ * 构建并运行（除 main.c 之外的全部源文件），全部通过时最后输出 ok 并返回 0：
+ *   cc -I. -o scheduler_host test/scheduler_host.c \
+ *      $(ls *.c | grep -v '^main.c$') tlsf/tlsf.c -ldl -lpthread -lm
+ *   ./scheduler_host
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #condition);                                                 \
+      exit(1);                                                             \
+    }                                                                      \
+  } while (false)
+
+//足够其他任务全部结束的时间片数；死循环的任务饿死其他任务时会用完
+#define STEP_LIMIT 1000
+
+int main() {
+  initVM();
+  Scheduler scheduler;
+  initScheduler(&scheduler, 1000);
+
+  CHECK(addTask(&scheduler, "while (true) {}", NULL, 1));
+  Task* spinner = scheduler.current;
+  CHECK(addTask(&scheduler,
+                "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+                "print fib(20);\n",
+                NULL, 5));
+  CHECK(addTask(&scheduler,
+                "fun add(total, i) { return total + i; }\n"
+                "print fold(100000, 0, add);\n",
+                NULL, 1));
+  CHECK(addTask(&scheduler,
+                "var s = \"\";\n"
+                "for (var i = 0; i < 2000; i = i + 1) s = s + \"ab\";\n"
+                "fun gen() { for (var i = 0; i < 100; i = i + 1) yield i; }\n"
+                "var fiber = gen();\n"
+                "var sum = 0;\n"
+                "for (var i = 0; i < 100; i = i + 1) sum = sum + resume(fiber);\n"
+                "print sum;\n",
+                NULL, 1));
+  CHECK(addTask(&scheduler, "print nil + 1;", NULL, 1));
+  CHECK(!addTask(&scheduler, "print 1 +;", NULL, 1));
+  CHECK(scheduler.failed == 1);
+
+  int steps = 0;
+  while (steps < STEP_LIMIT && stepScheduler(&scheduler)) steps++;
+  CHECK(scheduler.failed == 2);
+  CHECK(scheduler.current == spinner && spinner->next == spinner);
+
+  freeScheduler(&scheduler);
+  CHECK(scheduler.current == NULL);
+  freeVM();
+  printf("ok\n");
+  return 0;
+}
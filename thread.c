@@ -0,0 +1,824 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread.h"
+#include "isolate.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+ * 工作线程和通道。
+ *
+ * spawn(fn, args...) 在新的操作系统线程上执行 fn(args...)。每个线程有自己的虚拟机：
+ * 堆、字符串池、全局变量和栈都是线程局部的，各线程的 GC 互不干扰，也不加锁。
+ * fn 的函数连同它引用的函数、字符串常量和结构体描述一起冻结（见 isolate.c），
+ * 工作线程直接执行同一份字节码。fn 用到的全局变量在 spawn 时取快照，
+ * 可以发送的值交给工作线程，其余的在工作线程中未定义。
+ *
+ * 线程之间只通过消息交换值。消息在发送方编码，在接收方解码到接收方的堆中：
+ *   nil、布尔值、数字、短字符串      按位复制
+ *   冻结的字符串、结构体描述          按指针传递
+ *   通道                            按指针传递，队列按引用计数释放
+ *   堆字符串、缓冲区                复制内容
+ *   结构体实例、闭包                复制字段和上值的当前值，描述和函数按指针传递
+ * 类、实例、协程和原生函数不能发送。复制不保留对象之间的共享，也不支持环。
+ *
+ * 冻结的对象留在冻结它们的虚拟机的内存池中，所以虚拟机释放前等待它 spawn 的
+ * 全部线程结束：脚本结束时仍在运行或阻塞在通道上的线程会让进程一直等待。
+ */
+
+//消息中值的类型标签
+typedef enum {
+  MESSAGE_VALUE,      //不是对象的值，按位复制
+  MESSAGE_STRING,     //长度和字符，接收方重新驻留
+  MESSAGE_SHARED,     //冻结的字符串或结构体描述的指针
+  MESSAGE_CLOSURE,    //冻结的函数指针、上值个数和各个上值的值
+  MESSAGE_RECORD,     //冻结的结构体描述指针和各个字段的值
+  MESSAGE_BUFFER,     //长度和内容
+  MESSAGE_CHANNEL,    //消息持有的通道的下标
+} MessageTag;
+
+//编码后的消息。字节和数组都用 malloc 分配，不属于任何线程的内存池
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+  size_t position;          //解码游标
+  Channel** channels;       //消息持有引用的通道
+  int channelCount;
+  int channelCapacity;
+  ObjString** strings;      //消息中冻结的函数和描述用到的全部字符串，接收方先驻留
+  int stringCount;
+  int stringCapacity;
+} Message;
+
+typedef struct {
+  atomic_size_t sequence;   //等于写入位置时可写，等于写入位置加一时可读
+  Message* message;
+} ChannelCell;
+
+//有界的多生产者多消费者无锁队列。队列满或空时才用互斥锁和条件变量睡眠
+struct Channel {
+  atomic_int references;
+  size_t mask;              //容量减一，容量是 2 的幂
+  ChannelCell* cells;
+  //发送和接收的游标各占一个缓存行，发送者和接收者不互相使对方的缓存行失效
+  _Alignas(64) atomic_size_t sendPosition;
+  _Alignas(64) atomic_size_t receivePosition;
+  _Alignas(64) atomic_int waiters;  //睡眠中的发送者和接收者
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+struct Worker {
+  pthread_t thread;
+  Message* input;           //函数、参数和全局变量快照，由线程释放
+  Message* output;          //返回值，线程失败时为 NULL
+  atomic_bool finished;
+  bool joined;
+  bool abandoned;           //句柄已被回收，线程结束后即可释放
+  struct Worker* next;
+};
+
+
+/****************************************/
+/****    static function declaration  ***/
+/****************************************/
+static void* runWorker(void* argument);
+static void reapWorkers();
+static void freeWorker(Worker* worker);
+static Channel* createChannel(int capacity);
+static void retainChannel(Channel* channel);
+static bool pushCell(Channel* channel, Message* message);
+static Message* popCell(Channel* channel);
+static void sendMessage(Channel* channel, Message* message);
+static Message* receiveMessage(Channel* channel);
+static void wakeWaiters(Channel* channel);
+static Message* newMessage();
+static void freeMessage(Message* message);
+static void writeMessage(Message* message, const void* bytes, size_t length);
+static void writeTag(Message* message, MessageTag tag);
+static void writeCount(Message* message, uint32_t count);
+static void writePointer(Message* message, const void* pointer);
+static void readMessage(Message* message, void* bytes, size_t length);
+static uint32_t readCount(Message* message);
+static void* readPointer(Message* message);
+static void appendString(Message* message, ObjString* string);
+static bool encodeValue(Message* message, Value value, int depth,
+                        const char** error);
+static void collectStrings(Message* message, Obj* object);
+static void encodeGlobals(Message* message);
+static Value decodeValue(Message* message);
+static ObjString* adoptString(ObjString* string);
+static bool receiveValue(VM* context, Message* message, Value* result);
+
+
+/****************************************/
+/****    public function definition  ****/
+/****************************************/
+
+/**
+ * 释放一个通道引用。最后一个引用释放时丢弃队列中剩余的消息。
+ */
+void releaseChannel(Channel* channel) {
+  if (atomic_fetch_sub_explicit(&channel->references, 1,
+                                memory_order_acq_rel) != 1) {
+    return;
+  }
+  Message* message;
+  while ((message = popCell(channel)) != NULL) {
+    freeMessage(message);
+  }
+  pthread_cond_destroy(&channel->changed);
+  pthread_mutex_destroy(&channel->lock);
+  free(channel->cells);
+  free(channel);
+}
+
+/**
+ * 线程句柄被回收。线程继续运行，结束后在下一次 spawn 或释放虚拟机时回收。
+ */
+void abandonWorker(Worker* worker) {
+  worker->abandoned = true;
+}
+
+/**
+ * 等待当前虚拟机 spawn 的全部线程结束并释放它们，在释放内存池之前调用。
+ */
+void joinWorkers() {
+  while (vm.workers != NULL) {
+    Worker* worker = vm.workers;
+    vm.workers = worker->next;
+    freeWorker(worker);
+  }
+}
+
+/**
+ * spawn(fn, args...)：在新线程上执行 fn(args...)，返回线程句柄。
+ * 函数和参数按消息的规则交给新线程，之后与当前线程不再共享任何可变状态。
+ */
+bool spawnNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (argCount < 1 || !IS_CLOSURE(args[0])) {
+    return nativeError(vm, "Expected a function to spawn.");
+  }
+  reapWorkers();
+
+  //冻结时可能延迟编译函数体并扩容栈，args 之后失效，按下标读取
+  ptrdiff_t base = args - vm->stack;
+  Message* message = newMessage();
+  writeCount(message, (uint32_t)argCount);
+  for (int i = 0; i < argCount; i++) {
+    const char* error;
+    if (!encodeValue(message, vm->stack[base + i], 0, &error)) {
+      freeMessage(message);
+      return nativeError(vm, "%s", error);
+    }
+  }
+  encodeGlobals(message);
+
+  Worker* worker = (Worker*)malloc(sizeof(Worker));
+  if (worker == NULL) exit(1);
+  worker->input = message;
+  worker->output = NULL;
+  atomic_init(&worker->finished, false);
+  worker->joined = false;
+  worker->abandoned = false;
+  if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+    freeMessage(message);
+    free(worker);
+    return nativeError(vm, "Could not start a thread.");
+  }
+  worker->next = vm->workers;
+  vm->workers = worker;
+  *result = OBJ_VAL(newThread(worker));
+  return true;
+}
+
+/**
+ * join(thread)：等待线程结束，返回 fn 的返回值。线程因异常结束时抛出错误。
+ * 可以多次调用，每次得到返回值的一份新的副本。
+ */
+bool joinNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_THREAD(args[0])) return nativeError(vm, "Expected a thread.");
+  Worker* worker = AS_THREAD(args[0])->worker;
+  if (!worker->joined) {
+    pthread_join(worker->thread, NULL);
+    worker->joined = true;
+  }
+  if (worker->output == NULL) return nativeError(vm, "Thread failed.");
+  return receiveValue(vm, worker->output, result);
+}
+
+/**
+ * channel([capacity])：创建通道，容量向上取整到 2 的幂，默认 CHANNEL_CAPACITY。
+ */
+bool channelNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (argCount > 1) {
+    return nativeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+  }
+  int capacity = CHANNEL_CAPACITY;
+  if (argCount == 1) {
+    double number = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : 0;
+    if (number < 1 || number > CHANNEL_CAPACITY_MAX ||
+        number != (double)(int)number) {
+      return nativeError(vm, "Channel capacity must be an integer between 1 and %d.",
+                         CHANNEL_CAPACITY_MAX);
+    }
+    capacity = (int)number;
+  }
+  *result = OBJ_VAL(newChannel(createChannel(capacity)));
+  return true;
+}
+
+/**
+ * send(channel, value)：发送一个值，通道满时阻塞。
+ */
+bool sendNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_CHANNEL(args[0])) return nativeError(vm, "Expected a channel.");
+  Channel* channel = AS_CHANNEL(args[0])->channel;
+  Message* message = newMessage();
+  const char* error;
+  if (!encodeValue(message, args[1], 0, &error)) {
+    freeMessage(message);
+    return nativeError(vm, "%s", error);
+  }
+  sendMessage(channel, message);
+  *result = NIL_VAL;
+  return true;
+}
+
+/**
+ * receive(channel)：取出一个值，通道空时阻塞。
+ */
+bool receiveNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_CHANNEL(args[0])) return nativeError(vm, "Expected a channel.");
+  Message* message = receiveMessage(AS_CHANNEL(args[0])->channel);
+  bool ok = receiveValue(vm, message, result);
+  freeMessage(message);
+  return ok;
+}
+
+
+/****************************************/
+/****    static function definition  ****/
+/****************************************/
+
+/**
+ * 工作线程的入口：在线程局部状态中创建虚拟机，解码并调用函数，编码返回值。
+ */
+static void* runWorker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  Message* input = worker->input;
+  //冻结的字符串先于任何字符串驻留，冻结的代码中按指针比较的名字依然有效
+  initSharedVM(input->strings, input->stringCount);
+
+  uint32_t count = readCount(input);
+  Value* values = (Value*)malloc(sizeof(Value) * count);
+  if (values == NULL) exit(1);
+  for (uint32_t i = 0; i < count; i++) {
+    values[i] = decodeValue(input);
+    push(values[i]);
+  }
+  uint32_t globalCount = readCount(input);
+  for (uint32_t i = 0; i < globalCount; i++) {
+    ObjString* name = (ObjString*)readPointer(input);
+    push(decodeValue(input));
+    tableSet(&vm.globals, name, vm.stackTop[-1]);
+    pop();
+  }
+
+  Value result;
+  if (callFunction(values[0], (int)count - 1, values + 1, &result) ==
+      INTERPRET_OK) {
+    Message* output = newMessage();
+    const char* error;
+    if (encodeValue(output, result, 0, &error)) {
+      worker->output = output;
+    } else {
+      fprintf(stderr, "Thread result can't be sent: %s\n", error);
+      freeMessage(output);
+    }
+  }
+  free(values);
+  freeMessage(input);
+  worker->input = NULL;
+  freeVM();
+  atomic_store_explicit(&worker->finished, true, memory_order_release);
+  return NULL;
+}
+
+/**
+ * 释放句柄已被回收且已经结束的线程。
+ */
+static void reapWorkers() {
+  Worker** link = &vm.workers;
+  while (*link != NULL) {
+    Worker* worker = *link;
+    if (worker->abandoned &&
+        (worker->joined ||
+         atomic_load_explicit(&worker->finished, memory_order_acquire))) {
+      *link = worker->next;
+      freeWorker(worker);
+    } else {
+      link = &worker->next;
+    }
+  }
+}
+
+static void freeWorker(Worker* worker) {
+  if (!worker->joined) pthread_join(worker->thread, NULL);
+  if (worker->output != NULL) freeMessage(worker->output);
+  free(worker);
+}
+
+static Channel* createChannel(int capacity) {
+  //容量为 1 时同一个单元的序号无法区分空和满
+  size_t size = 2;
+  while (size < (size_t)capacity) size *= 2;
+
+  Channel* channel = (Channel*)aligned_alloc(_Alignof(Channel), sizeof(Channel));
+  ChannelCell* cells = (ChannelCell*)malloc(sizeof(ChannelCell) * size);
+  if (channel == NULL || cells == NULL) exit(1);
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&cells[i].sequence, i);
+    cells[i].message = NULL;
+  }
+  atomic_init(&channel->references, 1);
+  channel->mask = size - 1;
+  channel->cells = cells;
+  atomic_init(&channel->sendPosition, 0);
+  atomic_init(&channel->receivePosition, 0);
+  atomic_init(&channel->waiters, 0);
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_cond_init(&channel->changed, NULL);
+  return channel;
+}
+
+static void retainChannel(Channel* channel) {
+  atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+/**
+ * 不阻塞地写入一条消息：抢占发送游标指向的单元，写入后发布单元的序号。
+ *
+ * @return 队列满时返回 false
+ */
+static bool pushCell(Channel* channel, Message* message) {
+  size_t position = atomic_load_explicit(&channel->sendPosition,
+                                         memory_order_relaxed);
+  for (;;) {
+    ChannelCell* cell = &channel->cells[position & channel->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence,
+                                           memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+    if (difference == 0) {
+      //失败时 position 被更新为当前的游标
+      if (atomic_compare_exchange_weak_explicit(
+              &channel->sendPosition, &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+        cell->message = message;
+        atomic_store_explicit(&cell->sequence, position + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (difference < 0) {
+      //单元中还是上一轮的消息
+      return false;
+    } else {
+      position = atomic_load_explicit(&channel->sendPosition,
+                                      memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * 不阻塞地取出一条消息，取出后把单元的序号推进到下一轮的写入位置。
+ *
+ * @return 队列空时返回 NULL
+ */
+static Message* popCell(Channel* channel) {
+  size_t position = atomic_load_explicit(&channel->receivePosition,
+                                         memory_order_relaxed);
+  for (;;) {
+    ChannelCell* cell = &channel->cells[position & channel->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence,
+                                           memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &channel->receivePosition, &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+        Message* message = cell->message;
+        atomic_store_explicit(&cell->sequence, position + channel->mask + 1,
+                              memory_order_release);
+        return message;
+      }
+    } else if (difference < 0) {
+      return NULL;
+    } else {
+      position = atomic_load_explicit(&channel->receivePosition,
+                                      memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * 写入消息，队列满时先让出处理器重试，仍然满时睡眠到有接收者取走消息。
+ */
+static void sendMessage(Channel* channel, Message* message) {
+  for (int spins = 0; !pushCell(channel, message); spins++) {
+    if (spins < CHANNEL_SPINS) {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&channel->lock);
+    atomic_fetch_add_explicit(&channel->waiters, 1, memory_order_relaxed);
+    //登记之后再试一次：对方在此之前完成的操作在这里可见，之后完成的操作会看到登记并唤醒
+    atomic_thread_fence(memory_order_seq_cst);
+    bool sent = pushCell(channel, message);
+    if (!sent) pthread_cond_wait(&channel->changed, &channel->lock);
+    atomic_fetch_sub_explicit(&channel->waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&channel->lock);
+    if (sent) break;
+  }
+  wakeWaiters(channel);
+}
+
+/**
+ * 取出消息，队列空时的等待方式与 sendMessage 相同。
+ */
+static Message* receiveMessage(Channel* channel) {
+  Message* message;
+  for (int spins = 0; (message = popCell(channel)) == NULL; spins++) {
+    if (spins < CHANNEL_SPINS) {
+      sched_yield();
+      continue;
+    }
+    pthread_mutex_lock(&channel->lock);
+    atomic_fetch_add_explicit(&channel->waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    message = popCell(channel);
+    if (message == NULL) pthread_cond_wait(&channel->changed, &channel->lock);
+    atomic_fetch_sub_explicit(&channel->waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&channel->lock);
+    if (message != NULL) break;
+  }
+  wakeWaiters(channel);
+  return message;
+}
+
+/**
+ * 队列状态改变之后唤醒睡眠中的发送者和接收者。没有人睡眠时不碰互斥锁。
+ */
+static void wakeWaiters(Channel* channel) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&channel->waiters, memory_order_relaxed) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&channel->lock);
+  pthread_cond_broadcast(&channel->changed);
+  pthread_mutex_unlock(&channel->lock);
+}
+
+static Message* newMessage() {
+  Message* message = (Message*)calloc(1, sizeof(Message));
+  if (message == NULL) exit(1);
+  return message;
+}
+
+static void freeMessage(Message* message) {
+  for (int i = 0; i < message->channelCount; i++) {
+    releaseChannel(message->channels[i]);
+  }
+  free(message->bytes);
+  free(message->channels);
+  free(message->strings);
+  free(message);
+}
+
+static void writeMessage(Message* message, const void* bytes, size_t length) {
+  if (message->count + length > message->capacity) {
+    size_t capacity = message->capacity < 64 ? 64 : message->capacity * 2;
+    while (capacity < message->count + length) capacity *= 2;
+    message->bytes = (uint8_t*)realloc(message->bytes, capacity);
+    if (message->bytes == NULL) exit(1);
+    message->capacity = capacity;
+  }
+  memcpy(message->bytes + message->count, bytes, length);
+  message->count += length;
+}
+
+static void writeTag(Message* message, MessageTag tag) {
+  uint8_t byte = (uint8_t)tag;
+  writeMessage(message, &byte, sizeof(byte));
+}
+
+static void writeCount(Message* message, uint32_t count) {
+  writeMessage(message, &count, sizeof(count));
+}
+
+static void writePointer(Message* message, const void* pointer) {
+  writeMessage(message, &pointer, sizeof(pointer));
+}
+
+//消息只在同一个进程中传递，由 encodeValue 生成，不需要校验
+static void readMessage(Message* message, void* bytes, size_t length) {
+  memcpy(bytes, message->bytes + message->position, length);
+  message->position += length;
+}
+
+static uint32_t readCount(Message* message) {
+  uint32_t count;
+  readMessage(message, &count, sizeof(count));
+  return count;
+}
+
+static void* readPointer(Message* message) {
+  void* pointer;
+  readMessage(message, &pointer, sizeof(pointer));
+  return pointer;
+}
+
+static void appendString(Message* message, ObjString* string) {
+  if (message->stringCount == message->stringCapacity) {
+    message->stringCapacity = GROW_CAPACITY(message->stringCapacity);
+    message->strings = (ObjString**)realloc(
+        message->strings, sizeof(ObjString*) * message->stringCapacity);
+    if (message->strings == NULL) exit(1);
+  }
+  message->strings[message->stringCount++] = string;
+}
+
+/**
+ * 编码一个值。函数和结构体描述在这里冻结，它们用到的字符串记入消息。
+ *
+ * @param value 必须从栈或全局变量可达，冻结时可能发生 GC
+ * @param error 值不能发送时写入错误信息
+ */
+static bool encodeValue(Message* message, Value value, int depth,
+                        const char** error) {
+  if (depth > MESSAGE_DEPTH_MAX) {
+    *error = "Value is nested too deeply or contains a cycle.";
+    return false;
+  }
+  if (!IS_OBJ(value)) {
+    writeTag(message, MESSAGE_VALUE);
+    writeMessage(message, &value, sizeof(value));
+    return true;
+  }
+
+  Obj* object = AS_OBJ(value);
+  switch (object->type) {
+    case OBJ_STRING: {
+      if (object->space == SPACE_FROZEN) {
+        writeTag(message, MESSAGE_SHARED);
+        writePointer(message, object);
+        return true;
+      }
+      ObjString* string = (ObjString*)object;
+      writeTag(message, MESSAGE_STRING);
+      writeCount(message, (uint32_t)string->length);
+      writeMessage(message, string->chars, string->length);
+      return true;
+    }
+    case OBJ_STRUCT:
+      if (!freezeShared(object)) {
+        *error = "Value can't be sent between threads.";
+        return false;
+      }
+      collectStrings(message, object);
+      writeTag(message, MESSAGE_SHARED);
+      writePointer(message, object);
+      return true;
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      if (!freezeShared((Obj*)closure->function)) {
+        *error = "Function can't be shared between threads.";
+        return false;
+      }
+      collectStrings(message, (Obj*)closure->function);
+      writeTag(message, MESSAGE_CLOSURE);
+      writePointer(message, closure->function);
+      writeCount(message, (uint32_t)closure->upvalueCount);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        Value captured = *CLOSURE_UPVALUE(closure, i)->location;
+        if (!encodeValue(message, captured, depth + 1, error)) return false;
+      }
+      return true;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      if (!freezeShared((Obj*)record->type)) {
+        *error = "Value can't be sent between threads.";
+        return false;
+      }
+      collectStrings(message, (Obj*)record->type);
+      writeTag(message, MESSAGE_RECORD);
+      writePointer(message, record->type);
+      for (int i = 0; i < record->fieldCount; i++) {
+        if (!encodeValue(message, record->fields[i], depth + 1, error)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case OBJ_BUFFER: {
+      ObjBuffer* buffer = (ObjBuffer*)object;
+      writeTag(message, MESSAGE_BUFFER);
+      writeCount(message, (uint32_t)buffer->length);
+      writeMessage(message, buffer->bytes, buffer->length);
+      return true;
+    }
+    case OBJ_CHANNEL: {
+      Channel* channel = ((ObjChannel*)object)->channel;
+      if (message->channelCount == message->channelCapacity) {
+        message->channelCapacity = GROW_CAPACITY(message->channelCapacity);
+        message->channels = (Channel**)realloc(
+            message->channels, sizeof(Channel*) * message->channelCapacity);
+        if (message->channels == NULL) exit(1);
+      }
+      retainChannel(channel);
+      message->channels[message->channelCount] = channel;
+      writeTag(message, MESSAGE_CHANNEL);
+      writeCount(message, (uint32_t)message->channelCount++);
+      return true;
+    }
+    default:
+      *error = "Value can't be sent between threads.";
+      return false;
+  }
+}
+
+/**
+ * 收集冻结的函数或结构体描述中的全部字符串，包括嵌套的函数。
+ */
+static void collectStrings(Message* message, Obj* object) {
+  if (object == NULL) return;
+  switch (object->type) {
+    case OBJ_STRING:
+      appendString(message, (ObjString*)object);
+      break;
+    case OBJ_STRUCT: {
+      ObjStruct* type = (ObjStruct*)object;
+      appendString(message, type->name);
+      for (int i = 0; i < type->fieldCount; i++) {
+        appendString(message, type->fields[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      collectStrings(message, (Obj*)function->name);
+      ValueArray* constants = &function->chunk.constants;
+      for (int i = 0; i < constants->count; i++) {
+        if (IS_OBJ(constants->values[i])) {
+          collectStrings(message, AS_OBJ(constants->values[i]));
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/**
+ * 编码 spawn 的函数可能用到的全局变量：名字出现在已编码的函数的常量中，
+ * 值又是函数时继续收集它用到的全局变量。不能发送的值和原生函数跳过，
+ * 工作线程有自己的原生函数。
+ */
+static void encodeGlobals(Message* message) {
+  size_t countPosition = message->count;
+  uint32_t count = 0;
+  writeCount(message, 0);
+
+  Table seen;
+  initTable(&seen);
+  //编码函数会追加字符串，循环一直进行到没有新的名字
+  for (int i = 0; i < message->stringCount; i++) {
+    ObjString* name = message->strings[i];
+    Value value;
+    if (!tableGet(&vm.globals, name, &value) || IS_NATIVE(value) ||
+        !tableSet(&seen, name, NIL_VAL)) {
+      continue;
+    }
+
+    size_t position = message->count;
+    int channelCount = message->channelCount;
+    int stringCount = message->stringCount;
+    const char* error;
+    writePointer(message, name);
+    if (encodeValue(message, value, 0, &error)) {
+      count++;
+      continue;
+    }
+    //撤销这个变量已经写入的部分
+    message->count = position;
+    while (message->channelCount > channelCount) {
+      releaseChannel(message->channels[--message->channelCount]);
+    }
+    message->stringCount = stringCount;
+  }
+  freeTable(&seen);
+  memcpy(message->bytes + countPosition, &count, sizeof(count));
+}
+
+/**
+ * 在当前线程的堆中解码一个值。解码过程中分配的对象都压栈保护。
+ */
+static Value decodeValue(Message* message) {
+  uint8_t tag;
+  readMessage(message, &tag, sizeof(tag));
+  switch (tag) {
+    case MESSAGE_VALUE: {
+      Value value;
+      readMessage(message, &value, sizeof(value));
+      return value;
+    }
+    case MESSAGE_STRING: {
+      uint32_t length = readCount(message);
+      const char* chars = (const char*)message->bytes + message->position;
+      message->position += length;
+      return stringValue(chars, (int)length);
+    }
+    case MESSAGE_SHARED: {
+      Obj* object = (Obj*)readPointer(message);
+      if (object->type == OBJ_STRING) {
+        object = (Obj*)adoptString((ObjString*)object);
+      }
+      return OBJ_VAL(object);
+    }
+    case MESSAGE_CLOSURE: {
+      ObjFunction* function = (ObjFunction*)readPointer(message);
+      uint32_t count = readCount(message);
+      ObjClosure* closure = newClosure(function);
+      push(OBJ_VAL(closure));
+      for (uint32_t i = 0; i < count; i++) {
+        push(decodeValue(message));
+        //上值直接创建为已关闭的状态
+        ObjUpvalue* upvalue = newUpvalue(NULL);
+        upvalue->closed = pop();
+        upvalue->location = &upvalue->closed;
+        closure->upvalues[i] = toRef(upvalue);
+        writeBarrier((Obj*)closure, OBJ_VAL(upvalue));
+      }
+      return pop();
+    }
+    case MESSAGE_RECORD: {
+      ObjRecord* record = newRecord((ObjStruct*)readPointer(message));
+      push(OBJ_VAL(record));
+      for (int i = 0; i < record->fieldCount; i++) {
+        Value field = decodeValue(message);
+        record->fields[i] = field;
+        writeBarrier((Obj*)record, field);
+      }
+      return pop();
+    }
+    case MESSAGE_BUFFER: {
+      uint32_t length = readCount(message);
+      ObjBuffer* buffer = newBuffer((int)length);
+      readMessage(message, buffer->bytes, length);
+      return OBJ_VAL(buffer);
+    }
+    case MESSAGE_CHANNEL: {
+      Channel* channel = message->channels[readCount(message)];
+      retainChannel(channel);
+      return OBJ_VAL(newChannel(channel));
+    }
+    default:
+      return NIL_VAL; // Unreachable.
+  }
+}
+
+/**
+ * 接收冻结的字符串：当前线程已经有同样内容的字符串时使用它，否则把冻结的
+ * 字符串驻留进来，之后同样内容的字符串都是它。
+ */
+static ObjString* adoptString(ObjString* string) {
+  ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
+  if (interned != NULL) return interned;
+  tableSet(&vm.strings, string, NIL_VAL);
+  return string;
+}
+
+/**
+ * 把消息解码为当前线程中的值。消息中冻结的代码直接按指针比较它的字符串常量，
+ * 当前线程已经有同样内容的另一个字符串时不能接收。
+ */
+static bool receiveValue(VM* context, Message* message, Value* result) {
+  for (int i = 0; i < message->stringCount; i++) {
+    if (adoptString(message->strings[i]) != message->strings[i]) {
+      return nativeError(context,
+                         "Received function conflicts with string '%s'.",
+                         message->strings[i]->chars);
+    }
+  }
+  message->position = 0;
+  *result = decodeValue(message);
+  return true;
+}
@@ -0,0 +1,30 @@
+#ifndef clox_thread_h
+#define clox_thread_h
+
+#include "common.h"
+#include "object.h"
+
+/****************************************/
+/********    macro definition  **********/
+/****************************************/
+/* channel() 不指定容量时的队列容量 */
+#define CHANNEL_CAPACITY 64
+/* 队列容量的上限 */
+#define CHANNEL_CAPACITY_MAX (1 << 20)
+/* 队列满或空时，睡眠之前让出处理器重试的次数 */
+#define CHANNEL_SPINS 16
+/* 消息中记录和闭包的嵌套层数上限，超出时按含有环处理 */
+#define MESSAGE_DEPTH_MAX 64
+
+
+void releaseChannel(Channel* channel);
+void abandonWorker(Worker* worker);
+void joinWorkers();
+
+bool spawnNative(VM* vm, int argCount, Value* args, Value* result);
+bool joinNative(VM* vm, int argCount, Value* args, Value* result);
+bool channelNative(VM* vm, int argCount, Value* args, Value* result);
+bool sendNative(VM* vm, int argCount, Value* args, Value* result);
+bool receiveNative(VM* vm, int argCount, Value* args, Value* result);
+
+#endif // clox_thread_h
@@ -58,6 +58,10 @@ void printValue(Value value) {
     printf("nil");
   } else if (IS_NUMBER(value)) {
     printf("%g", AS_NUMBER(value));
+  } else if (IS_SMALL_STRING(value)) {
+    char chars[SMALL_STRING_MAX + 1];
+    int length = smallStringChars(value, chars);
+    printf("%.*s", length, chars);
   } else if (IS_OBJ(value)) {
     printObject(value);
   }
@@ -80,6 +84,7 @@ bool valuesEqual(Value a, Value b) {
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
   }
+  //短字符串总是以立即数表示，长字符串已经驻留，两种形式都可以按位比较
   return a == b;
 #else
   if (a.type != b.type) return false;
@@ -91,4 +96,35 @@ bool valuesEqual(Value a, Value b) {
     default:         return false; // Unreachable.
   }
 #endif // NAN_BOXING
-}
\ No newline at end of file
+}
+
+/**
+ * 计算值的哈希值，与 valuesEqual 保持一致：相等的值哈希值相同。
+ * 长字符串已经驻留，因此对象按地址哈希即可；短字符串是立即数，按位哈希。
+ *
+ * @param value 需要计算哈希的值
+ * @return 32 位哈希值
+ */
+uint32_t hashValue(Value value) {
+#ifdef NAN_BOXING
+  //0 和 -0 相等，需要得到同样的哈希值
+  if (IS_NUMBER(value) && AS_NUMBER(value) == 0) value = NUMBER_VAL(0);
+  uint64_t bits = value;
+#else
+  uint64_t bits = 0;
+  switch (value.type) {
+    case VAL_BOOL:   bits = AS_BOOL(value) ? 3 : 2; break;
+    case VAL_NIL:    bits = 1; break;
+    case VAL_NUMBER: {
+      double number = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+      memcpy(&bits, &number, sizeof(double));
+      break;
+    }
+    case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+  }
+#endif // NAN_BOXING
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
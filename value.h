@@ -14,6 +14,9 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+/* 短字符串直接存放在 Value 中：低 40 位为字符，第 40~42 位为长度 */
+#define TAG_SMALL_STRING ((uint64_t)0x0002000000000000)
+#define SMALL_STRING_MAX 5
 
 
 
@@ -39,6 +42,9 @@ typedef uint64_t Value;
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_SMALL_STRING(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_SMALL_STRING)) == (QNAN | TAG_SMALL_STRING))
+#define SMALL_STRING_LENGTH(value) ((int)(((value) >> 40) & 0x7))
 
 static inline Value numToValue(double num) {
   Value value;
@@ -54,6 +60,29 @@ static inline double valueToNum(Value value) {
   return num;
 }
 
+/**
+ * 把长度不超过 SMALL_STRING_MAX 的字符串打包成立即数。
+ */
+static inline Value smallStringValue(const char* chars, int length) {
+  uint64_t bits = 0;
+  for (int i = 0; i < length; i++) {
+    bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+  }
+  return (Value)(QNAN | TAG_SMALL_STRING | ((uint64_t)length << 40) | bits);
+}
+
+/**
+ * 把短字符串解包到 buffer 中（以 '\0' 结尾），返回字符串长度。
+ */
+static inline int smallStringChars(Value value, char* buffer) {
+  int length = SMALL_STRING_LENGTH(value);
+  for (int i = 0; i < length; i++) {
+    buffer[i] = (char)(value >> (8 * i));
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
 #else
 typedef enum {
   VAL_BOOL,
@@ -93,6 +122,10 @@ typedef struct {
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)    
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
+/* 不使用 NAN 装箱时没有短字符串立即数 */
+#define SMALL_STRING_MAX 0
+#define IS_SMALL_STRING(value) false
+
 
 
 #endif // NAN_BOXING
@@ -118,5 +151,6 @@ void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 bool valuesEqual(Value a, Value b);
+uint32_t hashValue(Value value);
 
 #endif
\ No newline at end of file
@@ -2,95 +2,481 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
+#include <limits.h>
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
 #include "memory.h"
 #include "value.h"
 #include "compiler.h"
+#include "profile.h"
+#include "bytecode.h"
+#include "module.h"
+#include "ffi.h"
+#include "thread.h"
+#include "io.h"
+#include "region.h"
 #include "object.h"
 #include "string.h"
 
-VM vm; 
+THREAD_LOCAL VM vm;
 
 /****************************************/
 /****    static function declaration  ***/
 /****************************************/
 static InterpretResult run();
+static InterpretResult runScript(ObjFunction* function, const char* source);
 static void resetStack();
 static Value peek(int distance);
-static void runtimeError(const char* format, ...);
+static bool runtimeError(const char* format, ...);
+static bool throwValue(Value exception);
+static void throwPendingError();
+static bool unwindToHandler(Value exception);
+static void abandonFrames(int from);
+static void reportUncaught(Value exception);
 static bool isFalsey(Value value);
 static void concatenate();
 static bool call(ObjClosure* closure, int argCount);
+static bool callGenerator(ObjClosure* closure, int argCount);
+static void growStack();
+static void saveFiber(ObjFiber* fiber);
+static void loadFiber(ObjFiber* fiber);
 static bool callValue(Value callee, int argCount);
-static void defineNative(const char* name, NativeFn function);
+static bool preempt();
 static ObjUpvalue* captureUpvalue(Value* local);
 static void closeUpvalues(Value* last);
 static void defineMethod(ObjString* name);
 static bool bindMethod(ObjClass* klass, ObjString* name);
 static bool invoke(ObjString* name, int argCount);
+static bool getProperty(ObjString* name);
+static bool setProperty(ObjString* name);
 static bool invokeFromClass(ObjClass* klass, ObjString* name,
                             int argCount);
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM* vm, int argCount, Value* args, Value* result) {
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+/**
+ * memoClear(fn)：清空 memo 函数的结果缓存。
+ * 参数不是 memo 函数时返回 false。
+ */
+static bool memoClearNative(VM* vm, int argCount, Value* args,
+                            Value* result) {
+  *result = BOOL_VAL(false);
+  if (!IS_CLOSURE(args[0])) return true;
+  ObjFunction* function = AS_CLOSURE(args[0])->function;
+  if (!function->isMemo) return true;
+  memoClear(function);
+  *result = BOOL_VAL(true);
+  return true;
+}
+
+/**
+ * fiberDone(fiber)：协程是否已经结束。
+ */
+static bool fiberDoneNative(VM* vm, int argCount, Value* args,
+                            Value* result) {
+  *result = BOOL_VAL(IS_FIBER(args[0]) &&
+                     AS_FIBER(args[0])->state == FIBER_DONE);
+  return true;
+}
+
+/**
+ * fold(count, initial, fn)：依次调用 fn(acc, i)，i 从 0 到 count - 1，
+ * 每次的返回值作为下一次的 acc，返回最后的 acc。循环在 C 中执行。
+ */
+static bool foldNative(VM* vm, int argCount, Value* args, Value* result) {
+  if (!IS_NUMBER(args[0])) return nativeError(vm, "Count must be a number.");
+  double count = AS_NUMBER(args[0]);
+  //第一次 callClosure 之后 args 失效，先取出回调函数
+  Value function = args[2];
+  //累加值留在栈顶，回调中发生 GC 时仍然可达
+  push(args[1]);
+  for (double i = 0; i < count; i++) {
+    Value callArgs[2] = {vm->stackTop[-1], NUMBER_VAL(i)};
+    Value next;
+    if (!callClosure(vm, function, 2, callArgs, &next)) {
+      pop();
+      return false;
+    }
+    vm->stackTop[-1] = next;
+  }
+  *result = pop();
+  return true;
 }
 
+//内建原生函数。堆镜像按名字保存原生函数，加载时据此找回函数指针
+static const struct {
+  const char* name;
+  NativeFn function;
+  int arity;
+} natives[] = {
+  {"clock", clockNative, 0},
+  {"memoClear", memoClearNative, 1},
+  {"fiberDone", fiberDoneNative, 1},
+  {"fold", foldNative, 3},
+  {"foreign", foreignNative, 3},
+  {"buffer", bufferNative, 1},
+  {"bufferLength", bufferLengthNative, 1},
+  {"bufferGet", bufferGetNative, 2},
+  {"bufferSet", bufferSetNative, 3},
+  {"bufferString", bufferStringNative, 3},
+  {"spawn", spawnNative, NATIVE_VARIADIC},
+  {"join", joinNative, 1},
+  {"channel", channelNative, NATIVE_VARIADIC},
+  {"send", sendNative, 2},
+  {"receive", receiveNative, 1},
+  {"pipe", pipeNative, 0},
+  {"open", openNative, 2},
+  {"listen", listenNative, NATIVE_VARIADIC},
+  {"connect", connectNative, NATIVE_VARIADIC},
+  {"accept", acceptNative, 1},
+  {"localPort", localPortNative, 1},
+  {"read", readNative, NATIVE_VARIADIC},
+  {"write", writeNative, 2},
+  {"close", closeNative, 1},
+  {"onReadable", onReadableNative, 2},
+  {"onWritable", onWritableNative, 2},
+  {"setTimeout", setTimeoutNative, 2},
+  {"readable", readableNative, 1},
+  {"writable", writableNative, 1},
+  {"sleep", sleepNative, 1},
+  {"runLoop", runLoopNative, 0},
+  {"region", regionNative, NATIVE_VARIADIC},
+};
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
+
 /****************************************/
 /****    public function definition  ****/
 /****************************************/
 void initVM() {
+  initSharedVM(NULL, 0);
+}
+
+/**
+ * 创建使用共享代码的虚拟机。共享代码中的字符串在任何字符串创建之前
+ * 驻留到新的字符串池中，之后同样内容的字符串（全局变量名、"init"、
+ * 原生函数名）都是这些共享对象，按指针比较依然成立。
+ *
+ * @param strings 共享代码中的全部字符串，没有共享代码时为 NULL
+ */
+void initSharedVM(ObjString** strings, int count) {
   initializeMemory();
   //GC
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
   vm.bytesAllocated = 0;
+  vm.peakAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.nextMinorGC = GC_NURSERY_SIZE;
+  vm.gcPaused = 0;
+  vm.batch = false;
 
 
   initTable(&vm.strings);
   initTable(&vm.globals);
-  vm.objects = NULL;
+  initTable(&vm.modules);
+  vm.heap.objects = NULL;
+  vm.heap.count = 0;
+  vm.heap.capacity = 0;
+  vm.heap.freeSlots = NULL;
+  vm.heap.freeCount = 0;
+  vm.heap.freeCapacity = 0;
+  vm.heap.marks = NULL;
+  vm.heap.old = NULL;
+  vm.heap.young = NULL;
+  vm.heap.youngCount = 0;
+  vm.heap.youngCapacity = 0;
+  vm.heap.remembered = NULL;
+  vm.heap.rememberedCount = 0;
+  vm.heap.rememberedCapacity = 0;
   vm.stackCapacity = 256;
   vm.stack = GROW_ARRAY(Value, NULL, 0, vm.stackCapacity);
+  vm.frameCapacity = GROW_CAPACITY(0);
+  vm.frames = GROW_ARRAY(CallFrame, NULL, 0, vm.frameCapacity);
+  vm.fiber = NULL;
   resetStack();
+  //主协程的执行状态就是 vm 中的初始栈和调用帧
+  vm.fiber = newFiber(NULL, 0);
+  vm.handles = NULL;
+  vm.workers = NULL;
+  vm.loop = NULL;
+  vm.region = NULL;
+  vm.baseFrame = 0;
+  vm.baseFiber = vm.fiber;
+  vm.pendingError = NIL_VAL;
+  vm.budget = INT_MAX;
+  vm.quantum = 0;
+  vm.profilePath = NULL;
+  vm.profiling = false;
+  vm.cacheDir = NULL;
+  vm.scriptPath = NULL;
+  for (int i = 0; i < count; i++) {
+    tableSet(&vm.strings, strings[i], NIL_VAL);
+  }
   //防止运行GC 标记initString时，指针错误指向
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
-  defineNative("clock", clockNative);
+  defineNatives(&vm.globals);
 }
 
 void freeVM() {
-  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+  //当前协程的栈和调用帧写回协程对象，随对象一起释放
+  saveFiber(vm.fiber);
   freeTable(&vm.strings);
   freeTable(&vm.globals);
+  freeTable(&vm.modules);
   vm.initString = NULL;
+  freeEventLoop();
   freeObjects();
+  //工作线程可能还在读这个内存池中冻结的代码
+  joinWorkers();
   freeMemory();
 }
 
 InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+  ObjFunction* function = compileScript(source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return runScript(function, source);
+}
+
+/**
+ * 执行字节码文件。文件不记录源码，不使用 profile。
+ *
+ * @param path 由 saveBytecode 写出的文件
+ * @return 文件无效时返回 INTERPRET_COMPILE_ERROR
+ */
+InterpretResult interpretBytecode(const char* path) {
+  ObjFunction* function = loadBytecode(path, NULL);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return runScript(function, NULL);
+}
+
+/**
+ * 编译脚本的顶层函数，不执行。
+ * 缓存命中时跳过扫描和编译；缓存中保存的是 profile 重排之前的字节码。
+ *
+ * @return 编译错误时返回 NULL
+ */
+ObjFunction* compileScript(const char* source) {
+  ObjFunction* function = NULL;
+  if (vm.cacheDir != NULL) function = loadCachedScript(vm.cacheDir, source);
+  if (function == NULL) {
+    function = compile(source);
+    if (function == NULL) return NULL;
+    if (vm.cacheDir != NULL) {
+      push(OBJ_VAL(function));
+      cacheScript(vm.cacheDir, source, function);
+      pop();
+    }
+  }
+  return function;
+}
+
+/**
+ * 压入脚本顶层函数的调用帧但不执行，之后由 resumeScript 分时间片执行。
+ *
+ * @return 导入的模块编译失败时返回 false
+ */
+bool startScript(ObjFunction* function) {
   push(OBJ_VAL(function));
+  if (!loadImports(function)) {
+    pop();
+    return false;
+  }
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
-  return run();
+  return true;
+}
+
+/**
+ * 执行 startScript 开始的脚本一个时间片：回边和调用合计 quantum 次之后，
+ * 在下一个回边或调用处让出。原生函数回调脚本期间不让出，预算补充后继续执行。
+ *
+ * @param quantum 这个时间片的预算，必须大于 0
+ * @return 让出时返回 INTERPRET_PREEMPTED，调用帧和栈保留，再次调用从原处继续
+ */
+InterpretResult resumeScript(int quantum) {
+  vm.quantum = quantum;
+  vm.budget = quantum;
+  InterpretResult result = run();
+  vm.quantum = 0;
+  vm.budget = INT_MAX;
+  //弹出顶层函数的返回值
+  if (result == INTERPRET_OK) pop();
+  return result;
+}
+
+/**
+ * 从 C 中调用一个值（闭包、绑定方法、类、结构体或原生函数）。
+ * 被调用者和参数压栈后进入一层新的 run()，被调用者返回时这一层 run() 结束，
+ * 不涉及扫描和编译。可以由宿主程序在没有脚本运行时调用，
+ * 也可以由原生函数在脚本运行中嵌套调用。
+ *
+ * 调用期间的异常只在这一层的调用帧中查找 catch。没有被捕获时：
+ * 最外层的调用打印错误并重置虚拟机；嵌套的调用把异常留在 vm.pendingError，
+ * 由原生函数返回 false 后在外层重新抛出。
+ *
+ * @param args 参数，可以指向值栈（原生函数的 args）；对象参数需要已经在栈上或被固定
+ * @param result 返回值；是对象时需在下一次分配内存前压栈或固定
+ * @return 有未捕获的异常时返回 INTERPRET_RUNTIME_ERROR
+ */
+InterpretResult callFunction(Value callee, int argCount, const Value* args,
+                             Value* result) {
+  int enclosingFrame = vm.baseFrame;
+  ObjFiber* enclosingFiber = vm.baseFiber;
+  vm.baseFrame = vm.frameCount;
+  vm.baseFiber = vm.fiber;
+  ptrdiff_t base = vm.stackTop - vm.stack;
+
+  //先为被调用者和参数留出空间：扩容会移动值栈，指向栈中的 args 随之换算
+  bool argsInStack = args >= vm.stack && args < vm.stack + vm.stackCapacity;
+  ptrdiff_t argsOffset = args - vm.stack;
+  while (vm.stackCapacity - (vm.stackTop - vm.stack) < argCount + 1) {
+    growStack();
+  }
+  if (argsInStack) args = vm.stack + argsOffset;
+
+  push(callee);
+  for (int i = 0; i < argCount; i++) {
+    push(args[i]);
+  }
+  InterpretResult status = INTERPRET_OK;
+  if (!callValue(callee, argCount)) {
+    status = INTERPRET_RUNTIME_ERROR;
+  } else if (vm.frameCount > vm.baseFrame) {
+    //原生函数、memo 命中、没有初始化方法的类和结构体不压入调用帧，结果已经在栈顶
+    status = run();
+  }
+  if (status == INTERPRET_OK) *result = pop();
+  //异常展开后栈顶停在入口之上的某处，恢复到调用之前
+  vm.stackTop = vm.stack + base;
+
+  vm.baseFrame = enclosingFrame;
+  vm.baseFiber = enclosingFiber;
+  return status;
+}
+
+/**
+ * 原生函数回调脚本中的函数，参见 callFunction。
+ * 可能扩容值栈：返回之后原生函数自己的 args 指针失效，需要的参数要在调用前取出。
+ *
+ * @return 回调抛出了未捕获的异常时返回 false，原生函数应直接返回 false
+ */
+bool callClosure(VM* context, Value callee, int argCount, const Value* args,
+                 Value* result) {
+  return callFunction(callee, argCount, args, result) == INTERPRET_OK;
+}
+
+/**
+ * 由宿主程序或原生函数恢复协程，参见 callFunction。协程 yield、返回
+ * 或因未捕获的异常结束时这一层 run() 结束，控制回到调用者。
+ *
+ * @param fiber 未结束且不在运行中的协程
+ * @param value 作为 yield 表达式的结果；首次恢复时忽略
+ * @param result yield 的值或返回值，协程是否结束由 fiber->state 区分
+ * @return 协程抛出了未捕获的异常时返回 INTERPRET_RUNTIME_ERROR
+ */
+InterpretResult resumeFiber(ObjFiber* fiber, Value value, Value* result) {
+  int enclosingFrame = vm.baseFrame;
+  ObjFiber* enclosingFiber = vm.baseFiber;
+  vm.baseFrame = vm.frameCount;
+  vm.baseFiber = vm.fiber;
+  ptrdiff_t base = vm.stackTop - vm.stack;
+
+  fiber->caller = vm.fiber;
+  writeBarrier((Obj*)fiber, OBJ_VAL(vm.fiber));
+  saveFiber(vm.fiber);
+  loadFiber(fiber);
+  if (fiber->state == FIBER_SUSPENDED) push(value);
+  fiber->state = FIBER_RUNNING;
+  InterpretResult status = run();
+  if (status == INTERPRET_OK) *result = pop();
+  vm.stackTop = vm.stack + base;
+
+  vm.baseFrame = enclosingFrame;
+  vm.baseFiber = enclosingFiber;
+  return status;
+}
+
+/**
+ * 原生函数报告错误：错误信息作为异常值，在原生函数返回后抛出。
+ * 用法：return nativeError(vm, "...", ...);
+ *
+ * @param context 原生函数收到的虚拟机，异常值记在它的 pendingError 上
+ * @return 总是返回 false
+ */
+bool nativeError(VM* context, const char* format, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (length >= (int)sizeof(message)) length = sizeof(message) - 1;
+
+  context->pendingError = stringValue(message, length);
+  return false;
+}
+
+/**
+ * 查找内建原生函数的名字，不是内建函数时返回 NULL。
+ */
+const char* nativeName(NativeFn function) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (natives[i].function == function) return natives[i].name;
+  }
+  return NULL;
+}
+
+/**
+ * 按名字查找内建原生函数，找不到时返回 NULL。
+ *
+ * @param arity 输出原生函数的参数个数
+ */
+NativeFn findNative(const char* name, int length, int* arity) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if ((int)strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, name, length) == 0) {
+      *arity = natives[i].arity;
+      return natives[i].function;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * 在全局变量表中定义全部内建原生函数，主脚本和每个模块各有一份。
+ */
+void defineNatives(Table* table) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    defineNative(table, natives[i].name, natives[i].arity,
+                 natives[i].function);
+  }
+}
+
+/**
+ * 在全局变量表中定义一个原生函数，宿主程序也用它注册自己的函数。
+ *
+ * @param arity 参数个数，调用时由 callValue 检查；NATIVE_VARIADIC 表示不检查
+ */
+void defineNative(Table* table, const char* name, int arity,
+                  NativeFn function) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  push(OBJ_VAL(newNative(function, AS_STRING(vm.stackTop[-1]), arity)));
+  tableSet(table, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+  pop();
+  pop();
 }
 
 void push(Value value) {
   /* 进行栈扩容操作 */
-  //TODO: 在进行栈扩容操作时，需要考虑函数调用返回位置的保存
-  if (vm.stackTop == vm.stack + vm.stackCapacity) {
-    int oldCapacity = vm.stackCapacity;
-    vm.stackCapacity = GROW_CAPACITY(vm.stackCapacity);
-    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-    vm.stackTop = vm.stack + oldCapacity;
-  }
+  if (vm.stackTop == vm.stack + vm.stackCapacity) growStack();
   *vm.stackTop = value;
   vm.stackTop++;
 }
@@ -107,6 +493,36 @@ Value pop() {
 /****************************************/
 /****    static function definition  ****/
 /****************************************/
+
+/**
+ * 执行顶层函数。source 不为 NULL 时按 vm.profilePath 训练或应用 profile。
+ */
+static InterpretResult runScript(ObjFunction* function, const char* source) {
+  push(OBJ_VAL(function));
+  //执行之前编译好全部直接和间接导入的模块
+  if (!loadImports(function)) {
+    pop();
+    return INTERPRET_COMPILE_ERROR;
+  }
+  if (vm.profilePath != NULL && source != NULL) {
+    if (vm.profiling) {
+      profileStart(function);
+    } else {
+      profileApply(function, source, vm.profilePath);
+    }
+  }
+  ObjClosure* closure = newClosure(function);
+  pop();
+  push(OBJ_VAL(closure));
+  call(closure, 0);
+  InterpretResult result = run();
+  //弹出顶层函数的返回值
+  if (result == INTERPRET_OK) pop();
+  //run 返回后不再分配内存，顶层函数不会在写入 profile 之前被回收
+  if (vm.profiling && source != NULL) profileSave(function, source, vm.profilePath);
+  return result;
+}
+
 static InterpretResult run() {
    CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
@@ -114,26 +530,69 @@ static InterpretResult run() {
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
         (frame->ip+= 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() \
+        (frame->ip += 3, \
+         (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() \
         (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+        (frame->closure->function->chunk.constants.values[READ_LONG()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+//以名字为操作数的指令长短两种形式共用一段代码，按操作码读取名字
+#define READ_NAME(shortOp) \
+        (instruction == (shortOp) ? READ_STRING() \
+                                  : AS_STRING(READ_CONSTANT_LONG()))
+//当前函数所属模块的全局变量表，主脚本中的函数使用 vm.globals
+#define GLOBALS() \
+        (frame->closure->function->module == NULL \
+             ? &vm.globals : &frame->closure->function->module->globals)
+//写入模块的全局变量表之前调用：vm.globals 是根，模块需要进入区域的记忆集
+#define GLOBALS_BARRIER() \
+    do { \
+      if (frame->closure->function->module != NULL) { \
+        rememberWrite((Obj*)frame->closure->function->module); \
+      } \
+    } while (false)
+//抛出运行时错误：被 catch 捕获时跳到处理器继续执行，否则结束解释
+#define THROW_ERROR(...) \
+    do { \
+      if (!runtimeError(__VA_ARGS__)) return INTERPRET_RUNTIME_ERROR; \
+      goto exceptionCaught; \
+    } while (false)
+//回边和调用处检查预算，用完时让出。让出前状态都已经在调用帧中
+#define CHECK_BUDGET() \
+    do { \
+      if (--vm.budget <= 0 && preempt()) return INTERPRET_PREEMPTED; \
+    } while (false)
+//辅助函数已经抛出异常并返回 false 时使用
+#define HANDLE_EXCEPTION() \
+    do { \
+      if (vm.fiber == vm.baseFiber && vm.frameCount == vm.baseFrame) { \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      goto exceptionCaught; \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+        THROW_ERROR("Operands must be numbers."); \
       } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
+//特化指令遇到与反馈不符的操作数：改回通用指令并重新执行
+#define DEOPTIMIZE(generic, length) \
+    do { \
+      frame->ip -= (length); \
+      *frame->ip = (generic); \
+    } while (false)
 #ifndef NAN_BOXING
 #define NEGATE(offset)  \
     do {                \
         if (!IS_NUMBER(peek(0))) {    \
-          runtimeError("Operand must be a number.");  \
-          return INTERPRET_RUNTIME_ERROR; \
+          THROW_ERROR("Operand must be a number.");  \
         } \
         AS_NUMBER(vm.stackTop[offset]) = -AS_NUMBER(vm.stackTop[offset]);\
     } while(0)
@@ -141,10 +600,9 @@ static InterpretResult run() {
 #define NEGATE(offset)  \
     do {                \
         if (!IS_NUMBER(peek(0))) {    \
-          runtimeError("Operand must be a number.");  \
-          return INTERPRET_RUNTIME_ERROR; \
+          THROW_ERROR("Operand must be a number.");  \
         } \
-        vm.stackTop[offset] = -AS_NUMBER(vm.stackTop[offset]);\
+        vm.stackTop[offset] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[offset]));\
     } while(0)
 #endif // NAN_BOXING
 
@@ -170,6 +628,11 @@ static InterpretResult run() {
         push(constant);
         break;
       }
+      case OP_CONSTANT_LONG: {
+        Value constant = READ_CONSTANT_LONG();
+        push(constant);
+        break;
+      }
       case OP_NIL: push(NIL_VAL); break;
       case OP_TRUE: push(BOOL_VAL(true)); break;
       case OP_FALSE: push(BOOL_VAL(false)); break;
@@ -186,83 +649,127 @@ static InterpretResult run() {
         frame->slots[slot] = peek(0);
         break;
       }
+      case OP_GET_LOCAL_LONG: {
+        uint32_t slot = READ_LONG();
+        push(frame->slots[slot]);
+        break;
+      }
+      case OP_SET_LOCAL_LONG: {
+        uint32_t slot = READ_LONG();
+        frame->slots[slot] = peek(0);
+        break;
+      }
 
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
+      case OP_GET_GLOBAL:
+      case OP_GET_GLOBAL_LONG: {
+        ObjString* name = READ_NAME(OP_GET_GLOBAL);
         Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        if (!tableGet(GLOBALS(), name, &value)) {
+          THROW_ERROR("Undefined variable '%s'.", name->chars);
         }
         push(value);
         break;
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0)); //先将变量放在栈上，防止后面GC回收
+      case OP_DEFINE_GLOBAL:
+      case OP_DEFINE_GLOBAL_LONG: {
+        ObjString* name = READ_NAME(OP_DEFINE_GLOBAL);
+        GLOBALS_BARRIER();
+        tableSet(GLOBALS(), name, peek(0)); //先将变量放在栈上，防止后面GC回收
         pop();
         break;
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_LONG: {
+        ObjString* name = READ_NAME(OP_SET_GLOBAL);
+        GLOBALS_BARRIER();
+        if (tableSet(GLOBALS(), name, peek(0))) {
           //如果全局变量不存在，先删除全局变量，再报错
-          tableDelete(&vm.globals, name); 
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          tableDelete(GLOBALS(), name); 
+          THROW_ERROR("Undefined variable '%s'.", name->chars);
         }
         break;
       }
       case OP_GET_UPVALUE: {
         uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+        push(*CLOSURE_UPVALUE(frame->closure, slot)->location);
         break;
       }
       case OP_SET_UPVALUE: {
         uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+        ObjUpvalue* upvalue = CLOSURE_UPVALUE(frame->closure, slot);
+        *upvalue->location = peek(0);
+        writeBarrier((Obj*)upvalue, peek(0));
         break;
       }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+      case OP_GET_UPVALUE_LONG: {
+        uint32_t slot = READ_LONG();
+        push(*CLOSURE_UPVALUE(frame->closure, slot)->location);
+        break;
+      }
+      case OP_SET_UPVALUE_LONG: {
+        uint32_t slot = READ_LONG();
+        ObjUpvalue* upvalue = CLOSURE_UPVALUE(frame->closure, slot);
+        *upvalue->location = peek(0);
+        writeBarrier((Obj*)upvalue, peek(0));
+        break;
+      }
+      case OP_GET_PROPERTY:
+      case OP_GET_PROPERTY_LONG: {
+        if (!getProperty(READ_NAME(OP_GET_PROPERTY))) {
+          HANDLE_EXCEPTION();
         }
-
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = READ_STRING();
-
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop(); // Instance.
-          push(value);
-          break;
+        break;
+      }
+      case OP_SET_PROPERTY:
+      case OP_SET_PROPERTY_LONG: {
+        if (!setProperty(READ_NAME(OP_SET_PROPERTY))) {
+          HANDLE_EXCEPTION();
         }
-
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_GET_FIELD:
+      case OP_GET_FIELD_LONG: {
+        ObjString* name = READ_NAME(OP_GET_FIELD);
+        uint8_t slot = READ_BYTE();
+        //接收者的布局与编译期猜测一致时直接按槽位读取
+        if (IS_RECORD(peek(0))) {
+          ObjRecord* record = AS_RECORD(peek(0));
+          if (slot < record->fieldCount && record->type->fields[slot] == name) {
+            vm.stackTop[-1] = record->fields[slot];
+            break;
+          }
+        }
+        if (!getProperty(name)) {
+          HANDLE_EXCEPTION();
         }
-
         break;
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
+      case OP_SET_FIELD:
+      case OP_SET_FIELD_LONG: {
+        ObjString* name = READ_NAME(OP_SET_FIELD);
+        uint8_t slot = READ_BYTE();
+        if (IS_RECORD(peek(1))) {
+          ObjRecord* record = AS_RECORD(peek(1));
+          if (slot < record->fieldCount && record->type->fields[slot] == name) {
+            Value value = pop();
+            record->fields[slot] = value;
+            writeBarrier((Obj*)record, value);
+            vm.stackTop[-1] = value;
+            break;
+          }
+        }
+        if (!setProperty(name)) {
+          HANDLE_EXCEPTION();
         }
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
         break;
       }
-      case OP_GET_SUPER: {
-        ObjString* name = READ_STRING();
+      case OP_GET_SUPER:
+      case OP_GET_SUPER_LONG: {
+        ObjString* name = READ_NAME(OP_GET_SUPER);
         ObjClass* superclass = AS_CLASS(pop());
 
         if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+          HANDLE_EXCEPTION();
         }
         break;
       }
@@ -297,19 +804,40 @@ static InterpretResult run() {
       }
 
       case OP_ADD:      {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        //按观察到的操作数类型把指令改写为特化指令
+        //隔离区之间共享的函数不能修改，保持通用指令
+        bool quicken = !frame->closure->function->isShared;
+        if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+          if (quicken) frame->ip[-1] = OP_ADD_STRING;
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          if (quicken) frame->ip[-1] = OP_ADD_NUMBER;
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
           push(NUMBER_VAL(a + b));
         } else {
-          runtimeError(
+          THROW_ERROR(
               "Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
         }
         break; 
       }
+      case OP_ADD_NUMBER: {
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          DEOPTIMIZE(OP_ADD, 1);
+          break;
+        }
+        double b = AS_NUMBER(pop());
+        vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + b);
+        break;
+      }
+      case OP_ADD_STRING: {
+        if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))) {
+          DEOPTIMIZE(OP_ADD, 1);
+          break;
+        }
+        concatenate();
+        break;
+      }
       case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
       case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
       case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
@@ -327,57 +855,120 @@ static InterpretResult run() {
 
       case OP_JUMP: {
         uint16_t offset = READ_SHORT();
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 3, true);
+        }
         frame->ip += offset;
         break;
       }    
       case OP_JUMP_IF_FALSE: {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
+        bool taken = isFalsey(peek(0));
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 3, taken);
+        }
+        if (taken) frame->ip += offset;
         break;
       }
       case OP_LOOP: {
         uint16_t offset = READ_SHORT();
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 3, true);
+        }
         frame->ip -= offset;
+        CHECK_BUDGET();
+        break;
+      }
+      case OP_JUMP_LONG: {
+        uint32_t offset = READ_LONG();
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 4, true);
+        }
+        frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_IF_FALSE_LONG: {
+        uint32_t offset = READ_LONG();
+        bool taken = isFalsey(peek(0));
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 4, taken);
+        }
+        if (taken) frame->ip += offset;
+        break;
+      }
+      case OP_LOOP_LONG: {
+        uint32_t offset = READ_LONG();
+        if (vm.profiling) {
+          profileBranch(&frame->closure->function->chunk, frame->ip - 4, true);
+        }
+        frame->ip -= offset;
+        CHECK_BUDGET();
         break;
       }
       case OP_CALL: {
         int argCount = READ_BYTE();
+        if (IS_CLOSURE(peek(argCount)) && !frame->closure->function->isShared) {
+          frame->ip[-2] = OP_CALL_CLOSURE;
+        }
         if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          HANDLE_EXCEPTION();
         }
-        frame = &vm.frames[vm.frameCount - 1];  
+        frame = &vm.frames[vm.frameCount - 1];
+        CHECK_BUDGET();
         break;
       }
-      case OP_INVOKE: {
-        ObjString* method = READ_STRING();
+      case OP_CALL_CLOSURE: {
+        int argCount = READ_BYTE();
+        Value callee = peek(argCount);
+        if (!IS_CLOSURE(callee)) {
+          DEOPTIMIZE(OP_CALL, 2);
+          break;
+        }
+        if (!call(AS_CLOSURE(callee), argCount)) {
+          HANDLE_EXCEPTION();
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        CHECK_BUDGET();
+        break;
+      }
+      case OP_INVOKE:
+      case OP_INVOKE_LONG: {
+        ObjString* method = READ_NAME(OP_INVOKE);
         int argCount = READ_BYTE();
         if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          HANDLE_EXCEPTION();
         }
         frame = &vm.frames[vm.frameCount - 1];
+        CHECK_BUDGET();
         break;
       }
-      case OP_SUPER_INVOKE: {
-        ObjString* method = READ_STRING();
+      case OP_SUPER_INVOKE:
+      case OP_SUPER_INVOKE_LONG: {
+        ObjString* method = READ_NAME(OP_SUPER_INVOKE);
         int argCount = READ_BYTE();
         ObjClass* superclass = AS_CLASS(pop());
         if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          HANDLE_EXCEPTION();
         }
         frame = &vm.frames[vm.frameCount - 1];
+        CHECK_BUDGET();
         break;
       }
 
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      case OP_CLOSURE:
+      case OP_CLOSURE_LONG: {
+        bool wide = instruction == OP_CLOSURE_LONG;
+        ObjFunction* function = AS_FUNCTION(
+            wide ? READ_CONSTANT_LONG() : READ_CONSTANT());
         ObjClosure* closure = newClosure(function);
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
+          uint32_t index = wide ? READ_LONG() : READ_BYTE();
           if (isLocal) {
-            closure->upvalues[i] =
-              captureUpvalue(frame->slots + index);
+            ObjUpvalue* upvalue = captureUpvalue(frame->slots + index);
+            closure->upvalues[i] = toRef(upvalue);
+            writeBarrier((Obj*)closure, OBJ_VAL(upvalue));
           } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
           }
@@ -388,14 +979,84 @@ static InterpretResult run() {
         closeUpvalues(vm.stackTop - 1);
         pop();
         break;
+      case OP_YIELD: {
+        Value value = pop();
+        ObjFiber* fiber = vm.fiber;
+        if (fiber->caller == NULL) {
+          THROW_ERROR("Can't yield from the main fiber.");
+        }
+        ObjFiber* caller = fiber->caller;
+        fiber->caller = NULL;
+        fiber->state = FIBER_SUSPENDED;
+        saveFiber(fiber);
+        loadFiber(caller);
+        push(value);
+        //由 resumeFiber 恢复的协程挂起：这一层 run() 结束，yield 的值留在栈顶
+        if (vm.fiber == vm.baseFiber && vm.frameCount == vm.baseFrame) {
+          return INTERPRET_OK;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        break;
+      }
+      case OP_RESUME: {
+        Value value = pop();
+        Value target = pop();
+        if (!IS_FIBER(target)) {
+          THROW_ERROR("Can only resume fibers.");
+        }
+        ObjFiber* fiber = AS_FIBER(target);
+        if (fiber->state == FIBER_DONE) {
+          THROW_ERROR("Can't resume a finished fiber.");
+        }
+        if (fiber->state == FIBER_RUNNING) {
+          THROW_ERROR("Fiber is already running.");
+        }
+        fiber->caller = vm.fiber;
+        writeBarrier((Obj*)fiber, OBJ_VAL(vm.fiber));
+        saveFiber(vm.fiber);
+        loadFiber(fiber);
+        //首次 resume 时参数已经在协程栈上，之后 resume 的值作为 yield 表达式的结果
+        if (fiber->state == FIBER_SUSPENDED) push(value);
+        fiber->state = FIBER_RUNNING;
+        frame = &vm.frames[vm.frameCount - 1];
+        break;
+      }
+      case OP_THROW: {
+        if (!throwValue(pop())) return INTERPRET_RUNTIME_ERROR;
+        goto exceptionCaught;
+      }
       case OP_RETURN: {
         Value result = pop();
+        if (frame->memo != NULL) {
+          memoComplete(frame->memo, result);
+          writeBarrier((Obj*)frame->closure->function, result);
+        }
         vm.frameCount--;
         closeUpvalues(frame->slots);
-        if (vm.frameCount == 0) {
-          pop();
+        if (vm.fiber == vm.baseFiber && vm.frameCount == vm.baseFrame) {
+          //这一层 run() 的入口调用返回：返回值留在栈顶交给调用者
+          vm.stackTop = frame->slots;
+          push(result);
           return INTERPRET_OK;
         }
+        if (vm.frameCount == 0) {
+          //生成器返回：结束协程，返回值作为 resume 的结果交给调用者
+          if (vm.fiber->caller != NULL) {
+            ObjFiber* fiber = vm.fiber;
+            ObjFiber* caller = fiber->caller;
+            fiber->caller = NULL;
+            fiber->state = FIBER_DONE;
+            vm.stackTop = vm.stack;
+            saveFiber(fiber);
+            loadFiber(caller);
+            push(result);
+            if (vm.fiber == vm.baseFiber && vm.frameCount == vm.baseFrame) {
+              return INTERPRET_OK;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            break;
+          }
+        }
 
         vm.stackTop = frame->slots;
         push(result);
@@ -403,13 +1064,13 @@ static InterpretResult run() {
         break;
       }
       case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
+      case OP_CLASS_LONG:
+        push(OBJ_VAL(newClass(READ_NAME(OP_CLASS))));
         break;
       case OP_INHERIT: {
         Value superclass = peek(1);
         if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+          THROW_ERROR("Superclass must be a class.");
         }
         ObjClass* subclass = AS_CLASS(peek(0));
         tableAddAll(&AS_CLASS(superclass)->methods,
@@ -418,15 +1079,57 @@ static InterpretResult run() {
         break;
       }
       case OP_METHOD:
-        defineMethod(READ_STRING());
+      case OP_METHOD_LONG:
+        defineMethod(READ_NAME(OP_METHOD));
         break;
+      case OP_IMPORT:
+      case OP_IMPORT_LONG: {
+        ObjString* path = READ_NAME(OP_IMPORT);
+        ObjModule* module = findModule(frame->closure->function->module, path);
+        if (module == NULL) {
+          THROW_ERROR("Module '%s' is not loaded.", path->chars);
+        }
+        push(OBJ_VAL(module));
+        //已经执行过（或正在执行，即循环导入）的模块只复制全局变量
+        if (module->executed) {
+          push(NIL_VAL);
+          break;
+        }
+        module->executed = true;
+        ObjClosure* closure = newClosure(module->function);
+        push(OBJ_VAL(closure));
+        if (!call(closure, 0)) {
+          HANDLE_EXCEPTION();
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        break;
+      }
+      case OP_IMPORT_GLOBALS: {
+        GLOBALS_BARRIER();
+        tableAddAll(&AS_MODULE(peek(0))->globals, GLOBALS());
+        pop();
+        break;
+      }
     }
+    continue;
+
+exceptionCaught:
+    //异常已被捕获，调用帧和栈已经展开到处理器所在的帧
+    frame = &vm.frames[vm.frameCount - 1];
   }
 
+#undef HANDLE_EXCEPTION
+#undef CHECK_BUDGET
+#undef THROW_ERROR
 #undef NEGATE
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef GLOBALS
+#undef READ_NAME
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
 #undef READ_CONSTANT
 #undef READ_BYTE
 }
@@ -436,6 +1139,7 @@ static InterpretResult run() {
  * 这个函数用于在需要清空栈时调用，例如在执行新的函数调用前。
  */
 static void resetStack() {
+  abandonFrames(0);
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
@@ -453,29 +1157,140 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
-static void runtimeError(const char* format, ...) {
+/**
+ * 抛出运行时错误。
+ * 错误信息被包装成字符串作为异常值抛出，可以被 catch 捕获。
+ *
+ * @return 异常被捕获返回 true；未被捕获时打印错误和调用栈并返回 false
+ */
+static bool runtimeError(const char* format, ...) {
+  char message[256];
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  int length = vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  fputs("\n", stderr);
+  if (length >= (int)sizeof(message)) length = sizeof(message) - 1;
+
+  return throwValue(stringValue(message, length));
+}
+
+/**
+ * 抛出异常值。
+ * 从当前调用帧开始向外查找异常表，找到处理器后关闭被展开区域的上值，
+ * 恢复栈顶并把异常值压栈，然后从 catch 入口继续执行。
+ * 正常执行路径上没有任何处理器相关的开销。
+ *
+ * @param exception 异常值
+ * @return 异常被捕获返回 true；未被捕获时打印错误和调用栈，重置虚拟机并返回 false。
+ *         在原生函数嵌套的 run() 中未被捕获时展开到入口，异常留在 vm.pendingError
+ */
+static bool throwValue(Value exception) {
+  for (;;) {
+    if (unwindToHandler(exception)) return true;
+    if (vm.fiber == vm.baseFiber) break;
+
+    //协程内未捕获的异常：结束该协程，异常传播到 resume 它的位置
+    ObjFiber* fiber = vm.fiber;
+    ObjFiber* caller = fiber->caller;
+    abandonFrames(0);
+    closeUpvalues(vm.stack);
+    fiber->caller = NULL;
+    fiber->state = FIBER_DONE;
+    vm.frameCount = 0;
+    vm.stackTop = vm.stack;
+    saveFiber(fiber);
+    loadFiber(caller);
+  }
+
+  if (vm.baseFrame > 0) {
+    //原生函数嵌套调用中的异常：展开到入口，交给原生函数的调用者重新抛出
+    abandonFrames(vm.baseFrame);
+    if (vm.frameCount > vm.baseFrame) {
+      closeUpvalues(vm.frames[vm.baseFrame].slots);
+    }
+    vm.frameCount = vm.baseFrame;
+    vm.pendingError = exception;
+    return false;
+  }
+  reportUncaught(exception);
+  resetStack();
+  return false;
+}
+
+/**
+ * 抛出原生函数或外部函数通过 nativeError 报告的错误。
+ */
+static void throwPendingError() {
+  Value exception = vm.pendingError;
+  vm.pendingError = NIL_VAL;
+  throwValue(exception);
+}
 
+/**
+ * 在当前协程中查找能处理异常的 catch，找到时展开调用帧和栈并跳到 catch 入口。
+ *
+ * @return 找到处理器返回 true
+ */
+static bool unwindToHandler(Value exception) {
+  //嵌套的 run() 中不展开到入口以下的调用帧，它们属于原生函数的调用者
+  int lowest = vm.fiber == vm.baseFiber ? vm.baseFrame : 0;
+  for (int i = vm.frameCount - 1; i >= lowest; i--) {
+    CallFrame* frame = &vm.frames[i];
+    Chunk* chunk = &frame->closure->function->chunk;
+    ExceptionHandler* handler = findHandler(chunk,
+                                            (int)(frame->ip - chunk->code - 1));
+    if (handler == NULL) continue;
+
+    abandonFrames(i + 1);
+    closeUpvalues(frame->slots + handler->stackDepth);
+    vm.frameCount = i + 1;
+    vm.stackTop = frame->slots + handler->stackDepth;
+    push(exception);
+    frame->ip = chunk->code + handler->target;
+    return true;
+  }
+  return false;
+}
 
+/**
+ * 放弃从第 from 个调用帧开始的所有帧中 memo 函数预留的缓存条目。
+ */
+static void abandonFrames(int from) {
+  for (int i = vm.frameCount - 1; i >= from; i--) {
+    CallFrame* frame = &vm.frames[i];
+    if (frame->memo != NULL) {
+      memoAbandon(frame->closure->function, frame->memo);
+    }
+  }
+}
+
+/**
+ * 打印未被捕获的异常和调用栈。
+ */
+static void reportUncaught(Value exception) {
+  if (IS_ANY_STRING(exception)) {
+    char buffer[SMALL_STRING_MAX + 1];
+    int length;
+    fprintf(stderr, "%s\n", stringChars(exception, buffer, &length));
+  } else if (IS_NUMBER(exception)) {
+    fprintf(stderr, "Uncaught exception: %g\n", AS_NUMBER(exception));
+  } else {
+    fprintf(stderr, "Uncaught exception.\n");
+  }
 
-   for (int i = vm.frameCount - 1; i >= 0; i--) {
+  for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
     int line = getLine(&function->chunk, instruction);
-    fprintf(stderr, "[line %d] in ", line);
+    int column = getColumn(&function->chunk, instruction);
+    fprintf(stderr, "[line %d column %d] in ", line, column);
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-
-  resetStack();
 }
 
 /**
@@ -492,19 +1307,30 @@ static bool isFalsey(Value value) {
 
 
 static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(chars, length);
+  char bufferA[SMALL_STRING_MAX + 1];
+  char bufferB[SMALL_STRING_MAX + 1];
+  int lengthA, lengthB;
+  const char* b = stringChars(peek(0), bufferB, &lengthB);
+  const char* a = stringChars(peek(1), bufferA, &lengthA);
+
+  int length = lengthA + lengthB;
+  Value result;
+  if (length <= SMALL_STRING_MAX) {
+    //结果仍是短字符串，不需要分配内存
+    char chars[SMALL_STRING_MAX + 1];
+    memcpy(chars, a, lengthA);
+    memcpy(chars + lengthA, b, lengthB);
+    result = stringValue(chars, length);
+  } else {
+    char* chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a, lengthA);
+    memcpy(chars + lengthA, b, lengthB);
+    chars[length] = '\0';
+    result = OBJ_VAL(takeString(chars, length));
+  }
   pop();
   pop();
-  push(OBJ_VAL(result));
+  push(result);
 }
 
 
@@ -517,21 +1343,101 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
+#ifdef LAZY_COMPILE
+  //函数体在首次调用时编译，区域中编译出的常量也在区域中
+  if (closure->function->lazy != NULL) {
+    rememberWrite((Obj*)closure->function);
+    if (!compileFunction(closure->function)) {
+      runtimeError("Can't compile function body.");
+      return false;
+    }
+  }
+#endif
+
+  if (closure->function->isGenerator) {
+    return callGenerator(closure, argCount);
+  }
+
   if (vm.frameCount == FRAMES_MAX) {
     runtimeError("Stack overflow.");
     return false;
   }
 
+  if (vm.frameCount == vm.frameCapacity) {
+    int oldCapacity = vm.frameCapacity;
+    vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+    if (vm.frameCapacity > FRAMES_MAX) vm.frameCapacity = FRAMES_MAX;
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+  }
+
+  //memo 函数先查缓存，命中时直接替换掉被调用者和参数，不压入调用帧
+  MemoEntry* memo = NULL;
+  if (closure->function->isMemo) {
+    Value* key = memoKey(closure->function, vm.stackTop - argCount);
+    Value result;
+    if (memoLookup(closure->function, key, &result)) {
+      vm.stackTop -= argCount + 1;
+      push(result);
+      return true;
+    }
+    memo = memoReserve(closure->function, key);
+    for (Value* value = key; value < vm.stackTop; value++) {
+      writeBarrier((Obj*)closure->function, *value);
+    }
+  }
+
+  if (vm.profiling) profileEnter(closure->function);
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
 
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
+  frame->memo = memo;
 
   frame->slots = vm.stackTop - argCount - 1;
   return true;
 }
 
 
+/**
+ * 调用生成器函数：不执行函数体，而是创建一个协程，
+ * 把被调用者和参数搬到协程自己的栈上，返回该协程。
+ */
+static bool callGenerator(ObjClosure* closure, int argCount) {
+  ObjFiber* fiber = newFiber(closure, argCount + 1);
+  Value* args = vm.stackTop - argCount - 1;
+  for (int i = 0; i <= argCount; i++) {
+    fiber->stack[i] = args[i];
+  }
+  fiber->stackTop = fiber->stack + argCount + 1;
+
+  if (vm.profiling) profileEnter(closure->function);
+
+  CallFrame* frame = &fiber->frames[fiber->frameCount++];
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  frame->slots = fiber->stack;
+  frame->memo = NULL;
+
+  vm.stackTop = args;
+  push(OBJ_VAL(fiber));
+  return true;
+}
+
+
+/**
+ * 预算用完时补充预算，返回是否让出。只有时间片中最外层的 run() 可以让出：
+ * 原生函数经 callClosure 嵌套进入的 run() 之下还有 C 栈帧，无法挂起。
+ */
+static bool preempt() {
+  if (vm.quantum == 0) {
+    vm.budget = INT_MAX;
+    return false;
+  }
+  vm.budget = vm.quantum;
+  return vm.baseFrame == 0;
+}
+
 static bool callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
@@ -551,12 +1457,54 @@ static bool callValue(Value callee, int argCount) {
                     argCount);
           return false;
         }
+        return true;
+      }
+      case OBJ_STRUCT: {
+        ObjStruct* type = AS_STRUCT(callee);
+        if (argCount != type->fieldCount) {
+          runtimeError("Expected %d arguments but got %d.",
+                       type->fieldCount, argCount);
+          return false;
+        }
+        ObjRecord* record = newRecord(type);
+        Value* args = vm.stackTop - argCount;
+        for (int i = 0; i < argCount; i++) {
+          record->fields[i] = args[i];
+        }
+        vm.stackTop -= argCount + 1;
+        push(OBJ_VAL(record));
+        return true;
       }
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
+        ObjNative* native = AS_NATIVE(callee);
+        if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+          runtimeError("Expected %d arguments but got %d.",
+                       native->arity, argCount);
+          return false;
+        }
+        Value result = NIL_VAL;
+        if (!native->function(&vm, argCount, vm.stackTop - argCount, &result)) {
+          throwPendingError();
+          return false;
+        }
+        vm.stackTop -= argCount + 1;
+        push(result);
+        return true;
+      }
+      case OBJ_FOREIGN: {
+        ObjForeign* foreign = AS_FOREIGN(callee);
+        if (argCount != foreign->arity) {
+          runtimeError("Expected %d arguments but got %d.",
+                       foreign->arity, argCount);
+          return false;
+        }
+        Value result = NIL_VAL;
+        if (!callForeign(foreign, vm.stackTop - argCount, &result)) {
+          throwPendingError();
+          return false;
+        }
         vm.stackTop -= argCount + 1;
         push(result);
         return true;
@@ -570,13 +1518,54 @@ static bool callValue(Value callee, int argCount) {
 }
 
 
+/**
+ * 扩容当前协程的值栈。
+ * 扩容可能移动栈，调用帧的 slots 和打开的上值都指向旧栈，需要重新定位。
+ */
+static void growStack() {
+  Value* oldStack = vm.stack;
+  int oldCapacity = vm.stackCapacity;
+  vm.stackCapacity = GROW_CAPACITY(oldCapacity);
+  vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+  if (vm.stack == oldStack) return;
+
+  vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+  }
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm.stack + (upvalue->location - oldStack);
+  }
+}
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+/**
+ * 把 vm 中的执行状态写回协程对象。
+ */
+static void saveFiber(ObjFiber* fiber) {
+  //协程的栈可能保存了区域中的对象
+  rememberWrite((Obj*)fiber);
+  fiber->stack = vm.stack;
+  fiber->stackTop = vm.stackTop;
+  fiber->stackCapacity = vm.stackCapacity;
+  fiber->frames = vm.frames;
+  fiber->frameCount = vm.frameCount;
+  fiber->frameCapacity = vm.frameCapacity;
+  fiber->openUpvalues = vm.openUpvalues;
+}
+
+/**
+ * 切换到协程：把协程的执行状态装入 vm，开销与一次函数调用相当。
+ */
+static void loadFiber(ObjFiber* fiber) {
+  vm.stack = fiber->stack;
+  vm.stackTop = fiber->stackTop;
+  vm.stackCapacity = fiber->stackCapacity;
+  vm.frames = fiber->frames;
+  vm.frameCount = fiber->frameCount;
+  vm.frameCapacity = fiber->frameCapacity;
+  vm.openUpvalues = fiber->openUpvalues;
+  vm.fiber = fiber;
 }
 
 static ObjUpvalue* captureUpvalue(Value* local) {
@@ -598,6 +1587,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     vm.openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
+    writeBarrier((Obj*)prevUpvalue, OBJ_VAL(createdUpvalue));
   }
   return createdUpvalue;
 }
@@ -609,6 +1599,7 @@ static void closeUpvalues(Value* last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -624,6 +1615,8 @@ static void defineMethod(ObjString *name)
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  writeBarrier((Obj*)klass, method);
+  writeBarrier((Obj*)klass, OBJ_VAL(name));
   pop();
 }
 
@@ -641,6 +1634,68 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
   return true;
 }
 
+/**
+ * 按名字读取栈顶对象的属性，结果替换栈顶的对象。
+ * 结构体实例的字段按名字线性查找，这是按槽位访问失败时的慢路径。
+ */
+static bool getProperty(ObjString* name) {
+  Value receiver = peek(0);
+  if (IS_RECORD(receiver)) {
+    ObjRecord* record = AS_RECORD(receiver);
+    int slot = structFieldIndex(record->type, name);
+    if (slot < 0) {
+      runtimeError("Undefined field '%s'.", name->chars);
+      return false;
+    }
+    vm.stackTop[-1] = record->fields[slot];
+    return true;
+  }
+
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  Value value;
+  if (tableGet(&instance->fields, name, &value)) {
+    pop(); // Instance.
+    push(value);
+    return true;
+  }
+  return bindMethod(instance->klass, name);
+}
+
+/**
+ * 按名字写入次栈顶对象的属性，栈上只留下写入的值。
+ * 结构体实例的布局固定，不能添加新字段。
+ */
+static bool setProperty(ObjString* name) {
+  Value receiver = peek(1);
+  if (IS_RECORD(receiver)) {
+    ObjRecord* record = AS_RECORD(receiver);
+    int slot = structFieldIndex(record->type, name);
+    if (slot < 0) {
+      runtimeError("Undefined field '%s'.", name->chars);
+      return false;
+    }
+    record->fields[slot] = peek(0);
+    writeBarrier((Obj*)record, peek(0));
+  } else if (IS_INSTANCE(receiver)) {
+    tableSet(&AS_INSTANCE(receiver)->fields, name, peek(0));
+    writeBarrier(AS_OBJ(receiver), peek(0));
+    writeBarrier(AS_OBJ(receiver), OBJ_VAL(name));
+  } else {
+    runtimeError("Only instances have fields.");
+    return false;
+  }
+
+  Value value = pop();
+  pop();
+  push(value);
+  return true;
+}
+
 static bool invokeFromClass(ObjClass* klass, ObjString* name,
                             int argCount) {
   Value method;
@@ -653,6 +1708,16 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,
 
 static bool invoke(ObjString* name, int argCount) {
   Value receiver = peek(argCount);
+  if (IS_RECORD(receiver)) {
+    ObjRecord* record = AS_RECORD(receiver);
+    int slot = structFieldIndex(record->type, name);
+    if (slot < 0) {
+      runtimeError("Undefined field '%s'.", name->chars);
+      return false;
+    }
+    vm.stackTop[-argCount - 1] = record->fields[slot];
+    return callValue(record->fields[slot], argCount);
+  }
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
     return false;
@@ -19,17 +19,40 @@
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
+typedef struct EventLoop EventLoop;
+typedef struct Region Region;
 
+//所有对象的表。GC 只写这张表和标记位图，不写对象头；
+//对象释放后槽位留空，之后创建的对象复用它
 typedef struct {
-  ObjClosure* closure;
-  uint8_t* ip;
-  Value* slots;
-} CallFrame;
-
-
-typedef struct {
-  CallFrame frames[FRAMES_MAX]; //调用帧
+  Obj** objects;      //以对象的 id 为下标，空闲的槽位为 NULL
+  int count;          //用过的最大槽位加一
+  int capacity;
+  int* freeSlots;     //空闲槽位的下标
+  int freeCount;
+  int freeCapacity;
+  uint64_t* marks;    //标记位图，以 id 为位号，GC 之外全为 0
+  uint64_t* old;      //老年代位图：经历过一次 GC 仍然存活的对象
+  int* young;         //上次 GC 之后创建的对象的 id，新生代回收只清扫它们
+  int youngCount;
+  int youngCapacity;
+  int* remembered;    //写入过新生代对象引用的老年代对象的 id（记忆集）
+  int rememberedCount;
+  int rememberedCapacity;
+} ObjectTable;
+
+//宿主程序持有的固定值，链表中的值都是 GC 的根
+typedef struct Handle {
+  Value value;
+  struct Handle* prev;
+  struct Handle* next;
+} Handle;
+
+struct VM {
+  //当前协程的执行状态，切换协程时与 ObjFiber 交换
+  CallFrame* frames; //调用帧
   int frameCount;
+  int frameCapacity;
 
   Chunk* chunk;
   uint8_t* ip;               //指令指针
@@ -39,34 +62,80 @@ typedef struct {
   Value* stackTop;    //栈顶
   int stackCapacity;  //栈的容量
 
-  Obj* objects; //所有对象的链表
+  ObjectTable heap; //所有对象
   Table strings; //字符串池
   
-  Table globals;  //全局变量表
+  Table globals;  //全局变量表（主脚本的全局变量）
+  Table modules;  //已加载的模块，规范化路径到模块
 
   ObjString* initString; // 类初始化调用对象
 
   ObjUpvalue* openUpvalues; //所有的上值
+  ObjFiber* fiber;          //当前正在运行的协程
+  Handle* handles;          //宿主程序固定的值
+  Worker* workers;          //这个虚拟机 spawn 的线程，释放虚拟机前等待它们结束
+  EventLoop* loop;          //事件循环，首次使用 I/O 回调或定时器时创建
+  Region* region;           //当前的区域，不为 NULL 时新对象分配在区域中
+
+  //当前这一层 run() 的入口：baseFiber 的调用帧数回到 baseFrame 时返回。
+  //原生函数通过 callClosure 嵌套进入 run()，异常不会展开到入口以下的调用帧
+  int baseFrame;
+  ObjFiber* baseFiber;
+  Value pendingError;       //原生函数抛出、尚未交给调用者重新抛出的异常
+
+  //抢占：回边和调用各消耗一个预算，预算用完时最外层的 run() 让出。
+  //quantum 为 0 时不抢占，预算只是一个不会用完的计数
+  int budget;
+  int quantum;
+
+  const char* profilePath;  //布局 profile 文件路径，为 NULL 时不使用 profile
+  bool profiling;           //训练模式：收集分支计数，结束时写入 profile
+  const char* cacheDir;     //编译缓存目录，为 NULL 时不使用缓存
+  const char* scriptPath;   //主脚本路径，主脚本中的 import 相对它所在的目录解析
   //处理GC
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
   size_t bytesAllocated;
+  size_t peakAllocated;  //bytesAllocated 的历史最大值
   size_t nextGC;
-} VM;
+  size_t nextMinorGC;    //超过时只回收新生代
+  int gcPaused;          //大于 0 时不执行 GC（离开区域复制对象、为模块定义原生函数期间）
+  bool batch;            //批处理模式：内存池快用完时才 GC，退出时不逐个释放对象
+#ifdef MEMO_WEAK_CACHE
+  MemoCache* weakMemos; //本轮 GC 中需要清理的弱缓存
+#endif
+};
 
 typedef enum {
   INTERPRET_OK,             //正常
   INTERPRET_COMPILE_ERROR,  //编译错误
-  INTERPRET_RUNTIME_ERROR   //运行时错误
+  INTERPRET_RUNTIME_ERROR,  //运行时错误
+  INTERPRET_PREEMPTED       //时间片用完，调用帧保留，resumeScript 从原处继续
 } InterpretResult;
 
-extern VM vm;
+extern THREAD_LOCAL VM vm;
 
 
 void initVM();
+void initSharedVM(ObjString** strings, int count);
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretBytecode(const char* path);
+ObjFunction* compileScript(const char* source);
+bool startScript(ObjFunction* function);
+InterpretResult resumeScript(int quantum);
+InterpretResult callFunction(Value callee, int argCount, const Value* args,
+                             Value* result);
+InterpretResult resumeFiber(ObjFiber* fiber, Value value, Value* result);
+const char* nativeName(NativeFn function);
+NativeFn findNative(const char* name, int length, int* arity);
+void defineNatives(Table* table);
+void defineNative(Table* table, const char* name, int arity,
+                  NativeFn function);
+bool callClosure(VM* context, Value callee, int argCount, const Value* args,
+                 Value* result);
+bool nativeError(VM* context, const char* format, ...);
 void push(Value value);
 Value pop();
 